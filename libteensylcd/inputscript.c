@@ -0,0 +1,165 @@
+#include "inputscript.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+void teensylcd_input_script_init(struct teensylcd_input_script_t *script)
+{
+    script->events = NULL;
+    script->count = 0;
+    script->capacity = 0;
+}
+
+static bool input_script_add(struct teensylcd_input_script_t *script, uint64_t time, bool usec, enum TEENSYLCD_BUTTON button, bool state)
+{
+    if (button >= NUM_TEENSYLCD_BUTTONS)
+        return false;
+
+    /* playback walks the events in order, cycles and microseconds only compare to their own kind */
+    for (size_t i = script->count; i > 0; i--)
+    {
+        const struct teensylcd_input_event_t *last = &script->events[i - 1];
+        if (last->usec == usec)
+        {
+            if (time < last->time)
+                return false;
+            break;
+        }
+    }
+
+    if (script->count == script->capacity)
+    {
+        size_t new_capacity = (script->capacity > 0) ? script->capacity * 2 : 64;
+        struct teensylcd_input_event_t *new_events = (struct teensylcd_input_event_t *)realloc(script->events, new_capacity * sizeof(struct teensylcd_input_event_t));
+        if (new_events == NULL)
+            return false;
+
+        script->events = new_events;
+        script->capacity = new_capacity;
+    }
+
+    struct teensylcd_input_event_t *event = &script->events[script->count++];
+    event->time = time;
+    event->usec = usec;
+    event->button = button;
+    event->state = state;
+    return true;
+}
+
+bool teensylcd_input_script_add(struct teensylcd_input_script_t *script, uint64_t cycle, enum TEENSYLCD_BUTTON button, bool state)
+{
+    return input_script_add(script, cycle, false, button, state);
+}
+
+bool teensylcd_input_script_add_usec(struct teensylcd_input_script_t *script, uint64_t usec, enum TEENSYLCD_BUTTON button, bool state)
+{
+    return input_script_add(script, usec, true, button, state);
+}
+
+/* parse a time, in cycles or with a us/ms suffix */
+static bool parse_time(const char *str, uint64_t *time, bool *usec)
+{
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+
+    *usec = (*end != '\0');
+    if (*end == '\0' || !strcmp(end, "us"))
+        *time = value;
+    else if (!strcmp(end, "ms"))
+        *time = value * 1000ULL;
+    else
+        return false;
+
+    return true;
+}
+
+static bool parse_state(const char *str, bool *state)
+{
+    if (!strcmp(str, "down") || !strcmp(str, "1"))
+        *state = true;
+    else if (!strcmp(str, "up") || !strcmp(str, "0"))
+        *state = false;
+    else
+        return false;
+
+    return true;
+}
+
+bool teensylcd_input_script_load(struct teensylcd_input_script_t *script, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open input script %s\n", filename);
+        return false;
+    }
+
+    char line[256];
+    int line_number = 0;
+    bool result = true;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_number++;
+
+        /* skip blank lines and comments */
+        char *start = line;
+        while (isspace((unsigned char)*start))
+            start++;
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        char time_str[32], button_str[32], state_str[32];
+        uint64_t time;
+        bool usec;
+        enum TEENSYLCD_BUTTON button;
+        bool state;
+        if (sscanf(start, "%31s %31s %31s", time_str, button_str, state_str) != 3 ||
+            !parse_time(time_str, &time, &usec) ||
+            !teensylcd_get_button_by_name(button_str, &button) ||
+            !parse_state(state_str, &state))
+        {
+            fprintf(stderr, "%s:%d: expected '<time> <button> <state>'\n", filename, line_number);
+            result = false;
+            break;
+        }
+
+        if (!input_script_add(script, time, usec, button, state))
+        {
+            fprintf(stderr, "%s:%d: events must be in time order\n", filename, line_number);
+            result = false;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return result;
+}
+
+bool teensylcd_input_script_save(const struct teensylcd_input_script_t *script, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open input script %s\n", filename);
+        return false;
+    }
+
+    fprintf(fp, "# teensylcd input script, times in cycles or microseconds (us)\n");
+    for (size_t i = 0; i < script->count; i++)
+    {
+        const struct teensylcd_input_event_t *event = &script->events[i];
+        fprintf(fp, "%llu%s %s %s\n", (unsigned long long)event->time, (event->usec) ? "us" : "",
+                teensylcd_get_button_name(event->button), (event->state) ? "down" : "up");
+    }
+
+    return (fclose(fp) == 0);
+}
+
+void teensylcd_input_script_free(struct teensylcd_input_script_t *script)
+{
+    free(script->events);
+    teensylcd_input_script_init(script);
+}
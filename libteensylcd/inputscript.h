@@ -0,0 +1,56 @@
+#ifndef __LIBTEENSYLCD_INPUTSCRIPT_H
+#define __LIBTEENSYLCD_INPUTSCRIPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "teensylcd.h"
+
+/**
+ * input scripts are text files with one button event per line, in time order:
+ *
+ *   # comment
+ *   <time> <button> <state>
+ *
+ * time is in cycles since playback started, or in microseconds/milliseconds with a "us"/"ms"
+ * suffix. button is a name from teensylcd_get_button_name, eg sw0 or stickup. state is
+ * down/up or 1/0. recorded scripts are written in cycles, so they replay exactly.
+ *
+ * microseconds are turned into cycles as the script plays, a millisecond at a time at the clock
+ * the firmware runs at then, so they stay right if the firmware changes it (CLKPR).
+ */
+
+/* a single time-stamped button change */
+struct teensylcd_input_event_t
+{
+    uint64_t time;                  /* in cycles, or in microseconds if usec */
+    bool usec;
+    enum TEENSYLCD_BUTTON button;
+    bool state;
+};
+
+/* a list of events, ordered by time */
+struct teensylcd_input_script_t
+{
+    struct teensylcd_input_event_t *events;
+    size_t count;
+    size_t capacity;
+};
+
+/* initializer, the script starts empty */
+void teensylcd_input_script_init(struct teensylcd_input_script_t *script);
+
+/* append an event, which must not be earlier than the last one in the same unit */
+bool teensylcd_input_script_add(struct teensylcd_input_script_t *script, uint64_t cycle, enum TEENSYLCD_BUTTON button, bool state);
+bool teensylcd_input_script_add_usec(struct teensylcd_input_script_t *script, uint64_t usec, enum TEENSYLCD_BUTTON button, bool state);
+
+/* load a script from a file */
+bool teensylcd_input_script_load(struct teensylcd_input_script_t *script, const char *filename);
+
+/* save a script to a file */
+bool teensylcd_input_script_save(const struct teensylcd_input_script_t *script, const char *filename);
+
+/* cleanup */
+void teensylcd_input_script_free(struct teensylcd_input_script_t *script);
+
+#endif        // __LIBTEENSYLCD_INPUTSCRIPT_H
@@ -0,0 +1,565 @@
+#include "lcdrecord.h"
+#include <stdlib.h>
+#include <string.h>
+#include "sim_cycle_timers.h"
+
+#define DISPLAY_SIZE (PCD8544_BANKS * PCD8544_LCD_X)
+
+/* runs of changed bytes this close together are written as one, as a new run costs at least 2 bytes */
+#define RUN_MERGE_GAP 2
+
+/* gif frames are timed on a 1/50s grid, as most viewers don't go any faster */
+#define GIF_FRAME_RATE 50
+
+/* lzw dictionary, codes are up to 12 bits, hashed into a table a bit over twice as big */
+#define LZW_MAX_CODES 4096
+#define LZW_HASH_SIZE 8209
+
+static void put_varint(FILE *fp, uint64_t value)
+{
+    uint8_t buffer[10];
+    size_t length = 0;
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            byte |= 0x80;
+        buffer[length++] = byte;
+    }
+    while (value != 0);
+    fwrite(buffer, 1, length, fp);
+}
+
+static bool get_varint(FILE *fp, uint64_t *value)
+{
+    *value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = fgetc(fp);
+        if (byte == EOF)
+            return false;
+
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void put_le(FILE *fp, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        fputc((int)((value >> (i * 8)) & 0xFF), fp);
+}
+
+static bool get_le(FILE *fp, uint64_t *value, size_t size)
+{
+    *value = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        int byte = fgetc(fp);
+        if (byte == EOF)
+            return false;
+        *value |= (uint64_t)byte << (i * 8);
+    }
+    return true;
+}
+
+static uint8_t get_display_flags(const struct pcd8544_t *lcd)
+{
+    return (lcd->contrast & 0x7F) | (lcd->invert_display ? 0x80 : 0);
+}
+
+/* writes a frame if the display changed, or regardless if forced */
+static void write_frame(struct teensylcd_lcd_recorder_t *recorder, bool force)
+{
+    const struct pcd8544_t *lcd = &recorder->teensy->lcd;
+    uint8_t flags = get_display_flags(lcd);
+    if (!force && flags == recorder->last_flags && memcmp(lcd->banks, recorder->last_banks, DISPLAY_SIZE) == 0)
+        return;
+
+    const uint8_t *current = &lcd->banks[0][0];
+    uint8_t *last = &recorder->last_banks[0][0];
+    uint8_t delta[DISPLAY_SIZE];
+    for (size_t i = 0; i < DISPLAY_SIZE; i++)
+        delta[i] = current[i] ^ last[i];
+
+    /* find the runs of changed bytes */
+    uint16_t run_starts[DISPLAY_SIZE / 2 + 1];
+    uint16_t run_lengths[DISPLAY_SIZE / 2 + 1];
+    size_t run_count = 0;
+    size_t i = 0;
+    while (i < DISPLAY_SIZE)
+    {
+        if (delta[i] == 0)
+        {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        size_t last_changed = i;
+        for (i++; i < DISPLAY_SIZE && i - last_changed <= RUN_MERGE_GAP; i++)
+        {
+            if (delta[i] != 0)
+                last_changed = i;
+        }
+
+        run_starts[run_count] = (uint16_t)start;
+        run_lengths[run_count++] = (uint16_t)(last_changed + 1 - start);
+        i = last_changed + 1;
+    }
+
+    uint64_t cycle = recorder->teensy->avr->cycle;
+    put_varint(recorder->fp, cycle - recorder->last_cycle);
+    fputc(flags, recorder->fp);
+    put_varint(recorder->fp, run_count);
+
+    size_t position = 0;
+    for (size_t run = 0; run < run_count; run++)
+    {
+        put_varint(recorder->fp, run_starts[run] - position);
+        put_varint(recorder->fp, run_lengths[run]);
+        fwrite(delta + run_starts[run], 1, run_lengths[run], recorder->fp);
+        position = run_starts[run] + run_lengths[run];
+    }
+
+    memcpy(last, current, DISPLAY_SIZE);
+    recorder->last_flags = flags;
+    recorder->last_cycle = cycle;
+    recorder->frames++;
+}
+
+static void recorder_frame_hook(struct pcd8544_t *lcd, void *param)
+{
+    write_frame((struct teensylcd_lcd_recorder_t *)param, false);
+}
+
+static avr_cycle_count_t recorder_timer(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct teensylcd_lcd_recorder_t *recorder = (struct teensylcd_lcd_recorder_t *)param;
+    write_frame(recorder, false);
+    return when + recorder->interval;
+}
+
+bool teensylcd_lcd_recorder_start(struct teensylcd_lcd_recorder_t *recorder, struct teensylcd_t *teensy, const char *filename, uint32_t interval)
+{
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->fp = fopen(filename, "wb");
+    if (recorder->fp == NULL)
+    {
+        fprintf(stderr, "Failed to open LCD recording %s\n", filename);
+        return false;
+    }
+
+    recorder->teensy = teensy;
+    recorder->interval = interval;
+    recorder->last_cycle = teensy->avr->cycle;
+
+    fwrite(TEENSYLCD_LCD_RECORDING_MAGIC, 1, strlen(TEENSYLCD_LCD_RECORDING_MAGIC), recorder->fp);
+    put_le(recorder->fp, teensy->avr->frequency, 4);
+    put_le(recorder->fp, teensy->avr->cycle, 8);
+
+    /* whatever is showing now is the first frame */
+    write_frame(recorder, true);
+
+    if (interval > 0)
+    {
+        avr_cycle_timer_register(teensy->avr, interval, recorder_timer, recorder);
+    }
+    else
+    {
+        teensy->lcd.frame_callback_param = recorder;
+        teensy->lcd.frame_callback = recorder_frame_hook;
+    }
+    return true;
+}
+
+void teensylcd_lcd_recorder_capture(struct teensylcd_lcd_recorder_t *recorder)
+{
+    write_frame(recorder, false);
+}
+
+bool teensylcd_lcd_recorder_stop(struct teensylcd_lcd_recorder_t *recorder)
+{
+    if (recorder->fp == NULL)
+        return false;
+
+    if (recorder->interval > 0)
+    {
+        avr_cycle_timer_cancel(recorder->teensy->avr, recorder_timer, recorder);
+    }
+    else
+    {
+        recorder->teensy->lcd.frame_callback = NULL;
+        recorder->teensy->lcd.frame_callback_param = NULL;
+    }
+
+    /* the last frame marks the end, even if nothing changed */
+    write_frame(recorder, true);
+
+    bool result = (ferror(recorder->fp) == 0);
+    if (fclose(recorder->fp) != 0)
+        result = false;
+
+    recorder->fp = NULL;
+    return result;
+}
+
+bool teensylcd_lcd_playback_open(struct teensylcd_lcd_playback_t *playback, const char *filename)
+{
+    memset(playback, 0, sizeof(*playback));
+    playback->fp = fopen(filename, "rb");
+    if (playback->fp == NULL)
+    {
+        fprintf(stderr, "Failed to open LCD recording %s\n", filename);
+        return false;
+    }
+
+    char magic[sizeof(TEENSYLCD_LCD_RECORDING_MAGIC) - 1];
+    uint64_t frequency, cycle;
+    if (fread(magic, 1, sizeof(magic), playback->fp) != sizeof(magic) || memcmp(magic, TEENSYLCD_LCD_RECORDING_MAGIC, sizeof(magic)) ||
+        !get_le(playback->fp, &frequency, 4) || !get_le(playback->fp, &cycle, 8) || frequency == 0)
+    {
+        fprintf(stderr, "%s is not an LCD recording\n", filename);
+        fclose(playback->fp);
+        playback->fp = NULL;
+        return false;
+    }
+
+    playback->frequency = (uint32_t)frequency;
+    playback->cycle = cycle;
+    return true;
+}
+
+bool teensylcd_lcd_playback_next(struct teensylcd_lcd_playback_t *playback)
+{
+    uint64_t delta_cycles, run_count;
+    int flags;
+    if (!get_varint(playback->fp, &delta_cycles) || (flags = fgetc(playback->fp)) == EOF || !get_varint(playback->fp, &run_count))
+        return false;
+
+    uint8_t *banks = &playback->banks[0][0];
+    uint64_t position = 0;
+    for (uint64_t run = 0; run < run_count; run++)
+    {
+        uint64_t skip, length;
+        uint8_t delta[DISPLAY_SIZE];
+        if (!get_varint(playback->fp, &skip) || !get_varint(playback->fp, &length))
+            return false;
+
+        position += skip;
+        if (position > DISPLAY_SIZE || length > DISPLAY_SIZE - position || fread(delta, 1, length, playback->fp) != length)
+        {
+            fprintf(stderr, "LCD recording is corrupt\n");
+            return false;
+        }
+
+        for (uint64_t i = 0; i < length; i++)
+            banks[position + i] ^= delta[i];
+        position += length;
+    }
+
+    playback->cycle += delta_cycles;
+    playback->contrast = flags & 0x7F;
+    playback->invert_display = (flags & 0x80) != 0;
+    return true;
+}
+
+void teensylcd_lcd_playback_render(const struct teensylcd_lcd_playback_t *playback, void *pixels)
+{
+    /* a controller with just the display state in it */
+    struct pcd8544_t lcd;
+    memset(&lcd, 0, sizeof(lcd));
+    memcpy(lcd.banks, playback->banks, sizeof(lcd.banks));
+    lcd.contrast = playback->contrast;
+    lcd.invert_display = playback->invert_display;
+    pcd8544_render_luminance(&lcd, pixels);
+}
+
+void teensylcd_lcd_playback_close(struct teensylcd_lcd_playback_t *playback)
+{
+    if (playback->fp != NULL)
+        fclose(playback->fp);
+    playback->fp = NULL;
+}
+
+/* renders the current frame, scaled up, into an image (PCD8544_LCD_X * scale) wide */
+static void render_scaled(const struct teensylcd_lcd_playback_t *playback, uint8_t *pixels, uint32_t scale)
+{
+    uint8_t image[PCD8544_LCD_X * PCD8544_LCD_Y];
+    teensylcd_lcd_playback_render(playback, image);
+
+    size_t width = PCD8544_LCD_X * scale;
+    for (size_t y = 0; y < PCD8544_LCD_Y; y++)
+    {
+        uint8_t *row = pixels + (y * scale * width);
+        for (size_t x = 0; x < PCD8544_LCD_X; x++)
+            memset(row + (x * scale), image[(y * PCD8544_LCD_X) + x], scale);
+        for (size_t i = 1; i < scale; i++)
+            memcpy(row + (i * width), row, width);
+    }
+}
+
+/* gif image data, lzw codes packed lsb first into sub-blocks of up to 255 bytes */
+struct gif_lzw_t
+{
+    FILE *fp;
+    uint32_t bits;
+    uint32_t bit_count;
+    uint8_t block[255];
+    size_t block_size;
+    int32_t hash_keys[LZW_HASH_SIZE];
+    uint16_t hash_codes[LZW_HASH_SIZE];
+};
+
+static void gif_put_code(struct gif_lzw_t *lzw, uint32_t code, uint32_t code_size)
+{
+    lzw->bits |= code << lzw->bit_count;
+    lzw->bit_count += code_size;
+    while (lzw->bit_count >= 8)
+    {
+        lzw->block[lzw->block_size++] = lzw->bits & 0xFF;
+        lzw->bits >>= 8;
+        lzw->bit_count -= 8;
+        if (lzw->block_size == sizeof(lzw->block))
+        {
+            fputc((int)lzw->block_size, lzw->fp);
+            fwrite(lzw->block, 1, lzw->block_size, lzw->fp);
+            lzw->block_size = 0;
+        }
+    }
+}
+
+static void gif_write_pixels(struct gif_lzw_t *lzw, const uint8_t *pixels, size_t pitch, size_t x, size_t y, size_t width, size_t height)
+{
+    const uint32_t clear_code = 256, end_code = 257;
+    uint32_t code_size = 9;
+    uint32_t next_code = end_code + 1;
+
+    lzw->bits = 0;
+    lzw->bit_count = 0;
+    lzw->block_size = 0;
+    memset(lzw->hash_keys, 0xFF, sizeof(lzw->hash_keys));
+
+    fputc(8, lzw->fp);
+    gif_put_code(lzw, clear_code, code_size);
+
+    uint32_t prefix = pixels[(y * pitch) + x];
+    for (size_t i = 1; i < width * height; i++)
+    {
+        uint32_t value = pixels[((y + (i / width)) * pitch) + x + (i % width)];
+        int32_t key = (int32_t)((prefix << 8) | value);
+
+        /* the string so far plus this pixel, if it's in the dictionary keep going */
+        uint32_t slot = (uint32_t)key % LZW_HASH_SIZE;
+        while (lzw->hash_keys[slot] != -1 && lzw->hash_keys[slot] != key)
+            slot = (slot + 1) % LZW_HASH_SIZE;
+        if (lzw->hash_keys[slot] == key)
+        {
+            prefix = lzw->hash_codes[slot];
+            continue;
+        }
+
+        gif_put_code(lzw, prefix, code_size);
+        if (next_code < LZW_MAX_CODES)
+        {
+            if (next_code == (1u << code_size))
+                code_size++;
+            lzw->hash_keys[slot] = key;
+            lzw->hash_codes[slot] = (uint16_t)next_code++;
+        }
+        else
+        {
+            /* dictionary full, start again */
+            gif_put_code(lzw, clear_code, code_size);
+            memset(lzw->hash_keys, 0xFF, sizeof(lzw->hash_keys));
+            code_size = 9;
+            next_code = end_code + 1;
+        }
+        prefix = value;
+    }
+
+    gif_put_code(lzw, prefix, code_size);
+    gif_put_code(lzw, end_code, code_size);
+    if (lzw->bit_count > 0)
+        gif_put_code(lzw, 0, 8 - lzw->bit_count);
+    if (lzw->block_size > 0)
+    {
+        fputc((int)lzw->block_size, lzw->fp);
+        fwrite(lzw->block, 1, lzw->block_size, lzw->fp);
+    }
+    fputc(0, lzw->fp);
+}
+
+/* writes the part of 'pixels' that differs from 'shown' as a frame lasting delay/100s, then updates 'shown' */
+static void gif_write_frame(struct gif_lzw_t *lzw, const uint8_t *pixels, uint8_t *shown, bool first, size_t width, size_t height, uint32_t delay)
+{
+    size_t min_x = 0, min_y = 0, max_x = width - 1, max_y = height - 1;
+    if (!first)
+    {
+        min_x = width;
+        min_y = height;
+        max_x = 0;
+        max_y = 0;
+        for (size_t y = 0; y < height; y++)
+        {
+            for (size_t x = 0; x < width; x++)
+            {
+                if (pixels[(y * width) + x] != shown[(y * width) + x])
+                {
+                    if (x < min_x) min_x = x;
+                    if (x > max_x) max_x = x;
+                    if (y < min_y) min_y = y;
+                    if (y > max_y) max_y = y;
+                }
+            }
+        }
+
+        /* nothing changed, a single unchanged pixel holds the delay */
+        if (min_x > max_x)
+        {
+            min_x = max_x = 0;
+            min_y = max_y = 0;
+        }
+    }
+
+    if (delay > 0xFFFF)
+        delay = 0xFFFF;
+
+    /* graphic control extension, leave the frame in place for the next one to draw over */
+    const uint8_t control[] = { 0x21, 0xF9, 0x04, 0x04, delay & 0xFF, delay >> 8, 0x00, 0x00 };
+    fwrite(control, 1, sizeof(control), lzw->fp);
+
+    fputc(0x2C, lzw->fp);
+    put_le(lzw->fp, min_x, 2);
+    put_le(lzw->fp, min_y, 2);
+    put_le(lzw->fp, max_x + 1 - min_x, 2);
+    put_le(lzw->fp, max_y + 1 - min_y, 2);
+    fputc(0x00, lzw->fp);
+    gif_write_pixels(lzw, pixels, width, min_x, min_y, max_x + 1 - min_x, max_y + 1 - min_y);
+
+    memcpy(shown, pixels, width * height);
+}
+
+bool teensylcd_lcd_recording_export_gif(const char *recording, const char *filename, uint32_t scale)
+{
+    struct teensylcd_lcd_playback_t playback;
+    if (scale == 0 || !teensylcd_lcd_playback_open(&playback, recording))
+        return false;
+
+    FILE *fp = fopen(filename, "wb");
+    size_t width = PCD8544_LCD_X * scale, height = PCD8544_LCD_Y * scale;
+    uint8_t *shown = (uint8_t *)malloc(width * height);
+    uint8_t *pending = (uint8_t *)malloc(width * height);
+    struct gif_lzw_t *lzw = (struct gif_lzw_t *)malloc(sizeof(struct gif_lzw_t));
+    if (fp == NULL || shown == NULL || pending == NULL || lzw == NULL)
+    {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        if (fp != NULL)
+            fclose(fp);
+        free(shown);
+        free(pending);
+        free(lzw);
+        teensylcd_lcd_playback_close(&playback);
+        return false;
+    }
+    lzw->fp = fp;
+
+    /* header and a greyscale palette, pixels are their own luminance */
+    fwrite("GIF89a", 1, 6, fp);
+    put_le(fp, width, 2);
+    put_le(fp, height, 2);
+    fputc(0xF7, fp);
+    fputc(0x00, fp);
+    fputc(0x00, fp);
+    for (int i = 0; i < 256; i++)
+    {
+        fputc(i, fp);
+        fputc(i, fp);
+        fputc(i, fp);
+    }
+
+    /* loop forever */
+    const uint8_t loop[] = { 0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+    fwrite(loop, 1, sizeof(loop), fp);
+
+    /* a frame is written once the next one on a later tick says how long it lasted */
+    uint64_t pending_tick = 0;
+    bool have_pending = false, first = true;
+    while (teensylcd_lcd_playback_next(&playback))
+    {
+        uint64_t tick = (playback.cycle * GIF_FRAME_RATE) / playback.frequency;
+        if (have_pending && tick != pending_tick)
+        {
+            gif_write_frame(lzw, pending, shown, first, width, height, (uint32_t)((tick - pending_tick) * (100 / GIF_FRAME_RATE)));
+            first = false;
+        }
+        if (!have_pending || tick != pending_tick)
+            pending_tick = tick;
+
+        render_scaled(&playback, pending, scale);
+        have_pending = true;
+    }
+
+    if (have_pending)
+        gif_write_frame(lzw, pending, shown, first, width, height, 100 / GIF_FRAME_RATE);
+    fputc(0x3B, fp);
+
+    bool result = (ferror(fp) == 0);
+    if (fclose(fp) != 0)
+        result = false;
+    free(shown);
+    free(pending);
+    free(lzw);
+    teensylcd_lcd_playback_close(&playback);
+    return result;
+}
+
+bool teensylcd_lcd_recording_export_y4m(const char *recording, const char *filename, uint32_t fps, uint32_t scale)
+{
+    struct teensylcd_lcd_playback_t playback;
+    if (fps == 0 || scale == 0 || !teensylcd_lcd_playback_open(&playback, recording))
+        return false;
+
+    FILE *fp = fopen(filename, "wb");
+    size_t width = PCD8544_LCD_X * scale, height = PCD8544_LCD_Y * scale;
+    uint8_t *pixels = (uint8_t *)malloc(width * height);
+    if (fp == NULL || pixels == NULL)
+    {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        if (fp != NULL)
+            fclose(fp);
+        free(pixels);
+        teensylcd_lcd_playback_close(&playback);
+        return false;
+    }
+
+    memset(pixels, 0, width * height);
+    fprintf(fp, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 Cmono\n", (unsigned int)width, (unsigned int)height, fps);
+
+    /* each output frame shows the last recorded frame at or before its time, up to the end of the recording */
+    uint64_t start_cycle = playback.cycle, end_cycle = playback.cycle;
+    bool more = teensylcd_lcd_playback_next(&playback);
+    for (uint64_t frame = 0; more || frame == 0 || start_cycle + (frame * playback.frequency) / fps <= end_cycle; frame++)
+    {
+        uint64_t frame_cycle = start_cycle + (frame * playback.frequency) / fps;
+        while (more && playback.cycle <= frame_cycle)
+        {
+            render_scaled(&playback, pixels, scale);
+            end_cycle = playback.cycle;
+            more = teensylcd_lcd_playback_next(&playback);
+        }
+
+        fputs("FRAME\n", fp);
+        fwrite(pixels, 1, width * height, fp);
+    }
+
+    bool result = (ferror(fp) == 0);
+    if (fclose(fp) != 0)
+        result = false;
+    free(pixels);
+    teensylcd_lcd_playback_close(&playback);
+    return result;
+}
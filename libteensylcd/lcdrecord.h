@@ -0,0 +1,80 @@
+#ifndef __LIBTEENSYLCD_LCDRECORD_H
+#define __LIBTEENSYLCD_LCDRECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "teensylcd.h"
+
+/**
+ * lcd recordings are a stream of cycle-stamped frames, each stored as the bytes that changed since the
+ * frame before it. all numbers are little endian, "varint" is 7 bits per byte, low bits first, with the
+ * top bit set on every byte but the last.
+ *
+ *   header: "TLCDREC1", frequency (u32), cycle the recording started at (u64)
+ *   frame:  cycles since the previous frame, or the start (varint)
+ *           contrast (u8), with the top bit set if the display is inverted
+ *           number of runs (varint), then for each run
+ *               bytes to skip (varint), length (varint), length bytes to xor into the display ram
+ *
+ * the display ram is in the controller's bank layout (pcd8544_t.banks) and starts out blank. frames are
+ * only written when something changed, except the last one, which marks when the recording stopped.
+ */
+
+#define TEENSYLCD_LCD_RECORDING_MAGIC "TLCDREC1"
+
+/* records the lcd of a running teensy */
+struct teensylcd_lcd_recorder_t
+{
+    struct teensylcd_t *teensy;
+    FILE *fp;
+    uint32_t interval;                                  /* cycles between captures, 0 for every frame */
+    uint64_t last_cycle;
+    uint8_t last_banks[PCD8544_BANKS][PCD8544_LCD_X];
+    uint8_t last_flags;
+    uint32_t frames;
+};
+
+/**
+ * start recording to a file, capturing each time the firmware finishes writing a frame (the raster wraps
+ * back to 0,0) or, if interval is non-zero, every interval cycles instead. the latter suits firmware that
+ * only redraws part of the screen. unchanged frames cost a compare of the display ram and nothing else.
+ */
+bool teensylcd_lcd_recorder_start(struct teensylcd_lcd_recorder_t *recorder, struct teensylcd_t *teensy, const char *filename, uint32_t interval);
+
+/* capture the display now, if it changed */
+void teensylcd_lcd_recorder_capture(struct teensylcd_lcd_recorder_t *recorder);
+
+/* stop recording and close the file, returns false if anything failed to write */
+bool teensylcd_lcd_recorder_stop(struct teensylcd_lcd_recorder_t *recorder);
+
+/* reads a recording back a frame at a time */
+struct teensylcd_lcd_playback_t
+{
+    FILE *fp;
+    uint32_t frequency;
+    uint64_t cycle;                                     /* cycle the current frame was captured at */
+    uint8_t banks[PCD8544_BANKS][PCD8544_LCD_X];
+    uint8_t contrast;
+    bool invert_display;
+};
+
+/* open a recording */
+bool teensylcd_lcd_playback_open(struct teensylcd_lcd_playback_t *playback, const char *filename);
+
+/* move on to the next frame, returns false at the end of the recording */
+bool teensylcd_lcd_playback_next(struct teensylcd_lcd_playback_t *playback);
+
+/* writes the current frame out to an 8-bit luminance image, as pcd8544_render_luminance */
+void teensylcd_lcd_playback_render(const struct teensylcd_lcd_playback_t *playback, void *pixels);
+
+/* cleanup */
+void teensylcd_lcd_playback_close(struct teensylcd_lcd_playback_t *playback);
+
+/* convert a recording to an animated GIF, scaled up by a whole number, frames are timed to 1/50s */
+bool teensylcd_lcd_recording_export_gif(const char *recording, const char *filename, uint32_t scale);
+
+/* convert a recording to a greyscale YUV4MPEG2 stream at a fixed frame rate, eg for ffmpeg */
+bool teensylcd_lcd_recording_export_y4m(const char *recording, const char *filename, uint32_t fps, uint32_t scale);
+
+#endif        // __LIBTEENSYLCD_LCDRECORD_H
@@ -1,11 +1,27 @@
 #include "pcd8544.h"
 #include "avr_ioport.h"
+#include "avr_spi.h"
+#include "sim_snapshot.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
 
+#if defined(__SSE2__)
+#define PCD8544_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PCD8544_NEON
+#include <arm_neon.h>
+#endif
+
+static void lcd_raster_moved(struct pcd8544_t *lcd)
+{
+    if (lcd->raster_callback != NULL && lcd->position_x == lcd->raster_watch_x && lcd->position_y == lcd->raster_watch_y)
+        lcd->raster_callback(lcd, lcd->raster_callback_param);
+}
+
 // handler
 static void lcd_control_handler(struct pcd8544_t *lcd, uint8_t value)
 {
@@ -31,6 +47,8 @@ static void lcd_control_handler(struct pcd8544_t *lcd, uint8_t value)
         if (value & 0x80)
         {
             printf("LCD contrast change %02X\n", value & 0x7F);
+            if (lcd->contrast != (value & 0x7F))
+                pcd8544_mark_dirty(lcd);
             lcd->contrast = value & 0x7F;
             return;
         }
@@ -78,7 +96,11 @@ static void lcd_control_handler(struct pcd8544_t *lcd, uint8_t value)
         /* set X address */
         if (value & 0x80) 
         {
-            lcd->position_x = value & 0x3F;
+            if (lcd->position_x != (value & 0x3F))
+            {
+                lcd->position_x = value & 0x3F;
+                lcd_raster_moved(lcd);
+            }
             //printf("Set LCD column to %u\n", lcd->position_x);
             return;
         }
@@ -86,7 +108,11 @@ static void lcd_control_handler(struct pcd8544_t *lcd, uint8_t value)
         /* set Y address */
         if (value & 0x40)
         {
-            lcd->position_y = value & 0x07;
+            if (lcd->position_y != (value & 0x07))
+            {
+                lcd->position_y = value & 0x07;
+                lcd_raster_moved(lcd);
+            }
             //printf("Set LCD row to %u\n", lcd->position_y);
             return;
         }
@@ -102,6 +128,8 @@ static void lcd_control_handler(struct pcd8544_t *lcd, uint8_t value)
         {
             // ((value & 0x4) >> 1) | (value & 0x1) -> D/E
             // -> 00 - display blank, 10 - normal mode, 01 - all display segments on, 11 - inverse video mode
+            if (lcd->invert_display != (value == 0x03))
+                pcd8544_mark_dirty(lcd);
             lcd->invert_display = (value == 0x03);
             return;
         }
@@ -121,27 +149,17 @@ static void lcd_data_handler(struct pcd8544_t *lcd, uint8_t value)
     if (lcd->reset)
         return;
 
-    /* value is 8 bits, each corresponding to a row of a single column */
-    uint8_t pixel_x = lcd->position_x;
-    uint8_t pixel_y = lcd->position_y * 8;
-    for (unsigned char i = 0; i < 8; i++)
+    /* value is 8 bits, each corresponding to a row of a single column, the same as we store it */
+    uint8_t x = lcd->position_x;
+    uint8_t bank = lcd->position_y;
+    if (x < PCD8544_LCD_X && bank < PCD8544_BANKS && lcd->banks[bank][x] != value)
     {
-        bool pixel_state = ((value >> i) & 0x01) != 0;
-        //printf("Set pixel [%u, %u] to %u\n", pixel_x, pixel_y, (uint32_t)pixel_state);
-        
-        /* calculate index */
-        uint32_t idx = ((uint32_t)pixel_y * PCD8544_LCD_X) + (uint32_t)pixel_x;
-        uint32_t byte = idx / 8;
-        uint32_t bit = idx % 8;
-        
-        // update pixel
-        if (pixel_state)
-            lcd->pixel_state[byte] |= (1 << bit);
-        else
-            lcd->pixel_state[byte] &= ~(1 << bit);
-
-        lcd->pixels_changed |= true;
-        pixel_y++;
+        lcd->banks[bank][x] = value;
+        if (x < lcd->dirty_min[bank])
+            lcd->dirty_min[bank] = x;
+        if (x > lcd->dirty_max[bank])
+            lcd->dirty_max[bank] = x;
+        lcd->pixels_changed = true;
     }
 
     // increment column/row
@@ -150,41 +168,39 @@ static void lcd_data_handler(struct pcd8544_t *lcd, uint8_t value)
         lcd->position_x = 0;
         lcd->position_y++;
         lcd->position_y %= (48 / 8);
+        if (lcd->position_y == 0 && lcd->frame_callback != NULL)
+            lcd->frame_callback(lcd, lcd->frame_callback_param);
     }
+    lcd_raster_moved(lcd);
 }
 
-static void lcd_dcpin_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+static void lcd_dcpin_changed(struct pcd8544_t *lcd, uint32_t value)
 {
-    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
-    
     //printf("LCD DCPIN changed -> %u %s\n", value, (value == 0) ? "ie control" : "ie data");
     lcd->data_flag = (value != 0);
 }
 
-static void lcd_rstpin_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+static void lcd_rstpin_changed(struct pcd8544_t *lcd, uint32_t value)
 {
-    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
-
     //printf("LCD RSTPIN went %s\n", (value == 0) ? "low" : "high");
     lcd->reset = (value == 0);
     if (lcd->reset) {
         printf("LCD now inactive due to reset...\n");
-        memset(lcd->pixel_state, 0, sizeof(lcd->pixel_state));
+        memset(lcd->banks, 0, sizeof(lcd->banks));
+        pcd8544_mark_dirty(lcd);
     } else {
         printf("LCD now active.\n");
     }
 }
 
-static void lcd_dinpin_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+static void lcd_dinpin_changed(struct pcd8544_t *lcd, uint32_t value)
 {
-    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
     //printf("LCD DINPIN changed -> %u\n", value);
     lcd->data_pin_value = (value != 0);
 }
 
-static void lcd_sckpin_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+static void lcd_sckpin_changed(struct pcd8544_t *lcd, uint32_t value)
 {
-    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
     //printf("LCD SCKPIN went %s\n", (value == 0) ? "low ie start of bit" : "high ie end of bit");
     
     /* datasheet page 11: "When SCE is HIGH, SCLK clock signals are ignored; during the HIGH time of SCE" */
@@ -214,21 +230,73 @@ static void lcd_sckpin_changed_hook(struct avr_irq_t *irq, uint32_t value, void
     }
 }
 
-static void lcd_scepin_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+static void lcd_scepin_changed(struct pcd8544_t *lcd, uint32_t value)
 {
-    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
     //printf("LCD SCEPIN changed -> %u %s\n", value, (value != 0) ? "ie end of data" : "start of data");
     lcd->chip_enable = (value == 0);
 }
 
+/*
+ * The lcd pins are spread over three ports, each port raises a single
+ * IOPORT_IRQ_PIN_CHANGE per write with the pins that changed, which are
+ * handled in pin order, same as individual pin hooks would be.
+ */
+static void lcd_portb_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
+    uint8_t levels = AVR_IOPORT_PIN_CHANGE_LEVELS(value);
+    uint8_t changed = AVR_IOPORT_PIN_CHANGE_MASK(value);
+
+    if (changed & (1 << 4))
+        lcd_rstpin_changed(lcd, levels & (1 << 4));
+    if (changed & (1 << 5))
+        lcd_dcpin_changed(lcd, levels & (1 << 5));
+    if (changed & (1 << 6))
+        lcd_dinpin_changed(lcd, levels & (1 << 6));
+}
+
+static void lcd_portd_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
+
+    if (AVR_IOPORT_PIN_CHANGE_MASK(value) & (1 << 7))
+        lcd_scepin_changed(lcd, AVR_IOPORT_PIN_CHANGE_LEVELS(value) & (1 << 7));
+}
+
+static void lcd_portf_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
+
+    if (AVR_IOPORT_PIN_CHANGE_MASK(value) & (1 << 7))
+        lcd_sckpin_changed(lcd, AVR_IOPORT_PIN_CHANGE_LEVELS(value) & (1 << 7));
+}
+
+/*
+ * Hardware SPI, the whole byte arrives at once when the transfer completes.
+ * SCE and D/C are still plain pins.
+ */
+static void lcd_spi_output_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct pcd8544_t *lcd = (struct pcd8544_t *)param;
+
+    /* datasheet page 11: "When SCE is HIGH, SCLK clock signals are ignored" */
+    if (!lcd->chip_enable)
+        return;
+
+    if (lcd->data_flag)
+        lcd_data_handler(lcd, value);
+    else
+        lcd_control_handler(lcd, value);
+}
+
 void pcd8544_init(struct avr_t *avr, struct pcd8544_t *lcd)
 {
     /* reset data */
     lcd->position_x = 0;
     lcd->position_y = 0;
-    memset(lcd->pixel_state, 0, sizeof(lcd->pixel_state));
+    memset(lcd->banks, 0, sizeof(lcd->banks));
     lcd->contrast = 0;
-    lcd->pixels_changed = true;
+    pcd8544_mark_dirty(lcd);
     lcd->reset = false;
     lcd->chip_enable = true;
     lcd->clock_count = 0;
@@ -237,76 +305,248 @@ void pcd8544_init(struct avr_t *avr, struct pcd8544_t *lcd)
     lcd->data_flag = false;
     lcd->extended_commands = false;
     lcd->invert_display = false;
+    lcd->raster_callback = NULL;
+    lcd->raster_callback_param = NULL;
+    lcd->raster_watch_x = 0;
+    lcd->raster_watch_y = 0;
+    lcd->frame_callback = NULL;
+    lcd->frame_callback_param = NULL;
     
     /* hook up lcd */
-    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('F'), 7), lcd_sckpin_changed_hook, lcd);
-    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 6), lcd_dinpin_changed_hook, lcd);
-    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 5), lcd_dcpin_changed_hook, lcd);
-    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4), lcd_rstpin_changed_hook, lcd);
-    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 7), lcd_scepin_changed_hook, lcd);
+    /* SCK = F7, DIN = B6, DC = B5, RST = B4, SCE = D7, or bytes from the hardware SPI */
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN_CHANGE), lcd_portb_changed_hook, lcd);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN_CHANGE), lcd_portd_changed_hook, lcd);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('F'), IOPORT_IRQ_PIN_CHANGE), lcd_portf_changed_hook, lcd);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), lcd_spi_output_hook, lcd);
+}
+
+void pcd8544_snapshot(struct pcd8544_t *lcd, struct avr_snapshot_t *s)
+{
+    avr_snapshot_section(s, "lcd");
+    AVR_SNAPSHOT_FIELD(s, lcd->position_x);
+    AVR_SNAPSHOT_FIELD(s, lcd->position_y);
+    AVR_SNAPSHOT_FIELD(s, lcd->banks);
+    AVR_SNAPSHOT_FIELD(s, lcd->contrast);
+    AVR_SNAPSHOT_FIELD(s, lcd->reset);
+    AVR_SNAPSHOT_FIELD(s, lcd->chip_enable);
+    AVR_SNAPSHOT_FIELD(s, lcd->clock_count);
+    AVR_SNAPSHOT_FIELD(s, lcd->data_shift_register);
+    AVR_SNAPSHOT_FIELD(s, lcd->data_pin_value);
+    AVR_SNAPSHOT_FIELD(s, lcd->data_flag);
+    AVR_SNAPSHOT_FIELD(s, lcd->extended_commands);
+    AVR_SNAPSHOT_FIELD(s, lcd->invert_display);
+
+    /* whatever is showing now has to be redrawn */
+    if (s->restore)
+        pcd8544_mark_dirty(lcd);
+}
+
+void pcd8544_mark_dirty(struct pcd8544_t *lcd)
+{
+    memset(lcd->dirty_min, 0, sizeof(lcd->dirty_min));
+    memset(lcd->dirty_max, PCD8544_LCD_X - 1, sizeof(lcd->dirty_max));
+    lcd->pixels_changed = true;
+}
+
+void pcd8544_clear_dirty(struct pcd8544_t *lcd)
+{
+    memset(lcd->dirty_min, 0xFF, sizeof(lcd->dirty_min));
+    memset(lcd->dirty_max, 0, sizeof(lcd->dirty_max));
+    lcd->pixels_changed = false;
+}
+
+size_t pcd8544_get_dirty_rects(const struct pcd8544_t *lcd, struct pcd8544_rect_t *rects)
+{
+    size_t count = 0;
+    for (size_t bank = 0; bank < PCD8544_BANKS; bank++)
+    {
+        uint8_t min = lcd->dirty_min[bank], max = lcd->dirty_max[bank];
+        if (min > max)
+            continue;
+
+        /* extend the last rectangle down when it covers the same columns, eg a full redraw */
+        struct pcd8544_rect_t *last = (count > 0) ? &rects[count - 1] : NULL;
+        if (last != NULL && last->x == min && last->width == max - min + 1 && last->y + last->height == bank * 8)
+        {
+            last->height += 8;
+            continue;
+        }
+
+        rects[count].x = min;
+        rects[count].y = bank * 8;
+        rects[count].width = max - min + 1;
+        rects[count].height = 8;
+        count++;
+    }
+
+    return count;
 }
 
 bool pcd8544_get_pixel(const struct pcd8544_t *lcd, unsigned char x, unsigned char y)
 {
     assert(x < PCD8544_LCD_X && y < PCD8544_LCD_Y);
-    
-    /* calculate index */
-    uint32_t idx = ((uint32_t)y * PCD8544_LCD_X) + (uint32_t)x;
-    uint32_t byte = idx / 8;
-    uint32_t bit = idx % 8;
-
-    return (lcd->pixel_state[byte] & (1 << bit)) != 0;
+    return ((lcd->banks[y / 8][x] >> (y % 8)) & 0x01) != 0;
 }
 
-void pcd8544_render_screen(const struct pcd8544_t *lcd, void *pixels, size_t pitch)
+static void get_brightness(const struct pcd8544_t *lcd, uint8_t *on, uint8_t *off)
 {
     /* this would be where to do inversion */
-    uint8_t pixel_on_brightness = 127 - lcd->contrast;
-    uint8_t pixel_off_brightness = 230;
+    *on = 127 - lcd->contrast;
+    *off = 230;
     if (lcd->invert_display)
     {
-        uint8_t swap = pixel_on_brightness;
-        pixel_on_brightness = pixel_off_brightness;
-        pixel_off_brightness = swap;
+        uint8_t swap = *on;
+        *on = *off;
+        *off = swap;
     }
-    
-    /* this could be seriously optimized... */
-    for (size_t y = 0; y < PCD8544_LCD_Y; y++)
+}
+
+/*
+ * Expands one pixel row, bit 'bit' of every column in a bank, to luminance. The vector
+ * versions do 16 columns at a time, the last block overlaps the one before it.
+ */
+#if defined(PCD8544_SSE2) || defined(PCD8544_NEON)
+static const size_t block_offsets[] = { 0, 16, 32, 48, 64, PCD8544_LCD_X - 16 };
+#define NUM_BLOCKS (sizeof(block_offsets) / sizeof(block_offsets[0]))
+#endif
+
+static void expand_row(const uint8_t *bank, unsigned int bit, uint8_t on, uint8_t off, uint8_t *out)
+{
+#if defined(PCD8544_SSE2)
+    const __m128i bitmask = _mm_set1_epi8((char)(1 << bit));
+    const __m128i offv = _mm_set1_epi8((char)off);
+    const __m128i flipv = _mm_set1_epi8((char)(on ^ off));
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
     {
-        uint8_t *pixout = (uint8_t *)pixels + (y * pitch);
-        for (size_t x = 0; x < PCD8544_LCD_X; x++)
-        {
-            bool pixon = pcd8544_get_pixel(lcd, x, y);
-            uint8_t brightness = (pixon) ? pixel_on_brightness : pixel_off_brightness;
-            *(pixout++) = brightness;   /* R */
-            *(pixout++) = brightness;   /* G */    
-            *(pixout++) = brightness;   /* B */
-            *(pixout++) = 255;          /* A */
-        }
+        __m128i v = _mm_loadu_si128((const __m128i *)(bank + block_offsets[i]));
+        __m128i set = _mm_cmpeq_epi8(_mm_and_si128(v, bitmask), bitmask);
+        _mm_storeu_si128((__m128i *)(out + block_offsets[i]), _mm_xor_si128(offv, _mm_and_si128(set, flipv)));
+    }
+#elif defined(PCD8544_NEON)
+    const uint8x16_t bitmask = vdupq_n_u8((uint8_t)(1 << bit));
+    const uint8x16_t onv = vdupq_n_u8(on);
+    const uint8x16_t offv = vdupq_n_u8(off);
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
+    {
+        uint8x16_t set = vtstq_u8(vld1q_u8(bank + block_offsets[i]), bitmask);
+        vst1q_u8(out + block_offsets[i], vbslq_u8(set, onv, offv));
+    }
+#else
+    for (size_t x = 0; x < PCD8544_LCD_X; x++)
+        out[x] = ((bank[x] >> bit) & 0x01) ? on : off;
+#endif
+}
+
+/* same again, but to RGBA8888 */
+static void expand_row_rgba(const uint8_t *bank, unsigned int bit, uint8_t on, uint8_t off, uint8_t *out)
+{
+#if defined(PCD8544_SSE2)
+    uint8_t luminance[PCD8544_LCD_X];
+    const __m128i alpha = _mm_set1_epi8((char)255);
+    expand_row(bank, bit, on, off, luminance);
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
+    {
+        __m128i l = _mm_loadu_si128((const __m128i *)(luminance + block_offsets[i]));
+        __m128i ll_lo = _mm_unpacklo_epi8(l, l), ll_hi = _mm_unpackhi_epi8(l, l);
+        __m128i la_lo = _mm_unpacklo_epi8(l, alpha), la_hi = _mm_unpackhi_epi8(l, alpha);
+        uint8_t *dst = out + (block_offsets[i] * 4);
+        _mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi16(ll_lo, la_lo));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(ll_lo, la_lo));
+        _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(ll_hi, la_hi));
+        _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(ll_hi, la_hi));
+    }
+#elif defined(PCD8544_NEON)
+    uint8_t luminance[PCD8544_LCD_X];
+    expand_row(bank, bit, on, off, luminance);
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
+    {
+        uint8x16x4_t rgba;
+        rgba.val[0] = rgba.val[1] = rgba.val[2] = vld1q_u8(luminance + block_offsets[i]);
+        rgba.val[3] = vdupq_n_u8(255);
+        vst4q_u8(out + (block_offsets[i] * 4), rgba);
     }
+#else
+    const uint8_t on_pixel[4] = { on, on, on, 255 };
+    const uint8_t off_pixel[4] = { off, off, off, 255 };
+    for (size_t x = 0; x < PCD8544_LCD_X; x++)
+        memcpy(out + (x * 4), ((bank[x] >> bit) & 0x01) ? on_pixel : off_pixel, 4);
+#endif
+}
+
+void pcd8544_render_screen(const struct pcd8544_t *lcd, void *pixels, size_t pitch)
+{
+    uint8_t on, off;
+    get_brightness(lcd, &on, &off);
+
+    for (size_t y = 0; y < PCD8544_LCD_Y; y++)
+        expand_row_rgba(lcd->banks[y / 8], y % 8, on, off, (uint8_t *)pixels + (y * pitch));
 }
 
 void pcd8544_render_luminance(const struct pcd8544_t *lcd, void *pixels)
 {
-    /* this would be where to do inversion */
-    uint8_t pixel_on_brightness = 127 - lcd->contrast;
-    uint8_t pixel_off_brightness = 230;
-    if (lcd->invert_display)
+    uint8_t on, off;
+    get_brightness(lcd, &on, &off);
+
+    for (size_t y = 0; y < PCD8544_LCD_Y; y++)
+        expand_row(lcd->banks[y / 8], y % 8, on, off, (uint8_t *)pixels + (y * PCD8544_LCD_X));
+}
+
+void pcd8544_render_screen_rect(const struct pcd8544_t *lcd, void *pixels, size_t pitch, const struct pcd8544_rect_t *rect)
+{
+    uint8_t on, off;
+    uint8_t rgba[PCD8544_LCD_X * 4];
+    get_brightness(lcd, &on, &off);
+    assert(rect->x + rect->width <= PCD8544_LCD_X && rect->y + rect->height <= PCD8544_LCD_Y);
+
+    /* expanding the whole row is about as cheap as part of it, only the copy out is cut down */
+    for (size_t y = rect->y; y < (size_t)(rect->y + rect->height); y++)
     {
-        uint8_t swap = pixel_on_brightness;
-        pixel_on_brightness = pixel_off_brightness;
-        pixel_off_brightness = swap;
+        expand_row_rgba(lcd->banks[y / 8], y % 8, on, off, rgba);
+        memcpy((uint8_t *)pixels + (y * pitch) + (rect->x * 4), rgba + (rect->x * 4), rect->width * 4);
     }
-    
-    /* this could be seriously optimized... */
+}
+
+void pcd8544_render_luminance_rect(const struct pcd8544_t *lcd, void *pixels, const struct pcd8544_rect_t *rect)
+{
+    uint8_t on, off;
+    uint8_t luminance[PCD8544_LCD_X];
+    get_brightness(lcd, &on, &off);
+    assert(rect->x + rect->width <= PCD8544_LCD_X && rect->y + rect->height <= PCD8544_LCD_Y);
+
+    for (size_t y = rect->y; y < (size_t)(rect->y + rect->height); y++)
+    {
+        expand_row(lcd->banks[y / 8], y % 8, on, off, luminance);
+        memcpy((uint8_t *)pixels + (y * PCD8544_LCD_X) + rect->x, luminance + rect->x, rect->width);
+    }
+}
+
+void pcd8544_render_scaled(const struct pcd8544_t *lcd, void *pixels, size_t pitch, uint32_t scale)
+{
+    uint8_t on, off;
+    uint8_t rgba[PCD8544_LCD_X * 4];
+    get_brightness(lcd, &on, &off);
+
+    if (scale <= 1)
+    {
+        pcd8544_render_screen(lcd, pixels, pitch);
+        return;
+    }
+
     for (size_t y = 0; y < PCD8544_LCD_Y; y++)
     {
-        uint8_t *pixout = (uint8_t *)pixels + (y * PCD8544_LCD_X);
+        expand_row_rgba(lcd->banks[y / 8], y % 8, on, off, rgba);
+
+        /* widen the first line, then copy it down */
+        uint8_t *line = (uint8_t *)pixels + (y * scale * pitch);
+        uint32_t *out = (uint32_t *)line;
         for (size_t x = 0; x < PCD8544_LCD_X; x++)
         {
-            bool pixon = pcd8544_get_pixel(lcd, x, y);
-            uint8_t brightness = (pixon) ? pixel_on_brightness : pixel_off_brightness;
-            *(pixout++) = brightness;   /* L */
+            uint32_t pixel;
+            memcpy(&pixel, rgba + (x * 4), sizeof(pixel));
+            for (uint32_t i = 0; i < scale; i++)
+                *(out++) = pixel;
         }
+        for (uint32_t i = 1; i < scale; i++)
+            memcpy(line + (i * pitch), line, PCD8544_LCD_X * scale * 4);
     }
-}
\ No newline at end of file
+}
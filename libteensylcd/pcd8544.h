@@ -8,6 +8,7 @@
 
 #define PCD8544_LCD_X 84
 #define PCD8544_LCD_Y 48
+#define PCD8544_BANKS (PCD8544_LCD_Y / 8)
 
 /* state */
 struct pcd8544_t
@@ -16,15 +17,19 @@ struct pcd8544_t
     uint8_t position_x;                    /* 0-84 */
     uint8_t position_y;                    /* 0-6, groups of 8 */
     
-    /* pixel bitmap, one bit for each pixel */
-    uint8_t pixel_state[PCD8544_LCD_X * PCD8544_LCD_Y / 8];
+    /* display ram as the controller lays it out, bit n of banks[b][x] is the pixel at x, (b * 8) + n */
+    uint8_t banks[PCD8544_BANKS][PCD8544_LCD_X];
     
     /* contrast level or Vop (0-127) */
     uint8_t contrast;
     
-    /* changed flag, feel free to reset externally */
+    /* changed flag, set along with the dirty columns below, feel free to reset externally */
     bool pixels_changed;
     
+    /* columns of each bank whose pixels changed since pcd8544_clear_dirty(), clean when min > max */
+    uint8_t dirty_min[PCD8544_BANKS];
+    uint8_t dirty_max[PCD8544_BANKS];
+    
     /* low-level access */
     
     /* reset state, TRUE indicates reset pin pulled low */
@@ -50,19 +55,64 @@ struct pcd8544_t
     
     /* inverted colours */
     bool invert_display;
+    
+    /* if set, called whenever the raster moves onto raster_watch_x, raster_watch_y */
+    void (*raster_callback)(struct pcd8544_t *lcd, void *param);
+    void *raster_callback_param;
+    uint8_t raster_watch_x;
+    uint8_t raster_watch_y;
+    
+    /* if set, called whenever a data write wraps the raster from the last byte back to 0,0 */
+    void (*frame_callback)(struct pcd8544_t *lcd, void *param);
+    void *frame_callback_param;
 };
 
+/* an area of the screen, in pixels */
+struct pcd8544_rect_t
+{
+    uint8_t x;
+    uint8_t y;
+    uint8_t width;
+    uint8_t height;
+};
+
+/* most dirty rectangles there can be, one per bank */
+#define PCD8544_MAX_DIRTY_RECTS PCD8544_BANKS
+
 /* initialize state */
 void pcd8544_init(struct avr_t *avr, struct pcd8544_t *lcd);
 
+/* save/restore the controller state as part of a simulator snapshot */
+struct avr_snapshot_t;
+void pcd8544_snapshot(struct pcd8544_t *lcd, struct avr_snapshot_t *s);
+
+/* mark the whole screen as needing to be redrawn */
+void pcd8544_mark_dirty(struct pcd8544_t *lcd);
+
+/* forget the changes so far, including pixels_changed */
+void pcd8544_clear_dirty(struct pcd8544_t *lcd);
+
+/**
+ * fills rects (PCD8544_MAX_DIRTY_RECTS long) with the areas changed since the last pcd8544_clear_dirty(),
+ * returns how many. a rectangle covers the changed columns of one or more banks, whole banks high.
+ */
+size_t pcd8544_get_dirty_rects(const struct pcd8544_t *lcd, struct pcd8544_rect_t *rects);
+
 /* returns a 0/1 depending on whether the pixel is on/off */
 bool pcd8544_get_pixel(const struct pcd8544_t *lcd, unsigned char x, unsigned char y);
 
-/* writes the lcd contents out to an image, using the current contrast level */
+/* writes the lcd contents out to an RGBA8888 image, using the current contrast level */
 void pcd8544_render_screen(const struct pcd8544_t *lcd, void *pixels, size_t pitch);
 
-/* writes the lcd contents out to an image, using the current contrast level */
+/* writes the lcd contents out to an 8-bit luminance image PCD8544_LCD_X wide, using the current contrast level */
 void pcd8544_render_luminance(const struct pcd8544_t *lcd, void *pixels);
 
+/* as pcd8544_render_screen and pcd8544_render_luminance, only writing the pixels inside rect */
+void pcd8544_render_screen_rect(const struct pcd8544_t *lcd, void *pixels, size_t pitch, const struct pcd8544_rect_t *rect);
+void pcd8544_render_luminance_rect(const struct pcd8544_t *lcd, void *pixels, const struct pcd8544_rect_t *rect);
+
+/* writes the lcd contents out to an RGBA8888 image scaled up by a whole number, using the current contrast level */
+void pcd8544_render_scaled(const struct pcd8544_t *lcd, void *pixels, size_t pitch, uint32_t scale);
+
 #endif      // __PCD8544_H
 
@@ -1,10 +1,13 @@
 #include "teensylcd.h"
+#include "inputscript.h"
 #include "sim_avr.h"
 #include "sim_irq.h"
 #include "sim_elf.h"
 #include "sim_hex.h"
 #include "sim_time.h"
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
+#include "sim_core.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -15,6 +18,34 @@ static const char *button_names[NUM_TEENSYLCD_BUTTONS] = {
     "teensylcd.stickup", "teensylcd.stickdown", "teensylcd.stickleft", "teensylcd.stickright", "teensylcd.stickpush"
 };
 
+/* short names for input scripts */
+static const char *button_script_names[NUM_TEENSYLCD_BUTTONS] = {
+    "sw0", "sw1", "sw2", "sw3",
+    "stickup", "stickdown", "stickleft", "stickright", "stickpush"
+};
+
+/* run_until stop hooks, a condition that is being waited for stops the core straight away */
+static void run_until_hit(struct teensylcd_t *teensy, uint32_t condition)
+{
+    if (teensy->run_until_conditions & condition)
+    {
+        teensy->run_until_met |= condition;
+        avr_run_break(teensy->avr);
+    }
+}
+
+static void run_until_raster_hook(struct pcd8544_t *lcd, void *param)
+{
+    run_until_hit((struct teensylcd_t *)param, TEENSYLCD_STOP_LCD_FRAME);
+}
+
+static void run_until_write_hook(struct avr_t *avr, uint16_t addr, uint8_t v, void *param)
+{
+    struct teensylcd_t *teensy = (struct teensylcd_t *)param;
+    if (addr == teensy->run_until_sram_address)
+        run_until_hit(teensy, TEENSYLCD_STOP_SRAM_WRITE);
+}
+
 /* led change hooks */
 
 static void led0_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
@@ -25,6 +56,8 @@ static void led0_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param
     
     if (teensy->led_change_callback != NULL)
         teensy->led_change_callback(teensy, TEENSYLCD_LED0, (value != 0));
+
+    run_until_hit(teensy, TEENSYLCD_STOP_LED_CHANGE);
 }
 
 static void led1_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
@@ -35,6 +68,8 @@ static void led1_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param
     
     if (teensy->led_change_callback != NULL)
         teensy->led_change_callback(teensy, TEENSYLCD_LED1, (value != 0));
+
+    run_until_hit(teensy, TEENSYLCD_STOP_LED_CHANGE);
 }
 
 static void led2_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
@@ -45,18 +80,84 @@ static void led2_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param
     
     if (teensy->led_change_callback != NULL)
         teensy->led_change_callback(teensy, TEENSYLCD_LED2, (value != 0));
+
+    run_until_hit(teensy, TEENSYLCD_STOP_LED_CHANGE);
 }
 
-/* adapted from button.h */
+/* adapted from button.h, one timer releases every pushed button when it is due */
 static avr_cycle_count_t button_auto_release(avr_t *avr, avr_cycle_count_t when, void *param)
 {
     struct teensylcd_t *teensy = (struct teensylcd_t *)param;
-    printf("button_auto_release\n");
-    teensylcd_set_button_state(teensy, (enum TEENSYLCD_BUTTON)param, 0);
+    avr_cycle_count_t next = 0;
+    for (int i = 0; i < NUM_TEENSYLCD_BUTTONS; i++)
+    {
+        if (teensy->button_release_cycles[i] == 0)
+            continue;
+
+        if (teensy->button_release_cycles[i] <= when)
+        {
+            teensy->button_release_cycles[i] = 0;
+            teensylcd_set_button_state(teensy, (enum TEENSYLCD_BUTTON)i, false);
+        }
+        else if (next == 0 || teensy->button_release_cycles[i] < next)
+        {
+            next = teensy->button_release_cycles[i];
+        }
+    }
+
+    return next;
+}
+
+/* the script's clock moves on at least this often, at whatever clock the firmware runs at then */
+#define INPUT_PLAYBACK_STEP_USEC 1000
+
+/* the cycle an input script event is due on, or the next step of the script's clock if that's sooner */
+static avr_cycle_count_t input_playback_due(const struct teensylcd_t *teensy, const struct teensylcd_input_event_t *event)
+{
+    avr_cycle_count_t step = teensy->input_playback_cycle + avr_usec_to_cycles(teensy->avr, INPUT_PLAYBACK_STEP_USEC);
+    if (!event->usec)
+        return (teensy->input_playback_start + event->time < step) ? teensy->input_playback_start + event->time : step;
+
+    uint64_t usec = (event->time > teensy->input_playback_usec) ? event->time - teensy->input_playback_usec : 0;
+    if (usec >= INPUT_PLAYBACK_STEP_USEC)
+        return step;
+    return teensy->input_playback_cycle + avr_usec_to_cycles(teensy->avr, (uint32_t)usec);
+}
+
+/* input script playback, fires every event due by 'when' and reschedules for the next one */
+static avr_cycle_count_t input_playback_timer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct teensylcd_t *teensy = (struct teensylcd_t *)param;
+    const struct teensylcd_input_script_t *script = teensy->input_playback;
+    if (script == NULL)
+        return 0;
+
+    /* simulated time since playback started, added up as the firmware changes its clock (CLKPR) */
+    if (when > teensy->input_playback_cycle)
+    {
+        teensy->input_playback_usec += avr_cycles_to_usec(avr, when - teensy->input_playback_cycle);
+        teensy->input_playback_cycle = when;
+    }
+
+    while (teensy->input_playback_position < script->count)
+    {
+        const struct teensylcd_input_event_t *event = &script->events[teensy->input_playback_position];
+        avr_cycle_count_t event_cycle = input_playback_due(teensy, event);
+        if (event_cycle > when)
+            return event_cycle;
+
+        /* the conversion rounds, the event is on time by definition */
+        if (event->usec && event->time > teensy->input_playback_usec)
+            teensy->input_playback_usec = event->time;
+
+        teensylcd_set_button_state(teensy, event->button, event->state);
+        teensy->input_playback_position++;
+    }
+
     return 0;
 }
 
-static bool teensylcd_init_common(struct teensylcd_t *teensy, uint32_t frequency, int loglevel)
+static bool teensylcd_init_common(struct teensylcd_t *teensy, uint32_t frequency, int loglevel, struct avr_t *share_flash)
 {
     /* create mcu */
     teensy->avr = avr_make_mcu_by_name("atmega32u4");
@@ -66,14 +167,33 @@ static bool teensylcd_init_common(struct teensylcd_t *teensy, uint32_t frequency
         return false;
     }
 
-    /* init mcu */
-    avr_init(teensy->avr);
+    /* init mcu, running from the flash of another instance if asked to */
+    if ((share_flash != NULL && avr_flash_share(teensy->avr, share_flash) != 0) ||
+        avr_init(teensy->avr) != 0)
+    {
+        fprintf(stderr, "Failed to initialize AVR core.\n");
+        avr_terminate(teensy->avr);
+        free(teensy->avr);
+        teensy->avr = NULL;
+        return false;
+    }
     teensy->avr->frequency = frequency;
     teensy->avr->log = loglevel;
     teensy->avr->trace = (loglevel >= LOG_TRACE);
     teensy->led_change_callback = NULL;
     memset(teensy->led_states, 0, sizeof(teensy->led_states));
     memset(teensy->button_states, 0, sizeof(teensy->button_states));
+    memset(teensy->button_release_cycles, 0, sizeof(teensy->button_release_cycles));
+    teensy->input_playback = NULL;
+    teensy->input_playback_start = 0;
+    teensy->input_playback_position = 0;
+    teensy->input_playback_cycle = 0;
+    teensy->input_playback_usec = 0;
+    teensy->input_record = NULL;
+    teensy->input_record_start = 0;
+    teensy->run_until_conditions = 0;
+    teensy->run_until_met = 0;
+    teensy->run_until_sram_address = 0;
     
     /* hook up lcd */
     pcd8544_init(teensy->avr, &teensy->lcd);
@@ -87,12 +207,9 @@ static bool teensylcd_init_common(struct teensylcd_t *teensy, uint32_t frequency
     return true;
 }
 
-bool teensylcd_init(struct teensylcd_t *teensy, uint32_t frequency, int loglevel)
+static void teensylcd_connect_old_pinout(struct teensylcd_t *teensy)
 {
-    if (!teensylcd_init_common(teensy, frequency, loglevel))
-        return false;
-
-    printf("Using old teensylcd pinout.\n");
+    teensy->new_pinout = false;
 
     /* hook up leds */
     avr_irq_register_notify(avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2), led0_changed_hook, teensy);
@@ -102,17 +219,12 @@ bool teensylcd_init(struct teensylcd_t *teensy, uint32_t frequency, int loglevel
     /* hook up buttons */
     avr_connect_irq(teensy->button_irqs[TEENSYLCD_BUTTON_SW0], avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0));
     avr_connect_irq(teensy->button_irqs[TEENSYLCD_BUTTON_SW1], avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1));
-
-    return true;
 }
 
-bool teensylcd_init_new(struct teensylcd_t *teensy, uint32_t frequency, int loglevel)
+static void teensylcd_connect_new_pinout(struct teensylcd_t *teensy)
 {
-    if (!teensylcd_init_common(teensy, frequency, loglevel))
-        return false;
+    teensy->new_pinout = true;
 
-    printf("Using new teensylcd pinout.\n");
-    
     /* hook up leds */
     avr_irq_register_notify(avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2), led0_changed_hook, teensy);
     avr_irq_register_notify(avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 3), led1_changed_hook, teensy);
@@ -126,13 +238,142 @@ bool teensylcd_init_new(struct teensylcd_t *teensy, uint32_t frequency, int logl
     avr_connect_irq(teensy->button_irqs[TEENSYLCD_STICK_LEFT], avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 1));    // ???
     avr_connect_irq(teensy->button_irqs[TEENSYLCD_STICK_RIGHT], avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2));   // ???
     avr_connect_irq(teensy->button_irqs[TEENSYLCD_STICK_PUSH], avr_io_getirq(teensy->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0));
+}
 
+bool teensylcd_init(struct teensylcd_t *teensy, uint32_t frequency, int loglevel)
+{
+    if (!teensylcd_init_common(teensy, frequency, loglevel, NULL))
+        return false;
+
+    printf("Using old teensylcd pinout.\n");
+    teensylcd_connect_old_pinout(teensy);
+    return true;
+}
+
+bool teensylcd_init_new(struct teensylcd_t *teensy, uint32_t frequency, int loglevel)
+{
+    if (!teensylcd_init_common(teensy, frequency, loglevel, NULL))
+        return false;
+
+    printf("Using new teensylcd pinout.\n");
+    teensylcd_connect_new_pinout(teensy);
     return true;
 }
 
 void teensylcd_reset(struct teensylcd_t *teensy)
 {
+    /* the reset drops all cycle timers, so pending releases and playback go with them */
     avr_reset(teensy->avr);
+    memset(teensy->button_release_cycles, 0, sizeof(teensy->button_release_cycles));
+    teensy->input_playback = NULL;
+    teensy->input_playback_position = 0;
+}
+
+/* teensylcd state on top of the avr, used both ways */
+static bool teensylcd_snapshot_state(struct teensylcd_t *teensy, struct avr_snapshot_t *s)
+{
+    uint32_t version = TEENSYLCD_SNAPSHOT_VERSION;
+
+    avr_snapshot_section(s, "tlcd");
+    AVR_SNAPSHOT_FIELD(s, version);
+    if (s->error || version != TEENSYLCD_SNAPSHOT_VERSION)
+        return false;
+
+    pcd8544_snapshot(&teensy->lcd, s);
+    AVR_SNAPSHOT_FIELD(s, teensy->led_states);
+    AVR_SNAPSHOT_FIELD(s, teensy->button_states);
+    AVR_SNAPSHOT_FIELD(s, teensy->next_cycles_sub);
+    AVR_SNAPSHOT_FIELD(s, teensy->button_release_cycles);
+    AVR_SNAPSHOT_FIELD(s, teensy->input_playback_start);
+    AVR_SNAPSHOT_FIELD(s, teensy->input_playback_position);
+    AVR_SNAPSHOT_FIELD(s, teensy->input_playback_cycle);
+    AVR_SNAPSHOT_FIELD(s, teensy->input_playback_usec);
+    return !s->error;
+}
+
+/* pending button auto release and input playback timers point at us, same on save and restore */
+static void teensylcd_snapshot_add(struct teensylcd_t *teensy, struct avr_snapshot_t *s)
+{
+    avr_snapshot_add_base(s, teensy, sizeof(*teensy));
+    AVR_SNAPSHOT_ADD_FUNCTION(s, button_auto_release);
+    AVR_SNAPSHOT_ADD_FUNCTION(s, input_playback_timer);
+}
+
+bool teensylcd_snapshot(struct teensylcd_t *teensy, void **data, size_t *size)
+{
+    struct avr_snapshot_t s;
+    avr_snapshot_init(&s);
+    teensylcd_snapshot_add(teensy, &s);
+
+    if (avr_snapshot_save(teensy->avr, &s) != 0 || !teensylcd_snapshot_state(teensy, &s))
+    {
+        fprintf(stderr, "Failed to save snapshot\n");
+        avr_snapshot_free(&s);
+        return false;
+    }
+
+    *data = s.data;
+    *size = s.size;
+    return true;
+}
+
+bool teensylcd_restore(struct teensylcd_t *teensy, const void *data, size_t size)
+{
+    struct avr_snapshot_t s;
+    avr_snapshot_init_restore(&s, data, size);
+    teensylcd_snapshot_add(teensy, &s);
+
+    if (avr_snapshot_restore(teensy->avr, &s) != 0 || !teensylcd_snapshot_state(teensy, &s))
+    {
+        fprintf(stderr, "Failed to restore snapshot\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool teensylcd_clone(struct teensylcd_t *clone, struct teensylcd_t *teensy)
+{
+    struct avr_snapshot_t save, restore;
+    bool result;
+
+    /* same board, running from the same flash */
+    if (!teensylcd_init_common(clone, teensy->avr->frequency, teensy->avr->log, teensy->avr))
+        return false;
+    if (teensy->new_pinout)
+        teensylcd_connect_new_pinout(clone);
+    else
+        teensylcd_connect_old_pinout(clone);
+    clone->led_change_callback = teensy->led_change_callback;
+    clone->input_playback = teensy->input_playback;
+
+    /* the gdb callbacks need a gdb server, which is not cloned */
+    if (teensy->avr->gdb == NULL)
+    {
+        clone->avr->run = teensy->avr->run;
+        clone->avr->sleep = teensy->avr->sleep;
+    }
+
+    /* then copy everything else across, the flash needn't be */
+    avr_snapshot_init(&save);
+    save.flags = AVR_SNAPSHOT_NO_FLASH;
+    teensylcd_snapshot_add(teensy, &save);
+    result = (avr_snapshot_save(teensy->avr, &save) == 0 && teensylcd_snapshot_state(teensy, &save));
+    if (result)
+    {
+        avr_snapshot_init_restore(&restore, save.data, save.size);
+        teensylcd_snapshot_add(clone, &restore);
+        result = (avr_snapshot_restore(clone->avr, &restore) == 0 && teensylcd_snapshot_state(clone, &restore));
+    }
+    avr_snapshot_free(&save);
+
+    if (!result)
+    {
+        fprintf(stderr, "Failed to clone simulator\n");
+        teensylcd_cleanup(clone);
+    }
+
+    return result;
 }
 
 bool teensylcd_load_elf(struct teensylcd_t *teensy, const char *filename)
@@ -211,19 +452,101 @@ void teensylcd_set_button_state(struct teensylcd_t *teensy, enum TEENSYLCD_BUTTO
         
     teensy->button_states[button] = state;
     avr_raise_irq(teensy->button_irqs[button], state);
+
+    if (teensy->input_record != NULL)
+        teensylcd_input_script_add(teensy->input_record, teensy->avr->cycle - teensy->input_record_start, button, state);
     
     //printf("set button %u %u\n", button, state);
 }
 
+const char *teensylcd_get_button_name(enum TEENSYLCD_BUTTON button)
+{
+    assert(button < NUM_TEENSYLCD_BUTTONS);
+    return button_script_names[button];
+}
+
+bool teensylcd_get_button_by_name(const char *name, enum TEENSYLCD_BUTTON *button)
+{
+    for (int i = 0; i < NUM_TEENSYLCD_BUTTONS; i++)
+    {
+        if (!strcmp(name, button_script_names[i]))
+        {
+            *button = (enum TEENSYLCD_BUTTON)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void teensylcd_push_button(struct teensylcd_t *teensy, enum TEENSYLCD_BUTTON button)
+{
+    teensylcd_push_button_time(teensy, button, 200000);
+}
+
+void teensylcd_push_button_time(struct teensylcd_t *teensy, enum TEENSYLCD_BUTTON button, uint32_t release_time)
 {
     assert(button < NUM_TEENSYLCD_BUTTONS);
     
     teensylcd_set_button_state(teensy, button, true);
-    
-    /* todo: case where both buttons are pushed at same time */
-    avr_cycle_timer_cancel(teensy->avr, button_auto_release, teensy);
-    avr_cycle_timer_register_usec(teensy->avr, 200000, button_auto_release, teensy);
+
+    /* release cycles are never zero, that marks a button with no release pending */
+    avr_cycle_count_t release_cycle = teensy->avr->cycle + avr_usec_to_cycles(teensy->avr, release_time);
+    teensy->button_release_cycles[button] = (release_cycle > 0) ? release_cycle : 1;
+
+    /* one timer covers all the buttons, so it fires for whichever is due first */
+    avr_cycle_count_t pending = avr_cycle_timer_status(teensy->avr, button_auto_release, teensy);
+    if (pending == 0 || teensy->avr->cycle + pending - 1 > release_cycle)
+        avr_cycle_timer_register(teensy->avr, release_cycle - teensy->avr->cycle, button_auto_release, teensy);
+}
+
+void teensylcd_play_input_script(struct teensylcd_t *teensy, const struct teensylcd_input_script_t *script)
+{
+    teensy->input_playback = script;
+    teensy->input_playback_start = teensy->avr->cycle;
+    teensy->input_playback_position = 0;
+    teensy->input_playback_cycle = teensy->avr->cycle;
+    teensy->input_playback_usec = 0;
+
+    /* events due now are fired by the next run, same as any other timer */
+    if (script->count > 0)
+        avr_cycle_timer_register(teensy->avr, input_playback_due(teensy, &script->events[0]) - teensy->avr->cycle,
+                                 input_playback_timer, teensy);
+    else
+        avr_cycle_timer_cancel(teensy->avr, input_playback_timer, teensy);
+}
+
+void teensylcd_stop_input_script(struct teensylcd_t *teensy)
+{
+    avr_cycle_timer_cancel(teensy->avr, input_playback_timer, teensy);
+    teensy->input_playback = NULL;
+    teensy->input_playback_position = 0;
+}
+
+bool teensylcd_is_input_script_playing(const struct teensylcd_t *teensy)
+{
+    return (teensy->input_playback != NULL && teensy->input_playback_position < teensy->input_playback->count);
+}
+
+void teensylcd_record_input(struct teensylcd_t *teensy, struct teensylcd_input_script_t *script)
+{
+    teensy->input_record = script;
+    teensy->input_record_start = teensy->avr->cycle;
+}
+
+void teensylcd_set_virtual_time(struct teensylcd_t *teensy, bool enabled)
+{
+    if (enabled)
+        teensy->avr->sleep = avr_callback_sleep_virtual;
+    else if (teensy->avr->gdb != NULL)
+        teensy->avr->sleep = avr_callback_sleep_gdb;
+    else
+        teensy->avr->sleep = avr_callback_sleep_raw;
+}
+
+bool teensylcd_get_virtual_time(const struct teensylcd_t *teensy)
+{
+    return (teensy->avr->sleep == avr_callback_sleep_virtual);
 }
 
 bool teensylcd_run_single(struct teensylcd_t *teensy)
@@ -291,27 +614,99 @@ bool teensylcd_run_frame(struct teensylcd_t *teensy, uint32_t target_framerate)
     return teensylcd_run_time_microseconds(teensy, 1000000 / target_framerate);
 }
 
-bool teensylcd_run_until_refresh(struct teensylcd_t *teensy)
+uint32_t teensylcd_run_until(struct teensylcd_t *teensy, const struct teensylcd_run_until_t *until)
 {
-    /* flatten out lcd position to a single value for easier comparison */
-    uint32_t initial_lcd_pos = ((uint32_t)teensy->lcd.position_y * PCD8544_LCD_X) + (uint32_t)teensy->lcd.position_x;
-    uint32_t lcd_pos = initial_lcd_pos;
-    
-    /* wait for the raster to reach this position again */
-    do
+    struct avr_t *avr = teensy->avr;
+    uint32_t conditions = until->conditions;
+    avr_cycle_count_t end_cycle = avr->cycle + until->cycles;
+    avr_cycle_count_t run_cycle_limit = avr->run_cycle_limit;
+    bool stop_set = false;
+
+    teensy->run_until_conditions = conditions;
+    teensy->run_until_met = 0;
+
+    /* hook up the conditions, the pc stop goes in below */
+    if (conditions & TEENSYLCD_STOP_LCD_FRAME)
+    {
+        teensy->lcd.raster_watch_x = teensy->lcd.position_x;
+        teensy->lcd.raster_watch_y = teensy->lcd.position_y;
+        teensy->lcd.raster_callback_param = teensy;
+        teensy->lcd.raster_callback = run_until_raster_hook;
+    }
+    if (conditions & TEENSYLCD_STOP_SRAM_WRITE)
     {
-        uint32_t last_position = lcd_pos;
-        while (lcd_pos == last_position)
+        teensy->run_until_sram_address = until->sram_address;
+        avr->write_watch_param = teensy;
+        avr->write_watch = run_until_write_hook;
+    }
+
+    while (teensy->run_until_met == 0)
+    {
+        if (conditions & TEENSYLCD_STOP_CYCLES)
         {
-            /* run until the position changes */
-            if (!teensylcd_run_single(teensy))
-                return false;
-            
-            lcd_pos = ((uint32_t)teensy->lcd.position_y * PCD8544_LCD_X) + (uint32_t)teensy->lcd.position_x;
+            if (avr->cycle >= end_cycle)
+            {
+                teensy->run_until_met |= TEENSYLCD_STOP_CYCLES;
+                break;
+            }
+
+            /* the core runs up to the next timer or the limit, whichever is first */
+            avr->run_cycle_limit = end_cycle - avr->cycle;
+            if (avr->run_cycle_count > avr->run_cycle_limit)
+                avr->run_cycle_count = avr->run_cycle_limit;
+        }
+        else
+        {
+            avr->run_cycle_limit = ~(avr_cycle_count_t)0;
+        }
+
+        if ((conditions & TEENSYLCD_STOP_PC) && !stop_set)
+        {
+            /* starting on pc, run that one instruction before putting the stop in */
+            if (avr->pc == until->pc)
+            {
+                avr_run_break(avr);
+            }
+            else
+            {
+                avr_core_set_stop(avr, until->pc);
+                stop_set = true;
+            }
+        }
+
+        int state = avr_run(avr);
+        if (state == cpu_StepDone)
+        {
+            avr->state = cpu_Running;
+            teensy->run_until_met |= TEENSYLCD_STOP_PC;
+        }
+        else if (state == cpu_Done || state == cpu_Crashed)
+        {
+            teensy->run_until_met |= TEENSYLCD_STOP_CPU_DONE;
         }
     }
-    while (lcd_pos != initial_lcd_pos);
-    return true;
+
+    /* unhook everything */
+    if (stop_set)
+        avr_core_clear_stop(avr, until->pc);
+    if (conditions & TEENSYLCD_STOP_SRAM_WRITE)
+    {
+        avr->write_watch = NULL;
+        avr->write_watch_param = NULL;
+    }
+    teensy->lcd.raster_callback = NULL;
+    teensy->lcd.raster_callback_param = NULL;
+    avr->run_cycle_limit = run_cycle_limit;
+    teensy->run_until_conditions = 0;
+    return teensy->run_until_met;
+}
+
+bool teensylcd_run_until_refresh(struct teensylcd_t *teensy)
+{
+    struct teensylcd_run_until_t until;
+    memset(&until, 0, sizeof(until));
+    until.conditions = TEENSYLCD_STOP_LCD_FRAME;
+    return (teensylcd_run_until(teensy, &until) & TEENSYLCD_STOP_CPU_DONE) == 0;
 }
 
 bool teensylcd_is_lcd_tracer_event(avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4)
@@ -329,9 +724,41 @@ bool teensylcd_is_lcd_tracer_event(avr_tracer_event event, uint32_t p1, uint32_t
     return false;
 }
 
+void teensylcd_get_perf_stats(struct teensylcd_t *teensy, avr_perf_stats_t *stats)
+{
+    avr_perf_get(teensy->avr, stats);
+}
+
+void teensylcd_set_perf_instructions(struct teensylcd_t *teensy, bool enabled)
+{
+    avr_perf_count_ops(teensy->avr, enabled);
+}
+
+void teensylcd_set_lcd_tracer_events(struct teensylcd_t *teensy, bool enabled)
+{
+    /* the same pins teensylcd_is_lcd_tracer_event() matches */
+    static const struct { char port; uint8_t pins; } lcd_pins[] = {
+        { 'B', (1 << 4) | (1 << 5) | (1 << 6) },
+        { 'D', (1 << 7) },
+        { 'F', (1 << 7) },
+    };
+
+    for (size_t i = 0; i < sizeof(lcd_pins) / sizeof(lcd_pins[0]); i++)
+    {
+        uint8_t *mask = &teensy->avr->tracer_pin_mask[lcd_pins[i].port - 'A'];
+        if (enabled)
+            *mask |= lcd_pins[i].pins;
+        else
+            *mask &= ~lcd_pins[i].pins;
+    }
+}
+
 void teensylcd_cleanup(struct teensylcd_t *teensy)
 {
     avr_terminate(teensy->avr);
     // @TODO the free() here breaks emscripten, figure out why, because it's a leak.
-    //free(teensy->avr);
+#ifndef __EMSCRIPTEN__
+    free(teensy->avr);
+    teensy->avr = NULL;
+#endif
 }
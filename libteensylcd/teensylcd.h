@@ -35,7 +35,28 @@ enum TEENSYLCD_BUTTON
     NUM_TEENSYLCD_BUTTONS
 };
 
-/* a simulated teensylcd */
+struct teensylcd_input_script_t;
+
+/* stop conditions for teensylcd_run_until, any combination */
+enum TEENSYLCD_STOP
+{
+    TEENSYLCD_STOP_LCD_FRAME = (1 << 0),     /* the lcd raster moves back to where it was at the start */
+    TEENSYLCD_STOP_LED_CHANGE = (1 << 1),    /* an led turns on or off */
+    TEENSYLCD_STOP_PC = (1 << 2),            /* the cpu is about to run the instruction at pc */
+    TEENSYLCD_STOP_SRAM_WRITE = (1 << 3),    /* the firmware writes to sram_address */
+    TEENSYLCD_STOP_CYCLES = (1 << 4),        /* this many cycles have been run */
+    TEENSYLCD_STOP_CPU_DONE = (1 << 5),      /* the cpu finished (cpu_Done) or crashed, always checked */
+};
+
+struct teensylcd_run_until_t
+{
+    uint32_t conditions;                    /* TEENSYLCD_STOP_* */
+    uint32_t pc;                            /* byte address, as avr->pc */
+    uint16_t sram_address;                  /* data address, 0x100 and up */
+    uint64_t cycles;
+};
+
+/* a simulated teensylcd, instances share no mutable state so each can be run on its own thread */
 struct teensylcd_t
 {
     struct avr_t *avr;
@@ -44,7 +65,19 @@ struct teensylcd_t
     teensylcd_led_change_callback led_change_callback;
     bool button_states[NUM_TEENSYLCD_BUTTONS];
     struct avr_irq_t *button_irqs[NUM_TEENSYLCD_BUTTONS];
+    uint64_t button_release_cycles[NUM_TEENSYLCD_BUTTONS];
+    const struct teensylcd_input_script_t *input_playback;
+    uint64_t input_playback_start;
+    size_t input_playback_position;
+    uint64_t input_playback_cycle;      /* the last time playback looked, */
+    uint64_t input_playback_usec;       /* and the simulated time since it started then */
+    struct teensylcd_input_script_t *input_record;
+    uint64_t input_record_start;
     uint64_t next_cycles_sub;
+    bool new_pinout;
+    uint32_t run_until_conditions;
+    uint32_t run_until_met;
+    uint16_t run_until_sram_address;
 };
 
 /* initializer */
@@ -54,6 +87,35 @@ bool teensylcd_init_new(struct teensylcd_t *teensy, uint32_t frequency, int logl
 /* reset the processor, keeping firmware loaded */
 void teensylcd_reset(struct teensylcd_t *teensy);
 
+/* version of the teensylcd part of a snapshot, the simavr part has its own */
+#define TEENSYLCD_SNAPSHOT_VERSION (4)
+
+/**
+ * save the full simulator state (cpu, memories including flash, peripherals, pending timers
+ * and interrupts, lcd, buttons and leds) to a newly allocated buffer, free it with free().
+ * it can be restored into this teensylcd, or any other initialized with the same pinout
+ * and callbacks, in this or another run of the same binary. it fails while cycle timers
+ * from outside simavr and libteensylcd are pending, eg those of an lcd recorder or profiler.
+ */
+bool teensylcd_snapshot(struct teensylcd_t *teensy, void **data, size_t *size);
+
+/**
+ * restore a snapshot made by teensylcd_snapshot, no firmware needs to be loaded beforehand.
+ * a failed restore can leave the teensylcd half overwritten: restore a good snapshot into it
+ * or clean it up with teensylcd_cleanup, but don't run it as it is.
+ */
+bool teensylcd_restore(struct teensylcd_t *teensy, const void *data, size_t size);
+
+/**
+ * make 'clone' (uninitialized) a copy of the running 'teensy', to be run separately from then on.
+ * the flash and its pre-decoded copy are shared until either instance writes to it, everything
+ * else is copied as in a snapshot, and the led callback is carried over. configuration applied by
+ * ELF firmware sections (console register, vcd traces) is not. clean it up with teensylcd_cleanup.
+ * 'teensy' must not be running while it is cloned, but several clones can be made from it at once,
+ * and they can be run on other threads.
+ */
+bool teensylcd_clone(struct teensylcd_t *clone, struct teensylcd_t *teensy);
+
 /* ELF firmware loader */
 bool teensylcd_load_elf(struct teensylcd_t *teensy, const char *filename);
 
@@ -70,9 +132,39 @@ void teensylcd_set_led_callback(struct teensylcd_t *teensy, teensylcd_led_change
 bool teensylcd_get_button_state(const struct teensylcd_t *teensy, enum TEENSYLCD_BUTTON button);
 void teensylcd_set_button_state(struct teensylcd_t *teensy, enum TEENSYLCD_BUTTON button, bool state);
 
-/* button pusher, it will be automatically released, TODO move timer to parameter */
+/* button names, eg sw0 or stickup, as used in input scripts */
+const char *teensylcd_get_button_name(enum TEENSYLCD_BUTTON button);
+bool teensylcd_get_button_by_name(const char *name, enum TEENSYLCD_BUTTON *button);
+
+/* button pusher, it will be automatically released after 200ms */
 void teensylcd_push_button(struct teensylcd_t *teensy, enum TEENSYLCD_BUTTON button);
 
+/* button pusher, it will be automatically released after release_time microseconds */
+void teensylcd_push_button_time(struct teensylcd_t *teensy, enum TEENSYLCD_BUTTON button, uint32_t release_time);
+
+/**
+ * play back an input script, event times are relative to the current cycle. each event fires
+ * from a cycle timer however the avr is run, those in cycles at their exact cycle and those in
+ * microseconds at the simulated time, whatever the clock (see inputscript.h). the script must stay around
+ * until playback finishes, is stopped, or the teensylcd is reset. snapshots record the playback
+ * position, which a restored teensylcd continues from in the script it is playing (if any), and
+ * clones play the same script.
+ */
+void teensylcd_play_input_script(struct teensylcd_t *teensy, const struct teensylcd_input_script_t *script);
+void teensylcd_stop_input_script(struct teensylcd_t *teensy);
+bool teensylcd_is_input_script_playing(const struct teensylcd_t *teensy);
+
+/* append every button change from now on to script, with times relative to the current cycle. NULL stops recording */
+void teensylcd_record_input(struct teensylcd_t *teensy, struct teensylcd_input_script_t *script);
+
+/**
+ * virtual time mode, off by default. when the firmware sleeps, simulated time jumps straight
+ * to the next timer deadline instead of the host sleeping to keep pace, so mostly-idle firmware
+ * runs headless as fast as it can. it is carried over to clones. enabling gdb turns it off.
+ */
+void teensylcd_set_virtual_time(struct teensylcd_t *teensy, bool enabled);
+bool teensylcd_get_virtual_time(const struct teensylcd_t *teensy);
+
 /* run a single clock cycle on the avr */
 bool teensylcd_run_single(struct teensylcd_t *teensy);
 
@@ -85,12 +177,36 @@ bool teensylcd_run_time_milliseconds(struct teensylcd_t *teensy, uint32_t run_ti
 /* run a single "frame" on the avr, ie 1/framerate seconds */
 bool teensylcd_run_frame(struct teensylcd_t *teensy, uint32_t target_framerate);
 
+/**
+ * run the avr until any of the conditions in 'until' is met, returning the ones that were (TEENSYLCD_STOP_*).
+ * each condition is a hook which breaks out of the core's run loop when it fires, so this runs as fast
+ * as the other run functions. the run stops at the end of the instruction that met a condition, except
+ * for TEENSYLCD_STOP_PC, which stops before the instruction at pc; starting on pc doesn't count. cycle
+ * budgets can be overrun by a few cycles, or up to the next timer if the cpu is sleeping. TEENSYLCD_STOP_PC
+ * is not for use with gdb attached.
+ */
+uint32_t teensylcd_run_until(struct teensylcd_t *teensy, const struct teensylcd_run_until_t *until);
+
 /* run the avr until a refresh is performed, ie the lcd raster position reaches the current position (usually 0,0) again */
 bool teensylcd_run_until_refresh(struct teensylcd_t *teensy);
 
 /* is a lcd-related tracer event */
 bool teensylcd_is_lcd_tracer_event(avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4);
 
+/* pass lcd pin events on to the tracer or not, filtered in the core before the tracer is called. on by default */
+void teensylcd_set_lcd_tracer_events(struct teensylcd_t *teensy, bool enabled);
+
+/**
+ * copy out the simulator's performance counters: instructions and cycles per opcode class, io register
+ * accesses, irqs, timers, interrupts, sleeps and why each avr_run() returned. they count from init, and
+ * are always on, except for the instructions. avr_perf_print() formats them. not while the avr is running
+ * on another thread.
+ */
+void teensylcd_get_perf_stats(struct teensylcd_t *teensy, avr_perf_stats_t *stats);
+
+/* count the instructions in the performance counters too, this slows the simulator down. off by default */
+void teensylcd_set_perf_instructions(struct teensylcd_t *teensy, bool enabled);
+
 /* cleanup */
 void teensylcd_cleanup(struct teensylcd_t *teensy);
 
@@ -1,17 +1,27 @@
+/* for clock_gettime with -std=c99 */
+#ifndef _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "timer.h"
-#include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 
 uint64_t get_time_milliseconds()
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint32_t)tv.tv_sec * 1000 + (uint32_t)tv.tv_usec / 1000;
+    return get_time_microseconds() / 1000ULL;
 }
 
 uint64_t get_time_microseconds()
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000000ULL + (uint64_t)tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+uint64_t get_cpu_time_microseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
 }
@@ -3,10 +3,13 @@
 
 #include <stdint.h>
 
-/* returns current time in milliseconds */
+/* returns the time in milliseconds from a monotonic clock, only differences between calls mean anything */
 uint64_t get_time_milliseconds();
 
-/* returns current time in microseconds */
+/* returns the time in microseconds from the same clock */
 uint64_t get_time_microseconds();
 
+/* returns the cpu time used by the whole process so far, in microseconds */
+uint64_t get_cpu_time_microseconds();
+
 #endif			//  __LIBTEENSYLCD_TIMER_H
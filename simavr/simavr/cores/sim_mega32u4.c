@@ -57,7 +57,10 @@ struct mcu_t {
     avr_timer_t        timer0,timer1,timer3, timer4;
     avr_spi_t        spi;
     avr_twi_t        twi;
-} mcu_mega32u4 = {
+};
+
+// read-only template, make() gives every instance its own copy
+static const struct mcu_t mcu_mega32u4 = {
     .core = {
         .mmcu = "atmega32u4",
         DEFAULT_CORE(4),
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_clkpr.h"
+#include "sim_snapshot.h"
 
 static uint8_t avr_clkpr_ioreg_read(struct avr_t *avr, avr_io_addr_t addr, void *param)
 {
@@ -38,8 +39,8 @@ static void avr_clkpr_ioreg_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t
     AVR_LOG(avr, LOG_TRACE, "CLKPR(@0x%x) write 0x%x\n", addr, v);
     if (v & 0x80)
     {
-        /* To set for clock prescaling factor it is necessary to access the CLKPR 
-         * twice within 4 clock cycles.First you set the highest bit(CLKPCE) to 1
+        /* To set for clock prescaling factor it is necessary to access the CLKPR 
+         * twice within 4 clock cycles.First you set the highest bit(CLKPCE) to 1
          * and all others to 0. Then you write the actual value for CLKPR.
          */
         clkpr->last_change_cycle = avr->cycle + 1 + 4;      /* IO Write operation = 1 cycle (not added yet), + 4 cycles wait */
@@ -64,8 +65,25 @@ static void avr_clkpr_ioreg_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t
     avr->frequency = new_frequency;
 }
 
+static void avr_clkpr_snapshot(avr_io_t *port, avr_snapshot_t *s)
+{
+    avr_clkpr_t *clkpr = (avr_clkpr_t *)port;
+
+    /* avr->frequency is saved with the core */
+    AVR_SNAPSHOT_FIELD(s, clkpr->current_prescale);
+    AVR_SNAPSHOT_FIELD(s, clkpr->last_change_cycle);
+}
+
+static avr_io_t _io = {
+    .kind = "clkpr",
+    .snapshot = avr_clkpr_snapshot,
+};
+
 void avr_clkpr_init(avr_t *avr, avr_clkpr_t *clkpr)
 {
+    clkpr->io = _io;
+    avr_register_io(avr, &clkpr->io);
+
     /* Register IO callbacks */
     avr_register_io_read(avr, clkpr->ioaddr, avr_clkpr_ioreg_read, (void *)clkpr);
     avr_register_io_write(avr, clkpr->ioaddr, avr_clkpr_ioreg_write, (void *)clkpr);
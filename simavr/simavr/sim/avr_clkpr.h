@@ -30,8 +30,10 @@ extern "C" {
 #endif
 
 #include "sim_avr.h"
+#include "sim_io.h"
 
 typedef struct avr_clkpr_t {
+    avr_io_t io;
     unsigned int base_frequency;
     avr_io_addr_t ioaddr;
     unsigned char current_prescale;
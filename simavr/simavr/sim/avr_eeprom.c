@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_eeprom.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -121,10 +122,28 @@ static void avr_eeprom_dealloc(struct avr_io_t * port)
 	p->eeprom = NULL;
 }
 
+static void avr_eeprom_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+	uint16_t size = p->size;
+
+	// the cycle timers this module registers
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_eempe_clear);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_eei_raise);
+
+	AVR_SNAPSHOT_FIELD(s, size);
+	if (size != p->size || !p->eeprom) {
+		s->error = 1;
+		return;
+	}
+	avr_snapshot_field(s, p->eeprom, p->size);
+}
+
 static	avr_io_t	_io = {
 	.kind = "eeprom",
 	.ioctl = avr_eeprom_ioctl,
 	.dealloc = avr_eeprom_dealloc,
+	.snapshot = avr_eeprom_snapshot,
 };
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_flash.h"
+#include "sim_snapshot.h"
+#include "sim_core.h"
 
 static avr_cycle_count_t avr_progen_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -71,17 +73,21 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 		avr_cycle_timer_cancel(avr, avr_progen_clear, p);
 
 		if (avr_regbit_get(avr, p->pgers)) {
+			avr_flash_unshare(avr);
 			z &= ~1;
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize; i++)
 				avr->flash[z++] = 0xff;
+			avr_decode_flash(avr, z - p->spm_pagesize, p->spm_pagesize);
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
+			avr_flash_unshare(avr);
 			z &= ~(p->spm_pagesize - 1);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
 				avr->flash[z++] = p->tmppage[i];
 				avr->flash[z++] = p->tmppage[i] >> 8;
 			}
+			avr_decode_flash(avr, z - p->spm_pagesize, p->spm_pagesize);
 			avr_flash_clear_temppage(p);
 		} else if (avr_regbit_get(avr, p->blbset)) {
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Setting lock bits (ignored)\n");
@@ -120,11 +126,24 @@ avr_flash_dealloc(struct avr_io_t * port)
 		free(p->tmppage_used);
 }
 
+static void avr_flash_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_flash_t * p = (avr_flash_t *)port;
+
+	// the cycle timers this module registers
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_progen_clear);
+
+	// the flash itself is saved with the core, this is the SPM page buffer
+	avr_snapshot_field(s, p->tmppage, p->spm_pagesize);
+	avr_snapshot_field(s, p->tmppage_used, p->spm_pagesize / 2);
+}
+
 static	avr_io_t	_io = {
 	.kind = "flash",
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
+	.snapshot = avr_flash_snapshot,
 };
 
 void avr_flash_init(avr_t * avr, avr_flash_t * p)
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
 
 #define D(_w)
 
@@ -48,21 +49,31 @@ avr_ioport_update_irqs(
 {
 	avr_t * avr = p->io.avr;
 	uint8_t ddr = avr->data[p->r_ddr];
+	uint8_t port = avr->data[p->r_port];
 	// Set the PORT value if the pin is marked as output
 	// otherwise, if there is an 'external' pullup, set it
 	// otherwise, if the PORT pin was 1 to indicate an
 	// internal pullup, set that.
+	uint8_t pull = p->external.pull_mask & ~ddr;
+	uint8_t driven = ddr | pull | port;
+	uint8_t levels = (port & ~pull) | (p->external.pull_value & pull);
+	uint8_t changed = 0;
 	for (int i = 0; i < 8; i++) {
-		if (ddr & (1 << i))
-			avr_raise_irq(p->io.irq + i, (avr->data[p->r_port] >> i) & 1);
-		else if (p->external.pull_mask & (1 << i))
-			avr_raise_irq(p->io.irq + i, (p->external.pull_value >> i) & 1);
-		else if ((avr->data[p->r_port] >> i) & 1)
-			avr_raise_irq(p->io.irq + i, 1);
+		if (!(driven & (1 << i)))
+			continue;
+		avr_irq_t * irq = p->io.irq + i;
+		uint32_t v = (levels >> i) & 1;
+		// pins are filtered, don't bother raising the ones that didn't change
+		if (v == irq->value && (irq->flags & (IRQ_FLAG_FILTERED | IRQ_FLAG_INIT | IRQ_FLAG_NOT)) == IRQ_FLAG_FILTERED)
+			continue;
+		changed |= 1 << i;
+		avr_raise_irq(irq, v);
 	}
-	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (avr->data[p->r_port] & ddr);
+	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (port & ddr);
 	pin = (pin & ~p->external.pull_mask) | p->external.pull_value;
 	avr_raise_irq(p->io.irq + IOPORT_IRQ_PIN_ALL, pin);
+	if (changed)
+		avr_raise_irq(p->io.irq + IOPORT_IRQ_PIN_CHANGE, (levels & changed) | (changed << 8));
 }
 
 static void
@@ -138,7 +149,7 @@ avr_ioport_irq_notify(
 	value &= 0xff;
 	uint8_t mask = 1 << irq->irq;
 
-    AVR_TRACER_EVENT(avr, avr_tracer_event_ioport, p->name, irq->irq, (avr->data[p->r_pin] >> irq->irq) & 1, (value & 1));
+    AVR_TRACER_PIN_EVENT(avr, p->name, irq->irq, (avr->data[p->r_pin] >> irq->irq) & 1, (value & 1));
 
 		// set the real PIN bit. ddr doesn't matter here as it's masked when read.
 	avr->data[p->r_pin] &= ~mask;
@@ -242,13 +253,23 @@ static const char * irq_names[IOPORT_IRQ_COUNT] = {
 	[IOPORT_IRQ_DIRECTION_ALL] = "8>ddr",
 	[IOPORT_IRQ_REG_PORT] = "8>port",
 	[IOPORT_IRQ_REG_PIN] = "8>pin",
+	[IOPORT_IRQ_PIN_CHANGE] = "16>change",
 };
 
+static void avr_ioport_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_ioport_t * p = (avr_ioport_t *)port;
+
+	// the pin levels themselves are in the IRQs
+	AVR_SNAPSHOT_FIELD(s, p->external);
+}
+
 static	avr_io_t	_io = {
 	.kind = "port",
 	.reset = avr_ioport_reset,
 	.ioctl = avr_ioport_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_ioport_snapshot,
 };
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
@@ -266,9 +287,12 @@ void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
 
 	for (int i = 0; i < IOPORT_IRQ_COUNT; i++)
 		p->io.irq[i].flags |= IRQ_FLAG_FILTERED;
+	// every change is notified, even if the value happens to be the same
+	p->io.irq[IOPORT_IRQ_PIN_CHANGE].flags &= ~IRQ_FLAG_FILTERED;
 
 	avr_register_io_write(avr, p->r_port, avr_ioport_write, p);
 	avr_register_io_read(avr, p->r_pin, avr_ioport_read, p);
+	avr_register_io_read_repeatable(avr, p->r_pin, p->io.irq + IOPORT_IRQ_REG_PIN);
 	avr_register_io_write(avr, p->r_pin, avr_ioport_pin_write, p);
 	avr_register_io_write(avr, p->r_ddr, avr_ioport_ddr_write, p);
 }
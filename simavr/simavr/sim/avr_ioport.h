@@ -36,9 +36,19 @@ enum {
 	IOPORT_IRQ_DIRECTION_ALL,
 	IOPORT_IRQ_REG_PORT,
 	IOPORT_IRQ_REG_PIN,
+	IOPORT_IRQ_PIN_CHANGE,	// see below
 	IOPORT_IRQ_COUNT
 };
 
+/*
+ * IOPORT_IRQ_PIN_CHANGE is raised once per PORT/DDR write that changes any
+ * of the pin IRQs, after they have all been raised. The low byte has the
+ * new levels of the pins that changed, the next one has the mask of these
+ * pins, so a peripheral can follow several pins of a port with one hook.
+ */
+#define AVR_IOPORT_PIN_CHANGE_LEVELS(_v)	((_v) & 0xff)
+#define AVR_IOPORT_PIN_CHANGE_MASK(_v)		(((_v) >> 8) & 0xff)
+
 #define AVR_IOPORT_OUTPUT 0x100
 
 // add port name (uppercase) to get the real IRQ
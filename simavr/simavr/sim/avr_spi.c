@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_spi.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -46,6 +47,21 @@ static uint8_t avr_spi_read(struct avr_t * avr, avr_io_addr_t addr, void * param
 	return v;
 }
 
+/*
+ * Number of cycles to shift a whole byte out; SCK is the system clock
+ * divided by 4, 16, 64 or 128 (SPR1:SPR0), twice as fast with SPI2X.
+ */
+static avr_cycle_count_t avr_spi_byte_cycles(struct avr_t * avr, avr_spi_t * p)
+{
+	static const uint8_t divider[4] = { 4, 16, 64, 128 };
+	avr_cycle_count_t cycles = 8 * divider[avr_regbit_get(avr, p->spr[0]) |
+			(avr_regbit_get(avr, p->spr[1]) << 1)];
+
+	if (avr_regbit_get(avr, p->spr[2]))
+		cycles /= 2;
+	return cycles;
+}
+
 static void avr_spi_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
 {
 	avr_spi_t * p = (avr_spi_t *)param;
@@ -55,7 +71,7 @@ static void avr_spi_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, voi
 		avr_regbit_clear(avr, p->spi.raised);
 
 		avr_core_watch_write(avr, addr, v);
-		avr_cycle_timer_register_usec(avr, 100, avr_spi_raise, p); // should be speed dependent
+		avr_cycle_timer_register(avr, avr_spi_byte_cycles(avr, p), avr_spi_raise, p);
 	}
 }
 
@@ -90,10 +106,21 @@ static const char * irq_names[SPI_IRQ_COUNT] = {
 	[SPI_IRQ_OUTPUT] = "8<out",
 };
 
+static void avr_spi_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_spi_t * p = (avr_spi_t *)port;
+
+	// the cycle timers this module registers
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_spi_raise);
+
+	AVR_SNAPSHOT_FIELD(s, p->input_data_register);
+}
+
 static	avr_io_t	_io = {
 	.kind = "spi",
 	.reset = avr_spi_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_spi_snapshot,
 };
 
 void avr_spi_init(avr_t * avr, avr_spi_t * p)
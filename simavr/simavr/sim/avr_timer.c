@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include "avr_timer.h"
+#include "sim_snapshot.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
 
@@ -534,10 +535,39 @@ static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_COMP + 3] = ">compd",
 };
 
+static void avr_timer_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_timer_t * p = (avr_timer_t *)port;
+
+	// the cycle timers this module registers
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_tov);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compa);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compb);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compc);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compd);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compa_down);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compb_down);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compc_down);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_timer_compd_down);
+
+	AVR_SNAPSHOT_FIELD(s, p->mode);
+	AVR_SNAPSHOT_FIELD(s, p->wgm_op_mode_kind);
+	AVR_SNAPSHOT_FIELD(s, p->wgm_op_mode_size);
+	AVR_SNAPSHOT_FIELD(s, p->cs_div_clock);
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		AVR_SNAPSHOT_FIELD(s, p->comp[compi].comp_cycles);
+		AVR_SNAPSHOT_FIELD(s, p->comp[compi].compd_cycles);
+	}
+	AVR_SNAPSHOT_FIELD(s, p->tov_cycles);
+	AVR_SNAPSHOT_FIELD(s, p->tov_base);
+	AVR_SNAPSHOT_FIELD(s, p->tov_top);
+}
+
 static	avr_io_t	_io = {
 	.kind = "timer",
 	.reset = avr_timer_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_timer_snapshot,
 };
 
 void avr_timer_init(avr_t * avr, avr_timer_t * p)
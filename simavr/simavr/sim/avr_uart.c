@@ -36,6 +36,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "avr_uart.h"
+#include "sim_snapshot.h"
 #include "sim_hex.h"
 
 //#define TRACE(_w) _w
@@ -274,11 +275,25 @@ static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_OUT_XOFF] = ">xoff",
 };
 
+static void avr_uart_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_uart_t * p = (avr_uart_t *)port;
+
+	// the cycle timers this module registers
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_uart_rxc_raise);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_uart_txc_raise);
+
+	// flags are set by the host with an ioctl, they stay as they are
+	AVR_SNAPSHOT_FIELD(s, p->input);
+	AVR_SNAPSHOT_FIELD(s, p->usec_per_byte);
+}
+
 static	avr_io_t	_io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_uart_snapshot,
 };
 
 void avr_uart_init(avr_t * avr, avr_uart_t * p)
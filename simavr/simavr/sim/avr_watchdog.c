@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "avr_watchdog.h"
+#include "sim_snapshot.h"
 
 static void avr_watchdog_run_callback_software_reset(avr_t * avr)
 {
@@ -211,10 +212,38 @@ static void avr_watchdog_reset(avr_io_t * port)
 	avr_irq_register_notify(p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
+static void avr_watchdog_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_watchdog_t * p = (avr_watchdog_t *)port;
+	avr_t * avr = p->io.avr;
+
+	// the cycle timers this module registers
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_watchdog_timer);
+	AVR_SNAPSHOT_ADD_FUNCTION(s, avr_wdce_clear);
+
+	AVR_SNAPSHOT_FIELD(s, p->cycle_count);
+	if (!s->restore) {
+		AVR_SNAPSHOT_FIELD(s, p->reset_context.wdrf);
+		return;
+	}
+	/*
+	 * A pending watchdog reset swaps avr->run, keep whichever run
+	 * callback this instance normally uses and swap it again if needed
+	 */
+	avr_run_t run = p->reset_context.wdrf ? p->reset_context.avr_run : avr->run;
+	AVR_SNAPSHOT_FIELD(s, p->reset_context.wdrf);
+	if (p->reset_context.wdrf) {
+		p->reset_context.avr_run = run;
+		avr->run = avr_watchdog_run_callback_software_reset;
+	} else
+		avr->run = run;
+}
+
 static	avr_io_t	_io = {
 	.kind = "watchdog",
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
+	.snapshot = avr_watchdog_snapshot,
 };
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
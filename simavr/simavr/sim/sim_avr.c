@@ -68,8 +68,25 @@ avr_global_logger_get(void)
 
 int avr_init(avr_t * avr)
 {
-	avr->flash = malloc(avr->flashend + 1);
-	memset(avr->flash, 0xff, avr->flashend + 1);
+	// unless it's shared with another instance, see avr_flash_share()
+	int decode = !avr->decode;
+	if (!avr->flash) {
+		avr->flash = malloc(avr->flashend + 1);
+		if (avr->flash)
+			memset(avr->flash, 0xff, avr->flashend + 1);
+	}
+	if (decode)
+		avr->decode = malloc(((avr->flashend + 1) / 2) * sizeof(avr_insn_t));
+	// counted from the start, so sharing it later is only an increment
+	if (!avr->flash_refs) {
+		avr->flash_refs = malloc(sizeof(*avr->flash_refs));
+		if (avr->flash_refs)
+			*avr->flash_refs = 1;
+	}
+	if (!avr->flash || !avr->decode || !avr->flash_refs) {
+		AVR_LOG(avr, LOG_ERROR, "%s: out of memory for the flash\n", __FUNCTION__);
+		return -1;
+	}
 	avr->codeend = avr->flashend;
 	avr->data = malloc(avr->ramend + 1);
 	//memset(avr->data, 0, avr->ramend + 1);
@@ -93,18 +110,45 @@ int avr_init(avr_t * avr)
 		avr->custom.init(avr, avr->custom.data);
 	if (avr->init)
 		avr->init(avr);
+	// pre-decode the blank flash, avr_loadcode() will update it
+	avr->callgraph = NULL;
+	avr->perf_ops = 0;
+	if (decode)
+		avr_decode_flash(avr, 0, avr->flashend + 1);
 	// set default (non gdb) fast callbacks
 	avr->run = avr_callback_run_raw;
 	avr->sleep = avr_callback_sleep_raw;
 	// number of address bytes to push/pull on/off the stack
 	avr->address_size = avr->eind ? 3 : 2;
 	avr->log = 1;
+	avr->write_watch = NULL;
+	avr->write_watch_param = NULL;
     avr->tracer_callback = NULL;
     avr->tracer_callback_param = NULL;
+    avr->tracer_mask = AVR_TRACER_MASK_ALL;
+    memset(avr->tracer_pin_mask, 0xff, sizeof(avr->tracer_pin_mask));
+	avr_perf_reset(avr);
 	avr_reset(avr);
 	return 0;
 }
 
+/*
+ * Drop this instance's reference to its flash and decode, freeing them if
+ * nobody else runs from them
+ */
+static void _avr_flash_release(avr_t * avr)
+{
+	if (!avr->flash_refs ||
+			__atomic_sub_fetch(avr->flash_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (avr->flash) free(avr->flash);
+		if (avr->decode) free(avr->decode);
+		if (avr->flash_refs) free(avr->flash_refs);
+	}
+	avr->flash = NULL;
+	avr->decode = NULL;
+	avr->flash_refs = NULL;
+}
+
 void avr_terminate(avr_t * avr)
 {
 	if (avr->custom.deinit)
@@ -118,10 +162,18 @@ void avr_terminate(avr_t * avr)
 		avr->vcd = NULL;
 	}
 	avr_deallocate_ios(avr);
+	avr_cycle_timer_free(avr);
+	avr_irq_pool_free(&avr->irq_pool);
 
-	if (avr->flash) free(avr->flash);
+	_avr_flash_release(avr);
+	if (avr->symbol) free(avr->symbol);
+	avr->symbol = NULL;
+	avr->symbolcount = 0;
 	if (avr->data) free(avr->data);
-	avr->flash = avr->data = NULL;
+	if (avr->console.buf) free(avr->console.buf);
+	avr->data = NULL;
+	avr->console.buf = NULL;
+	avr->console.size = avr->console.len = 0;
 }
 
 void avr_reset(avr_t * avr)
@@ -195,21 +247,18 @@ void avr_set_command_register(avr_t * avr, avr_io_addr_t addr)
 
 static void _avr_io_console_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
 {
-	static char * buf = NULL;
-	static int size = 0, len = 0;
-
-	if (v == '\r' && buf) {
-		buf[len] = 0;
-		AVR_LOG(avr, LOG_OUTPUT, "O:" "%s" "" "\n", buf);
-		len = 0;
+	if (v == '\r' && avr->console.buf) {
+		avr->console.buf[avr->console.len] = 0;
+		AVR_LOG(avr, LOG_OUTPUT, "O:" "%s" "" "\n", avr->console.buf);
+		avr->console.len = 0;
 		return;
 	}
-	if (len + 1 >= size) {
-		size += 128;
-		buf = (char*)realloc(buf, size);
+	if (avr->console.len + 1 >= avr->console.size) {
+		avr->console.size += 128;
+		avr->console.buf = (char*)realloc(avr->console.buf, avr->console.size);
 	}
 	if (v >= ' ')
-		buf[len++] = v;
+		avr->console.buf[avr->console.len++] = v;
 }
 
 void avr_set_console_register(avr_t * avr, avr_io_addr_t addr)
@@ -225,7 +274,57 @@ void avr_loadcode(avr_t * avr, uint8_t * code, uint32_t size, avr_flashaddr_t ad
 			size, avr->flashend + 1);
 		abort();
 	}
+	avr_flash_unshare(avr);
 	memcpy(avr->flash + address, code, size);
+	avr_decode_flash(avr, address, size);
+}
+
+int avr_flash_share(avr_t * avr, avr_t * from)
+{
+	// a profiled or counting decode isn't what the new instance wants,
+	// it gets a copy of the flash and avr_init() decodes it normally
+	if (from->callgraph || from->perf_ops) {
+		avr->flash = malloc(from->flashend + 1);
+		if (!avr->flash) {
+			AVR_LOG(avr, LOG_ERROR, "%s: out of memory for the flash\n", __FUNCTION__);
+			return -1;
+		}
+		memcpy(avr->flash, from->flash, from->flashend + 1);
+		return 0;
+	}
+	// avr_init() gave the count, so several instances can be made from
+	// 'from' at once
+	__atomic_add_fetch(from->flash_refs, 1, __ATOMIC_ACQ_REL);
+	avr->flash = from->flash;
+	avr->decode = from->decode;
+	avr->flash_refs = from->flash_refs;
+	return 0;
+}
+
+void avr_flash_unshare(avr_t * avr)
+{
+	// nobody else can take a share while this instance is busy here
+	if (!avr->flash_refs || __atomic_load_n(avr->flash_refs, __ATOMIC_ACQUIRE) == 1)
+		return;
+	// nobody writes to shared flash, so it's safe to copy even if the
+	// other instances are running
+	uint32_t size = avr->flashend + 1;
+	size_t decode_size = (size / 2) * sizeof(avr_insn_t);
+	uint8_t * flash = malloc(size);
+	avr_insn_t * decode = malloc(decode_size);
+	int * refs = malloc(sizeof(*refs));
+	if (!flash || !decode || !refs) {
+		// the caller is about to write to it, and can't be told
+		AVR_LOG(avr, LOG_ERROR, "%s: out of memory for a copy of the flash\n", __FUNCTION__);
+		abort();
+	}
+	memcpy(flash, avr->flash, size);
+	memcpy(decode, avr->decode, decode_size);
+	*refs = 1;
+	_avr_flash_release(avr);
+	avr->flash = flash;
+	avr->decode = decode;
+	avr->flash_refs = refs;
 }
 
 /**
@@ -254,6 +353,28 @@ void avr_callback_sleep_gdb(avr_t * avr, avr_cycle_count_t howLong)
 		;
 }
 
+/*
+ * Counts why the core came back out of avr_run_one()
+ */
+static inline void _avr_perf_run_exit(avr_t * avr)
+{
+	avr_perf_exit exit;
+
+	if (avr->state == cpu_Sleeping)
+		exit = avr_perf_exit_sleep;
+	else if (avr->state == cpu_Done || avr->state == cpu_Crashed)
+		exit = avr_perf_exit_done;
+	else if (avr->state != cpu_Running)
+		exit = avr_perf_exit_stopped;
+	else if (avr->interrupt_state)
+		exit = avr_perf_exit_interrupt;
+	else if (!avr->run_cycle_count)
+		exit = avr_perf_exit_break;
+	else
+		exit = avr_perf_exit_timer;
+	avr->perf.run_exits[exit]++;
+}
+
 void avr_callback_run_gdb(avr_t * avr)
 {
 	avr_gdb_processor(avr, avr->state == cpu_Stopped);
@@ -270,6 +391,7 @@ void avr_callback_run_gdb(avr_t * avr)
 
 	if (avr->state == cpu_Running) {
 		new_pc = avr_run_one(avr);
+		_avr_perf_run_exit(avr);
 #if CONFIG_SIMAVR_TRACE
 		avr_dump_state(avr);
 #endif
@@ -293,6 +415,8 @@ void avr_callback_run_gdb(avr_t * avr)
 		 */
 		avr->sleep(avr, sleep);
 		avr->cycle += 1 + sleep;
+		avr->perf.sleeps++;
+		avr->perf.sleep_cycles += 1 + sleep;
 	}
 	// Interrupt servicing might change the PC too, during 'sleep'
 	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
@@ -312,12 +436,19 @@ void avr_callback_sleep_raw(avr_t * avr, avr_cycle_count_t howLong)
 	}
 }
 
+void avr_callback_sleep_virtual(avr_t * avr, avr_cycle_count_t howLong)
+{
+	// nothing to wait for, the caller moves the cycle count on to the
+	// next timer deadline
+}
+
 void avr_callback_run_raw(avr_t * avr)
 {
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
 		new_pc = avr_run_one(avr);
+		_avr_perf_run_exit(avr);
 #if CONFIG_SIMAVR_TRACE
 		avr_dump_state(avr);
 #endif
@@ -341,6 +472,8 @@ void avr_callback_run_raw(avr_t * avr)
 		 */
 		avr->sleep(avr, sleep);
 		avr->cycle += 1 + sleep;
+		avr->perf.sleeps++;
+		avr->perf.sleep_cycles += 1 + sleep;
 	}
 	// Interrupt servicing might change the PC too, during 'sleep'
 	if (avr->state == cpu_Running || avr->state == cpu_Sleeping) {
@@ -352,12 +485,37 @@ void avr_callback_run_raw(avr_t * avr)
 }
 
 
+avr_symbol_t *
+avr_symbol_at(
+		avr_t * avr,
+		uint32_t addr)
+{
+	// first symbol past addr
+	uint32_t lo = 0, hi = avr->symbolcount;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (avr->symbol[mid]->addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? avr->symbol[lo - 1] : NULL;
+}
+
 int avr_run(avr_t * avr)
 {
+	avr->perf.runs++;
 	avr->run(avr);
 	return avr->state;
 }
 
+void avr_run_break(avr_t * avr)
+{
+	// the core only goes round again while there are cycles left, the
+	// cycle timers work out a new count before the next run
+	avr->run_cycle_count = 0;
+}
+
 avr_t *
 avr_core_allocate(
 		const avr_t * core,
@@ -365,6 +523,7 @@ avr_core_allocate(
 {
 	uint8_t * b = malloc(coreLen);
 	memcpy(b, core, coreLen);
+	((avr_t *)b)->core_size = coreLen;
 	return (avr_t *)b;
 }
 
@@ -30,6 +30,7 @@ extern "C" {
 #include "sim_interrupts.h"
 #include "sim_cycle_timers.h"
 #include "sim_tracer.h"
+#include "sim_perf.h"
 
 typedef uint32_t avr_flashaddr_t;
 
@@ -131,6 +132,9 @@ struct avr_trace_data_t {
 	// keeps track of which registers gets touched by instructions
 	// reset before each new instructions. Allows meaningful traces
 	uint32_t	touched[256 / 32];	// debug
+
+	// set while executing in a symbol dont_trace() skips
+	int			donttrace;
 };
 
 typedef void (*avr_run_t)(
@@ -156,6 +160,8 @@ typedef struct avr_t {
 
 	// filled by the ELF data, this allow tracking of invalid jumps
 	uint32_t			codeend;
+	// size of the block make() allocated, this avr_t and the IO modules after it
+	uint32_t			core_size;
 
 	int					state;		// stopped, running, sleeping
 	uint32_t			frequency;	// frequency we are running at
@@ -205,7 +211,8 @@ typedef struct avr_t {
 	/*!
 	 * Sleep default behaviour.
 	 * In "raw" mode, it calls usleep, in gdb mode, it waits
-	 * for howLong for gdb command on it's sockets.
+	 * for howLong for gdb command on it's sockets, in "virtual"
+	 * mode it returns at once.
 	 */
 	void (*sleep)(struct avr_t * avr, avr_cycle_count_t howLong);
 
@@ -254,6 +261,9 @@ typedef struct avr_t {
 		struct {
 			void * param;
 			avr_io_read_t c;
+			// see avr_register_io_read_repeatable()
+			uint8_t repeatable;
+			struct avr_irq_t * repeat_irq;
 		} r;
 		struct {
 			void * param;
@@ -281,6 +291,11 @@ typedef struct avr_t {
 
 	// flash memory (initialized to 0xff, and code loaded into it)
 	uint8_t *	flash;
+	// pre-decoded flash, one instruction per flash word (see sim_core.h)
+	struct avr_insn_t * decode;
+	// the number of instances running from this flash and decode (see
+	// avr_flash_share()), allocated with them by avr_init()
+	int *		flash_refs;
 	// this is the general purpose registers, IO registers, and SRAM
 	uint8_t *	data;
 
@@ -299,6 +314,16 @@ typedef struct avr_t {
 	// Only used if CONFIG_SIMAVR_TRACE is defined
 	struct avr_trace_data_t *trace_data;
 
+	// code symbols from the elf file, sorted by address, see avr_symbol_at()
+	struct avr_symbol_t **	symbol;
+	uint32_t	symbolcount;
+
+	// line buffer for the "console register", see avr_set_console_register()
+	struct {
+		char *	buf;
+		int		size, len;
+	} console;
+
 	// VALUE CHANGE DUMP file (waveforms)
 	// this is the VCD file that gets allocated if the
 	// firmware that is loaded explicitly asks for a trace
@@ -314,9 +339,25 @@ typedef struct avr_t {
 	// if zero, the simulator will just exit() in case of a crash
 	int		gdb_port;
 
+	// if set, called on every store to the data space above the registers,
+	// before the value is stored. Writes to IO registers with out, sbi or
+	// cbi don't go through it, stores to them do
+	void (*write_watch)(struct avr_t * avr, uint16_t addr, uint8_t v, void * param);
+	void *	write_watch_param;
+
     // tracer
     avr_tracer_callback_t tracer_callback;
     void *tracer_callback_param;
+    uint32_t tracer_mask;                               // AVR_TRACER_MASK() of the events to pass on
+    uint8_t tracer_pin_mask[AVR_TRACER_MAX_PORTS];      // ioport pins to pass on, per port
+
+    // performance counters, see avr_perf_get()
+    avr_perf_stats_t perf;
+    // non zero while the instructions are counted too, see avr_perf_count_ops()
+    int perf_ops;
+
+    // call graph profiler, while one is running, see avr_callgraph_start()
+    struct avr_callgraph_t *callgraph;
 } avr_t;
 
 
@@ -332,11 +373,18 @@ typedef struct avr_symbol_t {
 	const char  symbol[0];
 } avr_symbol_t;
 
+// the symbol 'addr' in flash is part of, ie the last one at or before it, or NULL
+avr_symbol_t *
+avr_symbol_at(
+		avr_t * avr,
+		uint32_t addr);
+
 // locate the maker for mcu "name" and allocates a new avr instance
 avr_t *
 avr_make_mcu_by_name(
 		const char *name);
 // initializes a new AVR instance. Will call the IO registers init(), and then reset()
+// Returns -1 if the flash can't be allocated, avr_terminate() the instance then
 int
 avr_init(
 		avr_t * avr);
@@ -354,6 +402,12 @@ avr_reset(
 int
 avr_run(
 		avr_t * avr);
+// makes avr_run() return once the current instruction is done, rather
+// than carrying on up to the next cycle timer. For hooks that want their
+// caller to have a look before the firmware goes any further.
+void
+avr_run_break(
+		avr_t * avr);
 // finish any pending operations
 void
 avr_terminate(
@@ -381,6 +435,24 @@ avr_loadcode(
 		uint32_t size,
 		avr_flashaddr_t address);
 
+// make 'avr' run from the flash of 'from', and its pre-decoded copy, instead
+// of allocating its own. Call between make() and avr_init(), 'avr' must be
+// the same core, and 'from' initialized and not running; several instances
+// can be made from it at once. Neither side writes to shared flash, each gets
+// its own copy first (see avr_flash_unshare()). If 'from' is running the call
+// graph profiler or counting its instructions, 'avr' just gets a copy of the
+// flash, and its own plain decode. Returns -1 if that copy can't be allocated
+int
+avr_flash_share(
+		avr_t * avr,
+		avr_t * from);
+// give 'avr' a private copy of its flash if it shares it, anything writing
+// to avr->flash or avr->decode has to call this first. Aborts if the copy
+// can't be allocated
+void
+avr_flash_unshare(
+		avr_t * avr);
+
 /*
  * These are accessors for avr->data but allows watchpoints to be set for gdb
  * IO modules use that to set values to registers, and the AVR core decoder uses
@@ -436,6 +508,12 @@ void avr_callback_sleep_gdb(avr_t * avr, avr_cycle_count_t howLong);
 void avr_callback_run_gdb(avr_t * avr);
 void avr_callback_sleep_raw(avr_t * avr, avr_cycle_count_t howLong);
 void avr_callback_run_raw(avr_t * avr);
+/*
+ * Sleep callback that never blocks the host, simulated time jumps
+ * straight to the next cycle timer deadline. Can be set as avr->sleep
+ * after avr_init()
+ */
+void avr_callback_sleep_virtual(avr_t * avr, avr_cycle_count_t howLong);
 
 /**
  * Accumulates sleep requests (and returns a sleep time of 0) until
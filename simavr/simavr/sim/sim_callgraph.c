@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_callgraph.h"
+#include "sim_profiler.h"
+
+#define NO_INDEX    0xffffffff
+
+static uint32_t hash_key(uint64_t key)
+{
+    key *= 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(key >> 32);
+}
+
+// grows an index to twice the size for 'count' entries, 'key' gives the key of entry n
+static uint32_t *grow_index(uint32_t *index, uint32_t *mask, uint32_t count, uint64_t (*key)(const avr_callgraph_t *, uint32_t),
+                            const avr_callgraph_t *callgraph)
+{
+    uint32_t grown_mask = *mask * 2 + 1;
+    uint32_t *grown = (uint32_t *)malloc((grown_mask + 1) * sizeof(uint32_t));
+    if (grown == NULL)
+        return NULL;
+    memset(grown, 0xff, (grown_mask + 1) * sizeof(uint32_t));
+    for (uint32_t n = 0; n < count; n++)
+    {
+        uint32_t slot = hash_key(key(callgraph, n)) & grown_mask;
+        while (grown[slot] != NO_INDEX)
+            slot = (slot + 1) & grown_mask;
+        grown[slot] = n;
+    }
+    free(index);
+    *mask = grown_mask;
+    return grown;
+}
+
+static uint64_t function_key(const avr_callgraph_t *callgraph, uint32_t n)
+{
+    return callgraph->functions[n].addr;
+}
+
+static uint64_t edge_key(const avr_callgraph_t *callgraph, uint32_t n)
+{
+    return (uint64_t)callgraph->edges[n].caller << 32 | callgraph->edges[n].callee;
+}
+
+// index of the function at 'addr', added if it's new, NO_INDEX if out of memory
+static uint32_t find_function(avr_callgraph_t *callgraph, uint32_t addr)
+{
+    uint32_t slot = hash_key(addr) & callgraph->function_mask;
+    for (; callgraph->function_index[slot] != NO_INDEX; slot = (slot + 1) & callgraph->function_mask)
+    {
+        if (callgraph->functions[callgraph->function_index[slot]].addr == addr)
+            return callgraph->function_index[slot];
+    }
+
+    if (callgraph->function_count == callgraph->function_size)
+    {
+        uint32_t size = callgraph->function_size * 2;
+        avr_callgraph_function_t *grown = (avr_callgraph_function_t *)realloc(callgraph->functions, size * sizeof(*grown));
+        if (grown == NULL)
+            return NO_INDEX;
+        callgraph->functions = grown;
+        callgraph->function_size = size;
+    }
+    uint32_t n = callgraph->function_count++;
+    memset(&callgraph->functions[n], 0, sizeof(callgraph->functions[n]));
+    callgraph->functions[n].addr = addr;
+    callgraph->function_index[slot] = n;
+
+    // keep the index at most half full
+    if (callgraph->function_count > (callgraph->function_mask + 1) / 2)
+    {
+        uint32_t *grown = grow_index(callgraph->function_index, &callgraph->function_mask, callgraph->function_count, function_key, callgraph);
+        if (grown == NULL)
+        {
+            callgraph->function_count--;
+            callgraph->function_index[slot] = NO_INDEX;
+            return NO_INDEX;
+        }
+        callgraph->function_index = grown;
+    }
+    return n;
+}
+
+static avr_callgraph_edge_t *find_edge(avr_callgraph_t *callgraph, uint32_t caller, uint32_t callee)
+{
+    uint64_t key = (uint64_t)caller << 32 | callee;
+    uint32_t slot = hash_key(key) & callgraph->edge_mask;
+    for (; callgraph->edge_index[slot] != NO_INDEX; slot = (slot + 1) & callgraph->edge_mask)
+    {
+        avr_callgraph_edge_t *edge = &callgraph->edges[callgraph->edge_index[slot]];
+        if (edge->caller == caller && edge->callee == callee)
+            return edge;
+    }
+
+    if (callgraph->edge_count == callgraph->edge_size)
+    {
+        uint32_t size = callgraph->edge_size * 2;
+        avr_callgraph_edge_t *grown = (avr_callgraph_edge_t *)realloc(callgraph->edges, size * sizeof(*grown));
+        if (grown == NULL)
+            return NULL;
+        callgraph->edges = grown;
+        callgraph->edge_size = size;
+    }
+    uint32_t n = callgraph->edge_count++;
+    memset(&callgraph->edges[n], 0, sizeof(callgraph->edges[n]));
+    callgraph->edges[n].caller = caller;
+    callgraph->edges[n].callee = callee;
+    callgraph->edge_index[slot] = n;
+
+    if (callgraph->edge_count > (callgraph->edge_mask + 1) / 2)
+    {
+        uint32_t *grown = grow_index(callgraph->edge_index, &callgraph->edge_mask, callgraph->edge_count, edge_key, callgraph);
+        if (grown == NULL)
+        {
+            callgraph->edge_count--;
+            callgraph->edge_index[slot] = NO_INDEX;
+            return NULL;
+        }
+        callgraph->edge_index = grown;
+    }
+    return &callgraph->edges[n];
+}
+
+static void push_frame(avr_callgraph_t *callgraph, uint64_t cycle, uint32_t addr, uint32_t sp, int interrupt)
+{
+    if (callgraph->depth == AVR_CALLGRAPH_MAX_DEPTH)
+    {
+        callgraph->overflows++;
+        return;
+    }
+    uint32_t function = find_function(callgraph, addr);
+    if (function == NO_INDEX)
+    {
+        callgraph->overflows++;
+        return;
+    }
+
+    avr_callgraph_frame_t *frame = &callgraph->frames[callgraph->depth++];
+    frame->function = function;
+    frame->sp = sp;
+    frame->interrupt = interrupt;
+    frame->entry = cycle;
+    frame->children = 0;
+    frame->interrupt_cycles = callgraph->interrupt_cycles;
+    callgraph->functions[function].calls++;
+    callgraph->functions[function].active++;
+}
+
+static void pop_frame(avr_callgraph_t *callgraph, uint64_t cycle)
+{
+    avr_callgraph_frame_t *frame = &callgraph->frames[--callgraph->depth];
+    avr_callgraph_function_t *function = &callgraph->functions[frame->function];
+    uint64_t inclusive = cycle - frame->entry - (callgraph->interrupt_cycles - frame->interrupt_cycles);
+
+    function->self += inclusive - frame->children;
+    if (--function->active == 0)
+        function->inclusive += inclusive;
+
+    if (frame->interrupt)
+        callgraph->interrupt_cycles += inclusive;
+    else if (callgraph->depth > 0)
+    {
+        avr_callgraph_frame_t *caller = &callgraph->frames[callgraph->depth - 1];
+        caller->children += inclusive;
+        avr_callgraph_edge_t *edge = find_edge(callgraph, caller->function, frame->function);
+        if (edge)
+        {
+            edge->calls++;
+            edge->inclusive += inclusive;
+        }
+    }
+}
+
+// ends the frames the stack pointer has moved back up past
+static void unwind(avr_callgraph_t *callgraph, uint64_t cycle, uint32_t sp)
+{
+    while (callgraph->depth > 1 && callgraph->frames[callgraph->depth - 1].sp < sp)
+        pop_frame(callgraph, cycle);
+}
+
+int avr_callgraph_start(avr_callgraph_t *callgraph, struct avr_t *avr)
+{
+    if (avr->callgraph != NULL)
+        return -1;
+
+    memset(callgraph, 0, sizeof(*callgraph));
+    callgraph->avr = avr;
+    callgraph->function_size = callgraph->edge_size = 64;
+    callgraph->function_mask = callgraph->edge_mask = 127;
+    callgraph->functions = (avr_callgraph_function_t *)malloc(callgraph->function_size * sizeof(avr_callgraph_function_t));
+    callgraph->edges = (avr_callgraph_edge_t *)malloc(callgraph->edge_size * sizeof(avr_callgraph_edge_t));
+    callgraph->function_index = (uint32_t *)malloc((callgraph->function_mask + 1) * sizeof(uint32_t));
+    callgraph->edge_index = (uint32_t *)malloc((callgraph->edge_mask + 1) * sizeof(uint32_t));
+    if (!callgraph->functions || !callgraph->edges || !callgraph->function_index || !callgraph->edge_index)
+    {
+        avr_callgraph_free(callgraph);
+        return -1;
+    }
+    memset(callgraph->function_index, 0xff, (callgraph->function_mask + 1) * sizeof(uint32_t));
+    memset(callgraph->edge_index, 0xff, (callgraph->edge_mask + 1) * sizeof(uint32_t));
+
+    // whatever is running now, it never returns as far as we know
+    avr_symbol_t *symbol = avr_symbol_at(avr, avr->pc);
+    callgraph->start_cycle = avr->cycle;
+    push_frame(callgraph, avr->cycle, symbol ? symbol->addr : avr->pc | AVR_PROFILER_FRAME_PC, 0xffffffff, 0);
+
+    // the calls and returns decode to the profiled versions from now on
+    avr->callgraph = callgraph;
+    avr_flash_unshare(avr);
+    avr_decode_flash(avr, 0, avr->flashend + 1);
+    callgraph->running = 1;
+    return 0;
+}
+
+void avr_callgraph_stop(avr_callgraph_t *callgraph)
+{
+    if (!callgraph->running)
+        return;
+
+    avr_t *avr = callgraph->avr;
+    avr->callgraph = NULL;
+    avr_flash_unshare(avr);
+    avr_decode_flash(avr, 0, avr->flashend + 1);
+
+    callgraph->stop_cycle = avr->cycle;
+    while (callgraph->depth > 0)
+        pop_frame(callgraph, avr->cycle);
+    callgraph->running = 0;
+}
+
+void avr_callgraph_free(avr_callgraph_t *callgraph)
+{
+    if (callgraph->avr)
+        avr_callgraph_stop(callgraph);
+    free(callgraph->functions);
+    free(callgraph->edges);
+    free(callgraph->function_index);
+    free(callgraph->edge_index);
+    memset(callgraph, 0, sizeof(*callgraph));
+}
+
+static uint32_t stack_pointer(avr_t *avr)
+{
+    return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+void avr_callgraph_call(avr_callgraph_t *callgraph, uint64_t cycle, uint32_t target)
+{
+    avr_t *avr = callgraph->avr;
+    uint32_t sp = stack_pointer(avr);
+    // the caller is running with the stack as it was before the call
+    unwind(callgraph, cycle, sp + avr->address_size);
+    push_frame(callgraph, cycle, target, sp, 0);
+}
+
+void avr_callgraph_return(avr_callgraph_t *callgraph, uint64_t cycle)
+{
+    unwind(callgraph, cycle, stack_pointer(callgraph->avr));
+}
+
+void avr_callgraph_interrupt(avr_callgraph_t *callgraph, uint64_t cycle, int vector)
+{
+    avr_t *avr = callgraph->avr;
+    uint32_t sp = stack_pointer(avr);
+    uint32_t handler = avr_profiler_vector_handler(avr, vector);
+    if (handler == 0xffffffff)
+        handler = vector * avr->vector_size;
+    unwind(callgraph, cycle, sp + avr->address_size);
+    push_frame(callgraph, cycle, handler, sp, 1);
+}
+
+// a function's sort keys, and its index in avr_callgraph_t.functions
+typedef struct function_key_t
+{
+    uint64_t self;
+    uint32_t addr;
+    uint32_t index;
+} function_key_t;
+
+// by self cycles, biggest first
+static int compare_self(const void *a, const void *b)
+{
+    const function_key_t *fa = (const function_key_t *)a, *fb = (const function_key_t *)b;
+    if (fa->self != fb->self)
+        return fa->self < fb->self ? 1 : -1;
+    return fa->addr < fb->addr ? -1 : fa->addr > fb->addr;
+}
+
+static uint64_t total_cycles(const avr_callgraph_t *callgraph)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < callgraph->function_count; i++)
+        total += callgraph->functions[i].self;
+    return total;
+}
+
+void avr_callgraph_print(const avr_callgraph_t *callgraph, FILE *out, int count)
+{
+    function_key_t *keys = (function_key_t *)malloc((callgraph->function_count + 1) * sizeof(function_key_t));
+    uint64_t total = total_cycles(callgraph);
+    char buffer[32];
+
+    if (keys == NULL)
+        return;
+    for (uint32_t i = 0; i < callgraph->function_count; i++)
+    {
+        keys[i].self = callgraph->functions[i].self;
+        keys[i].addr = callgraph->functions[i].addr;
+        keys[i].index = i;
+    }
+    qsort(keys, callgraph->function_count, sizeof(*keys), compare_self);
+
+    fprintf(out, "%-24s %10s %14s %7s %14s %7s\n", "function", "calls", "self", "%", "inclusive", "%");
+    for (uint32_t i = 0; i < callgraph->function_count && (count == 0 || i < (uint32_t)count); i++)
+    {
+        const avr_callgraph_function_t *function = &callgraph->functions[keys[i].index];
+        fprintf(out, "%-24s %10llu %14llu %6.2f%% %14llu %6.2f%%\n",
+                avr_profiler_frame_name(callgraph->avr, function->addr, buffer, sizeof(buffer)),
+                (unsigned long long)function->calls, (unsigned long long)function->self,
+                total ? 100.0 * function->self / total : 0, (unsigned long long)function->inclusive,
+                total ? 100.0 * function->inclusive / total : 0);
+    }
+    if (callgraph->overflows)
+        fprintf(out, "%llu calls past the shadow stack's depth of %d\n", (unsigned long long)callgraph->overflows,
+                AVR_CALLGRAPH_MAX_DEPTH);
+    free(keys);
+}
+
+// an edge's sort keys, and its index in avr_callgraph_t.edges
+typedef struct edge_key_t
+{
+    uint32_t caller, callee;
+    uint32_t index;
+} edge_key_t;
+
+// by caller, then callee
+static int compare_caller(const void *a, const void *b)
+{
+    const edge_key_t *ea = (const edge_key_t *)a, *eb = (const edge_key_t *)b;
+    if (ea->caller != eb->caller)
+        return ea->caller < eb->caller ? -1 : 1;
+    return ea->callee < eb->callee ? -1 : ea->callee > eb->callee;
+}
+
+// a function's name the first time, just its number after that
+static void write_function(const avr_callgraph_t *callgraph, FILE *out, const char *prefix, uint32_t function, uint8_t *named)
+{
+    char buffer[32];
+
+    fprintf(out, "%s=(%u)", prefix, function + 1);
+    if (!named[function])
+        fprintf(out, " %s", avr_profiler_frame_name(callgraph->avr, callgraph->functions[function].addr, buffer, sizeof(buffer)));
+    fputc('\n', out);
+    named[function] = 1;
+}
+
+int avr_callgraph_write_callgrind(const avr_callgraph_t *callgraph, FILE *out, const char *command)
+{
+    edge_key_t *keys = (edge_key_t *)malloc((callgraph->edge_count + 1) * sizeof(edge_key_t));
+    uint8_t *named = (uint8_t *)calloc(callgraph->function_count + 1, 1);
+    if (keys == NULL || named == NULL)
+    {
+        free(keys);
+        free(named);
+        return -1;
+    }
+    for (uint32_t i = 0; i < callgraph->edge_count; i++)
+    {
+        keys[i].caller = callgraph->edges[i].caller;
+        keys[i].callee = callgraph->edges[i].callee;
+        keys[i].index = i;
+    }
+    qsort(keys, callgraph->edge_count, sizeof(*keys), compare_caller);
+
+    fprintf(out, "# callgrind format\n");
+    fprintf(out, "version: 1\n");
+    fprintf(out, "creator: simavr\n");
+    if (command)
+        fprintf(out, "cmd: %s\n", command);
+    fprintf(out, "positions: line\n");
+    fprintf(out, "events: Cycles\n");
+    fprintf(out, "summary: %llu\n", (unsigned long long)total_cycles(callgraph));
+    fprintf(out, "\nfl=(1) ???\n");
+
+    uint32_t e = 0;
+    for (uint32_t f = 0; f < callgraph->function_count; f++)
+    {
+        fputc('\n', out);
+        write_function(callgraph, out, "fn", f, named);
+        fprintf(out, "0 %llu\n", (unsigned long long)callgraph->functions[f].self);
+        for (; e < callgraph->edge_count && keys[e].caller == f; e++)
+        {
+            const avr_callgraph_edge_t *edge = &callgraph->edges[keys[e].index];
+            write_function(callgraph, out, "cfn", edge->callee, named);
+            fprintf(out, "calls=%llu 0\n", (unsigned long long)edge->calls);
+            fprintf(out, "0 %llu\n", (unsigned long long)edge->inclusive);
+        }
+    }
+
+    free(keys);
+    free(named);
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,95 @@
+#ifndef __SIM_CALLGRAPH_H
+#define __SIM_CALLGRAPH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct avr_t;
+
+// deepest shadow call stack, calls past it count towards their caller
+#define AVR_CALLGRAPH_MAX_DEPTH     256
+
+// a function, by the address it was called at, named as avr_profiler_frame_name()
+typedef struct avr_callgraph_function_t
+{
+    uint32_t addr;
+    uint64_t calls;
+    uint64_t self;                  // cycles spent in the function itself
+    uint64_t inclusive;             // and in what it called, recursion counted once
+    uint32_t active;                // times it's on the shadow stack
+} avr_callgraph_function_t;
+
+// calls from one function to another
+typedef struct avr_callgraph_edge_t
+{
+    uint32_t caller, callee;        // indexes in avr_callgraph_t.functions
+    uint64_t calls;
+    uint64_t inclusive;
+} avr_callgraph_edge_t;
+
+typedef struct avr_callgraph_frame_t
+{
+    uint32_t function;
+    uint32_t sp;                    // stack pointer after the return address was pushed
+    int interrupt;
+    uint64_t entry;                 // cycle the function was entered at
+    uint64_t children;              // cycles in the calls it made
+    uint64_t interrupt_cycles;      // avr_callgraph_t.interrupt_cycles when entered
+} avr_callgraph_frame_t;
+
+/*
+ * Exact call graph profiler, for the cycles each function takes by itself
+ * and with everything it calls. While it runs the core decodes the calls
+ * and returns into versions that tell it, and it keeps a shadow call stack
+ * (so there's no cost at all when it isn't running, and the superblocks
+ * and loops run as usual in between).
+ *
+ * Frames are kept by the stack pointer they were entered with, not by
+ * matching calls and returns: whatever moves the stack pointer back up
+ * past a frame ends it, at the next call or return. So longjmp(), a ret
+ * used as a jump, 'rcall .+0' or a tail call all work out, near enough.
+ * Interrupt handlers are roots of their own, their cycles aren't counted
+ * in the function they interrupted.
+ *
+ * Sleeping counts towards the function that slept.
+ */
+typedef struct avr_callgraph_t
+{
+    struct avr_t *avr;
+    int running;
+    uint64_t start_cycle, stop_cycle;
+    uint64_t overflows;             // calls that didn't fit on the shadow stack
+
+    avr_callgraph_function_t *functions;
+    uint32_t function_count, function_size;
+    avr_callgraph_edge_t *edges;
+    uint32_t edge_count, edge_size;
+
+    // open addressing on the function address and the caller/callee pair
+    uint32_t *function_index, *edge_index;
+    uint32_t function_mask, edge_mask;
+
+    avr_callgraph_frame_t frames[AVR_CALLGRAPH_MAX_DEPTH];
+    int depth;
+    uint64_t interrupt_cycles;      // in interrupt handlers, less the ones nested in them
+} avr_callgraph_t;
+
+// start profiling avr, returns 0 on success, only one can run at a time
+int avr_callgraph_start(avr_callgraph_t *callgraph, struct avr_t *avr);
+// stop, the functions still running are counted as returning now
+void avr_callgraph_stop(avr_callgraph_t *callgraph);
+// stop, and free the results
+void avr_callgraph_free(avr_callgraph_t *callgraph);
+
+// called by the core, 'cycle' is the one the instruction finishes at
+void avr_callgraph_call(avr_callgraph_t *callgraph, uint64_t cycle, uint32_t target);
+void avr_callgraph_return(avr_callgraph_t *callgraph, uint64_t cycle);
+void avr_callgraph_interrupt(avr_callgraph_t *callgraph, uint64_t cycle, int vector);
+
+// the busiest functions, by self cycles, 0 for all of them
+void avr_callgraph_print(const avr_callgraph_t *callgraph, FILE *out, int count);
+
+// write a callgrind profile, for kcachegrind and callgrind_annotate, 'command' can be NULL
+int avr_callgraph_write_callgrind(const avr_callgraph_t *callgraph, FILE *out, const char *command);
+
+#endif      // __SIM_CALLGRAPH_H
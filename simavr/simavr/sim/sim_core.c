@@ -28,6 +28,7 @@
 #include "sim_gdb.h"
 #include "avr_flash.h"
 #include "avr_watchdog.h"
+#include "sim_callgraph.h"
 
 // SREG bit names
 const char * _sreg_bit_name = "cznvshti";
@@ -60,24 +61,22 @@ int dont_trace(const char * name)
 		!strcmp(name, "__epilogue_restores__"));
 }
 
-int donttrace = 0;
-
 #define STATE(_f, args...) { \
 	if (avr->trace) {\
 		if (avr->trace_data->codeline && avr->trace_data->codeline[avr->pc>>1]) {\
 			const char * symn = avr->trace_data->codeline[avr->pc>>1]->symbol; \
 			int dont = 0 && dont_trace(symn);\
-			if (dont!=donttrace) { \
-				donttrace = dont;\
+			if (dont!=avr->trace_data->donttrace) { \
+				avr->trace_data->donttrace = dont;\
 				DUMP_REG();\
 			}\
-			if (donttrace==0)\
+			if (avr->trace_data->donttrace==0)\
 				printf("%04x: %-25s " _f, avr->pc, symn, ## args);\
 		} else \
 			printf("%s: %04x: " _f, __FUNCTION__, avr->pc, ## args);\
 		}\
 	}
-#define SREG() if (avr->trace && donttrace == 0) {\
+#define SREG() if (avr->trace && avr->trace_data->donttrace == 0) {\
 	printf("%04x: \t\t\t\t\t\t\t\t\tSREG = ", avr->pc); \
 	for (int _sbi = 0; _sbi < 8; _sbi++)\
 		printf("%c", avr->sreg[_sbi] ? toupper(_sreg_bit_name[_sbi]) : '.');\
@@ -138,6 +137,8 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 	if (avr->gdb) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
 	}
+	if (avr->write_watch)
+		avr->write_watch(avr, addr, v, avr->write_watch_param);
 
 	avr->data[addr] = v;
 }
@@ -157,6 +158,20 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 	return avr->data[addr];
 }
 
+/*
+ * Raise the irqs of io register 'io' with value 'v', they are all counted
+ * in one go
+ */
+static inline void _avr_raise_io_irqs(avr_t * avr, avr_io_addr_t io, uint8_t v)
+{
+	avr_irq_t * irq = avr->io[io].irq;
+
+	avr->irq_pool.raised += AVR_IOMEM_IRQ_ALL + 1;
+	_avr_raise_irq(irq + AVR_IOMEM_IRQ_ALL, v);
+	for (int i = 0; i < 8; i++)
+		_avr_raise_irq(irq + i, (v >> i) & 1);
+}
+
 /*
  * Set a register (r < 256)
  * if it's an IO register (> 31) also (try to) call any callback that was
@@ -174,19 +189,27 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 	}
 	if (r > 31) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(r);
+		avr->perf.io_writes[io]++;
 		if (avr->io[io].w.c)
 			avr->io[io].w.c(avr, r, v, avr->io[io].w.param);
 		else
 			avr->data[r] = v;
-		if (avr->io[io].irq) {
-			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);				
-		}
+		if (avr->io[io].irq)
+			_avr_raise_io_irqs(avr, io, v);
 	} else
 		avr->data[r] = v;
 }
 
+/*
+ * Set a general purpose register (r < 32). Unlike IO registers, these
+ * have no side effects, so the decoder uses this shortcut when it can.
+ */
+static inline void _avr_set_gpr(avr_t * avr, uint8_t r, uint8_t v)
+{
+	REG_TOUCH(avr, r);
+	avr->data[r] = v;
+}
+
 /*
  * Stack pointer access
  */
@@ -206,9 +229,12 @@ inline void _avr_sp_set(avr_t * avr, uint16_t sp)
  */
 static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
 {
-	if (addr < MAX_IOs + 31)
+	if (addr < MAX_IOs + 31) {
+		// the top of this range is plain SRAM on most cores
+		if (avr->write_watch && addr > 31)
+			avr->write_watch(avr, addr, v, avr->write_watch_param);
 		_avr_set_r(avr, addr, v);
-	else
+	} else
 		avr_core_watch_write(avr, addr, v);
 }
 
@@ -223,19 +249,16 @@ static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 		 * while the core itself uses the "shortcut" array
 		 */
 		READ_SREG_INTO(avr, avr->data[R_SREG]);
-		
+		avr->perf.io_reads[AVR_DATA_TO_IO(R_SREG)]++;
 	} else if (addr > 31 && addr < 31 + MAX_IOs) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(addr);
-		
+
+		avr->perf.io_reads[io]++;
 		if (avr->io[io].r.c)
 			avr->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
 		
-		if (avr->io[io].irq) {
-			uint8_t v = avr->data[addr];
-			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);				
-		}
+		if (avr->io[io].irq)
+			_avr_raise_io_irqs(avr, io, avr->data[addr]);
 	}
 	return avr_core_watch_read(avr, addr);
 }
@@ -326,7 +349,7 @@ static void _avr_invalid_opcode(avr_t * avr)
  */
 void avr_dump_state(avr_t * avr)
 {
-	if (!avr->trace || donttrace)
+	if (!avr->trace || avr->trace_data->donttrace)
 		return;
 
 	int doit = 0;
@@ -352,23 +375,28 @@ void avr_dump_state(avr_t * avr)
 }
 #endif
 
+/*
+ * Operand accessors. The operands are extracted from the opcode only once,
+ * when the flash is decoded (see _avr_decode_one), these just fetch them back
+ * from the pre-decoded instruction, and read the register values involved.
+ */
 #define get_d5(o) \
-		const uint8_t d = (o >> 4) & 0x1f;
+		const uint8_t d = (o)->d;
 
 #define get_vd5(o) \
 		get_d5(o) \
 		const uint8_t vd = avr->data[d];
 
 #define get_r5(o) \
-		const uint8_t r = ((o >> 5) & 0x10) | (o & 0xf);
+		const uint8_t r = (o)->r;
 
 #define get_d5_a6(o) \
 		get_d5(o); \
-		const uint8_t A = ((((o >> 9) & 3) << 4) | ((o) & 0xf)) + 32;
+		const uint8_t A = (o)->k;
 
 #define get_vd5_s3(o) \
 		get_vd5(o); \
-		const uint8_t s = o & 7;
+		const uint8_t s = (o)->r;
 
 #define get_vd5_s3_mask(o) \
 		get_vd5_s3(o); \
@@ -385,8 +413,8 @@ void avr_dump_state(avr_t * avr)
 		const uint8_t vr = avr->data[r];
 		
 #define get_h4_k8(o) \
-		const uint8_t h = 16 + ((o >> 4) & 0xf); \
-		const uint8_t k = ((o & 0x0f00) >> 4) | (o & 0xf);
+		const uint8_t h = (o)->d; \
+		const uint8_t k = (o)->k;
 
 #define get_vh4_k8(o) \
 		get_h4_k8(o) \
@@ -394,30 +422,29 @@ void avr_dump_state(avr_t * avr)
 
 #define get_d5_q6(o) \
 		get_d5(o) \
-		const uint8_t q = ((o & 0x2000) >> 8) | ((o & 0x0c00) >> 7) | (o & 0x7);
+		const uint8_t q = (o)->k;
 
 #define get_io5(o) \
-		const uint8_t io = ((o >> 3) & 0x1f) + 32;
+		const uint8_t io = (o)->d;
 
 #define get_io5_b3(o) \
 		get_io5(o); \
-		const uint8_t b = o & 0x7;
+		const uint8_t b = (o)->r;
 
 #define get_io5_b3mask(o) \
 		get_io5(o); \
-		const uint8_t mask = 1 << (o & 0x7);
+		const uint8_t mask = 1 << (o)->r;
 
-//	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
 #define get_o12(op) \
-		const int16_t o = ((int16_t)((op << 4) & 0xffff)) >> 3;
+		const int16_t o = (int16_t)(op)->k;
 
 #define get_vp2_k6(o) \
-		const uint8_t p = 24 + ((o >> 3) & 0x6); \
-		const uint8_t k = ((o & 0x00c0) >> 2) | (o & 0xf); \
+		const uint8_t p = (o)->d; \
+		const uint8_t k = (o)->k; \
 		const uint16_t vp = avr->data[p] | (avr->data[p + 1] << 8);
 
 #define get_sreg_bit(o) \
-		const uint8_t b = (o >> 4) & 7;
+		const uint8_t b = (o)->d;
 
 /*
  * Add a "jump" address to the jump trace buffer
@@ -553,6 +580,8 @@ _avr_flags_znv0s (struct avr_t * avr, uint8_t res)
 
 static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
 {
+	if (pc + 1 > avr->flashend)
+		return 0;
 	uint16_t o = (avr->flash[pc] | (avr->flash[pc+1] << 8)) & 0xfc0f;
 	return	o == 0x9200 || // STS ! Store Direct to Data Space
 			o == 0x9000 || // LDS Load Direct from Data Space
@@ -563,768 +592,1290 @@ static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
 }
 
 /*
- * Main opcode decoder
- * 
- * The decoder was written by following the datasheet in no particular order.
- * As I went along, I noticed "bit patterns" that could be used to factor opcodes
- * However, a lot of these only became apparent later on, so SOME instructions
- * (skip of bit set etc) are compact, and some could use some refactoring (the ALU
- * ones scream to be factored).
- * I assume that the decoder could easily be 2/3 of it's current size.
- * 
- * + It lacks the "extended" XMega jumps. 
- * + It also doesn't check whether the core it's
- *   emulating is supposed to have the fancy instructions, like multiply and such.
- * 
- * The number of cycles taken by instruction has been added, but might not be
- * entirely accurate.
+ * Instruction handlers
+ *
+ * There is one of these per instruction (or family of instructions) and they
+ * are called by avr_run_one() with the pre-decoded operands. new_pc is the
+ * "default" pc for the next instruction, and *cycle is already loaded with the
+ * instruction base cycle count; handlers only add the variable part (branches,
+ * skips, stack pushes).
  */
-avr_flashaddr_t avr_run_one(avr_t * avr)
+#define AVR_OP(_name) \
+	static inline avr_flashaddr_t _avr_op_##_name(avr_t * avr, const avr_insn_t * i, \
+			avr_flashaddr_t new_pc, int * cycle)
+
+AVR_OP(invalid)
 {
-run_one_again:
-#if CONFIG_SIMAVR_TRACE
-	/*
-	 * this traces spurious reset or bad jumps
-	 */
-	if ((avr->pc == 0 && avr->cycle > 0) || avr->pc >= avr->codeend || _avr_sp_get(avr) > avr->ramend) {
-		avr->trace = 1;
-		STATE("RESET\n");
-		crash(avr);
-	}
-	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
-#endif
+	_avr_invalid_opcode(avr);
+	return new_pc;
+}
 
-	/* Ensure we don't crash simavr due to a bad instruction reading past
-	 * the end of the flash.
-	 */
-	if (unlikely(avr->pc >= avr->flashend)) {
-		STATE("CRASH\n");
-		crash(avr);
-		return 0;
+AVR_OP(nop)	// NOP
+{
+	STATE("nop\n");
+	return new_pc;
+}
+
+AVR_OP(cpc)	// CPC -- Compare with carry -- 0000 01rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd - vr - avr->sreg[S_C];
+	STATE("cpc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_flags_sub_Rzns(avr, res, vd, vr);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(add)	// ADD -- Add without carry -- 0000 11rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd + vr;
+	if (r == d) {
+		STATE("lsl %s[%02x] = %02x\n", avr_regname(d), vd, res & 0xff);
+	} else {
+		STATE("add %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
 	}
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_add_zns(avr, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-	uint32_t		opcode = (avr->flash[avr->pc + 1] << 8) | avr->flash[avr->pc];
-	avr_flashaddr_t	new_pc = avr->pc + 2;	// future "default" pc
-	int 			cycle = 1;
+AVR_OP(sbc)	// SBC -- Subtract with carry -- 0000 10rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd - vr - avr->sreg[S_C];
+	STATE("sbc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_sub_Rzns(avr, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-	switch (opcode & 0xf000) {
-		case 0x0000: {
-			switch (opcode) {
-				case 0x0000: {	// NOP
-					STATE("nop\n");
-				}	break;
-				default: {
-					switch (opcode & 0xfc00) {
-						case 0x0400: {	// CPC -- Compare with carry -- 0000 01rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd - vr - avr->sreg[S_C];
-							STATE("cpc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-							_avr_flags_sub_Rzns(avr, res, vd, vr);
-							SREG();
-						}	break;
-						case 0x0c00: {	// ADD -- Add without carry -- 0000 11rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd + vr;
-							if (r == d) {
-								STATE("lsl %s[%02x] = %02x\n", avr_regname(d), vd, res & 0xff);
-							} else {
-								STATE("add %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-							}
-							_avr_set_r(avr, d, res);
-							_avr_flags_add_zns(avr, res, vd, vr);
-							SREG();
-						}	break;
-						case 0x0800: {	// SBC -- Subtract with carry -- 0000 10rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd - vr - avr->sreg[S_C];
-							STATE("sbc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
-							_avr_set_r(avr, d, res);
-							_avr_flags_sub_Rzns(avr, res, vd, vr);
-							SREG();
-						}	break;
-						default:
-							switch (opcode & 0xff00) {
-								case 0x0100: {	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
-									uint8_t d = ((opcode >> 4) & 0xf) << 1;
-									uint8_t r = ((opcode) & 0xf) << 1;
-									STATE("movw %s:%s, %s:%s[%02x%02x]\n", avr_regname(d), avr_regname(d+1), avr_regname(r), avr_regname(r+1), avr->data[r+1], avr->data[r]);
-									_avr_set_r(avr, d, avr->data[r]);
-									_avr_set_r(avr, d+1, avr->data[r+1]);
-								}	break;
-								case 0x0200: {	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
-									int8_t r = 16 + (opcode & 0xf);
-									int8_t d = 16 + ((opcode >> 4) & 0xf);
-									int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-									STATE("muls %s[%d], %s[%02x] = %d\n", avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
-									_avr_set_r(avr, 0, res);
-									_avr_set_r(avr, 1, res >> 8);
-									avr->sreg[S_C] = (res >> 15) & 1;
-									avr->sreg[S_Z] = res == 0;
-									cycle++;
-									SREG();
-								}	break;
-								case 0x0300: {	// MUL -- Multiply -- 0000 0011 fddd frrr
-									int8_t r = 16 + (opcode & 0x7);
-									int8_t d = 16 + ((opcode >> 4) & 0x7);
-									int16_t res = 0;
-									uint8_t c = 0;
-									T(const char * name = "";)
-									switch (opcode & 0x88) {
-										case 0x00: 	// MULSU -- Multiply Signed Unsigned -- 0000 0011 0ddd 0rrr
-											res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											T(name = "mulsu";)
-											break;
-										case 0x08: 	// FMUL -- Fractional Multiply Unsigned -- 0000 0011 0ddd 1rrr
-											res = ((uint8_t)avr->data[r]) * ((uint8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmul";)
-											break;
-										case 0x80: 	// FMULS -- Multiply Signed -- 0000 0011 1ddd 0rrr
-											res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmuls";)
-											break;
-										case 0x88: 	// FMULSU -- Multiply Signed Unsigned -- 0000 0011 1ddd 1rrr
-											res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmulsu";)
-											break;
-									}
-									cycle++;
-									STATE("%s %s[%d], %s[%02x] = %d\n", name, avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
-									_avr_set_r(avr, 0, res);
-									_avr_set_r(avr, 1, res >> 8);
-									avr->sreg[S_C] = c;
-									avr->sreg[S_Z] = res == 0;
-									SREG();
-								}	break;
-								default: _avr_invalid_opcode(avr);
-							}
-					}
-				}
-			}
-		}	break;
+AVR_OP(movw)	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
+{
+	get_d5(i);
+	get_r5(i);
+	STATE("movw %s:%s, %s:%s[%02x%02x]\n", avr_regname(d), avr_regname(d+1), avr_regname(r), avr_regname(r+1), avr->data[r+1], avr->data[r]);
+	_avr_set_gpr(avr, d, avr->data[r]);
+	_avr_set_gpr(avr, d+1, avr->data[r+1]);
+	return new_pc;
+}
 
-		case 0x1000: {
-			switch (opcode & 0xfc00) {
-				case 0x1800: {	// SUB -- Subtract without carry -- 0001 10rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd - vr;
-					STATE("sub %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-					_avr_flags_sub_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				case 0x1000: {	// CPSE -- Compare, skip if equal -- 0001 00rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint16_t res = vd == vr;
-					STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
-					if (res) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
-							new_pc += 4; cycle += 2;
-						} else {
-							new_pc += 2; cycle++;
-						}
-					}
-				}	break;
-				case 0x1400: {	// CP -- Compare -- 0001 01rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd - vr;
-					STATE("cp %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_flags_sub_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				case 0x1c00: {	// ADD -- Add with carry -- 0001 11rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd + vr + avr->sreg[S_C];
-					if (r == d) {
-						STATE("rol %s[%02x] = %02x\n", avr_regname(d), avr->data[d], res);
-					} else {
-						STATE("addc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_add_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
+AVR_OP(muls)	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
+{
+	get_d5(i);
+	get_r5(i);
+	int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+	STATE("muls %s[%d], %s[%02x] = %d\n", avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
+	_avr_set_gpr(avr, 0, res);
+	_avr_set_gpr(avr, 1, res >> 8);
+	avr->sreg[S_C] = (res >> 15) & 1;
+	avr->sreg[S_Z] = res == 0;
+	SREG();
+	return new_pc;
+}
 
-		case 0x2000: {
-			switch (opcode & 0xfc00) {
-				case 0x2000: {	// AND -- Logical AND -- 0010 00rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd & vr;
-					if (r == d) {
-						STATE("tst %s[%02x]\n", avr_regname(d), avr->data[d]);
-					} else {
-						STATE("and %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2400: {	// EOR -- Logical Exclusive OR -- 0010 01rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd ^ vr;
-					if (r==d) {
-						STATE("clr %s[%02x]\n", avr_regname(d), avr->data[d]);
-					} else {
-						STATE("eor %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2800: {	// OR -- Logical OR -- 0010 10rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd | vr;
-					STATE("or %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2c00: {	// MOV -- 0010 11rd dddd rrrr
-					get_d5_vr5(opcode);
-					uint8_t res = vr;
-					STATE("mov %s, %s[%02x] = %02x\n", avr_regname(d), avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
+AVR_OP(fmul)	// MUL -- Multiply -- 0000 0011 fddd frrr
+{
+	get_d5(i);
+	get_r5(i);
+	int16_t res = 0;
+	uint8_t c = 0;
+	T(const char * name = "";)
+	switch (i->k) {
+		case 0x00: 	// MULSU -- Multiply Signed Unsigned -- 0000 0011 0ddd 0rrr
+			res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			T(name = "mulsu";)
+			break;
+		case 0x08: 	// FMUL -- Fractional Multiply Unsigned -- 0000 0011 0ddd 1rrr
+			res = ((uint8_t)avr->data[r]) * ((uint8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			T(name = "fmul";)
+			break;
+		case 0x80: 	// FMULS -- Multiply Signed -- 0000 0011 1ddd 0rrr
+			res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			T(name = "fmuls";)
+			break;
+		case 0x88: 	// FMULSU -- Multiply Signed Unsigned -- 0000 0011 1ddd 1rrr
+			res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			T(name = "fmulsu";)
+			break;
+	}
+	STATE("%s %s[%d], %s[%02x] = %d\n", name, avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
+	_avr_set_gpr(avr, 0, res);
+	_avr_set_gpr(avr, 1, res >> 8);
+	avr->sreg[S_C] = c;
+	avr->sreg[S_Z] = res == 0;
+	SREG();
+	return new_pc;
+}
 
-		case 0x3000: {	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k;
-			STATE("cpi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_flags_sub_zns(avr, res, vh, k);
-			SREG();
-		}	break;
+AVR_OP(sub)	// SUB -- Subtract without carry -- 0001 10rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd - vr;
+	STATE("sub %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_sub_zns(avr, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-		case 0x4000: {	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k - avr->sreg[S_C];
-			STATE("sbci %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
-			_avr_set_r(avr, h, res);
-			_avr_flags_sub_Rzns(avr, res, vh, k);
-			SREG();
-		}	break;
+AVR_OP(cpse)	// CPSE -- Compare, skip if equal -- 0001 00rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint16_t res = vd == vr;
+	STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
+	if (res) {
+		new_pc += i->skip;
+		*cycle += i->skip >> 1;
+	}
+	return new_pc;
+}
 
-		case 0x5000: {	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k;
-			STATE("subi %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
-			_avr_set_r(avr, h, res);
-			_avr_flags_sub_zns(avr, res, vh, k);
-			SREG();
-		}	break;
+AVR_OP(cp)	// CP -- Compare -- 0001 01rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd - vr;
+	STATE("cp %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_flags_sub_zns(avr, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-		case 0x6000: {	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh | k;
-			STATE("ori %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_set_r(avr, h, res);
-			_avr_flags_znv0s(avr, res);
-			SREG();
-		}	break;
+AVR_OP(adc)	// ADD -- Add with carry -- 0001 11rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd + vr + avr->sreg[S_C];
+	if (r == d) {
+		STATE("rol %s[%02x] = %02x\n", avr_regname(d), avr->data[d], res);
+	} else {
+		STATE("addc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
+	}
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_add_zns(avr, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-		case 0x7000: {	// ANDI	-- Logical AND with Immediate -- 0111 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh & k;
-			STATE("andi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_set_r(avr, h, res);
-			_avr_flags_znv0s(avr, res);
-			SREG();
-		}	break;
+AVR_OP(and)	// AND -- Logical AND -- 0010 00rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd & vr;
+	if (r == d) {
+		STATE("tst %s[%02x]\n", avr_regname(d), avr->data[d]);
+	} else {
+		STATE("and %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	}
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_znv0s(avr, res);
+	SREG();
+	return new_pc;
+}
 
-		case 0xa000:
-		case 0x8000: {
-			/*
-			 * Load (LDD/STD) store instructions
-			 *
-			 * 10q0 qqsd dddd yqqq
-			 * s = 0 = load, 1 = store
-			 * y = 16 bits register index, 1 = Y, 0 = X
-			 * q = 6 bit displacement
-			 */
-			switch (opcode & 0xd008) {
-				case 0xa000:
-				case 0x8000: {	// LD (LDD) -- Load Indirect using Z -- 10q0 qqsd dddd yqqq
-					uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					get_d5_q6(opcode);
-					if (opcode & 0x0200) {
-						STATE("st (Z+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
-						_avr_set_ram(avr, v+q, avr->data[d]);
-					} else {
-						STATE("ld %s, (Z+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
-						_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
-					}
-					cycle += 1; // 2 cycles, 3 for tinyavr
-				}	break;
-				case 0xa008:
-				case 0x8008: {	// LD (LDD) -- Load Indirect using Y -- 10q0 qqsd dddd yqqq
-					uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
-					get_d5_q6(opcode);
-					if (opcode & 0x0200) {
-						STATE("st (Y+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
-						_avr_set_ram(avr, v+q, avr->data[d]);
-					} else {
-						STATE("ld %s, (Y+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[d+q]);
-						_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
-					}
-					cycle += 1; // 2 cycles, 3 for tinyavr
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
+AVR_OP(eor)	// EOR -- Logical Exclusive OR -- 0010 01rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd ^ vr;
+	if (r==d) {
+		STATE("clr %s[%02x]\n", avr_regname(d), avr->data[d]);
+	} else {
+		STATE("eor %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	}
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_znv0s(avr, res);
+	SREG();
+	return new_pc;
+}
 
-		case 0x9000: {
-			/* this is an annoying special case, but at least these lines handle all the SREG set/clear opcodes */
-			if ((opcode & 0xff0f) == 0x9408) {
-				get_sreg_bit(opcode);
-				STATE("%s%c\n", opcode & 0x0080 ? "cl" : "se", _sreg_bit_name[b]);
-				avr_sreg_set(avr, b, (opcode & 0x0080) == 0);
-				SREG();
-			} else switch (opcode) {
-				case 0x9588: { // SLEEP -- 1001 0101 1000 1000
-					STATE("sleep\n");
-					/* Don't sleep if there are interrupts about to be serviced.
-					 * Without this check, it was possible to incorrectly enter a state
-					 * in which the cpu was sleeping and interrupts were disabled. For more
-					 * details, see the commit message. */
-					if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
-						avr->state = cpu_Sleeping;
-				}	break;
-				case 0x9598: { // BREAK -- 1001 0101 1001 1000
-					STATE("break\n");
-					if (avr->gdb) {
-						// if gdb is on, we break here as in here
-						// and we do so until gdb restores the instruction
-						// that was here before
-						avr->state = cpu_StepDone;
-						new_pc = avr->pc;
-						cycle = 0;
-					}
-				}	break;
-				case 0x95a8: { // WDR -- Watchdog Reset -- 1001 0101 1010 1000
-					STATE("wdr\n");
-					avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
-				}	break;
-				case 0x95e8: { // SPM -- Store Program Memory -- 1001 0101 1110 1000
-					STATE("spm\n");
-					avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
-				}	break;
-				case 0x9409:   // IJMP -- Indirect jump -- 1001 0100 0000 1001
-				case 0x9419:   // EIJMP -- Indirect jump -- 1001 0100 0001 1001   bit 4 is "indirect"
-				case 0x9509:   // ICALL -- Indirect Call to Subroutine -- 1001 0101 0000 1001
-				case 0x9519: { // EICALL -- Indirect Call to Subroutine -- 1001 0101 0001 1001   bit 8 is "push pc"
-					int e = opcode & 0x10;
-					int p = opcode & 0x100;
-					if (e && !avr->eind)
-						_avr_invalid_opcode(avr);
-					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					if (e)
-						z |= avr->data[avr->eind] << 16;
-					STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
-					if (p)
-						cycle += _avr_push_addr(avr, new_pc) - 1;
-					new_pc = z << 1;
-					cycle++;
-					TRACE_JUMP();
-				}	break;
-				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
-					avr_sreg_set(avr, S_I, 1);
-					avr_interrupt_reti(avr);
-				case 0x9508: {	// RET -- Return -- 1001 0101 0000 1000
-					new_pc = _avr_pop_addr(avr);
-					cycle += 1 + avr->address_size;
-					STATE("ret%s\n", opcode & 0x10 ? "i" : "");
-					TRACE_JUMP();
-					STACK_FRAME_POP();
-				}	break;
-				case 0x95c8: {	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
-					uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					STATE("lpm %s, (Z[%04x])\n", avr_regname(0), z);
-					cycle += 2; // 3 cycles
-					_avr_set_r(avr, 0, avr->flash[z]);
-				}	break;
-				default:  {
-					switch (opcode & 0xfe0f) {
-						case 0x9000: {	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
-							get_d5(opcode);
-							uint16_t x = (avr->flash[new_pc+1] << 8) | avr->flash[new_pc];
-							new_pc += 2;
-							STATE("lds %s[%02x], 0x%04x\n", avr_regname(d), avr->data[d], x);
-							_avr_set_r(avr, d, _avr_get_ram(avr, x));
-							cycle++; // 2 cycles
-						}	break;
-						case 0x9005:
-						case 0x9004: {	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
-							get_d5(opcode);
-							uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-							int op = opcode & 1;
-							STATE("lpm %s, (Z[%04x]%s)\n", avr_regname(d), z, op ? "+" : "");
-							_avr_set_r(avr, d, avr->flash[z]);
-							if (op) {
-								z++;
-								_avr_set_r(avr, R_ZH, z >> 8);
-								_avr_set_r(avr, R_ZL, z);
-							}
-							cycle += 2; // 3 cycles
-						}	break;
-						case 0x9006:
-						case 0x9007: {	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
-							if (!avr->rampz)
-								_avr_invalid_opcode(avr);
-							uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
-							get_d5(opcode);
-							int op = opcode & 1;
-							STATE("elpm %s, (Z[%02x:%04x]%s)\n", avr_regname(d), z >> 16, z & 0xffff, op ? "+" : "");
-							_avr_set_r(avr, d, avr->flash[z]);
-							if (op) {
-								z++;
-								_avr_set_r(avr, avr->rampz, z >> 16);
-								_avr_set_r(avr, R_ZH, z >> 8);
-								_avr_set_r(avr, R_ZL, z);
-							}
-							cycle += 2; // 3 cycles
-						}	break;
-						/*
-						 * Load store instructions
-						 *
-						 * 1001 00sr rrrr iioo
-						 * s = 0 = load, 1 = store
-						 * ii = 16 bits register index, 11 = X, 10 = Y, 00 = Z
-						 * oo = 1) post increment, 2) pre-decrement
-						 */
-						case 0x900c:
-						case 0x900d:
-						case 0x900e: {	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
-							STATE("ld %s, %sX[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", x, op == 1 ? "++" : "");
-							cycle++; // 2 cycles (1 for tinyavr, except with inc/dec 2)
-							if (op == 2) x--;
-							uint8_t vd = _avr_get_ram(avr, x);
-							if (op == 1) x++;
-							_avr_set_r(avr, R_XH, x >> 8);
-							_avr_set_r(avr, R_XL, x);
-							_avr_set_r(avr, d, vd);
-						}	break;
-						case 0x920c:
-						case 0x920d:
-						case 0x920e: {	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
-							STATE("st %sX[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", x, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) x--;
-							_avr_set_ram(avr, x, vd);
-							if (op == 1) x++;
-							_avr_set_r(avr, R_XH, x >> 8);
-							_avr_set_r(avr, R_XL, x);
-						}	break;
-						case 0x9009:
-						case 0x900a: {	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
-							STATE("ld %s, %sY[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", y, op == 1 ? "++" : "");
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) y--;
-							uint8_t vd = _avr_get_ram(avr, y);
-							if (op == 1) y++;
-							_avr_set_r(avr, R_YH, y >> 8);
-							_avr_set_r(avr, R_YL, y);
-							_avr_set_r(avr, d, vd);
-						}	break;
-						case 0x9209:
-						case 0x920a: {	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
-							STATE("st %sY[%04x]%s, %s[%02x]\n", op == 2 ? "--" : "", y, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++;
-							if (op == 2) y--;
-							_avr_set_ram(avr, y, vd);
-							if (op == 1) y++;
-							_avr_set_r(avr, R_YH, y >> 8);
-							_avr_set_r(avr, R_YL, y);
-						}	break;
-						case 0x9200: {	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
-							get_vd5(opcode);
-							uint16_t x = (avr->flash[new_pc+1] << 8) | avr->flash[new_pc];
-							new_pc += 2;
-							STATE("sts 0x%04x, %s[%02x]\n", x, avr_regname(d), vd);
-							cycle++;
-							_avr_set_ram(avr, x, vd);
-						}	break;
-						case 0x9001:
-						case 0x9002: {	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
-							STATE("ld %s, %sZ[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", z, op == 1 ? "++" : "");
-							cycle++;; // 2 cycles, except tinyavr
-							if (op == 2) z--;
-							uint8_t vd = _avr_get_ram(avr, z);
-							if (op == 1) z++;
-							_avr_set_r(avr, R_ZH, z >> 8);
-							_avr_set_r(avr, R_ZL, z);
-							_avr_set_r(avr, d, vd);
-						}	break;
-						case 0x9201:
-						case 0x9202: {	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
-							STATE("st %sZ[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", z, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) z--;
-							_avr_set_ram(avr, z, vd);
-							if (op == 1) z++;
-							_avr_set_r(avr, R_ZH, z >> 8);
-							_avr_set_r(avr, R_ZL, z);
-						}	break;
-						case 0x900f: {	// POP -- 1001 000d dddd 1111
-							get_d5(opcode);
-							_avr_set_r(avr, d, _avr_pop8(avr));
-							T(uint16_t sp = _avr_sp_get(avr);)
-							STATE("pop %s (@%04x)[%02x]\n", avr_regname(d), sp, avr->data[sp]);
-							cycle++;
-						}	break;
-						case 0x920f: {	// PUSH -- 1001 001d dddd 1111
-							get_vd5(opcode);
-							_avr_push8(avr, vd);
-							T(uint16_t sp = _avr_sp_get(avr);)
-							STATE("push %s[%02x] (@%04x)\n", avr_regname(d), vd, sp);
-							cycle++;
-						}	break;
-						case 0x9400: {	// COM -- One’s Complement -- 1001 010d dddd 0000
-							get_vd5(opcode);
-							uint8_t res = 0xff - vd;
-							STATE("com %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							_avr_flags_znv0s(avr, res);
-							avr->sreg[S_C] = 1;
-							SREG();
-						}	break;
-						case 0x9401: {	// NEG -- Two’s Complement -- 1001 010d dddd 0001
-							get_vd5(opcode);
-							uint8_t res = 0x00 - vd;
-							STATE("neg %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_H] = ((res >> 3) | (vd >> 3)) & 1;
-							avr->sreg[S_V] = res == 0x80;
-							avr->sreg[S_C] = res != 0;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x9402: {	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
-							get_vd5(opcode);
-							uint8_t res = (vd >> 4) | (vd << 4) ;
-							STATE("swap %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-						}	break;
-						case 0x9403: {	// INC -- Increment -- 1001 010d dddd 0011
-							get_vd5(opcode);
-							uint8_t res = vd + 1;
-							STATE("inc %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_V] = res == 0x80;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x9405: {	// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
-							get_vd5(opcode);
-							uint8_t res = (vd >> 1) | (vd & 0x80);
-							STATE("asr %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							_avr_flags_zcnvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x9406: {	// LSR -- Logical Shift Right -- 1001 010d dddd 0110
-							get_vd5(opcode);
-							uint8_t res = vd >> 1;
-							STATE("lsr %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_N] = 0;
-							_avr_flags_zcvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x9407: {	// ROR -- Rotate Right -- 1001 010d dddd 0111
-							get_vd5(opcode);
-							uint8_t res = (avr->sreg[S_C] ? 0x80 : 0) | vd >> 1;
-							STATE("ror %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							_avr_flags_zcnvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x940a: {	// DEC -- Decrement -- 1001 010d dddd 1010
-							get_vd5(opcode);
-							uint8_t res = vd - 1;
-							STATE("dec %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_V] = res == 0x7f;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x940c:
-						case 0x940d: {	// JMP -- Long Call to sub, 32 bits -- 1001 010a aaaa 110a
-							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
-							uint16_t x = (avr->flash[new_pc+1] << 8) | avr->flash[new_pc];
-							a = (a << 16) | x;
-							STATE("jmp 0x%06x\n", a);
-							new_pc = a << 1;
-							cycle += 2;
-							TRACE_JUMP();
-						}	break;
-						case 0x940e:
-						case 0x940f: {	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
-							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
-							uint16_t x = (avr->flash[new_pc+1] << 8) | avr->flash[new_pc];
-							a = (a << 16) | x;
-							STATE("call 0x%06x\n", a);
-							new_pc += 2;
-							cycle += 1 + _avr_push_addr(avr, new_pc);
-							new_pc = a << 1;
-							TRACE_JUMP();
-							STACK_FRAME_PUSH();
-						}	break;
+AVR_OP(or)	// OR -- Logical OR -- 0010 10rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint8_t res = vd | vr;
+	STATE("or %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_znv0s(avr, res);
+	SREG();
+	return new_pc;
+}
 
-						default: {
-							switch (opcode & 0xff00) {
-								case 0x9600: {	// ADIW -- Add Immediate to Word -- 1001 0110 KKpp KKKK
-									get_vp2_k6(opcode);
-									uint16_t res = vp + k;
-									STATE("adiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
-									_avr_set_r(avr, p + 1, res >> 8);
-									_avr_set_r(avr, p, res);
-									avr->sreg[S_V] = ((~vp & res) >> 15) & 1;
-									avr->sreg[S_C] = ((~res & vp) >> 15) & 1;
-									_avr_flags_zns16(avr, res);
-									SREG();
-									cycle++;
-								}	break;
-								case 0x9700: {	// SBIW -- Subtract Immediate from Word -- 1001 0111 KKpp KKKK
-									get_vp2_k6(opcode);
-									uint16_t res = vp - k;
-									STATE("sbiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
-									_avr_set_r(avr, p + 1, res >> 8);
-									_avr_set_r(avr, p, res);
-									avr->sreg[S_V] = ((vp & ~res) >> 15) & 1;
-									avr->sreg[S_C] = ((res & ~vp) >> 15) & 1;
-									_avr_flags_zns16(avr, res);
-									SREG();
-									cycle++;
-								}	break;
-								case 0x9800: {	// CBI -- Clear Bit in I/O Register -- 1001 1000 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & ~mask;
-									STATE("cbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
-									_avr_set_ram(avr, io, res);
-									cycle++;
-								}	break;
-								case 0x9900: {	// SBIC -- Skip if Bit in I/O Register is Cleared -- 1001 1001 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & mask;
-									STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
-									if (!res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
-											new_pc += 4; cycle += 2;
-										} else {
-											new_pc += 2; cycle++;
-										}
-									}
-								}	break;
-								case 0x9a00: {	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) | mask;
-									STATE("sbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
-									_avr_set_ram(avr, io, res);
-									cycle++;
-								}	break;
-								case 0x9b00: {	// SBIS -- Skip if Bit in I/O Register is Set -- 1001 1011 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & mask;
-									STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
-									if (res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
-											new_pc += 4; cycle += 2;
-										} else {
-											new_pc += 2; cycle++;
-										}
-									}
-								}	break;
-								default:
-									switch (opcode & 0xfc00) {
-										case 0x9c00: {	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
-											get_vd5_vr5(opcode);
-											uint16_t res = vd * vr;
-											STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-											cycle++;
-											_avr_set_r(avr, 0, res);
-											_avr_set_r(avr, 1, res >> 8);
-											avr->sreg[S_Z] = res == 0;
-											avr->sreg[S_C] = (res >> 15) & 1;
-											SREG();
-										}	break;
-										default: _avr_invalid_opcode(avr);
-									}
+AVR_OP(mov)	// MOV -- 0010 11rd dddd rrrr
+{
+	get_d5_vr5(i);
+	uint8_t res = vr;
+	STATE("mov %s, %s[%02x] = %02x\n", avr_regname(d), avr_regname(r), vr, res);
+	_avr_set_gpr(avr, d, res);
+	return new_pc;
+}
+
+AVR_OP(cpi)	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
+{
+	get_vh4_k8(i);
+	uint8_t res = vh - k;
+	STATE("cpi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+	_avr_flags_sub_zns(avr, res, vh, k);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(sbci)	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
+{
+	get_vh4_k8(i);
+	uint8_t res = vh - k - avr->sreg[S_C];
+	STATE("sbci %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
+	_avr_set_gpr(avr, h, res);
+	_avr_flags_sub_Rzns(avr, res, vh, k);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(subi)	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
+{
+	get_vh4_k8(i);
+	uint8_t res = vh - k;
+	STATE("subi %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
+	_avr_set_gpr(avr, h, res);
+	_avr_flags_sub_zns(avr, res, vh, k);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(ori)	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
+{
+	get_vh4_k8(i);
+	uint8_t res = vh | k;
+	STATE("ori %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+	_avr_set_gpr(avr, h, res);
+	_avr_flags_znv0s(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(andi)	// ANDI	-- Logical AND with Immediate -- 0111 kkkk hhhh kkkk
+{
+	get_vh4_k8(i);
+	uint8_t res = vh & k;
+	STATE("andi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+	_avr_set_gpr(avr, h, res);
+	_avr_flags_znv0s(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(ldd_z)	// LD (LDD) -- Load Indirect using Z -- 10q0 qq0d dddd 0qqq
+{
+	uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	get_d5_q6(i);
+	STATE("ld %s, (Z+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
+	_avr_set_gpr(avr, d, _avr_get_ram(avr, v+q));
+	return new_pc;
+}
+
+AVR_OP(std_z)	// ST (STD) -- Store Indirect using Z -- 10q0 qq1d dddd 0qqq
+{
+	uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	get_d5_q6(i);
+	STATE("st (Z+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
+	_avr_set_ram(avr, v+q, avr->data[d]);
+	return new_pc;
+}
+
+AVR_OP(ldd_y)	// LD (LDD) -- Load Indirect using Y -- 10q0 qq0d dddd 1qqq
+{
+	uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
+	get_d5_q6(i);
+	STATE("ld %s, (Y+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[d+q]);
+	_avr_set_gpr(avr, d, _avr_get_ram(avr, v+q));
+	return new_pc;
+}
+
+AVR_OP(std_y)	// ST (STD) -- Store Indirect using Y -- 10q0 qq1d dddd 1qqq
+{
+	uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
+	get_d5_q6(i);
+	STATE("st (Y+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
+	_avr_set_ram(avr, v+q, avr->data[d]);
+	return new_pc;
+}
+
+AVR_OP(sreg)	// BSET/BCLR -- all the SREG set/clear opcodes -- 1001 0100 Bsss 1000
+{
+	get_sreg_bit(i);
+	STATE("%s%c\n", i->r ? "se" : "cl", _sreg_bit_name[b]);
+	avr_sreg_set(avr, b, i->r);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(sleep)	// SLEEP -- 1001 0101 1000 1000
+{
+	STATE("sleep\n");
+	/* Don't sleep if there are interrupts about to be serviced.
+	 * Without this check, it was possible to incorrectly enter a state
+	 * in which the cpu was sleeping and interrupts were disabled. For more
+	 * details, see the commit message. */
+	if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
+		avr->state = cpu_Sleeping;
+	return new_pc;
+}
+
+AVR_OP(break)	// BREAK -- 1001 0101 1001 1000
+{
+	STATE("break\n");
+	if (avr->gdb) {
+		// if gdb is on, we break here as in here
+		// and we do so until gdb restores the instruction
+		// that was here before
+		avr->state = cpu_StepDone;
+		new_pc = avr->pc;
+		*cycle = 0;
+	}
+	return new_pc;
+}
+
+/*
+ * Not a real instruction, avr_core_set_stop() puts this in place of the
+ * one it stops in front of
+ */
+AVR_OP(stop)
+{
+	avr->state = cpu_StepDone;
+	*cycle = 0;
+	return avr->pc;
+}
+
+AVR_OP(wdr)	// WDR -- Watchdog Reset -- 1001 0101 1010 1000
+{
+	STATE("wdr\n");
+	avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
+	return new_pc;
+}
+
+AVR_OP(spm)	// SPM -- Store Program Memory -- 1001 0101 1110 1000
+{
+	STATE("spm\n");
+	/* note: this can re-decode the flash, including ourselves */
+	avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
+	return new_pc;
+}
+
+AVR_OP(ijmp)	// IJMP/EIJMP/ICALL/EICALL -- Indirect jump/call -- 1001 010p 000e 1001
+{
+	int e = i->d;
+	int p = i->r;
+	if (e && !avr->eind)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	if (e)
+		z |= avr->data[avr->eind] << 16;
+	STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
+	if (p)
+		*cycle += _avr_push_addr(avr, new_pc) - 1;
+	new_pc = z << 1;
+	TRACE_JUMP();
+	return new_pc;
+}
+
+AVR_OP(ret)	// RET -- Return -- 1001 0101 0000 1000
+{
+	new_pc = _avr_pop_addr(avr);
+	*cycle += 1 + avr->address_size;
+	STATE("ret%s\n", i->r ? "i" : "");
+	TRACE_JUMP();
+	STACK_FRAME_POP();
+	return new_pc;
+}
+
+AVR_OP(reti)	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
+{
+	avr_sreg_set(avr, S_I, 1);
+	avr_interrupt_reti(avr);
+	return _avr_op_ret(avr, i, new_pc, cycle);
+}
+
+AVR_OP(lpm0)	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
+{
+	uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	STATE("lpm %s, (Z[%04x])\n", avr_regname(0), z);
+	_avr_set_gpr(avr, 0, avr->flash[z]);
+	return new_pc;
+}
+
+AVR_OP(lds)	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
+{
+	get_d5(i);
+	uint16_t x = i->k;
+	new_pc += 2;
+	STATE("lds %s[%02x], 0x%04x\n", avr_regname(d), avr->data[d], x);
+	_avr_set_gpr(avr, d, _avr_get_ram(avr, x));
+	return new_pc;
+}
+
+AVR_OP(lpm)	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
+{
+	get_d5(i);
+	uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	int op = i->r;
+	STATE("lpm %s, (Z[%04x]%s)\n", avr_regname(d), z, op ? "+" : "");
+	_avr_set_gpr(avr, d, avr->flash[z]);
+	if (op) {
+		z++;
+		_avr_set_gpr(avr, R_ZH, z >> 8);
+		_avr_set_gpr(avr, R_ZL, z);
+	}
+	return new_pc;
+}
+
+AVR_OP(elpm)	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
+{
+	if (!avr->rampz)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
+	get_d5(i);
+	int op = i->r;
+	STATE("elpm %s, (Z[%02x:%04x]%s)\n", avr_regname(d), z >> 16, z & 0xffff, op ? "+" : "");
+	_avr_set_gpr(avr, d, avr->flash[z]);
+	if (op) {
+		z++;
+		_avr_set_r(avr, avr->rampz, z >> 16);
+		_avr_set_gpr(avr, R_ZH, z >> 8);
+		_avr_set_gpr(avr, R_ZL, z);
+	}
+	return new_pc;
+}
+
+/*
+ * Load store instructions
+ *
+ * 1001 00sr rrrr iioo
+ * s = 0 = load, 1 = store
+ * ii = 16 bits register index, 11 = X, 10 = Y, 00 = Z
+ * oo = 1) post increment, 2) pre-decrement
+ */
+AVR_OP(ld_x)	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
+{
+	int op = i->r;
+	get_d5(i);
+	uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
+	STATE("ld %s, %sX[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", x, op == 1 ? "++" : "");
+	if (op == 2) x--;
+	uint8_t vd = _avr_get_ram(avr, x);
+	if (op == 1) x++;
+	_avr_set_gpr(avr, R_XH, x >> 8);
+	_avr_set_gpr(avr, R_XL, x);
+	_avr_set_gpr(avr, d, vd);
+	return new_pc;
+}
+
+AVR_OP(st_x)	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
+{
+	int op = i->r;
+	get_vd5(i);
+	uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
+	STATE("st %sX[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", x, op == 1 ? "++" : "", avr_regname(d), vd);
+	if (op == 2) x--;
+	_avr_set_ram(avr, x, vd);
+	if (op == 1) x++;
+	_avr_set_gpr(avr, R_XH, x >> 8);
+	_avr_set_gpr(avr, R_XL, x);
+	return new_pc;
+}
+
+AVR_OP(ld_y)	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
+{
+	int op = i->r;
+	get_d5(i);
+	uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
+	STATE("ld %s, %sY[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", y, op == 1 ? "++" : "");
+	if (op == 2) y--;
+	uint8_t vd = _avr_get_ram(avr, y);
+	if (op == 1) y++;
+	_avr_set_gpr(avr, R_YH, y >> 8);
+	_avr_set_gpr(avr, R_YL, y);
+	_avr_set_gpr(avr, d, vd);
+	return new_pc;
+}
+
+AVR_OP(st_y)	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
+{
+	int op = i->r;
+	get_vd5(i);
+	uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
+	STATE("st %sY[%04x]%s, %s[%02x]\n", op == 2 ? "--" : "", y, op == 1 ? "++" : "", avr_regname(d), vd);
+	if (op == 2) y--;
+	_avr_set_ram(avr, y, vd);
+	if (op == 1) y++;
+	_avr_set_gpr(avr, R_YH, y >> 8);
+	_avr_set_gpr(avr, R_YL, y);
+	return new_pc;
+}
+
+AVR_OP(sts)	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
+{
+	get_vd5(i);
+	uint16_t x = i->k;
+	new_pc += 2;
+	STATE("sts 0x%04x, %s[%02x]\n", x, avr_regname(d), vd);
+	_avr_set_ram(avr, x, vd);
+	return new_pc;
+}
+
+AVR_OP(ld_z)	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
+{
+	int op = i->r;
+	get_d5(i);
+	uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
+	STATE("ld %s, %sZ[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", z, op == 1 ? "++" : "");
+	if (op == 2) z--;
+	uint8_t vd = _avr_get_ram(avr, z);
+	if (op == 1) z++;
+	_avr_set_gpr(avr, R_ZH, z >> 8);
+	_avr_set_gpr(avr, R_ZL, z);
+	_avr_set_gpr(avr, d, vd);
+	return new_pc;
+}
+
+AVR_OP(st_z)	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
+{
+	int op = i->r;
+	get_vd5(i);
+	uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
+	STATE("st %sZ[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", z, op == 1 ? "++" : "", avr_regname(d), vd);
+	if (op == 2) z--;
+	_avr_set_ram(avr, z, vd);
+	if (op == 1) z++;
+	_avr_set_gpr(avr, R_ZH, z >> 8);
+	_avr_set_gpr(avr, R_ZL, z);
+	return new_pc;
+}
+
+AVR_OP(pop)	// POP -- 1001 000d dddd 1111
+{
+	get_d5(i);
+	_avr_set_gpr(avr, d, _avr_pop8(avr));
+	T(uint16_t sp = _avr_sp_get(avr);)
+	STATE("pop %s (@%04x)[%02x]\n", avr_regname(d), sp, avr->data[sp]);
+	return new_pc;
+}
+
+AVR_OP(push)	// PUSH -- 1001 001d dddd 1111
+{
+	get_vd5(i);
+	_avr_push8(avr, vd);
+	T(uint16_t sp = _avr_sp_get(avr);)
+	STATE("push %s[%02x] (@%04x)\n", avr_regname(d), vd, sp);
+	return new_pc;
+}
+
+AVR_OP(com)	// COM -- One’s Complement -- 1001 010d dddd 0000
+{
+	get_vd5(i);
+	uint8_t res = 0xff - vd;
+	STATE("com %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_znv0s(avr, res);
+	avr->sreg[S_C] = 1;
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(neg)	// NEG -- Two’s Complement -- 1001 010d dddd 0001
+{
+	get_vd5(i);
+	uint8_t res = 0x00 - vd;
+	STATE("neg %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_gpr(avr, d, res);
+	avr->sreg[S_H] = ((res >> 3) | (vd >> 3)) & 1;
+	avr->sreg[S_V] = res == 0x80;
+	avr->sreg[S_C] = res != 0;
+	_avr_flags_zns(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(swap)	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
+{
+	get_vd5(i);
+	uint8_t res = (vd >> 4) | (vd << 4) ;
+	STATE("swap %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_gpr(avr, d, res);
+	return new_pc;
+}
+
+AVR_OP(inc)	// INC -- Increment -- 1001 010d dddd 0011
+{
+	get_vd5(i);
+	uint8_t res = vd + 1;
+	STATE("inc %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_gpr(avr, d, res);
+	avr->sreg[S_V] = res == 0x80;
+	_avr_flags_zns(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(asr)	// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
+{
+	get_vd5(i);
+	uint8_t res = (vd >> 1) | (vd & 0x80);
+	STATE("asr %s[%02x]\n", avr_regname(d), vd);
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_zcnvs(avr, res, vd);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(lsr)	// LSR -- Logical Shift Right -- 1001 010d dddd 0110
+{
+	get_vd5(i);
+	uint8_t res = vd >> 1;
+	STATE("lsr %s[%02x]\n", avr_regname(d), vd);
+	_avr_set_gpr(avr, d, res);
+	avr->sreg[S_N] = 0;
+	_avr_flags_zcvs(avr, res, vd);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(ror)	// ROR -- Rotate Right -- 1001 010d dddd 0111
+{
+	get_vd5(i);
+	uint8_t res = (avr->sreg[S_C] ? 0x80 : 0) | vd >> 1;
+	STATE("ror %s[%02x]\n", avr_regname(d), vd);
+	_avr_set_gpr(avr, d, res);
+	_avr_flags_zcnvs(avr, res, vd);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(dec)	// DEC -- Decrement -- 1001 010d dddd 1010
+{
+	get_vd5(i);
+	uint8_t res = vd - 1;
+	STATE("dec %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_gpr(avr, d, res);
+	avr->sreg[S_V] = res == 0x7f;
+	_avr_flags_zns(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(jmp)	// JMP -- Long Call to sub, 32 bits -- 1001 010a aaaa 110a
+{
+	avr_flashaddr_t a = i->k;
+	STATE("jmp 0x%06x\n", a);
+	new_pc = a << 1;
+	TRACE_JUMP();
+	return new_pc;
+}
+
+AVR_OP(call)	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
+{
+	avr_flashaddr_t a = i->k;
+	STATE("call 0x%06x\n", a);
+	new_pc += 2;
+	*cycle += _avr_push_addr(avr, new_pc);
+	new_pc = a << 1;
+	TRACE_JUMP();
+	STACK_FRAME_PUSH();
+	return new_pc;
+}
+
+AVR_OP(adiw)	// ADIW -- Add Immediate to Word -- 1001 0110 KKpp KKKK
+{
+	get_vp2_k6(i);
+	uint16_t res = vp + k;
+	STATE("adiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
+	_avr_set_gpr(avr, p + 1, res >> 8);
+	_avr_set_gpr(avr, p, res);
+	avr->sreg[S_V] = ((~vp & res) >> 15) & 1;
+	avr->sreg[S_C] = ((~res & vp) >> 15) & 1;
+	_avr_flags_zns16(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(sbiw)	// SBIW -- Subtract Immediate from Word -- 1001 0111 KKpp KKKK
+{
+	get_vp2_k6(i);
+	uint16_t res = vp - k;
+	STATE("sbiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
+	_avr_set_gpr(avr, p + 1, res >> 8);
+	_avr_set_gpr(avr, p, res);
+	avr->sreg[S_V] = ((vp & ~res) >> 15) & 1;
+	avr->sreg[S_C] = ((res & ~vp) >> 15) & 1;
+	_avr_flags_zns16(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(cbi)	// CBI -- Clear Bit in I/O Register -- 1001 1000 AAAA Abbb
+{
+	get_io5_b3mask(i);
+	uint8_t res = _avr_get_ram(avr, io) & ~mask;
+	STATE("cbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
+	_avr_set_ram(avr, io, res);
+	return new_pc;
+}
+
+AVR_OP(sbic)	// SBIC -- Skip if Bit in I/O Register is Cleared -- 1001 1001 AAAA Abbb
+{
+	get_io5_b3mask(i);
+	uint8_t res = _avr_get_ram(avr, io) & mask;
+	STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
+	if (!res) {
+		new_pc += i->skip;
+		*cycle += i->skip >> 1;
+	}
+	return new_pc;
+}
+
+AVR_OP(sbi)	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
+{
+	get_io5_b3mask(i);
+	uint8_t res = _avr_get_ram(avr, io) | mask;
+	STATE("sbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
+	_avr_set_ram(avr, io, res);
+	return new_pc;
+}
+
+AVR_OP(sbis)	// SBIS -- Skip if Bit in I/O Register is Set -- 1001 1011 AAAA Abbb
+{
+	get_io5_b3mask(i);
+	uint8_t res = _avr_get_ram(avr, io) & mask;
+	STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
+	if (res) {
+		new_pc += i->skip;
+		*cycle += i->skip >> 1;
+	}
+	return new_pc;
+}
+
+AVR_OP(mul)	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
+{
+	get_vd5_vr5(i);
+	uint16_t res = vd * vr;
+	STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_set_gpr(avr, 0, res);
+	_avr_set_gpr(avr, 1, res >> 8);
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_C] = (res >> 15) & 1;
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(out)	// OUT A,Rr -- 1011 1AAd dddd AAAA
+{
+	get_d5_a6(i);
+	STATE("out %s, %s[%02x]\n", avr_regname(A), avr_regname(d), avr->data[d]);
+	_avr_set_ram(avr, A, avr->data[d]);
+	return new_pc;
+}
+
+AVR_OP(in)	// IN Rd,A -- 1011 0AAd dddd AAAA
+{
+	get_d5_a6(i);
+	STATE("in %s, %s[%02x]\n", avr_regname(d), avr_regname(A), avr->data[A]);
+	_avr_set_gpr(avr, d, _avr_get_ram(avr, A));
+	return new_pc;
+}
+
+AVR_OP(rjmp)	// RJMP -- 1100 kkkk kkkk kkkk
+{
+	get_o12(i);
+	STATE("rjmp .%d [%04x]\n", o >> 1, new_pc + o);
+	new_pc = new_pc + o;
+	TRACE_JUMP();
+	return new_pc;
+}
+
+AVR_OP(rcall)	// RCALL -- 1101 kkkk kkkk kkkk
+{
+	get_o12(i);
+	STATE("rcall .%d [%04x]\n", o >> 1, new_pc + o);
+	*cycle += _avr_push_addr(avr, new_pc);
+	new_pc = new_pc + o;
+	// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
+	if (o != 0) {
+		TRACE_JUMP();
+		STACK_FRAME_PUSH();
+	}
+	return new_pc;
+}
+
+AVR_OP(ldi)	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
+{
+	get_h4_k8(i);
+	STATE("ldi %s, 0x%02x\n", avr_regname(h), k);
+	_avr_set_gpr(avr, h, k);
+	return new_pc;
+}
+
+AVR_OP(brxs)	// BRXC/BRXS -- All the SREG branches -- 1111 0Boo oooo osss
+{
+	int16_t o = (int16_t)i->k; // offset
+	uint8_t s = i->d;
+	int set = i->r;		// BRXS, otherwise BRXC
+	int branch = (avr->sreg[s] && set) || (!avr->sreg[s] && !set);
+#if CONFIG_SIMAVR_TRACE
+	const char *names[2][8] = {
+			{ "brcc", "brne", "brpl", "brvc", NULL, "brhc", "brtc", "brid"},
+			{ "brcs", "breq", "brmi", "brvs", NULL, "brhs", "brts", "brie"},
+	};
+	if (names[set][s]) {
+		STATE("%s .%d [%04x]\t; Will%s branch\n", names[set][s], o, new_pc + (o << 1), branch ? "":" not");
+	} else {
+		STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
+	}
+#endif
+	if (branch) {
+		(*cycle)++; // 2 cycles if taken, 1 otherwise
+		new_pc = new_pc + (o << 1);
+	}
+	return new_pc;
+}
+
+AVR_OP(bld)	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
+{
+	get_vd5_s3_mask(i);
+	uint8_t v = (vd & ~mask) | (avr->sreg[S_T] ? mask : 0);
+	STATE("bld %s[%02x], 0x%02x = %02x\n", avr_regname(d), vd, mask, v);
+	_avr_set_gpr(avr, d, v);
+	return new_pc;
+}
+
+AVR_OP(bst)	// BST -- Bit Store into T from bit in Register -- 1111 101d dddd 0bbb
+{
+	get_vd5_s3(i)
+	STATE("bst %s[%02x], 0x%02x\n", avr_regname(d), vd, 1 << s);
+	avr->sreg[S_T] = (vd >> s) & 1;
+	SREG();
+	return new_pc;
+}
+
+AVR_OP(sbrx)	// SBRS/SBRC -- Skip if Bit in Register is Set/Clear -- 1111 11sd dddd 0bbb
+{
+	get_vd5_s3_mask(i)
+	int set = i->k;
+	int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
+	STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
+	if (branch) {
+		new_pc += i->skip;
+		*cycle += i->skip >> 1;
+	}
+	return new_pc;
+}
+
+/*
+ * The calls and returns, telling the call graph profiler. The decoder only
+ * puts these in while one is running, see avr_callgraph_start()
+ */
+AVR_OP(cg_call)
+{
+	new_pc = _avr_op_call(avr, i, new_pc, cycle);
+	avr_callgraph_call(avr->callgraph, avr->cycle + *cycle, new_pc);
+	return new_pc;
+}
+
+AVR_OP(cg_rcall)
+{
+	avr_flashaddr_t ret = new_pc;
+	new_pc = _avr_op_rcall(avr, i, new_pc, cycle);
+	if (new_pc != ret)	// not 'rcall .+0'
+		avr_callgraph_call(avr->callgraph, avr->cycle + *cycle, new_pc);
+	return new_pc;
+}
+
+AVR_OP(cg_icall)
+{
+	new_pc = _avr_op_ijmp(avr, i, new_pc, cycle);
+	avr_callgraph_call(avr->callgraph, avr->cycle + *cycle, new_pc);
+	return new_pc;
+}
+
+AVR_OP(cg_ret)
+{
+	new_pc = _avr_op_ret(avr, i, new_pc, cycle);
+	avr_callgraph_return(avr->callgraph, avr->cycle + *cycle);
+	return new_pc;
+}
+
+AVR_OP(cg_reti)
+{
+	new_pc = _avr_op_reti(avr, i, new_pc, cycle);
+	avr_callgraph_return(avr->callgraph, avr->cycle + *cycle);
+	return new_pc;
+}
+
+/*
+ * List of all the instruction handlers, used to give each of them an index
+ * (avr_insn_t.op), for the superblocks and the performance counters
+ */
+#define AVR_OPS(_) \
+	_(invalid) _(nop) _(cpc) _(add) _(sbc) _(movw) _(muls) _(fmul) \
+	_(sub) _(cpse) _(cp) _(adc) _(and) _(eor) _(or) _(mov) \
+	_(cpi) _(sbci) _(subi) _(ori) _(andi) _(ldd_z) _(std_z) _(ldd_y) \
+	_(std_y) _(sreg) _(sleep) _(break) _(wdr) _(spm) _(ijmp) _(ret) \
+	_(reti) _(lpm0) _(lds) _(lpm) _(elpm) _(ld_x) _(st_x) _(ld_y) \
+	_(st_y) _(sts) _(ld_z) _(st_z) _(pop) _(push) _(com) _(neg) \
+	_(swap) _(inc) _(asr) _(lsr) _(ror) _(dec) _(jmp) _(call) \
+	_(adiw) _(sbiw) _(cbi) _(sbic) _(sbi) _(sbis) _(mul) _(out) \
+	_(in) _(rjmp) _(rcall) _(ldi) _(brxs) _(bld) _(bst) _(sbrx) \
+	_(cg_call) _(cg_rcall) _(cg_icall) _(cg_ret) _(cg_reti) _(stop)
+
+enum {
+#define _AVR_OP_INDEX(_name) avr_op_##_name,
+	AVR_OPS(_AVR_OP_INDEX)
+#undef _AVR_OP_INDEX
+	avr_op_count
+};
+
+// avr_perf_stats_t has to have room for all of them
+extern char _avr_perf_ops_fit[avr_op_count <= AVR_PERF_MAX_OPS ? 1 : -1];
+
+const char * avr_perf_op_name(unsigned op)
+{
+	static const char * const names[avr_op_count] = {
+#define _AVR_OP_NAME(_name) #_name,
+		AVR_OPS(_AVR_OP_NAME)
+#undef _AVR_OP_NAME
+	};
+	return op < avr_op_count ? names[op] : NULL;
+}
+
+static avr_flashaddr_t (* const _avr_op_handlers[avr_op_count])(avr_t * avr,
+		const avr_insn_t * i, avr_flashaddr_t new_pc, int * cycle) = {
+#define _AVR_OP_HANDLER(_name) [avr_op_##_name] = _avr_op_##_name,
+	AVR_OPS(_AVR_OP_HANDLER)
+#undef _AVR_OP_HANDLER
+};
+
+/*
+ * Handler of every instruction while avr_perf_count_ops() is on, runs the
+ * real one and counts it
+ */
+static avr_flashaddr_t _avr_op_count(avr_t * avr, const avr_insn_t * i,
+		avr_flashaddr_t new_pc, int * cycle)
+{
+	new_pc = _avr_op_handlers[i->op](avr, i, new_pc, cycle);
+	avr->perf.ops[i->op].count++;
+	avr->perf.ops[i->op].cycles += *cycle;
+	return new_pc;
+}
+
+/*
+ * The instructions that only touch the registers, flash and SREG (but not
+ * the I bit), have a fixed cycle count and always fall through to the next
+ * word. Runs of these form the "superblocks" of avr_insn_t.block, which the
+ * core can run in one go, see _avr_run_block()
+ */
+#define AVR_BLOCK_OPS(_) \
+	_(nop) _(cpc) _(add) _(sbc) _(movw) _(muls) _(fmul) _(sub) \
+	_(cp) _(adc) _(and) _(eor) _(or) _(mov) _(cpi) _(sbci) \
+	_(subi) _(ori) _(andi) _(lpm0) _(lpm) _(com) _(neg) _(swap) \
+	_(inc) _(asr) _(lsr) _(ror) _(dec) _(adiw) _(sbiw) _(mul) \
+	_(ldi) _(bld) _(bst)
+
+/*
+ * Main opcode decoder
+ * 
+ * The decoder was written by following the datasheet in no particular order.
+ * As I went along, I noticed "bit patterns" that could be used to factor opcodes
+ * However, a lot of these only became apparent later on, so SOME instructions
+ * (skip of bit set etc) are compact, and some could use some refactoring (the ALU
+ * ones scream to be factored).
+ * I assume that the decoder could easily be 2/3 of it's current size.
+ * 
+ * + It lacks the "extended" XMega jumps. 
+ * + It also doesn't check whether the core it's
+ *   emulating is supposed to have the fancy instructions, like multiply and such.
+ * 
+ * The number of cycles taken by instruction has been added, but might not be
+ * entirely accurate.
+ *
+ * This is only run when flash is loaded or modified; it fills in the handler,
+ * operands and base cycle count for the instruction at 'pc', and avr_run_one()
+ * then runs straight from that.
+ */
+static void _avr_decode_one(avr_t * avr, avr_flashaddr_t pc, avr_insn_t * i)
+{
+	uint32_t		opcode = (avr->flash[pc + 1] << 8) | avr->flash[pc];
+	// second word of the 32 bits instructions
+	uint16_t		x = pc + 3 <= avr->flashend ? (avr->flash[pc + 3] << 8) | avr->flash[pc + 2] : 0xffff;
+
+#define OP(_name, _cycles) { i->handler = _avr_op_##_name; i->op = avr_op_##_name; i->cycles = (_cycles); }
+	memset(i, 0, sizeof(*i));
+	i->skip = _avr_is_instruction_32_bits(avr, pc + 2) ? 4 : 2;
+	OP(invalid, 1);
+
+	switch (opcode & 0xf000) {
+		case 0x0000: {
+			switch (opcode) {
+				case 0x0000: OP(nop, 1); break;	// NOP
+				default: {
+					switch (opcode & 0xfc00) {
+						case 0x0400:	// CPC -- Compare with carry -- 0000 01rd dddd rrrr
+						case 0x0c00:	// ADD -- Add without carry -- 0000 11rd dddd rrrr
+						case 0x0800: {	// SBC -- Subtract with carry -- 0000 10rd dddd rrrr
+							i->d = (opcode >> 4) & 0x1f;
+							i->r = ((opcode >> 5) & 0x10) | (opcode & 0xf);
+							switch (opcode & 0xfc00) {
+								case 0x0400: OP(cpc, 1); break;
+								case 0x0c00: OP(add, 1); break;
+								case 0x0800: OP(sbc, 1); break;
 							}
 						}	break;
+						default:
+							switch (opcode & 0xff00) {
+								case 0x0100: {	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
+									i->d = ((opcode >> 4) & 0xf) << 1;
+									i->r = ((opcode) & 0xf) << 1;
+									OP(movw, 1);
+								}	break;
+								case 0x0200: {	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
+									i->r = 16 + (opcode & 0xf);
+									i->d = 16 + ((opcode >> 4) & 0xf);
+									OP(muls, 2);
+								}	break;
+								case 0x0300: {	// MUL -- Multiply -- 0000 0011 fddd frrr
+									i->r = 16 + (opcode & 0x7);
+									i->d = 16 + ((opcode >> 4) & 0x7);
+									i->k = opcode & 0x88;
+									OP(fmul, 2);
+								}	break;
+							}
 					}
-				}	break;
+				}
 			}
 		}	break;
 
-		case 0xb000: {
-			switch (opcode & 0xf800) {
-				case 0xb800: {	// OUT A,Rr -- 1011 1AAd dddd AAAA
-					get_d5_a6(opcode);
-					STATE("out %s, %s[%02x]\n", avr_regname(A), avr_regname(d), avr->data[d]);
-					_avr_set_ram(avr, A, avr->data[d]);
-				}	break;
-				case 0xb000: {	// IN Rd,A -- 1011 0AAd dddd AAAA
-					get_d5_a6(opcode);
-					STATE("in %s, %s[%02x]\n", avr_regname(d), avr_regname(A), avr->data[A]);
-					_avr_set_r(avr, d, _avr_get_ram(avr, A));
-				}	break;
-				default: _avr_invalid_opcode(avr);
+		case 0x1000:	// SUB, CPSE, CP, ADC -- 0001 xxrd dddd rrrr
+		case 0x2000: {	// AND, EOR, OR, MOV -- 0010 xxrd dddd rrrr
+			i->d = (opcode >> 4) & 0x1f;
+			i->r = ((opcode >> 5) & 0x10) | (opcode & 0xf);
+			switch (opcode & 0xfc00) {
+				case 0x1800: OP(sub, 1); break;
+				case 0x1000: OP(cpse, 1); break;
+				case 0x1400: OP(cp, 1); break;
+				case 0x1c00: OP(adc, 1); break;
+				case 0x2000: OP(and, 1); break;
+				case 0x2400: OP(eor, 1); break;
+				case 0x2800: OP(or, 1); break;
+				case 0x2c00: OP(mov, 1); break;
 			}
 		}	break;
 
-		case 0xc000: {	// RJMP -- 1100 kkkk kkkk kkkk
-			get_o12(opcode);
-			STATE("rjmp .%d [%04x]\n", o >> 1, new_pc + o);
-			new_pc = new_pc + o;
-			cycle++;
-			TRACE_JUMP();
+		case 0x3000:	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
+		case 0x4000:	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
+		case 0x5000:	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
+		case 0x6000:	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
+		case 0x7000:	// ANDI	-- Logical AND with Immediate -- 0111 kkkk hhhh kkkk
+		case 0xe000: {	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
+			i->d = 16 + ((opcode >> 4) & 0xf);
+			i->k = ((opcode & 0x0f00) >> 4) | (opcode & 0xf);
+			switch (opcode & 0xf000) {
+				case 0x3000: OP(cpi, 1); break;
+				case 0x4000: OP(sbci, 1); break;
+				case 0x5000: OP(subi, 1); break;
+				case 0x6000: OP(ori, 1); break;
+				case 0x7000: OP(andi, 1); break;
+				case 0xe000: OP(ldi, 1); break;
+			}
 		}	break;
 
-		case 0xd000: {	// RCALL -- 1101 kkkk kkkk kkkk
-			get_o12(opcode);
-			STATE("rcall .%d [%04x]\n", o >> 1, new_pc + o);
-			cycle += _avr_push_addr(avr, new_pc);
-			new_pc = new_pc + o;
-			// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
-			if (o != 0) {
-				TRACE_JUMP();
-				STACK_FRAME_PUSH();
+		case 0xa000:
+		case 0x8000: {
+			/*
+			 * Load (LDD/STD) store instructions
+			 *
+			 * 10q0 qqsd dddd yqqq
+			 * s = 0 = load, 1 = store
+			 * y = 16 bits register index, 1 = Y, 0 = X
+			 * q = 6 bit displacement
+			 */
+			i->d = (opcode >> 4) & 0x1f;
+			i->k = ((opcode & 0x2000) >> 8) | ((opcode & 0x0c00) >> 7) | (opcode & 0x7);
+			switch (opcode & 0xd008) {
+				case 0xa000:
+				case 0x8000:	// LD (LDD) -- Load Indirect using Z -- 10q0 qqsd dddd yqqq
+					if (opcode & 0x0200)
+						OP(std_z, 2)	// 2 cycles, 3 for tinyavr
+					else
+						OP(ldd_z, 2)
+					break;
+				case 0xa008:
+				case 0x8008:	// LD (LDD) -- Load Indirect using Y -- 10q0 qqsd dddd yqqq
+					if (opcode & 0x0200)
+						OP(std_y, 2)	// 2 cycles, 3 for tinyavr
+					else
+						OP(ldd_y, 2)
+					break;
 			}
 		}	break;
 
-		case 0xe000: {	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
-			get_h4_k8(opcode);
-			STATE("ldi %s, 0x%02x\n", avr_regname(h), k);
-			_avr_set_r(avr, h, k);
+		case 0x9000: {
+			/* this is an annoying special case, but at least these lines handle all the SREG set/clear opcodes */
+			if ((opcode & 0xff0f) == 0x9408) {
+				i->d = (opcode >> 4) & 7;
+				i->r = (opcode & 0x0080) == 0;
+				OP(sreg, 1);
+			} else switch (opcode) {
+				case 0x9588: OP(sleep, 1); break;	// SLEEP -- 1001 0101 1000 1000
+				case 0x9598: OP(break, 1); break;	// BREAK -- 1001 0101 1001 1000
+				case 0x95a8: OP(wdr, 1); break;		// WDR -- Watchdog Reset -- 1001 0101 1010 1000
+				case 0x95e8: OP(spm, 1); break;		// SPM -- Store Program Memory -- 1001 0101 1110 1000
+				case 0x9409:   // IJMP -- Indirect jump -- 1001 0100 0000 1001
+				case 0x9419:   // EIJMP -- Indirect jump -- 1001 0100 0001 1001   bit 4 is "indirect"
+				case 0x9509:   // ICALL -- Indirect Call to Subroutine -- 1001 0101 0000 1001
+				case 0x9519: { // EICALL -- Indirect Call to Subroutine -- 1001 0101 0001 1001   bit 8 is "push pc"
+					i->d = (opcode & 0x10) != 0;
+					i->r = (opcode & 0x100) != 0;
+					OP(ijmp, 2);
+				}	break;
+				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
+					i->r = 1;
+					OP(reti, 1);
+					break;
+				case 0x9508: OP(ret, 1); break;	// RET -- Return -- 1001 0101 0000 1000
+				case 0x95c8: OP(lpm0, 3); break;	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
+				default:  {
+					i->d = (opcode >> 4) & 0x1f;
+					switch (opcode & 0xfe0f) {
+						case 0x9000: {	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
+							i->k = x;
+							OP(lds, 2);
+						}	break;
+						case 0x9005:
+						case 0x9004: {	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
+							i->r = opcode & 1;
+							OP(lpm, 3);
+						}	break;
+						case 0x9006:
+						case 0x9007: {	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
+							i->r = opcode & 1;
+							OP(elpm, 3);
+						}	break;
+						case 0x900c:
+						case 0x900d:
+						case 0x900e:	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
+							i->r = opcode & 3;
+							OP(ld_x, 2);	// 2 cycles (1 for tinyavr, except with inc/dec 2)
+							break;
+						case 0x920c:
+						case 0x920d:
+						case 0x920e:	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
+							i->r = opcode & 3;
+							OP(st_x, 2);	// 2 cycles, except tinyavr
+							break;
+						case 0x9009:
+						case 0x900a:	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
+							i->r = opcode & 3;
+							OP(ld_y, 2);
+							break;
+						case 0x9209:
+						case 0x920a:	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
+							i->r = opcode & 3;
+							OP(st_y, 2);
+							break;
+						case 0x9200: {	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
+							i->k = x;
+							OP(sts, 2);
+						}	break;
+						case 0x9001:
+						case 0x9002:	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
+							i->r = opcode & 3;
+							OP(ld_z, 2);
+							break;
+						case 0x9201:
+						case 0x9202:	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
+							i->r = opcode & 3;
+							OP(st_z, 2);
+							break;
+						case 0x900f: OP(pop, 2); break;		// POP -- 1001 000d dddd 1111
+						case 0x920f: OP(push, 2); break;	// PUSH -- 1001 001d dddd 1111
+						case 0x9400: OP(com, 1); break;		// COM -- One’s Complement -- 1001 010d dddd 0000
+						case 0x9401: OP(neg, 1); break;		// NEG -- Two’s Complement -- 1001 010d dddd 0001
+						case 0x9402: OP(swap, 1); break;	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
+						case 0x9403: OP(inc, 1); break;		// INC -- Increment -- 1001 010d dddd 0011
+						case 0x9405: OP(asr, 1); break;		// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
+						case 0x9406: OP(lsr, 1); break;		// LSR -- Logical Shift Right -- 1001 010d dddd 0110
+						case 0x9407: OP(ror, 1); break;		// ROR -- Rotate Right -- 1001 010d dddd 0111
+						case 0x940a: OP(dec, 1); break;		// DEC -- Decrement -- 1001 010d dddd 1010
+						case 0x940c:
+						case 0x940d: {	// JMP -- Long Call to sub, 32 bits -- 1001 010a aaaa 110a
+							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
+							i->k = (a << 16) | x;
+							OP(jmp, 3);
+						}	break;
+						case 0x940e:
+						case 0x940f: {	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
+							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
+							i->k = (a << 16) | x;
+							OP(call, 2);
+						}	break;
+
+						default: {
+							switch (opcode & 0xff00) {
+								case 0x9600:	// ADIW -- Add Immediate to Word -- 1001 0110 KKpp KKKK
+								case 0x9700: {	// SBIW -- Subtract Immediate from Word -- 1001 0111 KKpp KKKK
+									i->d = 24 + ((opcode >> 3) & 0x6);
+									i->k = ((opcode & 0x00c0) >> 2) | (opcode & 0xf);
+									if (opcode & 0x0100)
+										OP(sbiw, 2)
+									else
+										OP(adiw, 2)
+								}	break;
+								case 0x9800:	// CBI -- Clear Bit in I/O Register -- 1001 1000 AAAA Abbb
+								case 0x9900:	// SBIC -- Skip if Bit in I/O Register is Cleared -- 1001 1001 AAAA Abbb
+								case 0x9a00:	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
+								case 0x9b00: {	// SBIS -- Skip if Bit in I/O Register is Set -- 1001 1011 AAAA Abbb
+									i->d = ((opcode >> 3) & 0x1f) + 32;
+									i->r = opcode & 0x7;
+									switch (opcode & 0xff00) {
+										case 0x9800: OP(cbi, 2); break;
+										case 0x9900: OP(sbic, 1); break;
+										case 0x9a00: OP(sbi, 2); break;
+										case 0x9b00: OP(sbis, 1); break;
+									}
+								}	break;
+								default:
+									switch (opcode & 0xfc00) {
+										case 0x9c00: {	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
+											i->r = ((opcode >> 5) & 0x10) | (opcode & 0xf);
+											OP(mul, 2);
+										}	break;
+									}
+							}
+						}	break;
+					}
+				}	break;
+			}
+		}	break;
+
+		case 0xb000: {	// OUT A,Rr -- 1011 1AAd dddd AAAA / IN Rd,A -- 1011 0AAd dddd AAAA
+			i->d = (opcode >> 4) & 0x1f;
+			i->k = ((((opcode >> 9) & 3) << 4) | ((opcode) & 0xf)) + 32;
+			if (opcode & 0x0800)
+				OP(out, 1)
+			else
+				OP(in, 1)
+		}	break;
+
+		case 0xc000:	// RJMP -- 1100 kkkk kkkk kkkk
+		case 0xd000: {	// RCALL -- 1101 kkkk kkkk kkkk
+			//	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
+			i->k = (uint16_t)(((int16_t)((opcode << 4) & 0xffff)) >> 3);
+			if (opcode & 0x1000)
+				OP(rcall, 1)
+			else
+				OP(rjmp, 2)
 		}	break;
 
 		case 0xf000: {
@@ -1333,59 +1884,443 @@ run_one_again:
 				case 0xf200:
 				case 0xf400:
 				case 0xf600: {	// BRXC/BRXS -- All the SREG branches -- 1111 0Boo oooo osss
-					int16_t o = ((int16_t)(opcode << 6)) >> 9; // offset
-					uint8_t s = opcode & 7;
-					int set = (opcode & 0x0400) == 0;		// this bit means BRXC otherwise BRXS
-					int branch = (avr->sreg[s] && set) || (!avr->sreg[s] && !set);
-					const char *names[2][8] = {
-							{ "brcc", "brne", "brpl", "brvc", NULL, "brhc", "brtc", "brid"},
-							{ "brcs", "breq", "brmi", "brvs", NULL, "brhs", "brts", "brie"},
-					};
-					if (names[set][s]) {
-						STATE("%s .%d [%04x]\t; Will%s branch\n", names[set][s], o, new_pc + (o << 1), branch ? "":" not");
-					} else {
-						STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
-					}
-					if (branch) {
-						cycle++; // 2 cycles if taken, 1 otherwise
-						new_pc = new_pc + (o << 1);
-					}
+					i->k = (uint16_t)(((int16_t)(opcode << 6)) >> 9); // offset
+					i->d = opcode & 7;
+					i->r = (opcode & 0x0400) == 0;		// this bit means BRXC otherwise BRXS
+					OP(brxs, 1);
 				}	break;
 				case 0xf800:
-				case 0xf900: {	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
-					get_vd5_s3_mask(opcode);
-					uint8_t v = (vd & ~mask) | (avr->sreg[S_T] ? mask : 0);
-					STATE("bld %s[%02x], 0x%02x = %02x\n", avr_regname(d), vd, mask, v);
-					_avr_set_r(avr, d, v);
-				}	break;
+				case 0xf900:	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
 				case 0xfa00:
-				case 0xfb00:{	// BST -- Bit Store into T from bit in Register -- 1111 101d dddd 0bbb
-					get_vd5_s3(opcode)
-					STATE("bst %s[%02x], 0x%02x\n", avr_regname(d), vd, 1 << s);
-					avr->sreg[S_T] = (vd >> s) & 1;
-					SREG();
-				}	break;
+				case 0xfb00:	// BST -- Bit Store into T from bit in Register -- 1111 101d dddd 0bbb
 				case 0xfc00:
 				case 0xfe00: {	// SBRS/SBRC -- Skip if Bit in Register is Set/Clear -- 1111 11sd dddd 0bbb
-					get_vd5_s3_mask(opcode)
-					int set = (opcode & 0x0200) != 0;
-					int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
-					STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
-					if (branch) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
-							new_pc += 4; cycle += 2;
-						} else {
-							new_pc += 2; cycle++;
-						}
+					i->d = (opcode >> 4) & 0x1f;
+					i->r = opcode & 7;
+					i->k = (opcode & 0x0200) != 0;
+					switch (opcode & 0xfe00) {
+						case 0xf800: OP(bld, 1); break;
+						case 0xfa00: OP(bst, 1); break;
+						default: OP(sbrx, 1); break;
 					}
 				}	break;
-				default: _avr_invalid_opcode(avr);
 			}
 		}	break;
+	}
+#undef OP
+
+	// while the call graph profiler runs it's told about calls and returns
+#define CG(_name) { i->handler = _avr_op_cg_##_name; i->op = avr_op_cg_##_name; }
+	if (avr->callgraph) {
+		switch (i->op) {
+			case avr_op_call: CG(call); break;
+			case avr_op_rcall: CG(rcall); break;
+			case avr_op_ijmp: if (i->r) CG(icall); break;	// not ijmp/eijmp
+			case avr_op_ret: CG(ret); break;
+			case avr_op_reti: CG(reti); break;
+		}
+	}
+#undef CG
+	if (avr->perf_ops)
+		i->handler = _avr_op_count;
+}
+
+static int _avr_insn_is_block(const avr_insn_t * i)
+{
+	switch (i->op) {
+#define _AVR_OP_BLOCK(_name) case avr_op_##_name:
+		AVR_BLOCK_OPS(_AVR_OP_BLOCK)
+#undef _AVR_OP_BLOCK
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Maximum length of a superblock; longer runs are just split
+ */
+#define AVR_BLOCK_MAX	1024
+
+/*
+ * Delay and polling loops the core can fast forward, see _avr_run_loop().
+ * Only the shapes avr-gcc and avr-libc actually emit are recognised:
+ *   counted: "sbiw rp,k", "dec rd" or "subi rd,k" followed by up to three
+ *            "sbci rn,0", then "brne" back to the start
+ *   polling: "sbis/sbic io,b; rjmp", "in rd,io; sbrs/sbrc rd,b; rjmp" or
+ *            "in rd,io; andi rd,k; breq/brne" back to the start
+ */
+enum {
+	AVR_LOOP_NONE = 0,
+	AVR_LOOP_COUNT,
+	AVR_LOOP_POLL,
+};
+
+static int _avr_decode_loop(avr_t * avr, avr_flashaddr_t pc, uint8_t * cycles)
+{
+	const avr_insn_t * i = &avr->decode[pc >> 1];
+	int kind = AVR_LOOP_NONE;
+	int n = 1;	// instructions before the branch back
+
+	switch (i->op) {
+		case avr_op_sbiw:
+		case avr_op_subi:
+			if (!i->k)
+				break;
+			// fall through
+		case avr_op_dec:
+			kind = AVR_LOOP_COUNT;
+			if (i->op != avr_op_subi)
+				break;
+			// the counter bytes have to be distinct registers
+			for (; n < 4 && pc + (n << 1) < avr->flashend &&
+					i[n].op == avr_op_sbci && i[n].k == 0; n++) {
+				for (int j = 0; j < n; j++)
+					if (i[j].d == i[n].d)
+						return AVR_LOOP_NONE;
+			}
+			break;
+		case avr_op_sbis:
+		case avr_op_sbic:
+			kind = AVR_LOOP_POLL;
+			break;
+		case avr_op_in:
+			if (i->k == R_SREG || pc + 2 >= avr->flashend)
+				break;
+			if ((i[1].op == avr_op_sbrx || i[1].op == avr_op_andi) && i[1].d == i->d) {
+				kind = AVR_LOOP_POLL;
+				n = 2;
+			}
+			break;
+	}
+	if (kind == AVR_LOOP_NONE || pc + (n << 1) >= avr->flashend)
+		return AVR_LOOP_NONE;
+
+	const avr_insn_t * b = &i[n];
+	avr_flashaddr_t next = pc + (n << 1) + 2;
+	int back;
+	if (b->op == avr_op_rjmp)
+		back = kind == AVR_LOOP_POLL && i[n - 1].op != avr_op_andi &&
+				next + (int16_t)b->k == pc;
+	else if (b->op == avr_op_brxs)	// brne, or breq after andi
+		back = b->d == S_Z && (b->r == 0 || i[n - 1].op == avr_op_andi) &&
+				(kind == AVR_LOOP_COUNT || i[n - 1].op == avr_op_andi) &&
+				next + ((int16_t)b->k << 1) == pc;
+	else
+		back = 0;
+	if (!back)
+		return AVR_LOOP_NONE;
+
+	// one pass, with the branch back taken
+	*cycles = b->cycles + (b->op == avr_op_brxs);
+	for (int j = 0; j < n; j++)
+		*cycles += i[j].cycles;
+	return kind;
+}
+
+/*
+ * Works out the superblocks and loops again after the decoded instructions
+ * from 'addr' to 'end' have changed
+ */
+static void _avr_decode_runs(avr_t * avr, avr_flashaddr_t addr, avr_flashaddr_t end)
+{
+	/*
+	 * Superblocks are worked out backward from the end of each run, so the
+	 * ones starting before the modified area might have changed too; walk
+	 * back until they don't.
+	 */
+	for (avr_flashaddr_t pc = end; pc >= 2; ) {
+		pc -= 2;
+		avr_insn_t * i = &avr->decode[pc >> 1];
+		const avr_insn_t * next = pc + 2 < avr->flashend ? i + 1 : NULL;
+		uint16_t block = 0, block_cycles = 0;
+		if (_avr_insn_is_block(i)) {
+			block = 1;
+			block_cycles = i->cycles;
+			if (next && next->block && next->block < AVR_BLOCK_MAX) {
+				block += next->block;
+				block_cycles += next->block_cycles;
+			}
+		}
+		if (pc < addr && i->block == block && i->block_cycles == block_cycles)
+			break;
+		i->block = block;
+		i->block_cycles = block_cycles;
+	}
+	// loops span a few words, so the ones starting just before can change
+	for (avr_flashaddr_t pc = addr >= 8 ? addr - 8 : 0; pc < end; pc += 2) {
+		avr_insn_t * i = &avr->decode[pc >> 1];
+		i->loop = _avr_decode_loop(avr, pc, &i->loop_cycles);
+	}
+}
+
+void avr_decode_flash(avr_t * avr, avr_flashaddr_t addr, uint32_t size)
+{
+	if (!avr->decode || !size)
+		return;
+	avr_flashaddr_t end = (addr + size + 1) & ~1;
+	if (end > avr->flashend + 1)
+		end = avr->flashend + 1;
+	/*
+	 * The word just before the modified area can be a skip or a 32 bits
+	 * instruction, both of which depend on the first word we are changing
+	 */
+	addr &= ~1;
+	if (addr >= 2)
+		addr -= 2;
+	for (avr_flashaddr_t pc = addr; pc < end; pc += 2)
+		_avr_decode_one(avr, pc, &avr->decode[pc >> 1]);
+	_avr_decode_runs(avr, addr, end);
+}
+
+void avr_core_set_stop(avr_t * avr, avr_flashaddr_t pc)
+{
+	pc &= ~1;
+	if (!avr->decode || pc >= avr->flashend)
+		return;
+	// the decode no longer matches the flash, other instances keep theirs
+	avr_flash_unshare(avr);
+	avr_insn_t * i = &avr->decode[pc >> 1];
+	i->handler = _avr_op_stop;
+	i->op = avr_op_stop;
+	i->cycles = 0;
+	// superblocks and loops can't run through it now
+	_avr_decode_runs(avr, pc, pc + 2);
+}
+
+void avr_core_clear_stop(avr_t * avr, avr_flashaddr_t pc)
+{
+	avr_decode_flash(avr, pc & ~1, 2);
+}
+
+/*
+ * Runs the whole superblock starting at avr->pc, returns the pc after it.
+ * The caller has made sure there is enough time before the next cycle
+ * timer, and adds insn->block_cycles itself.
+ */
+static inline avr_flashaddr_t _avr_run_block(avr_t * avr, const avr_insn_t * insn)
+{
+	avr_flashaddr_t new_pc = avr->pc;
+	int cycle = 0;
+
+	// the ops in a block have fixed cycles, count them all at its head
+	if (avr->perf_ops) {
+		for (int n = 0; n < insn->block; n++) {
+			avr->perf.ops[insn[n].op].count++;
+			avr->perf.ops[insn[n].op].cycles += insn[n].cycles;
+		}
+	}
+	for (int n = insn->block; n; n--, insn++) {
+		switch (insn->op) {
+#define _AVR_OP_BLOCK(_name) \
+			case avr_op_##_name: \
+				new_pc = _avr_op_##_name(avr, insn, new_pc + 2, &cycle); \
+				break;
+			AVR_BLOCK_OPS(_AVR_OP_BLOCK)
+#undef _AVR_OP_BLOCK
+		}
+	}
+	return new_pc;
+}
+
+/*
+ * Reading io register 'addr' again straight away would give the same value,
+ * and any irq it raises would have no effect
+ */
+static inline int _avr_irq_is_quiet(avr_irq_t * irq)
+{
+	return !irq || !avr_irq_has_listeners(irq) || (irq->flags & IRQ_FLAG_FILTERED);
+}
+
+static int _avr_io_read_is_repeatable(avr_t * avr, uint16_t addr)
+{
+	avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+
+	if (avr->io[io].r.c &&
+			!(avr->io[io].r.repeatable && _avr_irq_is_quiet(avr->io[io].r.repeat_irq)))
+		return 0;
+	if (avr->io[io].irq) {
+		for (int b = 0; b <= AVR_IOMEM_IRQ_ALL; b++)
+			if (!_avr_irq_is_quiet(avr->io[io].irq + b))
+				return 0;
+	}
+	return 1;
+}
 
-		default: _avr_invalid_opcode(avr);
+/*
+ * Counts 'passes' more times round the loop at 'insn' in avr->perf, the
+ * branch back is given whatever the other instructions don't add up to
+ */
+static void _avr_perf_loop(avr_t * avr, const avr_insn_t * insn, avr_cycle_count_t passes)
+{
+	avr_cycle_count_t rest = insn->loop_cycles;
+	const avr_insn_t * i = insn;
+
+	if (avr->perf_ops) {
+		for (; i->op != avr_op_rjmp && i->op != avr_op_brxs; i++) {
+			avr->perf.ops[i->op].count += passes;
+			avr->perf.ops[i->op].cycles += passes * i->cycles;
+			rest -= i->cycles;
+		}
+		avr->perf.ops[i->op].count += passes;
+		avr->perf.ops[i->op].cycles += passes * rest;
+	}
+	if (insn->loop == AVR_LOOP_POLL)
+		avr->perf.io_reads[AVR_DATA_TO_IO(insn->op == avr_op_in ? insn->k : insn->d)] += passes;
+}
+
+/*
+ * Fast forwards the delay or polling loop starting at avr->pc, up to the
+ * next cycle timer, and returns non zero if it did. The end state is the
+ * same as running it one instruction at a time:
+ * + Counted loops have their counter moved on to just before the last pass
+ *   that fits, which is then run for real so the flags are right too. The
+ *   pass where the loop ends is always left to the core.
+ * + Polling loops are run once for real. If that goes back to the start,
+ *   the next passes would read the same value and write the same registers
+ *   and flags, as nothing else can happen until the next cycle timer.
+ */
+static int _avr_run_loop(avr_t * avr, const avr_insn_t * insn)
+{
+	avr_cycle_count_t pass = insn->loop_cycles;
+	avr_cycle_count_t passes;
+	const avr_insn_t * i = insn;
+
+	if (insn->loop == AVR_LOOP_COUNT) {
+		uint64_t counter = 0, k = insn->op == avr_op_dec ? 1 : insn->k;
+		int bits = 0;
+
+		if (insn->op == avr_op_sbiw) {
+			counter = avr->data[insn->d] | (avr->data[insn->d + 1] << 8);
+			bits = 16;
+		} else {
+			for (; i->op != avr_op_brxs; i++, bits += 8)
+				counter |= (uint64_t)avr->data[i->d] << bits;
+		}
+		// passes left with the branch taken, only worked out for the easy cases
+		if (counter == 0 && k == 1)
+			passes = (1ULL << bits) - 1;
+		else if (counter && counter % k == 0)
+			passes = counter / k - 1;
+		else
+			return 0;
+		if (passes > (avr->run_cycle_count - 1) / pass)
+			passes = (avr->run_cycle_count - 1) / pass;
+		if (passes < 2)
+			return 0;
+
+		counter -= (passes - 1) * k;
+		if (insn->op == avr_op_sbiw) {
+			_avr_set_gpr(avr, insn->d, counter);
+			_avr_set_gpr(avr, insn->d + 1, counter >> 8);
+		} else {
+			for (i = insn; i->op != avr_op_brxs; i++, counter >>= 8)
+				_avr_set_gpr(avr, i->d, counter);
+		}
+		// not counted, this is one of the passes _avr_perf_loop() adds
+		for (i = insn; i->op != avr_op_brxs; i++) {
+			int cycle = 0;
+			_avr_op_handlers[i->op](avr, i, 0, &cycle);
+		}
+	} else {
+		if (!_avr_io_read_is_repeatable(avr, insn->op == avr_op_in ? insn->k : insn->d))
+			return 0;
+		// one pass for real, the read sees the exact cycle it happens at
+		avr_flashaddr_t pc = avr->pc, new_pc;
+		for (;; i++, pc = new_pc) {
+			int cycle = i->cycles;
+			new_pc = i->handler(avr, i, pc + 2, &cycle);
+			avr->cycle += cycle;
+			avr->run_cycle_count -= cycle;
+			if (new_pc != pc + 2 || i->op == avr_op_rjmp || i->op == avr_op_brxs)
+				break;
+		}
+		if (new_pc != avr->pc) {
+			avr->pc = new_pc;
+			return 1;
+		}
+		passes = (avr->run_cycle_count - 1) / pass;
+	}
+	_avr_perf_loop(avr, insn, passes);
+	avr->cycle += passes * pass;
+	avr->run_cycle_count -= passes * pass;
+	return 1;
+}
+
+/*
+ * A loop is only fast forwarded with the same conditions as a superblock
+ * (see below), and when there is room for a couple of passes
+ */
+#if CONFIG_SIMAVR_TRACE
+#define AVR_CAN_RUN_LOOP(avr, insn) 0
+#else
+#define AVR_CAN_RUN_LOOP(avr, insn) \
+	((insn)->loop && \
+	 (avr)->run_cycle_count > 2 * (avr_cycle_count_t)(insn)->loop_cycles && \
+	 (avr)->interrupt_state == 0 && \
+	 !(avr)->gdb)
+#endif
+
+/*
+ * A superblock is only run in one go when it can't make any difference:
+ * the next cycle timer is further away than the whole block, no interrupt
+ * is pending, and gdb isn't attached (it checks breakpoints on every pc).
+ * Otherwise the core just single steps as usual.
+ */
+#if CONFIG_SIMAVR_TRACE
+#define AVR_CAN_RUN_BLOCK(avr, insn) 0
+#else
+#define AVR_CAN_RUN_BLOCK(avr, insn) \
+	((insn)->block > 1 && \
+	 (avr)->run_cycle_count > (insn)->block_cycles && \
+	 (avr)->interrupt_state == 0 && \
+	 !(avr)->gdb)
+#endif
+
+/*
+ * Run one instruction (or as many as fit before the next cycle timer, see
+ * below) from the pre-decoded flash.
+ */
+avr_flashaddr_t avr_run_one(avr_t * avr)
+{
+run_one_again:
+#if CONFIG_SIMAVR_TRACE
+	/*
+	 * this traces spurious reset or bad jumps
+	 */
+	if ((avr->pc == 0 && avr->cycle > 0) || avr->pc >= avr->codeend || _avr_sp_get(avr) > avr->ramend) {
+		avr->trace = 1;
+		STATE("RESET\n");
+		crash(avr);
+	}
+	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
+#endif
+
+	/* Ensure we don't crash simavr due to a bad instruction reading past
+	 * the end of the flash.
+	 */
+	if (unlikely(avr->pc >= avr->flashend)) {
+		STATE("CRASH\n");
+		crash(avr);
+		return 0;
+	}
 
+	const avr_insn_t * insn = &avr->decode[avr->pc >> 1];
+
+	if (AVR_CAN_RUN_LOOP(avr, insn) && _avr_run_loop(avr, insn)) {
+		if (avr->state != cpu_Running || avr->interrupt_state != 0)
+			return avr->pc;
+		goto run_one_again;
+	}
+	if (AVR_CAN_RUN_BLOCK(avr, insn)) {
+		avr->pc = _avr_run_block(avr, insn);
+		avr->cycle += insn->block_cycles;
+		avr->run_cycle_count -= insn->block_cycles;
+		goto run_one_again;
 	}
+
+	int cycle = insn->cycles;
+	avr_flashaddr_t	new_pc = insn->handler(avr, insn, avr->pc + 2, &cycle);
+
 	avr->cycle += cycle;
 	
 	if ((avr->state == cpu_Running) && 
@@ -1399,5 +2334,3 @@ run_one_again:
 	
 	return new_pc;
 }
-
-
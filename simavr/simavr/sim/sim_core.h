@@ -36,11 +36,57 @@ extern "C" {
 	#define FONT_DEFAULT	"\e[0m"
 #endif
 
+struct avr_insn_t;
+
+/*
+ * Instruction handler. new_pc is the address of the next instruction, cycle
+ * is preloaded with the instruction base cycle count. Returns the new pc.
+ */
+typedef avr_flashaddr_t (*avr_insn_handler_t)(
+		avr_t * avr,
+		const struct avr_insn_t * insn,
+		avr_flashaddr_t new_pc,
+		int * cycle);
+
+/*
+ * Pre-decoded instruction, there is one of these for each word of flash in
+ * avr->decode. Operands are extracted once at decode time, so the core
+ * doesn't have to go through the opcode decoder for every instruction run.
+ */
+typedef struct avr_insn_t {
+	avr_insn_handler_t	handler;
+	uint32_t	k;		// immediate, IO address, displacement or jump target
+	uint8_t		d, r;	// register operands, bit numbers or instruction flags
+	uint8_t		cycles;	// cycles taken, not counting taken branches/skips
+	uint8_t		skip;	// size (in bytes) of the next instruction, for skips
+	uint8_t		op;		// handler index, see AVR_OPS in sim_core.c
+	uint16_t	block;	// length of the superblock starting here, if any
+	uint16_t	block_cycles;	// ... and the cycles it takes
+	uint8_t		loop;	// kind of delay/polling loop starting here, if any
+	uint8_t		loop_cycles;	// ... and the cycles one pass takes
+} avr_insn_t;
+
 /*
  * Instruction decoder, run ONE instruction
  */
 avr_flashaddr_t avr_run_one(avr_t * avr);
 
+/*
+ * (Re)decode 'size' bytes of flash at 'addr' into avr->decode. This has
+ * to be called whenever the flash is modified (loadcode, SPM, gdb...)
+ */
+void avr_decode_flash(avr_t * avr, avr_flashaddr_t addr, uint32_t size);
+
+/*
+ * Puts a stop in front of the instruction at 'pc': when the core gets there
+ * it leaves it unrun and avr_run() returns with the state set to
+ * cpu_StepDone, as a BREAK does with gdb attached. Set the state back to
+ * cpu_Running to carry on. avr_core_clear_stop() puts the instruction back.
+ * Not for use with gdb attached, it uses cpu_StepDone itself.
+ */
+void avr_core_set_stop(avr_t * avr, avr_flashaddr_t pc);
+void avr_core_clear_stop(avr_t * avr, avr_flashaddr_t pc);
+
 /*
  * These are for internal access to the stack (for interrupts)
  */
@@ -25,44 +25,230 @@
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_cycle_timers.h"
+#include "sim_snapshot.h"
 
-#define QUEUE(__q, __e) { \
-		(__e)->next = (__q); \
-		(__q) = __e; \
+#define DEFAULT_SLEEP_CYCLES 1000
+
+// end of a slot list, and the heap position of a free slot
+#define NO_SLOT		0xffffffff
+// children per heap node, four keeps the heap shallow, with the
+// children of a node next to each other
+#define HEAP_ARITY	4
+// slots allocated the first time a timer is registered
+#define INITIAL_SLOTS	64
+
+static inline uint32_t
+avr_cycle_timer_hash(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	uint64_t h = ((uint64_t)(uintptr_t)timer ^ ((uint64_t)(uintptr_t)param << 7)) *
+			0x9e3779b97f4a7c15ULL;
+	return (uint32_t)(h >> 32) & pool->index_mask;
+}
+
+// does heap entry 'a' fire before 'b'
+static inline int
+avr_cycle_timer_before(
+		const avr_cycle_timer_heap_t * a,
+		const avr_cycle_timer_heap_t * b)
+{
+	return (a->when < b->when) | ((a->when == b->when) & (a->order < b->order));
+}
+
+/*
+ * The heap is fixed by moving a 'hole' at 'pos' up or down, and putting
+ * the new entry in where it ends up
+ */
+static inline void
+avr_cycle_timer_heap_up(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t pos,
+		avr_cycle_count_t when,
+		uint64_t order,
+		uint32_t slot)
+{
+	avr_cycle_timer_heap_t e = { .when = when, .order = order, .slot = slot };
+	while (pos > 0) {
+		uint32_t parent = (pos - 1) / HEAP_ARITY;
+		if (!avr_cycle_timer_before(&e, &pool->heap[parent]))
+			break;
+		pool->heap[pos] = pool->heap[parent];
+		pool->slots[pool->heap[pos].slot].heap = pos;
+		pos = parent;
+	}
+	pool->heap[pos] = e;
+	pool->slots[e.slot].heap = pos;
+}
+
+static inline void
+avr_cycle_timer_heap_down(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t pos,
+		avr_cycle_count_t when,
+		uint64_t order,
+		uint32_t slot)
+{
+	avr_cycle_timer_heap_t e = { .when = when, .order = order, .slot = slot };
+	for (;;) {
+		uint32_t first = pos * HEAP_ARITY + 1;
+		if (first >= pool->count)
+			break;
+		uint32_t last = first + HEAP_ARITY < pool->count ? first + HEAP_ARITY : pool->count;
+		uint32_t child = first;
+		for (uint32_t c = first + 1; c < last; c++)
+			child = avr_cycle_timer_before(&pool->heap[c], &pool->heap[child]) ? c : child;
+		if (!avr_cycle_timer_before(&pool->heap[child], &e))
+			break;
+		pool->heap[pos] = pool->heap[child];
+		pool->slots[pool->heap[pos].slot].heap = pos;
+		pos = child;
 	}
-#define DETACH(__q, __l, __e) { \
-		if (__l) \
-			(__l)->next = (__e)->next; \
-		else \
-			(__q) = (__e)->next; \
+	pool->heap[pos] = e;
+	pool->slots[e.slot].heap = pos;
+}
+
+// add a slot to the heap, as registered now
+static inline void
+avr_cycle_timer_heap_push(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t slot,
+		avr_cycle_count_t when)
+{
+	// timers due on the same cycle fire in the order they were registered
+	avr_cycle_timer_heap_up(pool, pool->count++, when, pool->order++, slot);
+}
+
+// take the slot at 'pos' out of the heap
+static inline void
+avr_cycle_timer_heap_remove(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t pos)
+{
+	if (pos != --pool->count) {
+		avr_cycle_timer_heap_t * last = &pool->heap[pool->count];
+		if (pos > 0 && avr_cycle_timer_before(last, &pool->heap[(pos - 1) / HEAP_ARITY]))
+			avr_cycle_timer_heap_up(pool, pos, last->when, last->order, last->slot);
+		else
+			avr_cycle_timer_heap_down(pool, pos, last->when, last->order, last->slot);
+	}
+}
+
+// double the pool (or allocate it), returns zero if out of memory
+static int
+avr_cycle_timer_grow(
+		avr_cycle_timer_pool_t * pool)
+{
+	uint32_t size = pool->size ? pool->size * 2 : INITIAL_SLOTS;
+	if (!pool->size)
+		pool->free = pool->firing = NO_SLOT;
+	avr_cycle_timer_slot_t * slots = realloc(pool->slots, size * sizeof(*slots));
+	if (!slots)
+		return 0;
+	pool->slots = slots;
+	avr_cycle_timer_heap_t * heap = realloc(pool->heap, size * sizeof(*heap));
+	if (!heap)
+		return 0;
+	pool->heap = heap;
+	uint32_t * index = realloc(pool->index, size * sizeof(*index));
+	if (!index)
+		return 0;
+	pool->index = index;
+
+	// new slots go on the free list
+	for (uint32_t i = size; i > pool->size; i--) {
+		slots[i - 1].heap = NO_SLOT;
+		slots[i - 1].next = pool->free;
+		pool->free = i - 1;
+	}
+	pool->size = size;
+
+	// one bucket per slot, rehash the ones in use
+	pool->index_mask = size - 1;
+	for (uint32_t i = 0; i < size; i++)
+		index[i] = NO_SLOT;
+	for (uint32_t i = 0; i < size; i++) {
+		avr_cycle_timer_slot_p t = &slots[i];
+		if (t->heap == NO_SLOT)
+			continue;
+		uint32_t bucket = avr_cycle_timer_hash(pool, t->timer, t->param);
+		t->next = index[bucket];
+		index[bucket] = i;
 	}
-#define INSERT(__q, __l, __e) { \
-		if (__l) { \
-			(__e)->next = (__l)->next; \
-			(__l)->next = (__e); \
-		} else { \
-			(__e)->next = (__q); \
-			(__q) = (__e); \
-		} \
+	return 1;
+}
+
+// slot of the pending (timer, param), or NO_SLOT
+static inline uint32_t
+avr_cycle_timer_find(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	if (!pool->count)
+		return NO_SLOT;
+	uint32_t slot = pool->index[avr_cycle_timer_hash(pool, timer, param)];
+	while (slot != NO_SLOT) {
+		avr_cycle_timer_slot_p t = &pool->slots[slot];
+		// the one firing isn't pending any more, same as once it's done
+		if (t->timer == timer && t->param == param && slot != pool->firing)
+			break;
+		slot = t->next;
 	}
+	return slot;
+}
 
-#define DEFAULT_SLEEP_CYCLES 1000
+// take a slot out of the index, and free it
+static void
+avr_cycle_timer_release(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t slot)
+{
+	avr_cycle_timer_slot_p t = &pool->slots[slot];
+	uint32_t * link = &pool->index[avr_cycle_timer_hash(pool, t->timer, t->param)];
+	while (*link != slot)
+		link = &pool->slots[*link].next;
+	*link = t->next;
+
+	t->heap = NO_SLOT;
+	t->next = pool->free;
+	pool->free = slot;
+}
 
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
-	memset(pool, 0, sizeof(*pool));
-	// queue all slots into the free queue
-	for (int i = 0; i < MAX_CYCLE_TIMERS; i++) {
-		avr_cycle_timer_slot_p t = &pool->timer_slots[i];
-		QUEUE(pool->timer_free, t);
+	// keep the allocations, just put every slot back on the free list
+	pool->free = NO_SLOT;
+	for (uint32_t i = pool->size; i > 0; i--) {
+		pool->slots[i - 1].heap = NO_SLOT;
+		pool->slots[i - 1].next = pool->free;
+		pool->free = i - 1;
 	}
+	for (uint32_t i = 0; i < pool->size; i++)
+		pool->index[i] = NO_SLOT;
+	pool->count = 0;
+	pool->firing = NO_SLOT;
+	pool->order = 0;
 	avr->run_cycle_count = 1;
 	avr->run_cycle_limit = 1;
 }
 
+void
+avr_cycle_timer_free(
+		struct avr_t * avr)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	free(pool->slots);
+	free(pool->heap);
+	free(pool->index);
+	memset(pool, 0, sizeof(*pool));
+	pool->free = pool->firing = NO_SLOT;
+}
+
 static avr_cycle_count_t
 avr_cycle_timer_return_sleep_run_cycles_limited(
 	avr_t *avr,
@@ -85,9 +271,9 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 	avr_cycle_count_t sleep_cycle_count = DEFAULT_SLEEP_CYCLES;
 
-	if(pool->timer) {
-		if(pool->timer->when > avr->cycle) {
-			sleep_cycle_count = pool->timer->when - avr->cycle;
+	if (pool->count) {
+		if (pool->heap[0].when > avr->cycle) {
+			sleep_cycle_count = pool->heap[0].when - avr->cycle;
 		} else {
 			sleep_cycle_count = 0;
 		}
@@ -108,28 +294,22 @@ avr_cycle_timer_insert(
 
 	when += avr->cycle;
 
-	avr_cycle_timer_slot_p t = pool->timer_free;
-
-	if (!t) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: ran out of timers (%d)!\n", __func__, MAX_CYCLE_TIMERS);
+	if ((!pool->size || pool->free == NO_SLOT) && !avr_cycle_timer_grow(pool)) {
+		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: out of memory for %u timers!\n", __func__, pool->size * 2);
 		return;
 	}
 	// detach head
-	pool->timer_free = t->next;
-	t->next = NULL;
+	uint32_t slot = pool->free;
+	avr_cycle_timer_slot_p t = &pool->slots[slot];
+	pool->free = t->next;
 	t->timer = timer;
 	t->param = param;
-	t->when = when;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p loop = pool->timer, last = NULL;
-	while (loop) {
-		if (loop->when > when)
-			break;
-		last = loop;
-		loop = loop->next;
-	}
-	INSERT(pool->timer, last, t);
+	uint32_t bucket = avr_cycle_timer_hash(pool, timer, param);
+	t->next = pool->index[bucket];
+	pool->index[bucket] = slot;
+
+	avr_cycle_timer_heap_push(pool, slot, when);
 }
 
 void
@@ -141,14 +321,19 @@ avr_cycle_timer_register(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	// remove it if it was already scheduled
-	avr_cycle_timer_cancel(avr, timer, param);
-
-	if (!pool->timer_free) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: pool is full (%d)!\n", __func__, MAX_CYCLE_TIMERS);
-		return;
-	}
-	avr_cycle_timer_insert(avr, when, timer, param);
+	// if it was already scheduled, just move it, as if registered now
+	uint32_t slot = avr_cycle_timer_find(pool, timer, param);
+	if (slot != NO_SLOT) {
+		uint32_t pos = pool->slots[slot].heap;
+		when += avr->cycle;
+		// it now comes after everything due on the same cycle, so only a
+		// sooner 'when' can move it up
+		if (when < pool->heap[pos].when)
+			avr_cycle_timer_heap_up(pool, pos, when, pool->order++, slot);
+		else
+			avr_cycle_timer_heap_down(pool, pos, when, pool->order++, slot);
+	} else
+		avr_cycle_timer_insert(avr, when, timer, param);
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
 
@@ -170,16 +355,10 @@ avr_cycle_timer_cancel(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer, last = NULL;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			DETACH(pool->timer, last, t);
-			QUEUE(pool->timer_free, t);
-			break;
-		}
-		last = t;
-		t = t->next;
+	uint32_t slot = avr_cycle_timer_find(pool, timer, param);
+	if (slot != NO_SLOT) {
+		avr_cycle_timer_heap_remove(pool, pool->slots[slot].heap);
+		avr_cycle_timer_release(pool, slot);
 	}
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
@@ -196,14 +375,9 @@ avr_cycle_timer_status(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			return 1 + (t->when - avr->cycle);
-		}
-		t = t->next;
-	}
+	uint32_t slot = avr_cycle_timer_find(pool, timer, param);
+	if (slot != NO_SLOT)
+		return 1 + (pool->heap[pool->slots[slot].heap].when - avr->cycle);
 	return 0;
 }
 
@@ -218,32 +392,108 @@ avr_cycle_timer_process(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	if (pool->timer) do {
-		avr_cycle_timer_slot_p t = pool->timer;
-		avr_cycle_count_t when = t->when;
+	while (pool->count) {
+		avr_cycle_count_t when = pool->heap[0].when;
 
 		if (when > avr->cycle)
 			return avr_cycle_timer_return_sleep_run_cycles_limited(avr, when - avr->cycle);
 
-		// detach from active timers
-		pool->timer = t->next;
-		t->next = NULL;
+		// it stays at the top of the heap while its callback runs, as
+		// anything the callback registers is due after it
+		uint32_t slot = pool->heap[0].slot;
+		avr_cycle_timer_t timer = pool->slots[slot].timer;
+		void * param = pool->slots[slot].param;
+		pool->firing = slot;
 		do {
-			avr_cycle_count_t w = t->timer(avr, when, t->param);
+			avr_cycle_count_t w = timer(avr, when, param);
+			avr->perf.timers_fired++;
 			// make sure the return value is either zero, or greater
 			// than the last one to prevent infinite loop here
 			when = w > when ? w : 0;
 		} while (when && when <= avr->cycle);
-		
-		if (when) // reschedule then
-			avr_cycle_timer_insert(avr, when - avr->cycle, t->timer, t->param);
-		
-		// requeue this one into the free ones
-		QUEUE(pool->timer_free, t);
-	} while (pool->timer);
+
+		if (pool->firing != slot) {
+			// the pool was reset under us, start afresh
+			if (when)
+				avr_cycle_timer_insert(avr, when - avr->cycle, timer, param);
+			continue;
+		}
+		pool->firing = NO_SLOT;
+		if (when) { // reschedule then
+			avr_cycle_timer_heap_down(pool, 0, when, pool->order++, slot);
+		} else {
+			avr_cycle_timer_heap_remove(pool, 0);
+			avr_cycle_timer_release(pool, slot);
+		}
+	}
 
 	// original behavior was to return 1000 cycles when no timers were present...
 	// run_cycles are bound to at least one cycle but no more than requested limit...
 	//	value passed here is returned unbounded, thus preserving original behavior.
 	return avr_cycle_timer_return_sleep_run_cycles_limited(avr, DEFAULT_SLEEP_CYCLES);
 }
+
+// sorts heap entries in firing order, the keys are unique
+static int
+avr_cycle_timer_compare(
+		const void * a,
+		const void * b)
+{
+	return avr_cycle_timer_before(a, b) ? -1 : 1;
+}
+
+/*
+ * Timers are saved in firing order, and inserted back the same way on
+ * restore, so ones due on the same cycle keep their order.
+ */
+void
+avr_cycle_timer_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	uint32_t count = pool->count;
+
+	avr_snapshot_section(s, "timr");
+	AVR_SNAPSHOT_FIELD(s, count);
+	if (s->error)
+		return;
+
+	if (!s->restore) {
+		if (!count)
+			return;
+		avr_cycle_timer_heap_t * sorted = malloc(count * sizeof(*sorted));
+		if (!sorted) {
+			s->error = 1;
+			return;
+		}
+		memcpy(sorted, pool->heap, count * sizeof(*sorted));
+		qsort(sorted, count, sizeof(*sorted), avr_cycle_timer_compare);
+		for (uint32_t i = 0; i < count; i++) {
+			avr_cycle_timer_slot_p t = &pool->slots[sorted[i].slot];
+			AVR_SNAPSHOT_FIELD(s, sorted[i].when);
+			AVR_SNAPSHOT_FUNCTION(s, t->timer);
+			AVR_SNAPSHOT_POINTER(s, t->param);
+		}
+		free(sorted);
+		return;
+	}
+
+	// drop whatever was pending, without touching the run counts
+	avr_cycle_count_t run_cycle_count = avr->run_cycle_count;
+	avr_cycle_count_t run_cycle_limit = avr->run_cycle_limit;
+	avr_cycle_timer_reset(avr);
+	avr->run_cycle_count = run_cycle_count;
+	avr->run_cycle_limit = run_cycle_limit;
+
+	for (uint32_t i = 0; i < count && !s->error; i++) {
+		avr_cycle_count_t when = 0;
+		avr_cycle_timer_t timer = NULL;
+		void * param = NULL;
+		AVR_SNAPSHOT_FIELD(s, when);
+		AVR_SNAPSHOT_FUNCTION(s, timer);
+		AVR_SNAPSHOT_POINTER(s, param);
+		if (!s->error)
+			avr_cycle_timer_insert(avr, when - avr->cycle, timer, param);
+	}
+}
@@ -24,9 +24,11 @@
  * these timers are one shots, then get cleared if the timer function returns zero,
  * they get reset if the callback function returns a new cycle number
  *
- * the implementation maintains a list of 'pending' timers, sorted by when they
- * should run, it allows very quick comparison with the next timer to run, and
- * quick removal of then from the pile once dispatched.
+ * the implementation keeps the 'pending' timers in a 4-ary heap ordered by when
+ * they should run (and by when they were registered, for timers due on the same
+ * cycle), so the next timer to run is always at the top, and a hash index on
+ * (timer, param) finds a timer for cancel and status without walking the heap.
+ * the pool grows as needed, there is no limit on the number of pending timers.
  */
 #ifndef __SIM_CYCLE_TIMERS_H___
 #define __SIM_CYCLE_TIMERS_H___
@@ -37,8 +39,6 @@
 extern "C" {
 #endif
 
-#define MAX_CYCLE_TIMERS	64
-
 typedef avr_cycle_count_t (*avr_cycle_timer_t)(
 		struct avr_t * avr,
 		avr_cycle_count_t when,
@@ -46,7 +46,8 @@ typedef avr_cycle_count_t (*avr_cycle_timer_t)(
 
 /*
  * Each timer instance contains the absolute cycle number they
- * are hoping to run at, a function pointer to call and a parameter
+ * are hoping to run at (in its heap entry), a function pointer to
+ * call and a parameter
  * 
  * it will NEVER be the exact cycle specified, as each instruction is
  * not divisible and might take 2 or more cycles anyway.
@@ -55,22 +56,38 @@ typedef avr_cycle_count_t (*avr_cycle_timer_t)(
  * repeteadly until it 'caches up'.
  */
 typedef struct avr_cycle_timer_slot_t {
-	struct avr_cycle_timer_slot_t *next;
-	avr_cycle_count_t	when;
 	avr_cycle_timer_t	timer;
 	void * param;
+	uint32_t	heap;		// position in the heap
+	uint32_t	next;		// next slot in the index bucket, or in the free list
 } avr_cycle_timer_slot_t, *avr_cycle_timer_slot_p;
 
 /*
- * Timer pool contains a pool of timer slots available, they all
- * start queued into the 'free' qeueue, are migrated to the
- * 'active' queue when needed and are re-queued to the free one
- * when done
+ * The heap entries hold when their slot's timer fires, so the heap can be
+ * kept in order without looking at the slots
+ */
+typedef struct avr_cycle_timer_heap_t {
+	avr_cycle_count_t	when;
+	uint64_t	order;		// registration order, breaks ties on 'when'
+	uint32_t	slot;
+} avr_cycle_timer_heap_t;
+
+/*
+ * Timer pool contains the timer slots, the heap of pending ones and the
+ * (timer, param) index. Slots that aren't pending are chained in the
+ * 'free' list. Everything is allocated on first use and doubled when
+ * full, slot numbers stay valid when it is.
  */
 typedef struct avr_cycle_timer_pool_t {
-	avr_cycle_timer_slot_t timer_slots[MAX_CYCLE_TIMERS];
-	avr_cycle_timer_slot_p timer_free;
-	avr_cycle_timer_slot_p timer;
+	avr_cycle_timer_slot_t * slots;
+	avr_cycle_timer_heap_t * heap;
+	uint32_t *	index;		// index_mask + 1 buckets, each a slot list
+	uint32_t	index_mask;
+	uint32_t	size;		// slots allocated
+	uint32_t	count;		// slots pending, ie in the heap
+	uint32_t	free;
+	uint32_t	firing;		// slot whose callback is being called
+	uint64_t	order;
 } avr_cycle_timer_pool_t, *avr_cycle_timer_pool_p;
 
 
@@ -113,6 +130,17 @@ avr_cycle_timer_process(
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr);
+// frees the pool, called from avr_terminate()
+void
+avr_cycle_timer_free(
+		struct avr_t * avr);
+
+struct avr_snapshot_t;
+// save/restore the pending timers, see sim_snapshot.h
+void
+avr_cycle_timer_snapshot(
+		struct avr_t * avr,
+		struct avr_snapshot_t * s);
 
 #ifdef __cplusplus
 };
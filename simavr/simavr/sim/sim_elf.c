@@ -68,6 +68,21 @@ void avr_load_firmware(avr_t * avr, elf_firmware_t * firmware)
 	}
 #endif
 
+#if ELF_SYMBOLS
+	// keep the code symbols, for avr_symbol_at(), they're already sorted
+	free(avr->symbol);
+	avr->symbol = NULL;
+	avr->symbolcount = 0;
+	for (int i = 0; i < firmware->symbolcount; i++) {
+		if (firmware->symbol[i]->addr > avr->flashend)
+			continue;
+		if (!(avr->symbolcount % 64))
+			avr->symbol = realloc(avr->symbol,
+					(avr->symbolcount + 64) * sizeof(avr->symbol[0]));
+		avr->symbol[avr->symbolcount++] = firmware->symbol[i];
+	}
+#endif
+
 	avr_loadcode(avr, firmware->flash, firmware->flashsize, firmware->flashbase);
 	avr->codeend = firmware->flashsize + firmware->flashbase - firmware->datasize;
 	if (firmware->eeprom && firmware->eesize) {
@@ -301,6 +316,9 @@ int elf_read_firmware(const char * file, elf_firmware_t * firmware)
 					// if its a bootloader, this symbol will be the entry point we need
 					if (!strcmp(name, "__vectors"))
 						firmware->flashbase = sym.st_value;
+					// the linker's region sizes and such aren't addresses
+					if (sym.st_shndx == SHN_ABS)
+						continue;
 					avr_symbol_t * s = malloc(sizeof(avr_symbol_t) + strlen(name) + 1);
 					strcpy((char*)s->symbol, name);
 					s->addr = sym.st_value;
@@ -404,7 +404,9 @@ gdb_handle_command(
 				break;
 			}
 			if (addr < 0xffff) {
+				avr_flash_unshare(avr);
 				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
+				avr_decode_flash(avr, addr, len);
 				gdb_send_reply(g, "OK");			
 			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
 				read_hex_string(start + 1, avr->data + addr - 0x800000, strlen(start+1));
@@ -27,6 +27,8 @@
 #include "sim_interrupts.h"
 #include "sim_avr.h"
 #include "sim_core.h"
+#include "sim_snapshot.h"
+#include "sim_callgraph.h"
 
 // modulo a cursor value on the pending interrupt fifo
 #define INT_FIFO_SIZE (sizeof(table->pending) / sizeof(avr_int_vector_t *))
@@ -59,6 +61,30 @@ avr_interrupt_reset(
 		table->vector[i]->pending = 0;
 }
 
+void
+avr_interrupt_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_int_table_p table = &avr->interrupts;
+
+	avr_snapshot_section(s, "ints");
+	for (int i = 0; i < table->vector_count; i++) {
+		uint8_t pending = table->vector[i]->pending;
+		AVR_SNAPSHOT_FIELD(s, pending);
+		table->vector[i]->pending = pending;
+	}
+	AVR_SNAPSHOT_FIELD(s, table->pending_w);
+	AVR_SNAPSHOT_FIELD(s, table->pending_r);
+	for (uint8_t r = table->pending_r; r != table->pending_w && !s->error; r = INT_FIFO_MOD(r + 1))
+		AVR_SNAPSHOT_POINTER(s, table->pending[r]);
+	AVR_SNAPSHOT_FIELD(s, table->running_ptr);
+	if (table->running_ptr > (sizeof(table->running) / sizeof(table->running[0])))
+		s->error = 1;
+	for (int i = 0; i < table->running_ptr && !s->error; i++)
+		AVR_SNAPSHOT_POINTER(s, table->running[i]);
+}
+
 void
 avr_register_vector(
 		avr_t *avr,
@@ -273,6 +299,9 @@ avr_service_interrupts(
 		_avr_push_addr(avr, avr->pc);
 		avr_sreg_set(avr, S_I, 0);
 		avr->pc = vector->vector * avr->vector_size;
+		avr->perf.interrupts_serviced++;
+		if (avr->callgraph)
+			avr_callgraph_interrupt(avr->callgraph, avr->cycle, vector->vector);
 
 		avr_raise_irq(vector->irq + AVR_INT_IRQ_RUNNING, 1);
 		avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING, vector->vector);
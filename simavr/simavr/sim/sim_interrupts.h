@@ -122,6 +122,13 @@ void
 avr_interrupt_reset(
 		struct avr_t * avr );
 
+struct avr_snapshot_t;
+// save/restore the pending fifo and the nested interrupts, see sim_snapshot.h
+void
+avr_interrupt_snapshot(
+		struct avr_t * avr,
+		struct avr_snapshot_t * s);
+
 #ifdef __cplusplus
 };
 #endif
@@ -71,6 +71,19 @@ avr_register_io_read(
 	}
 	avr->io[a].r.param = param;
 	avr->io[a].r.c = readp;
+	avr->io[a].r.repeatable = 0;
+	avr->io[a].r.repeat_irq = NULL;
+}
+
+void
+avr_register_io_read_repeatable(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		struct avr_irq_t * irq)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+	avr->io[a].r.repeatable = 1;
+	avr->io[a].r.repeat_irq = irq;
 }
 
 static void
@@ -39,6 +39,8 @@ extern "C" {
  * IO module base struct
  * Modules uses that as their first member in their own struct
  */
+struct avr_snapshot_t;
+
 typedef struct avr_io_t {
 	struct avr_io_t * 	next;
 	avr_t *				avr;		// avr we are attached to
@@ -56,6 +58,8 @@ typedef struct avr_io_t {
 
 	// optional, a function to free up allocated system resources
 	void (*dealloc)(struct avr_io_t *io);
+	// optional, saves/restores the module runtime state, see sim_snapshot.h
+	void (*snapshot)(struct avr_io_t *io, struct avr_snapshot_t *s);
 } avr_io_t;
 
 /*
@@ -85,6 +89,14 @@ avr_register_io_read(
 		avr_io_addr_t addr,
 		avr_io_read_t read,
 		void * param);
+// tell the core that reading "addr" again, with nothing else happening in between,
+// returns the same value and does nothing but raise "irq" (can be NULL) again.
+// the core can then fast forward firmware loops polling that register
+void
+avr_register_io_read_repeatable(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		struct avr_irq_t * irq);
 // register a callback for when the IO register is written. callback has to set the memory itself
 void
 avr_register_io_write(
@@ -23,17 +23,92 @@
 #include <stdio.h>
 #include <string.h>
 #include "sim_irq.h"
+#include "sim_snapshot.h"
 
 // internal structure for a hook, never seen by the notify procs
 typedef struct avr_irq_hook_t {
-	struct avr_irq_hook_t * next;
-	int busy;	// prevent reentrance of callbacks
-	
 	struct avr_irq_t * chain;	// raise the IRQ on this too - optional if "notify" is on
 	avr_irq_notify_t notify;	// called when IRQ is raised - optional if "chain" is on
 	void * param;				// "notify" parameter
+	int busy;	// prevent reentrance of callbacks
 } avr_irq_hook_t;
 
+/*
+ * Hook tables are carved out of chunks of the pool's arena, and tables
+ * given back (when one grows, or its irq is freed) are kept on a free
+ * list by size. Table sizes are powers of two.
+ */
+#define IRQ_ARENA_CHUNK		128		// hooks
+#define IRQ_ARENA_CLASSES	16
+
+typedef struct avr_irq_arena_chunk_t {
+	struct avr_irq_arena_chunk_t * next;
+	uint32_t size, used;
+	avr_irq_hook_t hook[];
+} avr_irq_arena_chunk_t;
+
+typedef struct avr_irq_arena_t {
+	avr_irq_arena_chunk_t * chunk;	// the one being carved first
+	avr_irq_hook_t * free[IRQ_ARENA_CLASSES];
+} avr_irq_arena_t;
+
+static int
+_avr_irq_hook_class(
+		uint32_t size)
+{
+	int c = 0;
+	while ((1u << c) < size)
+		c++;
+	return c;
+}
+
+static avr_irq_hook_t *
+_avr_irq_hook_table_alloc(
+		avr_irq_pool_t * pool,
+		uint32_t size)
+{
+	if (!pool)
+		return malloc(size * sizeof(avr_irq_hook_t));
+	if (!pool->arena)
+		pool->arena = calloc(1, sizeof(*pool->arena));
+	avr_irq_arena_t * arena = pool->arena;
+	int c = _avr_irq_hook_class(size);
+	avr_irq_hook_t * table = arena->free[c];
+	if (table) {
+		arena->free[c] = *(avr_irq_hook_t **)table;
+		return table;
+	}
+	avr_irq_arena_chunk_t * chunk = arena->chunk;
+	if (!chunk || chunk->size - chunk->used < size) {
+		uint32_t chunk_size = size > IRQ_ARENA_CHUNK ? size : IRQ_ARENA_CHUNK;
+		chunk = malloc(sizeof(*chunk) + chunk_size * sizeof(avr_irq_hook_t));
+		chunk->next = arena->chunk;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunk = chunk;
+	}
+	table = chunk->hook + chunk->used;
+	chunk->used += size;
+	return table;
+}
+
+static void
+_avr_irq_hook_table_free(
+		avr_irq_pool_t * pool,
+		avr_irq_hook_t * table,
+		uint32_t size)
+{
+	if (!table)
+		return;
+	if (!pool || !pool->arena) {
+		free(table);
+		return;
+	}
+	int c = _avr_irq_hook_class(size);
+	*(avr_irq_hook_t **)table = pool->arena->free[c];
+	pool->arena->free[c] = table;
+}
+
 static void
 _avr_irq_pool_add(
 		avr_irq_pool_t * pool,
@@ -59,6 +134,34 @@ _avr_irq_pool_remove(
 		}
 }
 
+void
+avr_irq_pool_free(
+		avr_irq_pool_t * pool)
+{
+	// whatever is left in the pool loses its hooks with the arena
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		irq->hook = NULL;
+		irq->hook_count = irq->hook_size = 0;
+		irq->pool = NULL;
+	}
+	if (pool->arena) {
+		avr_irq_arena_chunk_t * chunk = pool->arena->chunk;
+		while (chunk) {
+			avr_irq_arena_chunk_t * next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		free(pool->arena);
+	}
+	free(pool->irq);
+	pool->arena = NULL;
+	pool->irq = NULL;
+	pool->count = 0;
+}
+
 void
 avr_init_irq(
 		avr_irq_pool_t * pool,
@@ -96,17 +199,60 @@ avr_alloc_irq(
 	return irq;
 }
 
+/*
+ * New hooks go at the end of the table, and avr_raise_irq_hooks() walks
+ * it backward, so the newest are still called first
+ */
 static avr_irq_hook_t *
 _avr_alloc_irq_hook(
 		avr_irq_t * irq)
 {
-	avr_irq_hook_t *hook = malloc(sizeof(avr_irq_hook_t));
+	if (irq->hook_count == irq->hook_size) {
+		uint32_t size = irq->hook_size ? irq->hook_size * 2 : 1;
+		avr_irq_hook_t * table = _avr_irq_hook_table_alloc(irq->pool, size);
+		if (irq->hook_count)
+			memcpy(table, irq->hook, irq->hook_count * sizeof(avr_irq_hook_t));
+		_avr_irq_hook_table_free(irq->pool, irq->hook, irq->hook_size);
+		irq->hook = table;
+		irq->hook_size = size;
+	}
+	avr_irq_hook_t *hook = &irq->hook[irq->hook_count++];
 	memset(hook, 0, sizeof(avr_irq_hook_t));
-	hook->next = irq->hook;
-	irq->hook = hook;
 	return hook;
 }
 
+/*
+ * While the irq is being raised, removed hooks are only cleared, so the
+ * walk through the table isn't upset; the table is compacted afterward
+ */
+static void
+_avr_free_irq_hook(
+		avr_irq_t * irq,
+		avr_irq_hook_t * hook)
+{
+	if (irq->raising) {
+		hook->notify = NULL;
+		hook->chain = NULL;
+		irq->flags |= IRQ_FLAG_HOOKS_DIRTY;
+		return;
+	}
+	int index = hook - irq->hook;
+	memmove(hook, hook + 1, (irq->hook_count - index - 1) * sizeof(avr_irq_hook_t));
+	irq->hook_count--;
+}
+
+static void
+_avr_irq_compact_hooks(
+		avr_irq_t * irq)
+{
+	int count = 0;
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify || irq->hook[i].chain)
+			irq->hook[count++] = irq->hook[i];
+	irq->hook_count = count;
+	irq->flags &= ~IRQ_FLAG_HOOKS_DIRTY;
+}
+
 void
 avr_free_irq(
 		avr_irq_t * irq,
@@ -116,19 +262,15 @@ avr_free_irq(
 		return;
 	for (int i = 0; i < count; i++) {
 		avr_irq_t * iq = irq + i;
+		// purge hooks
+		_avr_irq_hook_table_free(iq->pool, iq->hook, iq->hook_size);
+		iq->hook = NULL;
+		iq->hook_count = iq->hook_size = 0;
 		if (iq->pool)
 			_avr_irq_pool_remove(iq->pool, iq);
 		if (iq->name)
 			free((char*)iq->name);
 		iq->name = NULL;
-		// purge hooks
-		avr_irq_hook_t *hook = iq->hook;
-		while (hook) {
-			avr_irq_hook_t * next = hook->next;
-			free(hook);
-			hook = next;
-		}
-		iq->hook = NULL;
 	}
 	// if that irq list was allocated by us, free it
 	if (irq->flags & IRQ_FLAG_ALLOC)
@@ -144,13 +286,10 @@ avr_irq_register_notify(
 	if (!irq || !notify)
 		return;
 	
-	avr_irq_hook_t *hook = irq->hook;
-	while (hook) {
-		if (hook->notify == notify && hook->param == param)
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify == notify && irq->hook[i].param == param)
 			return;	// already there
-		hook = hook->next;
-	}
-	hook = _avr_alloc_irq_hook(irq);
+	avr_irq_hook_t *hook = _avr_alloc_irq_hook(irq);
 	hook->notify = notify;
 	hook->param = param;
 }
@@ -161,53 +300,43 @@ avr_irq_unregister_notify(
 		avr_irq_notify_t notify,
 		void * param)
 {
-	avr_irq_hook_t *hook, *prev;
 	if (!irq || !notify)
 		return;
 
-	hook = irq->hook;
-	prev = NULL;
-	while (hook) {
-		if (hook->notify == notify && hook->param == param) {
-			if ( prev )
-				prev->next = hook->next;
-			else
-				irq->hook = hook->next;
-			free(hook);
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify == notify && irq->hook[i].param == param) {
+			_avr_free_irq_hook(irq, &irq->hook[i]);
 			return;
 		}
-		prev = hook;
-		hook = hook->next;
-	}
 }
 
 void
-avr_raise_irq(
+avr_raise_irq_hooks(
 		avr_irq_t * irq,
-		uint32_t value)
+		uint32_t output)
 {
-	if (!irq)
-		return ;
-	uint32_t output = (irq->flags & IRQ_FLAG_NOT) ? !value : value;
 	// if value is the same but it's the first time, raise it anyway
 	if (irq->value == output &&
 			(irq->flags & IRQ_FLAG_FILTERED) && !(irq->flags & IRQ_FLAG_INIT))
 		return;
 	irq->flags &= ~IRQ_FLAG_INIT;
-	avr_irq_hook_t *hook = irq->hook;
-	while (hook) {
-		avr_irq_hook_t * next = hook->next;
-			// prevents reentrance / endless calling loops
-		if (hook->busy == 0) {
-			hook->busy++;
-			if (hook->notify)
-				hook->notify(irq, output,  hook->param);
-			if (hook->chain)
-				avr_raise_irq(hook->chain, output);
-			hook->busy--;
-		}			
-		hook = next;
+	irq->raising++;
+	// a hook can add another, which might move the table
+	for (int i = irq->hook_count - 1; i >= 0; i--) {
+		// prevents reentrance / endless calling loops
+		if (irq->hook[i].busy)
+			continue;
+		irq->hook[i].busy++;
+		if (irq->pool)
+			irq->pool->hooks_called++;
+		if (irq->hook[i].notify)
+			irq->hook[i].notify(irq, output, irq->hook[i].param);
+		if (irq->hook[i].chain)
+			avr_raise_irq(irq->hook[i].chain, output);
+		irq->hook[i].busy--;
 	}
+	if (--irq->raising == 0 && (irq->flags & IRQ_FLAG_HOOKS_DIRTY))
+		_avr_irq_compact_hooks(irq);
 	// the value is set after the callbacks are called, so the callbacks
 	// can themselves compare for old/new values between their parameter
 	// they are passed (new value) and the previous irq->value
@@ -223,13 +352,10 @@ avr_connect_irq(
 		fprintf(stderr, "error: %s invalid irq %p/%p", __FUNCTION__, src, dst);
 		return;
 	}
-	avr_irq_hook_t *hook = src->hook;
-	while (hook) {
-		if (hook->chain == dst)
+	for (int i = 0; i < src->hook_count; i++)
+		if (src->hook[i].chain == dst)
 			return;	// already there
-		hook = hook->next;
-	}
-	hook = _avr_alloc_irq_hook(src);
+	avr_irq_hook_t *hook = _avr_alloc_irq_hook(src);
 	hook->chain = dst;
 }
 
@@ -238,24 +364,43 @@ avr_unconnect_irq(
 		avr_irq_t * src,
 		avr_irq_t * dst)
 {
-	avr_irq_hook_t *hook, *prev;
-
 	if (!src || !dst || src == dst) {
 		fprintf(stderr, "error: %s invalid irq %p/%p", __FUNCTION__, src, dst);
 		return;
 	}
-	hook = src->hook;
-	prev = NULL;
-	while (hook) {
-		if (hook->chain == dst) {
-			if ( prev )
-				prev->next = hook->next;
-			else
-				src->hook = hook->next;
-			free(hook);
+	for (int i = 0; i < src->hook_count; i++)
+		if (src->hook[i].chain == dst) {
+			_avr_free_irq_hook(src, &src->hook[i]);
 			return;
 		}
-		prev = hook;
-		hook = hook->next;
+}
+
+/*
+ * Only the values and the "not used yet" flag change at runtime, the hooks
+ * and the other flags are set up by whoever created the IRQs.
+ */
+void
+avr_irq_pool_snapshot(
+		avr_irq_pool_t * pool,
+		avr_snapshot_t * s)
+{
+	int count = pool->count;
+
+	avr_snapshot_section(s, "irqs");
+	AVR_SNAPSHOT_FIELD(s, count);
+	if (count != pool->count) {
+		s->error = 1;
+		return;
+	}
+	for (int i = 0; i < count && !s->error; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		uint32_t value = irq ? irq->value : 0;
+		uint8_t init = irq ? irq->flags & IRQ_FLAG_INIT : 0;
+		AVR_SNAPSHOT_FIELD(s, value);
+		AVR_SNAPSHOT_FIELD(s, init);
+		if (irq && s->restore) {
+			irq->value = value;
+			irq->flags = (irq->flags & ~IRQ_FLAG_INIT) | init;
+		}
 	}
 }
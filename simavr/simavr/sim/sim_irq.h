@@ -42,6 +42,9 @@ extern "C" {
  * 
  * IRQ hook needs to be registered in reset() handlers, ie after all modules init() bits
  * have been called, to prevent race condition of the initialization order.
+ *
+ * The hooks of an IRQ are kept in one table, allocated from its pool's arena. Raising
+ * an IRQ nobody listens to is inlined, and only updates its value.
  */
 struct avr_irq_t;
 
@@ -56,14 +59,21 @@ enum {
 	IRQ_FLAG_FILTERED	= (1 << 1),	//!< do not "notify" if "value" is the same as previous raise
 	IRQ_FLAG_ALLOC		= (1 << 2), //!< this irq structure was malloced via avr_alloc_irq
 	IRQ_FLAG_INIT		= (1 << 3), //!< this irq hasn't been used yet
+	IRQ_FLAG_HOOKS_DIRTY	= (1 << 4), //!< hooks were removed while raising it
 };
 
+struct avr_irq_hook_t;
+struct avr_irq_arena_t;
+
 /*
  * IRQ Pool structure
  */
 typedef struct avr_irq_pool_t {
 	int count;						//!< number of irqs living in the pool
 	struct avr_irq_t ** irq;		//!< irqs belonging in this pool
+	struct avr_irq_arena_t * arena;	//!< hook tables of these irqs
+	uint64_t raised;				//!< avr_raise_irq() calls on these irqs
+	uint64_t hooks_called;			//!< hooks and chained irqs they notified
 } avr_irq_pool_t;
 
 /*!
@@ -75,7 +85,10 @@ typedef struct avr_irq_t {
 	uint32_t			irq;		//!< any value the user needs
 	uint32_t			value;		//!< current value
 	uint8_t				flags;		//!< IRQ_* flags
-	struct avr_irq_hook_t * hook;	//!< list of hooks to be notified
+	uint8_t				raising;	//!< nesting depth of avr_raise_irq() on this irq
+	uint16_t			hook_count;	//!< hooks to be notified, zero if nobody listens
+	uint16_t			hook_size;	//!< size of the hook table
+	struct avr_irq_hook_t * hook;	//!< table of hooks to be notified
 } avr_irq_t;
 
 //! allocates 'count' IRQs, initializes their "irq" starting from 'base' and increment
@@ -98,11 +111,47 @@ avr_init_irq(
 		uint32_t base,
 		uint32_t count,
 		const char ** names /* optional */);
-//! 'raise' an IRQ. Ie call their 'hooks', and raise any chained IRQs, and set the new 'value'
+//! calls the hooks of 'irq' with 'output', for avr_raise_irq()
 void
+avr_raise_irq_hooks(
+		avr_irq_t * irq,
+		uint32_t output);
+
+//! is anything hooked or connected to 'irq'
+static inline int
+avr_irq_has_listeners(
+		const avr_irq_t * irq)
+{
+	return irq->hook_count != 0;
+}
+
+//! avr_raise_irq() without counting it in the pool, for callers that count it themselves
+static inline void
+_avr_raise_irq(
+		avr_irq_t * irq,
+		uint32_t value)
+{
+	uint32_t output = (irq->flags & IRQ_FLAG_NOT) ? !value : value;
+	if (!irq->hook_count) {
+		irq->flags &= ~IRQ_FLAG_INIT;
+		irq->value = output;
+		return;
+	}
+	avr_raise_irq_hooks(irq, output);
+}
+
+//! 'raise' an IRQ. Ie call their 'hooks', and raise any chained IRQs, and set the new 'value'
+static inline void
 avr_raise_irq(
 		avr_irq_t * irq,
-		uint32_t value);
+		uint32_t value)
+{
+	if (!irq)
+		return ;
+	if (irq->pool)
+		irq->pool->raised++;
+	_avr_raise_irq(irq, value);
+}
 //! this connects a "source" IRQ to a "destination" IRQ
 void
 avr_connect_irq(
@@ -126,6 +175,18 @@ avr_irq_unregister_notify(
 		avr_irq_notify_t notify,
 		void * param);
 
+//! frees the irq table and the hook arena of 'pool', once its irqs aren't used any more
+void
+avr_irq_pool_free(
+		avr_irq_pool_t * pool);
+
+struct avr_snapshot_t;
+//! save/restore the values of all the IRQs in 'pool', see sim_snapshot.h
+void
+avr_irq_pool_snapshot(
+		avr_irq_pool_t * pool,
+		struct avr_snapshot_t * s);
+
 #ifdef __cplusplus
 };
 #endif
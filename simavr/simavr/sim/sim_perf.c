@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_perf.h"
+
+void avr_perf_get(struct avr_t *avr, avr_perf_stats_t *stats)
+{
+    *stats = avr->perf;
+    // the core sends the start of sram down the io path too, but it isn't io
+    for (int io = AVR_DATA_TO_IO(avr->ramstart); io >= 0 && io < AVR_PERF_MAX_IOS; io++)
+        stats->io_reads[io] = stats->io_writes[io] = 0;
+    stats->irqs_raised = avr->irq_pool.raised;
+    stats->irq_hooks_called = avr->irq_pool.hooks_called;
+}
+
+void avr_perf_reset(struct avr_t *avr)
+{
+    memset(&avr->perf, 0, sizeof(avr->perf));
+    avr->irq_pool.raised = 0;
+    avr->irq_pool.hooks_called = 0;
+}
+
+void avr_perf_count_ops(struct avr_t *avr, int on)
+{
+    on = !!on;
+    if (avr->perf_ops == on)
+        return;
+    avr->perf_ops = on;
+    avr_flash_unshare(avr);
+    avr_decode_flash(avr, 0, avr->flashend + 1);
+}
+
+uint64_t avr_perf_instructions(const avr_perf_stats_t *stats)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < AVR_PERF_MAX_OPS; i++)
+        total += stats->ops[i].count;
+    return total;
+}
+
+uint64_t avr_perf_cycles(const avr_perf_stats_t *stats)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < AVR_PERF_MAX_OPS; i++)
+        total += stats->ops[i].cycles;
+    return total;
+}
+
+const char *avr_perf_exit_name(avr_perf_exit exit)
+{
+    static const char *const names[avr_perf_exit_count] = {
+        "timer", "interrupt", "sleep", "break", "stopped", "done"
+    };
+    return (unsigned)exit < avr_perf_exit_count ? names[exit] : "?";
+}
+
+// a non-zero total, and the op or io it belongs to
+typedef struct perf_rank_t
+{
+    uint64_t total;
+    int index;
+} perf_rank_t;
+
+// biggest total first
+static int compare_ranks(const void *a, const void *b)
+{
+    const perf_rank_t *ra = (const perf_rank_t *)a, *rb = (const perf_rank_t *)b;
+    if (ra->total != rb->total)
+        return ra->total < rb->total ? 1 : -1;
+    return ra->index - rb->index;
+}
+
+// fills rank with the non-zero totals, in order, and returns how many
+static int sorted_ranks(perf_rank_t *rank, const uint64_t *totals, int count)
+{
+    int used = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (totals[i])
+        {
+            rank[used].total = totals[i];
+            rank[used].index = i;
+            used++;
+        }
+    }
+    qsort(rank, used, sizeof(*rank), compare_ranks);
+    return used;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total ? 100.0 * part / total : 0;
+}
+
+void avr_perf_print(const avr_perf_stats_t *stats, FILE *out)
+{
+    uint64_t instructions = avr_perf_instructions(stats);
+    uint64_t cycles = avr_perf_cycles(stats);
+    uint64_t totals[AVR_PERF_MAX_IOS];
+    perf_rank_t rank[AVR_PERF_MAX_IOS];
+
+    if (instructions)
+        fprintf(out, "instructions     %llu, %llu cycles, %.2f cycles each\n", (unsigned long long)instructions,
+                (unsigned long long)cycles, (double)cycles / instructions);
+    else
+        fprintf(out, "instructions     not counted\n");
+    fprintf(out, "sleeping         %llu times, %llu cycles\n", (unsigned long long)stats->sleeps,
+            (unsigned long long)stats->sleep_cycles);
+    fprintf(out, "cycle timers     %llu fired\n", (unsigned long long)stats->timers_fired);
+    fprintf(out, "interrupts       %llu serviced\n", (unsigned long long)stats->interrupts_serviced);
+    fprintf(out, "irqs             %llu raised, %llu hooks called\n", (unsigned long long)stats->irqs_raised,
+            (unsigned long long)stats->irq_hooks_called);
+    fprintf(out, "runs             %llu", (unsigned long long)stats->runs);
+    for (int i = 0; i < avr_perf_exit_count; i++)
+    {
+        if (stats->run_exits[i])
+            fprintf(out, ", %s %llu", avr_perf_exit_name((avr_perf_exit)i), (unsigned long long)stats->run_exits[i]);
+    }
+    fprintf(out, "\n");
+
+    for (int i = 0; i < AVR_PERF_MAX_OPS; i++)
+        totals[i] = stats->ops[i].cycles;
+    int used = sorted_ranks(rank, totals, AVR_PERF_MAX_OPS);
+    if (used)
+        fprintf(out, "\n%-8s %14s %7s %14s %7s\n", "op", "count", "%", "cycles", "%");
+    for (int i = 0; i < used; i++)
+    {
+        int op = rank[i].index;
+        fprintf(out, "%-8s %14llu %6.2f%% %14llu %6.2f%%\n", avr_perf_op_name(op),
+                (unsigned long long)stats->ops[op].count, percent(stats->ops[op].count, instructions),
+                (unsigned long long)stats->ops[op].cycles, percent(stats->ops[op].cycles, cycles));
+    }
+
+    for (int i = 0; i < AVR_PERF_MAX_IOS; i++)
+        totals[i] = stats->io_reads[i] + stats->io_writes[i];
+    used = sorted_ranks(rank, totals, AVR_PERF_MAX_IOS);
+    if (used)
+        fprintf(out, "\n%-8s %14s %14s\n", "io", "reads", "writes");
+    for (int i = 0; i < used; i++)
+    {
+        int io = rank[i].index;
+        fprintf(out, "0x%04x   %14llu %14llu\n", io + 32, (unsigned long long)stats->io_reads[io],
+                (unsigned long long)stats->io_writes[io]);
+    }
+}
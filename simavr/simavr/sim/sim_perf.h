@@ -0,0 +1,76 @@
+#ifndef __SIM_PERF_H
+#define __SIM_PERF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct avr_t;
+
+// room for the core's instruction handlers, see AVR_OPS in sim_core.c
+#define AVR_PERF_MAX_OPS            80
+// io registers, indexed by AVR_DATA_TO_IO(), the same as avr_t.io
+#define AVR_PERF_MAX_IOS            280
+
+// why avr_run_one() handed control back to avr_run()
+typedef enum avr_perf_exit
+{
+    avr_perf_exit_timer,            // ran up to the next cycle timer
+    avr_perf_exit_interrupt,        // an interrupt is pending
+    avr_perf_exit_sleep,            // the firmware went to sleep
+    avr_perf_exit_break,            // avr_run_break()
+    avr_perf_exit_stopped,          // gdb stopped or stepped it
+    avr_perf_exit_done,             // cpu_Done or cpu_Crashed
+    avr_perf_exit_count
+} avr_perf_exit;
+
+/*
+ * Counters kept by every avr_t as it runs, in avr->perf, they only cost an
+ * increment where they're counted. The instructions are only counted after
+ * avr_perf_count_ops(), by handler, each of which covers a class of opcodes
+ * (brxs is every conditional branch, ld_x is all the ld X variants...), see
+ * avr_perf_op_name(). Instructions in superblocks and fast forwarded loops
+ * are counted as if they had run one at a time.
+ *
+ * The irq counters live in avr->irq_pool and only cover the irqs allocated
+ * from it, avr_perf_get() adds them in.
+ */
+typedef struct avr_perf_stats_t
+{
+    uint64_t runs;                  // calls to avr_run()
+    uint64_t run_exits[avr_perf_exit_count];
+    uint64_t irqs_raised;           // avr_raise_irq() calls
+    uint64_t irq_hooks_called;      // notify hooks and chained irqs
+    uint64_t timers_fired;          // cycle timer callbacks
+    uint64_t interrupts_serviced;
+    uint64_t sleeps;                // times the core slept to the next timer
+    uint64_t sleep_cycles;          // cycles skipped by sleeping
+
+    struct
+    {
+        uint64_t count;             // instructions retired
+        uint64_t cycles;            // and the cycles they took
+    } ops[AVR_PERF_MAX_OPS];
+    uint64_t io_reads[AVR_PERF_MAX_IOS];
+    uint64_t io_writes[AVR_PERF_MAX_IOS];
+} avr_perf_stats_t;
+
+// copy out avr's counters, only while it isn't running on another thread
+void avr_perf_get(struct avr_t *avr, avr_perf_stats_t *stats);
+// start counting again from zero
+void avr_perf_reset(struct avr_t *avr);
+// count the instructions too, or stop, this decodes the flash again with a
+// counting handler, so it costs nothing while off
+void avr_perf_count_ops(struct avr_t *avr, int on);
+
+// name of the handler op counts instructions by, NULL past the last one
+const char *avr_perf_op_name(unsigned op);
+// total instructions and cycles over all the ops
+uint64_t avr_perf_instructions(const avr_perf_stats_t *stats);
+uint64_t avr_perf_cycles(const avr_perf_stats_t *stats);
+
+const char *avr_perf_exit_name(avr_perf_exit exit);
+
+// human readable report, the busiest ops and io registers first
+void avr_perf_print(const avr_perf_stats_t *stats, FILE *out);
+
+#endif      // __SIM_PERF_H
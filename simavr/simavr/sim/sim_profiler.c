@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_interrupts.h"
+#include "sim_cycle_timers.h"
+#include "sim_profiler.h"
+
+#define NO_TARGET   0xffffffff
+
+static uint16_t flash_word(avr_t *avr, uint32_t addr)
+{
+    return avr->flash[addr] | (avr->flash[addr + 1] << 8);
+}
+
+// if the instruction before 'ret' is a call, its length, and where it went, if it's known
+static int call_before(avr_t *avr, uint32_t ret, uint32_t *target)
+{
+    if (ret >= 4)
+    {
+        uint16_t op = flash_word(avr, ret - 4);
+        if ((op & 0xfe0e) == 0x940e)        // call
+        {
+            *target = ((((op & 0x01f0) >> 3) | (op & 1)) << 16 | flash_word(avr, ret - 2)) << 1;
+            return 4;
+        }
+    }
+    if (ret >= 2)
+    {
+        uint16_t op = flash_word(avr, ret - 2);
+        if ((op & 0xf000) == 0xd000)        // rcall, wraps around small flashes
+        {
+            *target = (ret + ((int16_t)(op << 4) >> 3)) & avr->flashend;
+            return 2;
+        }
+        if (op == 0x9509 || op == 0x9519)   // icall, eicall
+        {
+            *target = NO_TARGET;
+            return 2;
+        }
+    }
+    return 0;
+}
+
+// where the jmp or rjmp at 'addr' goes, if it is one
+static uint32_t jump_target(avr_t *avr, uint32_t addr)
+{
+    uint16_t op = flash_word(avr, addr);
+    if ((op & 0xfe0e) == 0x940c && addr + 4 <= avr->codeend)
+        return ((((op & 0x01f0) >> 3) | (op & 1)) << 16 | flash_word(avr, addr + 2)) << 1;
+    if ((op & 0xf000) == 0xc000)
+        return (addr + 2 + ((int16_t)(op << 4) >> 3)) & avr->flashend;
+    return NO_TARGET;
+}
+
+uint32_t avr_profiler_vector_handler(struct avr_t *avr, int vector)
+{
+    uint32_t addr = vector * avr->vector_size;
+    if (addr + 4 > avr->codeend)
+        return NO_TARGET;
+    return jump_target(avr, addr);
+}
+
+/*
+ * Cycle timers run between an instruction and the pc moving on, so avr->pc
+ * is still the instruction just run. That is the right function, except
+ * when it was a call or a return, which have already changed the stack:
+ * the leaf is then the function called, or the one returned to. Jumps are
+ * followed too, so a sample just after an interrupt's vector lands in its
+ * handler rather than in the vector table.
+ */
+static uint32_t sample_pc(avr_t *avr, uint32_t sp)
+{
+    uint32_t pc = avr->pc;
+    int size = avr->address_size;
+
+    // while sleeping, the core hasn't run anything, pc is the next instruction
+    if (avr->state == cpu_Sleeping || pc + 2 > avr->codeend)
+        return pc;
+
+    uint16_t op = flash_word(avr, pc);
+    uint32_t target = jump_target(avr, pc);
+    if (target != NO_TARGET)
+        return target;
+    if (op == 0x9409 || (op == 0x9419 && avr->eind))   // ijmp, eijmp
+        return (avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (op == 0x9419 ? avr->data[avr->eind] << 16 : 0)) << 1;
+    if (op == 0x9508 || op == 0x9518)       // ret, reti, the address is still there below sp
+    {
+        if (sp < (uint32_t)size)
+            return pc;
+        uint32_t ret = 0;
+        for (int b = 0; b < size; b++)
+            ret = (ret << 8) | avr->data[sp - size + b];
+        return ret << 1;
+    }
+
+    uint32_t len = 0;
+    if ((op & 0xfe0e) == 0x940e && pc + 4 <= avr->codeend)   // call
+    {
+        len = 4;
+        target = ((((op & 0x01f0) >> 3) | (op & 1)) << 16 | flash_word(avr, pc + 2)) << 1;
+    }
+    else if ((op & 0xf000) == 0xd000)       // rcall
+    {
+        len = 2;
+        target = (pc + 2 + ((int16_t)(op << 4) >> 3)) & avr->flashend;
+    }
+    else if (op == 0x9509 || (op == 0x9519 && avr->eind))  // icall, eicall, Z hasn't changed
+    {
+        len = 2;
+        target = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+        if (op == 0x9519)
+            target |= avr->data[avr->eind] << 16;
+        target <<= 1;
+    }
+    if (!len || sp + size > avr->ramend + 1)
+        return pc;
+
+    // only if the call has pushed its return address
+    uint32_t ret = 0;
+    for (int b = 0; b < size; b++)
+        ret = (ret << 8) | avr->data[sp + b];
+    return (ret << 1) == pc + len ? target : pc;
+}
+
+static avr_cycle_count_t sample_timer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    avr_profiler_t *profiler = (avr_profiler_t *)param;
+    avr_profiler_sample(profiler);
+    return when + profiler->interval;
+}
+
+// remembers where each interrupt started on the stack, the walk stops there
+static void interrupt_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    avr_profiler_t *profiler = (avr_profiler_t *)param;
+    avr_t *avr = profiler->avr;
+    int running = avr->interrupts.running_ptr;
+
+    // a reti has already popped its vector, an entry is yet to push it
+    if (running < profiler->interrupt_depth || running >= AVR_PROFILER_MAX_INTERRUPTS)
+    {
+        profiler->interrupt_depth = running;
+        return;
+    }
+    profiler->interrupt_sp[running] = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+    profiler->interrupt_vector[running] = value;
+    profiler->interrupt_depth = running + 1;
+}
+
+int avr_profiler_start(avr_profiler_t *profiler, struct avr_t *avr, uint32_t interval)
+{
+    memset(profiler, 0, sizeof(*profiler));
+    profiler->avr = avr;
+    profiler->interval = interval ? interval : 1;
+
+    profiler->stack_mask = 255;
+    profiler->stacks = (avr_profiler_stack_t *)calloc(profiler->stack_mask + 1, sizeof(avr_profiler_stack_t));
+    profiler->frame_size = 1024;
+    profiler->frames = (uint32_t *)malloc(profiler->frame_size * sizeof(uint32_t));
+    if (profiler->stacks == NULL || profiler->frames == NULL)
+    {
+        avr_profiler_free(profiler);
+        return -1;
+    }
+
+    // interrupts already running when we start, their stack is unknown, so the walk goes to the top
+    profiler->interrupt_depth = avr->interrupts.running_ptr;
+    if (profiler->interrupt_depth > AVR_PROFILER_MAX_INTERRUPTS)
+        profiler->interrupt_depth = AVR_PROFILER_MAX_INTERRUPTS;
+    for (int i = 0; i < profiler->interrupt_depth; i++)
+    {
+        profiler->interrupt_sp[i] = avr->ramend;
+        profiler->interrupt_vector[i] = avr->interrupts.running[i]->vector;
+    }
+
+    avr_irq_register_notify(avr->interrupts.irq + AVR_INT_IRQ_RUNNING, interrupt_hook, profiler);
+    avr_cycle_timer_register(avr, profiler->interval, sample_timer, profiler);
+    profiler->running = 1;
+    return 0;
+}
+
+void avr_profiler_stop(avr_profiler_t *profiler)
+{
+    if (!profiler->running)
+        return;
+    avr_cycle_timer_cancel(profiler->avr, sample_timer, profiler);
+    avr_irq_unregister_notify(profiler->avr->interrupts.irq + AVR_INT_IRQ_RUNNING, interrupt_hook, profiler);
+    profiler->running = 0;
+}
+
+void avr_profiler_free(avr_profiler_t *profiler)
+{
+    if (profiler->avr)
+        avr_profiler_stop(profiler);
+    free(profiler->stacks);
+    free(profiler->frames);
+    memset(profiler, 0, sizeof(*profiler));
+}
+
+static uint32_t hash_frames(const uint32_t *frames, int depth)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < depth; i++)
+    {
+        uint32_t frame = frames[i];
+        for (int b = 0; b < 4; b++, frame >>= 8)
+            hash = (hash ^ (frame & 0xff)) * 16777619u;
+    }
+    return hash;
+}
+
+static avr_profiler_stack_t *find_stack(avr_profiler_stack_t *stacks, uint32_t mask, const uint32_t *all_frames,
+                                        uint32_t hash, const uint32_t *frames, int depth)
+{
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        avr_profiler_stack_t *stack = &stacks[i];
+        if (stack->samples == 0)
+            return stack;
+        if (stack->hash == hash && stack->depth == (uint32_t)depth &&
+            !memcmp(all_frames + stack->frames, frames, depth * sizeof(*frames)))
+            return stack;
+    }
+}
+
+static int grow_stacks(avr_profiler_t *profiler)
+{
+    uint32_t mask = profiler->stack_mask * 2 + 1;
+    avr_profiler_stack_t *stacks = (avr_profiler_stack_t *)calloc(mask + 1, sizeof(avr_profiler_stack_t));
+    if (stacks == NULL)
+        return -1;
+    for (uint32_t i = 0; i <= profiler->stack_mask; i++)
+    {
+        avr_profiler_stack_t *stack = &profiler->stacks[i];
+        if (stack->samples == 0)
+            continue;
+        uint32_t slot = stack->hash & mask;
+        while (stacks[slot].samples)
+            slot = (slot + 1) & mask;
+        stacks[slot] = *stack;
+    }
+    free(profiler->stacks);
+    profiler->stacks = stacks;
+    profiler->stack_mask = mask;
+    return 0;
+}
+
+static void add_stack(avr_profiler_t *profiler, const uint32_t *frames, int depth)
+{
+    uint32_t hash = hash_frames(frames, depth);
+    avr_profiler_stack_t *stack = find_stack(profiler->stacks, profiler->stack_mask, profiler->frames, hash, frames, depth);
+    if (stack->samples)
+    {
+        stack->samples++;
+        return;
+    }
+
+    // a new one, keep the table at most half full
+    if (profiler->stack_count >= (profiler->stack_mask + 1) / 2)
+    {
+        if (grow_stacks(profiler))
+            return;
+        stack = find_stack(profiler->stacks, profiler->stack_mask, profiler->frames, hash, frames, depth);
+    }
+    if (profiler->frame_count + depth > profiler->frame_size)
+    {
+        uint32_t size = profiler->frame_size * 2 + depth;
+        uint32_t *grown = (uint32_t *)realloc(profiler->frames, size * sizeof(uint32_t));
+        if (grown == NULL)
+            return;
+        profiler->frames = grown;
+        profiler->frame_size = size;
+    }
+    memcpy(profiler->frames + profiler->frame_count, frames, depth * sizeof(*frames));
+    stack->hash = hash;
+    stack->depth = depth;
+    stack->frames = profiler->frame_count;
+    stack->samples = 1;
+    profiler->frame_count += depth;
+    profiler->stack_count++;
+}
+
+void avr_profiler_sample(avr_profiler_t *profiler)
+{
+    avr_t *avr = profiler->avr;
+    uint32_t pcs[AVR_PROFILER_MAX_DEPTH];
+    uint32_t targets[AVR_PROFILER_MAX_DEPTH + 1];   // targets[i] is the call at pcs[i] went to, ie pcs[i - 1]'s function
+    uint32_t frames[AVR_PROFILER_MAX_DEPTH + 1];
+    int size = avr->address_size;
+    uint32_t sp = (avr->data[R_SPL] | (avr->data[R_SPH] << 8)) + 1;
+    uint32_t end = avr->ramend + 1;
+    int depth = 1;
+
+    // missed a reset, which drops the running interrupts without telling anyone
+    if (profiler->interrupt_depth > avr->interrupts.running_ptr)
+        profiler->interrupt_depth = avr->interrupts.running_ptr;
+    int interrupt = profiler->interrupt_depth;
+    if (interrupt && profiler->interrupt_sp[interrupt - 1] < avr->ramend)
+        end = profiler->interrupt_sp[interrupt - 1] + 1;
+
+    pcs[0] = sample_pc(avr, sp);
+    targets[0] = NO_TARGET;
+    while (sp + size <= end)
+    {
+        uint32_t ret = 0;
+        for (int b = 0; b < size; b++)
+            ret = (ret << 8) | avr->data[sp + b];
+        ret <<= 1;
+        int len = ret < avr->codeend ? call_before(avr, ret, &targets[depth]) : 0;
+        if (!len)
+        {
+            sp++;       // saved registers, locals...
+            continue;
+        }
+        if (depth == AVR_PROFILER_MAX_DEPTH)
+        {
+            profiler->truncated++;
+            break;
+        }
+        pcs[depth++] = ret - len;
+        sp += size;
+    }
+    // the outermost function of a handler was 'called' from its vector
+    targets[depth] = interrupt ? avr_profiler_vector_handler(avr, profiler->interrupt_vector[interrupt - 1]) : NO_TARGET;
+
+    int count = 0;
+    for (int i = depth - 1; i >= 0; i--)
+    {
+        avr_symbol_t *symbol = avr_symbol_at(avr, pcs[i]);
+        if (symbol)
+            frames[count++] = symbol->addr;
+        else if (targets[i + 1] != NO_TARGET && targets[i + 1] <= pcs[i])
+            frames[count++] = targets[i + 1];
+        else
+            frames[count++] = pcs[i] | AVR_PROFILER_FRAME_PC;
+    }
+    if (avr->state == cpu_Sleeping)
+        frames[count++] = AVR_PROFILER_FRAME_SLEEP;
+
+    add_stack(profiler, frames, count);
+    profiler->samples++;
+}
+
+const char *avr_profiler_frame_name(struct avr_t *avr, uint32_t frame, char *buffer, size_t size)
+{
+    if (frame == AVR_PROFILER_FRAME_SLEEP)
+        return "[sleep]";
+    if (frame & AVR_PROFILER_FRAME_PC)
+    {
+        snprintf(buffer, size, "0x%04x", frame & ~AVR_PROFILER_FRAME_PC);
+        return buffer;
+    }
+    avr_symbol_t *symbol = avr_symbol_at(avr, frame);
+    if (symbol && symbol->addr == frame)
+        return symbol->symbol;
+    for (int i = 0; i < avr->interrupts.vector_count; i++)
+    {
+        int vector = avr->interrupts.vector[i]->vector;
+        if (avr_profiler_vector_handler(avr, vector) == frame)
+        {
+            snprintf(buffer, size, "__vector_%d", vector);
+            return buffer;
+        }
+    }
+    snprintf(buffer, size, "sub_%04x", frame);
+    return buffer;
+}
+
+int avr_profiler_write_folded(const avr_profiler_t *profiler, FILE *out)
+{
+    char buffer[32];
+
+    for (uint32_t i = 0; i <= profiler->stack_mask; i++)
+    {
+        const avr_profiler_stack_t *stack = &profiler->stacks[i];
+        if (stack->samples == 0)
+            continue;
+        for (uint32_t f = 0; f < stack->depth; f++)
+        {
+            if (f)
+                fputc(';', out);
+            fputs(avr_profiler_frame_name(profiler->avr, profiler->frames[stack->frames + f], buffer, sizeof(buffer)), out);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)stack->samples);
+    }
+    return ferror(out) ? -1 : 0;
+}
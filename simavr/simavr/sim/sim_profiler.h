@@ -0,0 +1,84 @@
+#ifndef __SIM_PROFILER_H
+#define __SIM_PROFILER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct avr_t;
+struct avr_irq_t;
+
+// deepest call stack kept per sample
+#define AVR_PROFILER_MAX_DEPTH      64
+// nested interrupts followed, the same as avr_int_table_t.running
+#define AVR_PROFILER_MAX_INTERRUPTS 64
+
+// frames are the address of the function they're in, or one of these
+#define AVR_PROFILER_FRAME_PC       0x40000000      // just the pc, the function isn't known
+#define AVR_PROFILER_FRAME_SLEEP    0x80000000      // the cpu was sleeping
+
+// one distinct call stack and how many samples landed in it
+typedef struct avr_profiler_stack_t
+{
+    uint32_t hash;
+    uint32_t depth;
+    uint32_t frames;                // index of its outermost frame in avr_profiler_t.frames
+    uint64_t samples;
+} avr_profiler_stack_t;
+
+/*
+ * Sampling profiler for the firmware. A cycle timer looks at the pc every
+ * 'interval' cycles, and walks the stack for the calls that led there: the
+ * AVR keeps no frame pointers, so every word on the stack that points just
+ * after a call instruction is taken to be a return address. In an
+ * interrupt, the walk stops where the interrupt was entered, so handlers
+ * show up as stacks of their own, rooted at the vector.
+ *
+ * Functions are named from the elf symbols (avr->symbol). Without them,
+ * eg for hex files, a function is named by the address it was called at,
+ * as sub_XXXX, or 0xXXXX for the pc when even that isn't known.
+ *
+ * The profiler's timer can't be saved in a snapshot, stop it first.
+ */
+typedef struct avr_profiler_t
+{
+    struct avr_t *avr;
+    uint32_t interval;              // cycles between samples
+    uint64_t samples;
+    uint64_t truncated;             // samples with more than AVR_PROFILER_MAX_DEPTH calls
+    int running;
+
+    // distinct call stacks, open addressing on their hash
+    avr_profiler_stack_t *stacks;
+    uint32_t stack_count;
+    uint32_t stack_mask;            // table size - 1, size is a power of two
+
+    // frames of all the stacks, outermost first
+    uint32_t *frames;
+    uint32_t frame_count;
+    uint32_t frame_size;
+
+    // stack pointer each running interrupt was entered with, after the pc was pushed
+    uint16_t interrupt_sp[AVR_PROFILER_MAX_INTERRUPTS];
+    uint8_t interrupt_vector[AVR_PROFILER_MAX_INTERRUPTS];
+    int interrupt_depth;
+} avr_profiler_t;
+
+// start sampling avr every 'interval' cycles, returns 0 on success
+int avr_profiler_start(avr_profiler_t *profiler, struct avr_t *avr, uint32_t interval);
+// stop sampling, the samples are kept
+void avr_profiler_stop(avr_profiler_t *profiler);
+// stop, and free the samples
+void avr_profiler_free(avr_profiler_t *profiler);
+
+// take a sample now, the cycle timer calls this
+void avr_profiler_sample(avr_profiler_t *profiler);
+
+// name of a frame of avr's firmware, into 'buffer' if it has to be made up
+const char *avr_profiler_frame_name(struct avr_t *avr, uint32_t frame, char *buffer, size_t size);
+// where the jmp or rjmp in the slot for 'vector' goes, 0xffffffff if it's something else
+uint32_t avr_profiler_vector_handler(struct avr_t *avr, int vector);
+
+// write the samples as folded stacks, "outer;inner;leaf count" per line, for flamegraph.pl and the like
+int avr_profiler_write_folded(const avr_profiler_t *profiler, FILE *out);
+
+#endif      // __SIM_PROFILER_H
@@ -0,0 +1,349 @@
+/*
+	sim_snapshot.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_io.h"
+#include "sim_snapshot.h"
+
+// pointer tags, followed by the offset in the base
+enum {
+	AVR_SNAPSHOT_PTR_NULL = 0,
+	AVR_SNAPSHOT_PTR_BASE,		// + base index
+};
+
+typedef struct avr_snapshot_header_t {
+	char		magic[4];
+	uint32_t	version;
+	char		mmcu[16];
+	uint32_t	flashend;
+	uint32_t	ramend;
+	uint32_t	e2end;
+	uint32_t	core_size;
+	uint32_t	flags;
+	uint32_t	reserved;
+	// distance between two functions, catches snapshots from another build
+	int64_t		code_check;
+} avr_snapshot_header_t;
+
+void
+avr_snapshot_init(
+		avr_snapshot_t * s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void
+avr_snapshot_init_restore(
+		avr_snapshot_t * s,
+		const void * data,
+		size_t size)
+{
+	memset(s, 0, sizeof(*s));
+	s->data = (uint8_t *)data;
+	s->size = size;
+	s->restore = 1;
+}
+
+void
+avr_snapshot_free(
+		avr_snapshot_t * s)
+{
+	if (s->alloc)
+		free(s->data);
+	s->data = NULL;
+	s->size = s->alloc = s->pos = 0;
+}
+
+int
+avr_snapshot_add_base(
+		avr_snapshot_t * s,
+		void * base,
+		size_t size)
+{
+	// slot 0 is kept for the core
+	if (s->base_count == 0)
+		s->base_count = 1;
+	if (s->base_count == AVR_SNAPSHOT_MAX_BASES)
+		return -1;
+	s->bases[s->base_count].base = base;
+	s->bases[s->base_count].size = size;
+	return s->base_count++;
+}
+
+int
+avr_snapshot_add_function(
+		avr_snapshot_t * s,
+		void (*function)(void))
+{
+	for (int i = 0; i < s->function_count; i++)
+		if (s->functions[i] == function)
+			return i;
+	if (s->function_count == AVR_SNAPSHOT_MAX_FUNCTIONS)
+		return -1;
+	s->functions[s->function_count] = function;
+	return s->function_count++;
+}
+
+void
+avr_snapshot_field(
+		avr_snapshot_t * s,
+		void * field,
+		size_t size)
+{
+	if (s->error)
+		return;
+	if (s->restore) {
+		if (s->pos + size > s->size) {
+			s->error = 1;
+			return;
+		}
+		memcpy(field, s->data + s->pos, size);
+		s->pos += size;
+		return;
+	}
+	if (s->size + size > s->alloc) {
+		size_t alloc = s->alloc ? s->alloc : 4096;
+		while (alloc < s->size + size)
+			alloc *= 2;
+		uint8_t * data = realloc(s->data, alloc);
+		if (!data) {
+			s->error = 1;
+			return;
+		}
+		s->data = data;
+		s->alloc = alloc;
+	}
+	memcpy(s->data + s->size, field, size);
+	s->size += size;
+}
+
+void
+avr_snapshot_pointer(
+		avr_snapshot_t * s,
+		void ** pointer)
+{
+	uint8_t tag = AVR_SNAPSHOT_PTR_NULL;
+	uint64_t offset = 0;
+
+	if (!s->restore && *pointer) {
+		uint8_t * p = (uint8_t *)*pointer;
+		int i;
+		for (i = 0; i < s->base_count; i++) {
+			uint8_t * base = (uint8_t *)s->bases[i].base;
+			if (p >= base && p < base + s->bases[i].size)
+				break;
+		}
+		if (i == s->base_count) {
+			// not something we know how to find again
+			s->error = 1;
+			return;
+		}
+		tag = AVR_SNAPSHOT_PTR_BASE + i;
+		offset = p - (uint8_t *)s->bases[i].base;
+	}
+	AVR_SNAPSHOT_FIELD(s, tag);
+	AVR_SNAPSHOT_FIELD(s, offset);
+
+	if (s->restore && !s->error) {
+		if (tag == AVR_SNAPSHOT_PTR_NULL) {
+			*pointer = NULL;
+		} else if (tag - AVR_SNAPSHOT_PTR_BASE < s->base_count &&
+				offset < s->bases[tag - AVR_SNAPSHOT_PTR_BASE].size) {
+			*pointer = (uint8_t *)s->bases[tag - AVR_SNAPSHOT_PTR_BASE].base + offset;
+		} else
+			s->error = 1;
+	}
+}
+
+void
+avr_snapshot_function(
+		avr_snapshot_t * s,
+		void (**function)(void))
+{
+	uint8_t null = *function == NULL;
+	uint32_t index = 0;
+
+	if (!s->restore && !null) {
+		while (index < s->function_count && s->functions[index] != *function)
+			index++;
+		if (index == s->function_count) {
+			// nobody said what this is, it can't be found again
+			s->error = 1;
+			return;
+		}
+	}
+	AVR_SNAPSHOT_FIELD(s, null);
+	AVR_SNAPSHOT_FIELD(s, index);
+
+	if (s->restore && !s->error) {
+		if (null)
+			*function = NULL;
+		else if (index < s->function_count)
+			*function = s->functions[index];
+		else
+			s->error = 1;
+	}
+}
+
+void
+avr_snapshot_section(
+		avr_snapshot_t * s,
+		const char * tag)
+{
+	char t[4] = { 0 }, check[4];
+	size_t len = strlen(tag);
+	memcpy(t, tag, len < sizeof(t) ? len : sizeof(t));
+	memcpy(check, t, sizeof(check));
+	AVR_SNAPSHOT_FIELD(s, check);
+	if (s->restore && !s->error && memcmp(check, t, sizeof(t)))
+		s->error = 1;
+}
+
+/*
+ * Everything in avr_t that changes while running, the rest is set up at
+ * init time and is expected to match.
+ */
+static void
+avr_snapshot_core(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_snapshot_section(s, "core");
+	AVR_SNAPSHOT_FIELD(s, avr->state);
+	AVR_SNAPSHOT_FIELD(s, avr->frequency);
+	AVR_SNAPSHOT_FIELD(s, avr->vcc);
+	AVR_SNAPSHOT_FIELD(s, avr->avcc);
+	AVR_SNAPSHOT_FIELD(s, avr->aref);
+	AVR_SNAPSHOT_FIELD(s, avr->codeend);
+	AVR_SNAPSHOT_FIELD(s, avr->reset_pc);
+	AVR_SNAPSHOT_FIELD(s, avr->pc);
+	AVR_SNAPSHOT_FIELD(s, avr->cycle);
+	AVR_SNAPSHOT_FIELD(s, avr->run_cycle_count);
+	AVR_SNAPSHOT_FIELD(s, avr->run_cycle_limit);
+	AVR_SNAPSHOT_FIELD(s, avr->sleep_usec);
+	AVR_SNAPSHOT_FIELD(s, avr->sreg);
+	AVR_SNAPSHOT_FIELD(s, avr->interrupt_state);
+
+	avr_snapshot_section(s, "sram");
+	avr_snapshot_field(s, avr->data, avr->ramend + 1);
+	if (s->flags & AVR_SNAPSHOT_NO_FLASH)
+		return;
+	avr_snapshot_section(s, "flsh");
+	if (s->restore)
+		avr_flash_unshare(avr);
+	avr_snapshot_field(s, avr->flash, avr->flashend + 1);
+}
+
+/*
+ * Header, core, the IO modules in registration order, then the cycle timers.
+ * Used both ways.
+ */
+static int
+avr_snapshot_state(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_snapshot_header_t h, check;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AVR_SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = AVR_SNAPSHOT_VERSION;
+	strncpy(h.mmcu, avr->mmcu, sizeof(h.mmcu) - 1);
+	h.flashend = avr->flashend;
+	h.ramend = avr->ramend;
+	h.e2end = avr->e2end;
+	h.core_size = avr->core_size;
+	h.flags = s->flags;
+	h.code_check = (int64_t)((intptr_t)avr_snapshot_restore - (intptr_t)avr_snapshot_save);
+
+	check = h;
+	AVR_SNAPSHOT_FIELD(s, check);
+	if (s->error)
+		return -1;
+	// the flags are whatever the snapshot was saved with
+	if (s->restore)
+		h.flags = s->flags = check.flags;
+	if (memcmp(&check, &h, sizeof(h))) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: snapshot doesn't match this core or build\n", __func__);
+		return -1;
+	}
+
+	avr_snapshot_core(avr, s);
+	avr_interrupt_snapshot(avr, s);
+	avr_irq_pool_snapshot(&avr->irq_pool, s);
+
+	for (avr_io_t * port = avr->io_port; port && !s->error; port = port->next) {
+		avr_snapshot_section(s, port->kind);
+		if (port->snapshot)
+			port->snapshot(port, s);
+	}
+	// last, the IO modules have added their timer callbacks by now, and
+	// the function indexes only mean the same if both sides added as many
+	uint32_t function_count = s->function_count;
+	avr_snapshot_section(s, "func");
+	AVR_SNAPSHOT_FIELD(s, function_count);
+	if (s->restore && !s->error && function_count != s->function_count)
+		s->error = 1;
+	avr_cycle_timer_snapshot(avr, s);
+	avr_snapshot_section(s, "end.");
+	return s->error ? -1 : 0;
+}
+
+int
+avr_snapshot_save(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	s->restore = 0;
+	s->error = 0;
+	s->bases[0].base = avr;
+	s->bases[0].size = avr->core_size;
+	if (s->base_count == 0)
+		s->base_count = 1;
+	if (avr_snapshot_state(avr, s)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: failed to save state\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	s->restore = 1;
+	s->error = 0;
+	s->pos = 0;
+	s->bases[0].base = avr;
+	s->bases[0].size = avr->core_size;
+	if (s->base_count == 0)
+		s->base_count = 1;
+	if (avr_snapshot_state(avr, s)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: failed to restore state, the core is now undefined\n", __func__);
+		return -1;
+	}
+	// the flash came back too, the pre-decoded copy has to follow
+	if (!(s->flags & AVR_SNAPSHOT_NO_FLASH))
+		avr_decode_flash(avr, 0, avr->flashend + 1);
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+	sim_snapshot.h
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Snapshots save the complete runtime state of an avr_t into a flat binary
+ * buffer, and restore it later into the same instance or into another one
+ * that was created and set up the same way (same core, same IO modules,
+ * same IRQ connections). Configuration -- hooks, callbacks, io register
+ * handlers -- is not part of a snapshot, only the state that changes while
+ * running is.
+ *
+ * The same functions are used to write and to read a snapshot: each piece
+ * of state is passed to avr_snapshot_field() and friends, which copy it out
+ * when saving and back in when restoring. IO modules take part through the
+ * avr_io_t snapshot() callback.
+ *
+ * Pointers are stored relative to the core block (the struct avr_kind make()
+ * allocated) or to one of the extra bases added with avr_snapshot_add_base(),
+ * and function pointers as their index in the functions added with
+ * avr_snapshot_add_function(), so a snapshot can be restored into a different
+ * instance, or a different run of the same binary. IO modules add the cycle
+ * timer callbacks they use from their snapshot() callback; code outside simavr
+ * that registers cycle timers adds its own before saving and restoring, in the
+ * same order both times. A pending timer whose callback wasn't added can't be
+ * saved. The data is in host byte order.
+ *
+ * A failed restore can leave the instance half overwritten. It must then be
+ * restored again from a good snapshot, or discarded.
+ */
+#ifndef __SIM_SNAPSHOT_H__
+#define __SIM_SNAPSHOT_H__
+
+#include <stddef.h>
+#include "sim_avr_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_SNAPSHOT_MAGIC		"SAVR"
+#define AVR_SNAPSHOT_VERSION	3
+
+#define AVR_SNAPSHOT_MAX_BASES	4
+#define AVR_SNAPSHOT_MAX_FUNCTIONS	32
+
+enum {
+	// leave the flash out, for restoring into an instance that already runs
+	// from the same flash (see avr_flash_share())
+	AVR_SNAPSHOT_NO_FLASH	= (1 << 0),
+};
+
+struct avr_t;
+
+typedef struct avr_snapshot_t {
+	uint8_t *	data;
+	size_t		size;		// bytes written, or bytes available when restoring
+	size_t		alloc;		// allocated size of data, zero if not owned
+	size_t		pos;		// read cursor when restoring
+	int			restore;	// non-zero when reading a snapshot back
+	int			error;		// set on the first failure, later calls are no-ops
+	uint32_t	flags;		// AVR_SNAPSHOT_*, set before saving, read back on restore
+
+	// address ranges pointers are stored relative to, 0 is the core
+	struct {
+		void *	base;
+		size_t	size;
+	} bases[AVR_SNAPSHOT_MAX_BASES];
+	int			base_count;
+
+	// function pointers are stored as an index in this table
+	void		(*functions[AVR_SNAPSHOT_MAX_FUNCTIONS])(void);
+	int			function_count;
+} avr_snapshot_t;
+
+// prepare an empty snapshot to save into, the buffer grows as needed
+void
+avr_snapshot_init(
+		avr_snapshot_t * s);
+// prepare to restore from 'size' bytes at 'data', which are not copied
+void
+avr_snapshot_init_restore(
+		avr_snapshot_t * s,
+		const void * data,
+		size_t size);
+// frees the buffer if the snapshot owns it
+void
+avr_snapshot_free(
+		avr_snapshot_t * s);
+
+// pointers into [base, base + size) will be saved/restored relative to base
+int
+avr_snapshot_add_base(
+		avr_snapshot_t * s,
+		void * base,
+		size_t size);
+// 'function' will be saved/restored as its index in the added functions,
+// adding it again returns the same index
+int
+avr_snapshot_add_function(
+		avr_snapshot_t * s,
+		void (*function)(void));
+
+// save the state of 'avr', returns 0 on success
+int
+avr_snapshot_save(
+		struct avr_t * avr,
+		avr_snapshot_t * s);
+// restore the state of 'avr', returns 0 on success. On failure the state
+// of 'avr' is undefined
+int
+avr_snapshot_restore(
+		struct avr_t * avr,
+		avr_snapshot_t * s);
+
+/*
+ * Helpers for the avr_io_t snapshot() callbacks
+ */
+// copy 'size' bytes of state to or from the snapshot
+void
+avr_snapshot_field(
+		avr_snapshot_t * s,
+		void * field,
+		size_t size);
+// data pointer, relocated against the bases
+void
+avr_snapshot_pointer(
+		avr_snapshot_t * s,
+		void ** pointer);
+// function pointer, saved as its index in the added functions
+void
+avr_snapshot_function(
+		avr_snapshot_t * s,
+		void (**function)(void));
+// a 4 character tag, checked on restore to catch mismatched layouts
+void
+avr_snapshot_section(
+		avr_snapshot_t * s,
+		const char * tag);
+
+#define AVR_SNAPSHOT_FIELD(_s, _field) \
+		avr_snapshot_field(_s, &(_field), sizeof(_field))
+#define AVR_SNAPSHOT_POINTER(_s, _pointer) \
+		avr_snapshot_pointer(_s, (void **)&(_pointer))
+#define AVR_SNAPSHOT_FUNCTION(_s, _function) \
+		avr_snapshot_function(_s, (void (**)(void))&(_function))
+#define AVR_SNAPSHOT_ADD_FUNCTION(_s, _function) \
+		avr_snapshot_add_function(_s, (void (*)(void))(_function))
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPSHOT_H__ */
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_tracer.h"
+
+int avr_tracer_ring_init(avr_tracer_ring_t *ring, uint32_t size)
+{
+    uint32_t ring_size = 16;
+    while (ring_size < size && ring_size < (1u << 30))
+        ring_size <<= 1;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->records = (avr_tracer_record_t *)malloc(ring_size * sizeof(avr_tracer_record_t));
+    if (ring->records == NULL)
+        return -1;
+
+    ring->mask = ring_size - 1;
+    return 0;
+}
+
+void avr_tracer_ring_free(avr_tracer_ring_t *ring)
+{
+    free(ring->records);
+    memset(ring, 0, sizeof(*ring));
+}
+
+void avr_tracer_ring_attach(struct avr_t *avr, avr_tracer_ring_t *ring, uint32_t mask)
+{
+    avr->tracer_callback = avr_tracer_ring_callback;
+    avr->tracer_callback_param = ring;
+    avr->tracer_mask = mask;
+}
+
+void avr_tracer_ring_callback(struct avr_t *avr, void *param, avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4)
+{
+    avr_tracer_ring_t *ring = (avr_tracer_ring_t *)param;
+    uint32_t head = ring->head;
+
+    // only go back to the shared tail when our copy says we're full
+    if (head - ring->tail_cache > ring->mask)
+    {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache > ring->mask)
+        {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    avr_tracer_record_t *record = &ring->records[head & ring->mask];
+    record->cycle = avr->cycle;
+    record->pc = avr->pc;
+    record->event = event;
+    record->p1 = p1;
+    record->p2 = p2;
+    record->p3 = p3;
+    record->p4 = p4;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+size_t avr_tracer_ring_read(avr_tracer_ring_t *ring, avr_tracer_record_t *records, size_t count)
+{
+    uint32_t tail = ring->tail;
+    uint32_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    if (count > available)
+        count = available;
+
+    for (size_t i = 0; i < count; i++)
+        records[i] = ring->records[(tail + i) & ring->mask];
+
+    __atomic_store_n(&ring->tail, tail + (uint32_t)count, __ATOMIC_RELEASE);
+    return count;
+}
+
+uint64_t avr_tracer_ring_dropped(const avr_tracer_ring_t *ring)
+{
+    return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
+
+int avr_tracer_record_format(const avr_tracer_record_t *record, avr_tracer_format format, char *buffer, size_t size)
+{
+    unsigned long long cycle = (unsigned long long)record->cycle;
+
+    if (format == avr_tracer_format_csv)
+    {
+        return snprintf(buffer, size, "%llu,0x%04x,%u,%u,%u,%u,%u", cycle, record->pc, record->event,
+                        record->p1, record->p2, record->p3, record->p4);
+    }
+
+    switch (record->event)
+    {
+    case avr_tracer_event_ioport:
+        return snprintf(buffer, size, "%llu %04x: PIN%c BIT %u %u -> %u", cycle, record->pc,
+                        (char)record->p1, record->p2, record->p3, record->p4);
+
+    case avr_tracer_event_ddr:
+        return snprintf(buffer, size, "%llu %04x: DDR%c 0x%02X -> 0x%02X", cycle, record->pc,
+                        (char)record->p1, record->p2, record->p3);
+
+    case avr_tracer_event_interrupt:
+        // in datasheets interrupt vectors are one-based not zero-based
+        return snprintf(buffer, size, "%llu %04x: interrupt %u fired", cycle, record->pc, record->p1 + 1);
+
+    default:
+        return snprintf(buffer, size, "%llu %04x: event %u (%u, %u, %u, %u)", cycle, record->pc, record->event,
+                        record->p1, record->p2, record->p3, record->p4);
+    }
+}
+
+const char *avr_tracer_csv_header(void)
+{
+    return "cycle,pc,event,p1,p2,p3,p4";
+}
@@ -1,21 +1,100 @@
 #ifndef __SIM_TRACER_H
 #define __SIM_TRACER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct avr_t;
+
 typedef enum avr_tracer_event
 {
     avr_tracer_event_ioport,        // p1 = ioport, p2 = bit, p3 = old value, p4 = new value
     avr_tracer_event_ddr,           // p1 = ioport, p2 = old value, p3 = new value
     avr_tracer_event_interrupt,     // p1 = interrupt
+    avr_tracer_event_count
 } avr_tracer_event;
 
 typedef void(*avr_tracer_callback_t)(struct avr_t *avr, void *param, avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4);
 
+// bits for avr->tracer_mask, events not in the mask never reach the callback
+#define AVR_TRACER_MASK(event)      (1u << (event))
+#define AVR_TRACER_MASK_ALL         ((1u << avr_tracer_event_count) - 1)
+
+// ioports 'A' onwards get a bit per pin in avr->tracer_pin_mask
+#define AVR_TRACER_MAX_PORTS        16
+
 #define AVR_TRACER_EVENT(avr, event, p1, p2, p3, p4) \
     do { \
-        if (avr->tracer_callback) { \
+        if ((avr->tracer_mask & AVR_TRACER_MASK(event)) && avr->tracer_callback) { \
             avr->tracer_callback(avr, avr->tracer_callback_param, (avr_tracer_event)event, (uint32_t)(p1), (uint32_t)(p2), (uint32_t)(p3), (uint32_t)(p4)); \
         } \
     } while (0)
 
-#endif      // __SIM_TRACER_H
+// ioport pin events, filtered on the pin too
+#define AVR_TRACER_PIN_EVENT(avr, port, bit, old, new) \
+    do { \
+        if ((avr->tracer_mask & AVR_TRACER_MASK(avr_tracer_event_ioport)) && \
+            (uint8_t)((port) - 'A') < AVR_TRACER_MAX_PORTS && \
+            (avr->tracer_pin_mask[(port) - 'A'] & (1 << (bit)))) { \
+            AVR_TRACER_EVENT(avr, avr_tracer_event_ioport, port, bit, old, new); \
+        } \
+    } while (0)
 
+/*
+ * Fixed size record written by the ring backend
+ */
+typedef struct avr_tracer_record_t
+{
+    uint64_t cycle;
+    uint32_t pc;
+    uint32_t event;
+    uint32_t p1, p2, p3, p4;
+} avr_tracer_record_t;
+
+/*
+ * Single producer, single consumer ring of records. The core writes from
+ * whatever thread runs it, the consumer drains from another (or the same)
+ * thread with avr_tracer_ring_read(). When full, new records are dropped
+ * and counted rather than stalling the core.
+ */
+typedef struct avr_tracer_ring_t
+{
+    avr_tracer_record_t *records;
+    uint32_t mask;                  // size - 1, size is a power of two
+
+    // producer side
+    uint32_t head;
+    uint32_t tail_cache;
+    uint64_t dropped;
+    uint8_t pad[64];
+
+    // consumer side
+    uint32_t tail;
+} avr_tracer_ring_t;
+
+typedef enum avr_tracer_format
+{
+    avr_tracer_format_text,
+    avr_tracer_format_csv,
+} avr_tracer_format;
+
+// allocate a ring of at least 'size' records, returns 0 on success
+int avr_tracer_ring_init(avr_tracer_ring_t *ring, uint32_t size);
+void avr_tracer_ring_free(avr_tracer_ring_t *ring);
+
+// install the ring as avr's tracer, subscribed to 'mask' events
+void avr_tracer_ring_attach(struct avr_t *avr, avr_tracer_ring_t *ring, uint32_t mask);
+// the tracer callback used by avr_tracer_ring_attach(), param is the ring
+void avr_tracer_ring_callback(struct avr_t *avr, void *param, avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4);
+
+// consumer side, copies out up to 'count' records and returns how many
+size_t avr_tracer_ring_read(avr_tracer_ring_t *ring, avr_tracer_record_t *records, size_t count);
+// number of records dropped because the ring was full
+uint64_t avr_tracer_ring_dropped(const avr_tracer_ring_t *ring);
+
+// decode a record into 'buffer', returns snprintf()'s result
+int avr_tracer_record_format(const avr_tracer_record_t *record, avr_tracer_format format, char *buffer, size_t size);
+// header line for avr_tracer_format_csv
+const char *avr_tracer_csv_header(void);
+
+#endif      // __SIM_TRACER_H
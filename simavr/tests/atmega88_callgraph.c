@@ -0,0 +1,35 @@
+/*
+ * atmega88_callgraph.c
+ *
+ * A few nested calls in a loop, for the call graph profiler tests,
+ * then sleeps with interrupts off to end the run.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega88");
+
+volatile uint8_t count;
+
+static void __attribute__((noinline)) leaf(void)
+{
+	count++;
+}
+
+static void __attribute__((noinline)) middle(void)
+{
+	leaf();
+	leaf();
+}
+
+int main(void)
+{
+	for (uint16_t i = 0; i < 1000; i++)
+		middle();
+
+	cli();
+	sleep_mode();
+}
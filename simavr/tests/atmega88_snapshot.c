@@ -0,0 +1,46 @@
+/*
+ * atmega88_snapshot.c
+ *
+ * Never ends: the main loop steps a 16 bit LFSR and calls mark() every 64
+ * steps, while the timer 0 overflow interrupt counts ticks. This keeps the
+ * SRAM changing and a cycle timer pending, for the snapshot, clone and run
+ * stop tests.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega88");
+
+volatile uint16_t value = 1;
+volatile uint16_t ticks;
+volatile uint8_t marks;
+
+ISR(TIMER0_OVF_vect)
+{
+	ticks++;
+}
+
+void __attribute__((noinline)) mark(void)
+{
+	marks++;
+}
+
+int main(void)
+{
+	// the tests watch 'marks', tell them where it is
+	GPIOR1 = (uint16_t)&marks;
+	GPIOR2 = (uint16_t)&marks >> 8;
+
+	TCCR0B = (1 << CS00);	// no prescaler, overflows every 256 cycles
+	TIMSK0 = (1 << TOIE0);
+	sei();
+
+	for (uint8_t n = 0; ; n++) {
+		uint16_t v = value;
+		value = (v >> 1) ^ (-(v & 1) & 0xb400);
+		if ((n & 63) == 0)
+			mark();
+	}
+}
@@ -0,0 +1,66 @@
+#include <string.h>
+#include "tests.h"
+#include "sim_callgraph.h"
+
+/*
+ * Cloning an instance while the call graph profiler runs on it: the clone
+ * can't run from the profiled decode, as it has no call graph of its own.
+ */
+
+static void run_to_end(avr_t *avr) {
+	for (int i = 0; i < 1000000; i++) {
+		int state = avr_run(avr);
+		if (state == cpu_Done)
+			return;
+		if (state == cpu_Crashed)
+			fail("Crashed at pc 0x%04x", avr->pc);
+	}
+	fail("Firmware didn't finish");
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t *avr = tests_init_avr("atmega88_callgraph.axf");
+	for (int i = 0; i < 1000; i++)
+		avr_run(avr);
+
+	avr_callgraph_t callgraph;
+	if (avr_callgraph_start(&callgraph, avr))
+		fail("Failed to start the call graph");
+
+	avr_t *clone = avr_make_mcu_by_name(avr->mmcu);
+	if (!clone)
+		fail("Creating the clone failed.");
+	avr_flash_share(clone, avr);
+	avr_init(clone);
+	if (clone->decode == avr->decode)
+		fail("The clone runs from the profiled decode");
+	if (memcmp(clone->flash, avr->flash, avr->flashend + 1))
+		fail("The clone's flash differs");
+	run_to_end(clone);
+
+	run_to_end(avr);
+	avr_callgraph_stop(&callgraph);
+	if (callgraph.function_count < 3)
+		fail("Only %u functions in the call graph", callgraph.function_count);
+	uint64_t calls = 0;
+	for (uint32_t i = 0; i < callgraph.function_count; i++)
+		calls += callgraph.functions[i].calls;
+	if (calls < 2000)
+		fail("Only %llu calls in the call graph", (unsigned long long)calls);
+
+	// the original is back to the plain decode, and can share again
+	avr_t *again = avr_make_mcu_by_name(avr->mmcu);
+	avr_flash_share(again, avr);
+	avr_init(again);
+	if (again->decode != avr->decode)
+		fail("The second clone doesn't share the decode");
+
+	avr_callgraph_free(&callgraph);
+	avr_terminate(clone);
+	avr_terminate(again);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_snapshot.h"
+
+/*
+ * A clone runs from the flash of the instance it was made from, and is
+ * otherwise on its own: running either one leaves the other where it was,
+ * and writing to the clone's flash gives it a copy of its own.
+ */
+
+static void run_to(avr_t *avr, avr_cycle_count_t cycle) {
+	while (avr->cycle < cycle)
+		if (avr_run(avr) == cpu_Crashed)
+			fail("Crashed at pc 0x%04x", avr->pc);
+}
+
+static avr_t *clone_avr(avr_t *avr) {
+	avr_t *clone = avr_make_mcu_by_name(avr->mmcu);
+	if (!clone)
+		fail("Creating the clone failed.");
+	avr_flash_share(clone, avr);
+	avr_init(clone);
+
+	avr_snapshot_t save, restore;
+	avr_snapshot_init(&save);
+	save.flags = AVR_SNAPSHOT_NO_FLASH;
+	if (avr_snapshot_save(avr, &save))
+		fail("Saving failed");
+	avr_snapshot_init_restore(&restore, save.data, save.size);
+	if (avr_snapshot_restore(clone, &restore))
+		fail("Restoring into the clone failed");
+	avr_snapshot_free(&save);
+	return clone;
+}
+
+static void check_same(avr_t *avr, avr_t *other, const char *what) {
+	if (avr->cycle != other->cycle || avr->pc != other->pc)
+		fail("%s: cycle %" PRI_avr_cycle_count " pc 0x%04x against cycle %"
+		     PRI_avr_cycle_count " pc 0x%04x", what,
+		     avr->cycle, avr->pc, other->cycle, other->pc);
+	if (memcmp(avr->data, other->data, avr->ramend + 1))
+		fail("%s: SRAM differs", what);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t *avr = tests_init_avr("atmega88_snapshot.axf");
+	run_to(avr, 100000);
+
+	avr_t *clone = clone_avr(avr);
+	if (clone->flash != avr->flash || clone->decode != avr->decode)
+		fail("The clone doesn't share the flash");
+	check_same(clone, avr, "Clone");
+
+	// running the clone leaves the original alone
+	avr_cycle_count_t cycle = avr->cycle;
+	avr_flashaddr_t pc = avr->pc;
+	uint8_t *sram = malloc(avr->ramend + 1);
+	memcpy(sram, avr->data, avr->ramend + 1);
+	run_to(clone, 300000);
+	if (avr->cycle != cycle || avr->pc != pc || memcmp(avr->data, sram, avr->ramend + 1))
+		fail("Running the clone changed the original");
+
+	// which then gets to the same place on its own
+	run_to(avr, 300000);
+	check_same(clone, avr, "After running both");
+
+	// and the other way round
+	memcpy(sram, clone->data, clone->ramend + 1);
+	run_to(avr, 400000);
+	if (clone->cycle >= 400000 || memcmp(clone->data, sram, clone->ramend + 1))
+		fail("Running the original changed the clone");
+
+	// the end of the flash is unused, and erased
+	avr_flashaddr_t addr = avr->flashend - 1;
+	uint8_t nop[2] = { 0, 0 };
+	avr_loadcode(clone, nop, sizeof(nop), addr);
+	if (clone->flash == avr->flash || clone->decode == avr->decode)
+		fail("Writing the clone's flash didn't unshare it");
+	if (avr->flash[addr] != 0xff || clone->flash[addr] != 0)
+		fail("Writing the clone's flash went to the wrong place");
+
+	free(sram);
+	avr_terminate(clone);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,90 @@
+#include "tests.h"
+#include "sim_cycle_timers.h"
+
+/*
+ * Cycle timers fire in the order they are due, and those due on the same
+ * cycle in the order they were registered. A cancelled timer doesn't fire,
+ * registering a pending timer again moves it, and a timer that returns a
+ * cycle fires again then.
+ */
+
+typedef struct fired_t {
+	int id;
+	avr_cycle_count_t when;
+	avr_cycle_count_t cycle;
+} fired_t;
+
+static fired_t fired[16];
+static int fired_count;
+static int repeats;
+
+static avr_cycle_count_t record(avr_t *avr, avr_cycle_count_t when, void *param) {
+	if (fired_count < 16) {
+		fired[fired_count].id = *(int *)param;
+		fired[fired_count].when = when;
+		fired[fired_count].cycle = avr->cycle;
+	}
+	fired_count++;
+	return 0;
+}
+
+static avr_cycle_count_t repeat(avr_t *avr, avr_cycle_count_t when, void *param) {
+	record(avr, when, param);
+	return ++repeats < 3 ? when + 120 : 0;
+}
+
+int main(int argc, char **argv) {
+	static int ids[] = { 0, 1, 2, 3, 4, 5, 6 };
+	static const fired_t expected[] = {
+		{ 1, 100 }, { 3, 100 }, { 6, 150 }, { 2, 200 },
+		{ 6, 270 }, { 0, 300 }, { 6, 390 }, { 5, 400 },
+	};
+	const int expected_count = sizeof(expected) / sizeof(expected[0]);
+
+	tests_init(argc, argv);
+
+	avr_t *avr = tests_init_avr("atmega88_snapshot.axf");
+	for (int i = 0; i < 100; i++)
+		avr_run(avr);
+
+	avr_cycle_count_t start = avr->cycle;
+	avr_cycle_timer_register(avr, 300, record, &ids[0]);
+	avr_cycle_timer_register(avr, 100, record, &ids[1]);
+	avr_cycle_timer_register(avr, 200, record, &ids[2]);
+	avr_cycle_timer_register(avr, 100, record, &ids[3]);
+	avr_cycle_timer_register(avr, 250, record, &ids[4]);
+	avr_cycle_timer_register(avr, 50, record, &ids[5]);
+	avr_cycle_timer_register(avr, 150, repeat, &ids[6]);
+
+	avr_cycle_timer_cancel(avr, record, &ids[4]);
+	if (avr_cycle_timer_status(avr, record, &ids[4]))
+		fail("Timer 4 is still pending after being cancelled");
+	avr_cycle_timer_register(avr, 400, record, &ids[5]);
+	if (avr_cycle_timer_status(avr, record, &ids[5]) != 400 + 1)
+		fail("Timer 5 is due in %" PRI_avr_cycle_count " cycles",
+		     avr_cycle_timer_status(avr, record, &ids[5]) - 1);
+
+	while (avr->cycle < start + 1000)
+		if (avr_run(avr) == cpu_Crashed)
+			fail("Crashed at pc 0x%04x", avr->pc);
+
+	if (fired_count != expected_count)
+		fail("%d timers fired, expected %d", fired_count, expected_count);
+	for (int i = 0; i < expected_count; i++) {
+		if (fired[i].id != expected[i].id ||
+				fired[i].when != start + expected[i].when)
+			fail("Timer %d fired for cycle +%" PRI_avr_cycle_count
+			     " in place %d, expected timer %d for +%" PRI_avr_cycle_count,
+			     fired[i].id, fired[i].when - start, i,
+			     expected[i].id, expected[i].when);
+		// they run after the instruction they fall in, at most 4 cycles long
+		if (fired[i].cycle < fired[i].when || fired[i].cycle > fired[i].when + 3)
+			fail("Timer %d due on cycle %" PRI_avr_cycle_count
+			     " fired on cycle %" PRI_avr_cycle_count,
+			     fired[i].id, fired[i].when, fired[i].cycle);
+	}
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include <string.h>
+#include "tests.h"
+#include "sim_core.h"
+
+/*
+ * The stops teensylcd_run_until() is built on: a stop on a pc, a break from
+ * an SRAM write watch, and a run cycle limit. Each one has to hand control
+ * back at the right instruction.
+ */
+
+static avr_flashaddr_t symbol_addr(avr_t *avr, const char *name) {
+	for (uint32_t i = 0; i < avr->symbolcount; i++)
+		if (!strcmp(avr->symbol[i]->symbol, name))
+			return avr->symbol[i]->addr;
+	fail("No symbol '%s'", name);
+}
+
+static uint16_t watched;
+static int writes;
+static avr_cycle_count_t write_cycle;
+static uint8_t write_value;
+
+static void write_hook(avr_t *avr, uint16_t addr, uint8_t v, void *param) {
+	if (addr != watched)
+		return;
+	writes++;
+	write_cycle = avr->cycle;
+	write_value = v;
+	avr_run_break(avr);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t *avr = tests_init_avr("atmega88_snapshot.axf");
+	for (int i = 0; i < 1000; i++)
+		avr_run(avr);
+
+	// the firmware puts the address of its 'marks' counter in GPIOR1/2
+	watched = avr->data[0x4a] | (avr->data[0x4b] << 8);
+	if (watched < 0x100 || watched > avr->ramend)	// the SRAM starts at 0x100
+		fail("'marks' is at 0x%04x", watched);
+
+	// stop on a pc: the core returns there with the instruction not run
+	avr_flashaddr_t mark = symbol_addr(avr, "mark");
+	uint8_t marks = avr->data[watched];
+	avr_core_set_stop(avr, mark);
+	for (int i = 0; i < 100000 && avr->state != cpu_StepDone; i++)
+		avr_run(avr);
+	if (avr->state != cpu_StepDone || avr->pc != mark)
+		fail("Stopped at pc 0x%04x state %d, expected pc 0x%04x",
+		     avr->pc, avr->state, mark);
+	if (avr->data[watched] != marks)
+		fail("mark() ran before the stop");
+	avr_core_clear_stop(avr, mark);
+	avr->state = cpu_Running;
+
+	// break on an SRAM write: the core returns right after the store
+	avr->write_watch = write_hook;
+	for (int i = 0; i < 100000 && !writes; i++)
+		avr_run(avr);
+	avr->write_watch = NULL;
+	if (writes != 1)
+		fail("%d writes to 'marks' seen", writes);
+	if (write_value != (uint8_t)(marks + 1) || avr->data[watched] != write_value)
+		fail("'marks' is %d, the write was %d, expected %d",
+		     avr->data[watched], write_value, (uint8_t)(marks + 1));
+	// sts takes 2 cycles, and nothing else runs after it
+	if (avr->cycle > write_cycle + 2)
+		fail("Ran on to cycle %" PRI_avr_cycle_count " after the write on %"
+		     PRI_avr_cycle_count, avr->cycle, write_cycle);
+
+	// a cycle budget: the run limit holds the core back
+	avr_cycle_count_t end = avr->cycle + 12345;
+	avr_cycle_count_t run_cycle_limit = avr->run_cycle_limit;
+	while (avr->cycle < end) {
+		avr->run_cycle_limit = end - avr->cycle;
+		if (avr->run_cycle_count > avr->run_cycle_limit)
+			avr->run_cycle_count = avr->run_cycle_limit;
+		avr_run(avr);
+	}
+	avr->run_cycle_limit = run_cycle_limit;
+	// the last instruction can go over, by 3 cycles at most
+	if (avr->cycle > end + 3)
+		fail("Ran to cycle %" PRI_avr_cycle_count " for a budget ending on %"
+		     PRI_avr_cycle_count, avr->cycle, end);
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
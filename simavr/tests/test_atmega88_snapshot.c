@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_snapshot.h"
+#include "sim_cycle_timers.h"
+
+/*
+ * Saving, restoring and running on ends in the same state as running on
+ * without the snapshot, restored into the same instance or a new one. A
+ * pending cycle timer of ours comes back and fires on the same cycle.
+ */
+
+static int fired;
+static avr_cycle_count_t fired_when;
+static avr_cycle_count_t saved_cycle;
+
+static avr_cycle_count_t host_timer(avr_t *avr, avr_cycle_count_t when, void *param) {
+	fired++;
+	fired_when = when;
+	return 0;
+}
+
+static void run_to(avr_t *avr, avr_cycle_count_t cycle) {
+	while (avr->cycle < cycle)
+		if (avr_run(avr) == cpu_Crashed)
+			fail("Crashed at pc 0x%04x", avr->pc);
+}
+
+typedef struct state_t {
+	avr_cycle_count_t cycle;
+	avr_flashaddr_t pc;
+	uint8_t sreg[8];
+	uint8_t *sram;
+} state_t;
+
+static void get_state(avr_t *avr, state_t *state) {
+	state->cycle = avr->cycle;
+	state->pc = avr->pc;
+	memcpy(state->sreg, avr->sreg, sizeof(state->sreg));
+	state->sram = malloc(avr->ramend + 1);
+	memcpy(state->sram, avr->data, avr->ramend + 1);
+}
+
+static void check_state(avr_t *avr, const state_t *state, const char *what) {
+	if (avr->cycle != state->cycle || avr->pc != state->pc)
+		fail("%s: at cycle %" PRI_avr_cycle_count " pc 0x%04x, expected %"
+		     PRI_avr_cycle_count " pc 0x%04x", what,
+		     avr->cycle, avr->pc, state->cycle, state->pc);
+	if (memcmp(avr->sreg, state->sreg, sizeof(state->sreg)))
+		fail("%s: SREG differs", what);
+	if (memcmp(avr->data, state->sram, avr->ramend + 1))
+		fail("%s: SRAM differs", what);
+	if (fired != 1 || fired_when != 150000)
+		fail("%s: our timer fired %d times, last for cycle %"
+		     PRI_avr_cycle_count, what, fired, fired_when);
+}
+
+static void restore(avr_t *avr, const avr_snapshot_t *saved) {
+	avr_snapshot_t s;
+	avr_snapshot_init_restore(&s, saved->data, saved->size);
+	AVR_SNAPSHOT_ADD_FUNCTION(&s, host_timer);
+	if (avr_snapshot_restore(avr, &s))
+		fail("Restoring failed");
+	if (avr->cycle != saved_cycle)
+		fail("Restored to cycle %" PRI_avr_cycle_count, avr->cycle);
+	fired = 0;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t *avr = tests_init_avr("atmega88_snapshot.axf");
+	run_to(avr, 100000);
+	avr_cycle_timer_register(avr, 150000 - avr->cycle, host_timer, NULL);
+
+	avr_snapshot_t saved;
+	avr_snapshot_init(&saved);
+	AVR_SNAPSHOT_ADD_FUNCTION(&saved, host_timer);
+	if (avr_snapshot_save(avr, &saved))
+		fail("Saving failed");
+	saved_cycle = avr->cycle;
+
+	state_t end;
+	run_to(avr, 300000);
+	get_state(avr, &end);
+	if (fired != 1)
+		fail("Our timer fired %d times", fired);
+
+	// back into the same instance
+	restore(avr, &saved);
+	run_to(avr, 300000);
+	check_state(avr, &end, "Same instance");
+
+	// into a new one, which has no firmware loaded
+	avr_t *other = avr_make_mcu_by_name(avr->mmcu);
+	if (!other)
+		fail("Creating the second instance failed.");
+	avr_init(other);
+	restore(other, &saved);
+	run_to(other, 300000);
+	check_state(other, &end, "New instance");
+
+	// a pending timer nobody told the snapshot about can't be saved
+	avr_snapshot_t unknown;
+	avr_snapshot_init(&unknown);
+	avr_cycle_timer_register(avr, 1000, host_timer, NULL);
+	if (avr_snapshot_save(avr, &unknown) == 0)
+		fail("Saved a timer with an unknown callback");
+	avr_snapshot_free(&unknown);
+
+	// and a truncated snapshot is refused
+	avr_snapshot_t truncated;
+	avr_snapshot_init_restore(&truncated, saved.data, saved.size / 2);
+	AVR_SNAPSHOT_ADD_FUNCTION(&truncated, host_timer);
+	if (avr_snapshot_restore(other, &truncated) == 0)
+		fail("Restored a truncated snapshot");
+
+	avr_snapshot_free(&saved);
+	free(end.sram);
+	avr_terminate(other);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
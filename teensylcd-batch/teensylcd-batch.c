@@ -0,0 +1,707 @@
+/* for dup/fdopen/open_memstream with -std=c99 */
+#ifndef _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "teensylcd.h"
+#include "inputscript.h"
+#include "lcdrecord.h"
+#include "timer.h"
+#include "sim_avr.h"
+#include "sim_time.h"
+#include "sim_profiler.h"
+#include "sim_callgraph.h"
+
+/* exit codes, with several firmwares the highest one wins */
+#define EXIT_RAN_TO_END 0       /* still running when the time ran out */
+#define EXIT_ERROR 1            /* bad arguments, firmware failed to load... */
+#define EXIT_CPU_DONE 2         /* firmware stopped (sleep with interrupts off) */
+#define EXIT_CPU_CRASHED 3      /* firmware crashed */
+
+/* longest time run in one teensylcd_run_time_milliseconds() call */
+#define RUN_SLICE_MS 1000
+
+/* most worker threads we'll start */
+#define MAX_THREADS 64
+
+/* frame rate of exported Y4M video */
+#define EXPORT_FPS 50
+
+/* default cycles between profiler samples, 16000 a second at 16mhz */
+#define PROFILE_INTERVAL 1000
+
+static const char *state_names[] = {
+    [cpu_Limbo] = "limbo",
+    [cpu_Stopped] = "stopped",
+    [cpu_Running] = "running",
+    [cpu_Sleeping] = "sleeping",
+    [cpu_Step] = "step",
+    [cpu_StepDone] = "stepdone",
+    [cpu_Done] = "done",
+    [cpu_Crashed] = "crashed",
+};
+
+/* a single firmware run */
+struct batch_job_t
+{
+    const char *filename;
+    bool is_elf;
+
+    /* results */
+    int exit_code;
+    uint64_t cycles;
+    char *report;
+    size_t report_size;
+};
+
+/* options shared by every job */
+struct batch_options_t
+{
+    uint32_t frequency;
+    uint32_t run_ms;
+    int loglevel;
+    const char *image_filename;
+    const struct teensylcd_input_script_t *input_script;
+    const char *record_filename;
+    uint32_t record_rate;
+    const char *profile_filename;
+    uint32_t profile_interval;
+    const char *callgraph_filename;
+};
+
+/* the work queue, workers pull the next job index until it runs out */
+struct batch_queue_t
+{
+    const struct batch_options_t *options;
+    struct batch_job_t *jobs;
+    int job_count;
+    int next_job;
+    pthread_mutex_t lock;
+};
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "TeensyLCD Simulator, headless batch runner\n");
+    fprintf(stderr, "Using simavr by Michel Pollet\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage: %s [-f <frequency>] [-e <elf_file>] [-x <hex_file>] [-t <ms>] [-o <file>] [-i <file>] [-I <script>] [-r <file>] [-R <rate>] [-X <file>] [-z <scale>] [-F <file>] [-N <cycles>] [-G <file>] [-j <threads>] [-S <threads>] [-v] [-h] [firmware...]\n", progname);
+    fprintf(stderr, "       -f: Use this frequency, default 16000000 or 16mhz\n");
+    fprintf(stderr, "       -e: Load this ELF file as firmware\n");
+    fprintf(stderr, "       -x: Load this HEX file as firmware\n");
+    fprintf(stderr, "       -t: Simulated time to run for in milliseconds, default 1000\n");
+    fprintf(stderr, "       -o: Write the report to this file instead of stdout\n");
+    fprintf(stderr, "       -i: Also write the final LCD image to this file (PGM), single firmware only\n");
+    fprintf(stderr, "       -I: Play back this input script in every firmware\n");
+    fprintf(stderr, "       -r: Record the LCD to this file, single firmware only\n");
+    fprintf(stderr, "       -R: Record the LCD this many times a second, default every frame the firmware draws\n");
+    fprintf(stderr, "       -X: Export the -r recording to this .gif or .y4m file, with no firmware just converts it\n");
+    fprintf(stderr, "       -z: Scale the exported video up by this much, default 4\n");
+    fprintf(stderr, "       -F: Profile the firmware, writing folded stacks for flamegraphs to this file, single firmware only\n");
+    fprintf(stderr, "       -N: Cycles between profiler samples, default %d\n", PROFILE_INTERVAL);
+    fprintf(stderr, "       -G: Profile the exact cycles per function, writing a callgrind file, single firmware only\n");
+    fprintf(stderr, "       -j: Number of worker threads, default one per CPU up to %d\n", MAX_THREADS);
+    fprintf(stderr, "       -S: Scaling benchmark, run %d jobs with 1, 2, 4... up to this many threads\n", MAX_THREADS);
+    fprintf(stderr, "       -v: Verbose output\n");
+    fprintf(stderr, "       -h: Help detail\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Any other arguments are firmware files, ELF unless they end in .hex. Each one\n");
+    fprintf(stderr, "runs on its own simulator, spread over the worker threads, and the reports are\n");
+    fprintf(stderr, "written in command line order.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Simulator messages go to stderr. Exit status is %d if the firmware was still\n", EXIT_RAN_TO_END);
+    fprintf(stderr, "running at the end, %d if it stopped (cpu_Done), %d if it crashed, %d on error.\n",
+            EXIT_CPU_DONE, EXIT_CPU_CRASHED, EXIT_ERROR);
+    fprintf(stderr, "With several firmwares the highest of these is returned.\n");
+    fprintf(stderr, "\n");
+}
+
+static void write_report(FILE *fp, const struct teensylcd_t *teensy, const char *firmware, uint64_t run_us)
+{
+    struct avr_t *avr = teensy->avr;
+
+    fprintf(fp, "firmware: %s\n", firmware);
+    fprintf(fp, "frequency: %u\n", avr->frequency);
+    fprintf(fp, "time_ms: %llu\n", (unsigned long long)(run_us / 1000));
+    fprintf(fp, "cycles: %llu\n", (unsigned long long)avr->cycle);
+    fprintf(fp, "state: %s\n", (avr->state < sizeof(state_names) / sizeof(state_names[0])) ? state_names[avr->state] : "unknown");
+    fprintf(fp, "pc: 0x%04x\n", avr->pc);
+    for (int i = 0; i < NUM_TEENSYLCD_LEDS; i++)
+        fprintf(fp, "led%d: %d\n", i, teensylcd_get_led_state(teensy, (enum TEENSYLCD_LED)i) ? 1 : 0);
+    fprintf(fp, "lcd_contrast: %u\n", teensy->lcd.contrast);
+    fprintf(fp, "lcd_invert: %d\n", teensy->lcd.invert_display ? 1 : 0);
+    fprintf(fp, "lcd:\n");
+    for (int y = 0; y < PCD8544_LCD_Y; y++)
+    {
+        char line[PCD8544_LCD_X + 1];
+        for (int x = 0; x < PCD8544_LCD_X; x++)
+            line[x] = pcd8544_get_pixel(&teensy->lcd, x, y) ? '#' : '.';
+        line[PCD8544_LCD_X] = '\0';
+        fprintf(fp, "%s\n", line);
+    }
+}
+
+static bool write_image(const char *filename, const struct teensylcd_t *teensy)
+{
+    uint8_t pixels[PCD8544_LCD_X * PCD8544_LCD_Y];
+    pcd8544_render_luminance(&teensy->lcd, pixels);
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL)
+        return false;
+
+    fprintf(fp, "P5\n%d %d\n255\n", PCD8544_LCD_X, PCD8544_LCD_Y);
+    bool ok = (fwrite(pixels, sizeof(pixels), 1, fp) == 1);
+    return (fclose(fp) == 0) && ok;
+}
+
+static bool write_profile(const char *filename, avr_profiler_t *profiler)
+{
+    avr_profiler_stop(profiler);
+
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+        return false;
+
+    bool ok = (avr_profiler_write_folded(profiler, fp) == 0);
+    return (fclose(fp) == 0) && ok;
+}
+
+static bool write_callgraph(const char *filename, avr_callgraph_t *callgraph, const char *firmware)
+{
+    avr_callgraph_stop(callgraph);
+
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+        return false;
+
+    bool ok = (avr_callgraph_write_callgrind(callgraph, fp, firmware) == 0);
+    return (fclose(fp) == 0) && ok;
+}
+
+/* run one firmware on a simulator of its own, the report is kept in memory */
+static void run_job(struct batch_job_t *job, const struct batch_options_t *options)
+{
+    FILE *report = open_memstream(&job->report, &job->report_size);
+    if (report == NULL)
+    {
+        fprintf(stderr, "%s: Failed to allocate report\n", job->filename);
+        job->exit_code = EXIT_ERROR;
+        return;
+    }
+
+    job->exit_code = EXIT_ERROR;
+    job->cycles = 0;
+
+    struct teensylcd_t *teensy = (struct teensylcd_t *)calloc(1, sizeof(struct teensylcd_t));
+    if (teensy == NULL || !teensylcd_init_new(teensy, options->frequency, options->loglevel))
+    {
+        fprintf(report, "firmware: %s\nerror: failed to create teensylcd\n", job->filename);
+        fclose(report);
+        free(teensy);
+        return;
+    }
+
+    /* never sleep on the host, and don't wait for gdb if it crashes */
+    teensylcd_set_virtual_time(teensy, true);
+    teensy->avr->gdb_port = 0;
+
+    bool loaded = (job->is_elf) ? teensylcd_load_elf(teensy, job->filename) : teensylcd_load_hex(teensy, job->filename);
+    if (!loaded)
+    {
+        fprintf(report, "firmware: %s\nerror: failed to read %s firmware\n", job->filename, (job->is_elf) ? "ELF" : "HEX");
+    }
+    else
+    {
+        /* the script is only read, so every job can play the same one */
+        if (options->input_script != NULL)
+            teensylcd_play_input_script(teensy, options->input_script);
+
+        struct teensylcd_lcd_recorder_t recorder;
+        bool recording = false;
+        if (options->record_filename != NULL)
+        {
+            uint32_t interval = (options->record_rate > 0) ? options->frequency / options->record_rate : 0;
+            recording = teensylcd_lcd_recorder_start(&recorder, teensy, options->record_filename, interval);
+        }
+
+        avr_profiler_t profiler;
+        bool profiling = false;
+        if (options->profile_filename != NULL)
+            profiling = (avr_profiler_start(&profiler, teensy->avr, options->profile_interval) == 0);
+
+        avr_callgraph_t callgraph;
+        bool graphing = false;
+        if (options->callgraph_filename != NULL)
+            graphing = (avr_callgraph_start(&callgraph, teensy->avr) == 0);
+
+        /* the firmware can change its clock (CLKPR) as it runs, so the time run is added up
+           from the slices rather than worked out from the cycle count at the end */
+        uint32_t remaining_ms = options->run_ms;
+        uint64_t run_us = 0;
+        while (remaining_ms > 0)
+        {
+            uint32_t slice_ms = (remaining_ms < RUN_SLICE_MS) ? remaining_ms : RUN_SLICE_MS;
+            avr_cycle_count_t slice_start = teensy->avr->cycle;
+            if (!teensylcd_run_time_milliseconds(teensy, slice_ms))
+            {
+                /* stopped part way, at the clock it ran the slice at */
+                run_us += avr_cycles_to_usec(teensy->avr, teensy->avr->cycle - slice_start);
+                break;
+            }
+
+            run_us += (uint64_t)slice_ms * 1000;
+            remaining_ms -= slice_ms;
+        }
+
+        bool recorded = true;
+        if (options->record_filename != NULL)
+            recorded = recording && teensylcd_lcd_recorder_stop(&recorder);
+
+        bool profiled = true;
+        if (options->profile_filename != NULL)
+            profiled = profiling && write_profile(options->profile_filename, &profiler);
+        if (profiling)
+            avr_profiler_free(&profiler);
+
+        bool graphed = true;
+        if (options->callgraph_filename != NULL)
+            graphed = graphing && write_callgraph(options->callgraph_filename, &callgraph, job->filename);
+        if (graphing)
+            avr_callgraph_free(&callgraph);
+
+        job->cycles = teensy->avr->cycle;
+        write_report(report, teensy, job->filename, run_us);
+
+        if (teensy->avr->state == cpu_Done)
+            job->exit_code = EXIT_CPU_DONE;
+        else if (teensy->avr->state == cpu_Crashed)
+            job->exit_code = EXIT_CPU_CRASHED;
+        else
+            job->exit_code = EXIT_RAN_TO_END;
+
+        if (options->image_filename != NULL && !write_image(options->image_filename, teensy))
+        {
+            fprintf(stderr, "Failed to write %s\n", options->image_filename);
+            job->exit_code = EXIT_ERROR;
+        }
+
+        if (!recorded)
+        {
+            fprintf(stderr, "Failed to write %s\n", options->record_filename);
+            job->exit_code = EXIT_ERROR;
+        }
+
+        if (!profiled)
+        {
+            fprintf(stderr, "Failed to write %s\n", options->profile_filename);
+            job->exit_code = EXIT_ERROR;
+        }
+
+        if (!graphed)
+        {
+            fprintf(stderr, "Failed to write %s\n", options->callgraph_filename);
+            job->exit_code = EXIT_ERROR;
+        }
+    }
+
+    if (fclose(report) != 0)
+        job->exit_code = EXIT_ERROR;
+
+    teensylcd_cleanup(teensy);
+    free(teensy);
+}
+
+static void *worker_thread(void *param)
+{
+    struct batch_queue_t *queue = (struct batch_queue_t *)param;
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->job_count)
+            break;
+
+        run_job(&queue->jobs[index], queue->options);
+    }
+
+    return NULL;
+}
+
+/* run all the jobs over thread_count workers, returns false if a thread couldn't be started */
+static bool run_jobs(struct batch_job_t *jobs, int job_count, int thread_count, const struct batch_options_t *options)
+{
+    struct batch_queue_t queue;
+    queue.options = options;
+    queue.jobs = jobs;
+    queue.job_count = job_count;
+    queue.next_job = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    /* no point in more workers than jobs, and one worker doesn't need a thread */
+    if (thread_count > job_count)
+        thread_count = job_count;
+
+    bool result = true;
+    if (thread_count <= 1)
+    {
+        worker_thread(&queue);
+    }
+    else
+    {
+        pthread_t threads[MAX_THREADS];
+        int started = 0;
+        for (; started < thread_count; started++)
+        {
+            if (pthread_create(&threads[started], NULL, worker_thread, &queue) != 0)
+            {
+                fprintf(stderr, "Failed to start worker thread %d\n", started);
+                result = false;
+                break;
+            }
+        }
+
+        /* whatever did start still drains the queue */
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+    return result;
+}
+
+static void free_job_reports(struct batch_job_t *jobs, int job_count)
+{
+    for (int i = 0; i < job_count; i++)
+    {
+        free(jobs[i].report);
+        jobs[i].report = NULL;
+        jobs[i].report_size = 0;
+    }
+}
+
+/* run MAX_THREADS copies of the firmware list with 1, 2, 4... threads and report throughput */
+static int run_scaling_benchmark(FILE *report, const struct batch_job_t *firmwares, int firmware_count,
+                                 int max_threads, const struct batch_options_t *options)
+{
+    struct batch_job_t jobs[MAX_THREADS];
+    int job_count = MAX_THREADS;
+
+    fprintf(report, "# %d jobs of %u ms simulated time\n", job_count, options->run_ms);
+    fprintf(report, "%-8s %10s %10s %12s %8s %10s\n", "threads", "wall_s", "jobs/s", "sim_mhz", "speedup", "efficiency");
+
+    double base_time = 0.0;
+    int exit_code = EXIT_RAN_TO_END;
+    for (int thread_count = 1; ; thread_count = (thread_count * 2 < max_threads) ? thread_count * 2 : max_threads)
+    {
+        for (int i = 0; i < job_count; i++)
+        {
+            jobs[i] = firmwares[i % firmware_count];
+            jobs[i].report = NULL;
+            jobs[i].report_size = 0;
+        }
+
+        uint64_t start_time = get_time_microseconds();
+        if (!run_jobs(jobs, job_count, thread_count, options))
+            exit_code = EXIT_ERROR;
+        double elapsed = (double)(get_time_microseconds() - start_time) / 1000000.0;
+
+        uint64_t total_cycles = 0;
+        for (int i = 0; i < job_count; i++)
+        {
+            total_cycles += jobs[i].cycles;
+            if (jobs[i].exit_code == EXIT_ERROR)
+                exit_code = EXIT_ERROR;
+        }
+        free_job_reports(jobs, job_count);
+
+        if (thread_count == 1)
+            base_time = elapsed;
+
+        double speedup = (elapsed > 0.0) ? base_time / elapsed : 0.0;
+        fprintf(report, "%-8d %10.3f %10.2f %12.1f %8.2f %9.0f%%\n", thread_count, elapsed,
+                (elapsed > 0.0) ? job_count / elapsed : 0.0,
+                (elapsed > 0.0) ? (double)total_cycles / elapsed / 1000000.0 : 0.0,
+                speedup, speedup * 100.0 / thread_count);
+        fflush(report);
+
+        /* doubling, but always finishing on max_threads */
+        if (thread_count == max_threads)
+            break;
+    }
+
+    return exit_code;
+}
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return (len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0);
+}
+
+/* convert an lcd recording to video, the format going by the filename */
+static bool export_recording(const char *recording, const char *filename, uint32_t scale)
+{
+    bool result = has_suffix(filename, ".gif") ? teensylcd_lcd_recording_export_gif(recording, filename, scale)
+                                               : teensylcd_lcd_recording_export_y4m(recording, filename, EXPORT_FPS, scale);
+    if (!result)
+        fprintf(stderr, "Failed to export %s to %s\n", recording, filename);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *report_filename = NULL;
+    const char *script_filename = NULL;
+    const char *export_filename = NULL;
+    uint32_t export_scale = 4;
+    struct batch_options_t options;
+    options.frequency = TEENSYLCD_DEFAULT_FREQUENCY;
+    options.run_ms = 1000;
+    options.loglevel = LOG_WARNING;
+    options.image_filename = NULL;
+    options.input_script = NULL;
+    options.record_filename = NULL;
+    options.record_rate = 0;
+    options.profile_filename = NULL;
+    options.profile_interval = PROFILE_INTERVAL;
+    options.callgraph_filename = NULL;
+
+    /* one worker per CPU by default, only an explicit -j above MAX_THREADS is an error */
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = (cpu_count > MAX_THREADS) ? MAX_THREADS : (cpu_count > 0) ? (int)cpu_count : 1;
+    int scaling_threads = 0;
+
+    /* one job per firmware, -e/-x and the trailing arguments */
+    struct batch_job_t *jobs = (struct batch_job_t *)calloc(argc, sizeof(struct batch_job_t));
+    int job_count = 0;
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_ERROR;
+    }
+
+    // parse options
+    {
+        if (argc == 1)
+        {
+            usage(argv[0]);
+            return EXIT_ERROR;
+        }
+
+        int c;
+        while ((c = getopt(argc, argv, "f:e:x:t:o:i:I:r:R:X:z:F:N:G:j:S:vh")) != -1)
+        {
+            switch (c)
+            {
+            case 'f':
+                options.frequency = atoi(optarg);
+                break;
+            case 'e':
+                jobs[job_count].filename = optarg;
+                jobs[job_count++].is_elf = true;
+                break;
+            case 'x':
+                jobs[job_count].filename = optarg;
+                jobs[job_count++].is_elf = false;
+                break;
+            case 't':
+                options.run_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                report_filename = optarg;
+                break;
+            case 'i':
+                options.image_filename = optarg;
+                break;
+            case 'I':
+                script_filename = optarg;
+                break;
+            case 'r':
+                options.record_filename = optarg;
+                break;
+            case 'R':
+                options.record_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'X':
+                export_filename = optarg;
+                break;
+            case 'z':
+                export_scale = strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                options.profile_filename = optarg;
+                break;
+            case 'N':
+                options.profile_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'G':
+                options.callgraph_filename = optarg;
+                break;
+            case 'j':
+                thread_count = atoi(optarg);
+                break;
+            case 'S':
+                scaling_threads = atoi(optarg);
+                break;
+            case 'v':
+                options.loglevel = LOG_TRACE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case '?':
+                usage(argv[0]);
+                return EXIT_ERROR;
+            }
+        }
+
+        for (int i = optind; i < argc; i++)
+        {
+            jobs[job_count].filename = argv[i];
+            jobs[job_count++].is_elf = !has_suffix(argv[i], ".hex");
+        }
+    }
+
+    if (export_filename != NULL && (options.record_filename == NULL || export_scale == 0 ||
+                                    !(has_suffix(export_filename, ".gif") || has_suffix(export_filename, ".y4m"))))
+    {
+        fprintf(stderr, "Exporting needs a recording (-r), a scale of at least 1 and a .gif or .y4m filename\n");
+        return EXIT_ERROR;
+    }
+
+    /* just converting an existing recording */
+    if (job_count == 0 && export_filename != NULL)
+        return export_recording(options.record_filename, export_filename, export_scale) ? EXIT_RAN_TO_END : EXIT_ERROR;
+
+    if (job_count == 0)
+    {
+        fprintf(stderr, "Either an ELF or HEX filename must be provided.\n");
+        return EXIT_ERROR;
+    }
+
+    if (options.frequency == 0)
+    {
+        fprintf(stderr, "Invalid frequency, it must be a positive number\n");
+        return EXIT_ERROR;
+    }
+
+    if (thread_count < 1 || thread_count > MAX_THREADS || scaling_threads < 0 || scaling_threads > MAX_THREADS)
+    {
+        fprintf(stderr, "Invalid thread count, it must be between 1 and %d\n", MAX_THREADS);
+        return EXIT_ERROR;
+    }
+
+    if (options.image_filename != NULL && (job_count > 1 || scaling_threads > 0))
+    {
+        fprintf(stderr, "An LCD image can only be written when running a single firmware\n");
+        return EXIT_ERROR;
+    }
+
+    if (options.record_filename != NULL && (job_count > 1 || scaling_threads > 0))
+    {
+        fprintf(stderr, "The LCD can only be recorded when running a single firmware\n");
+        return EXIT_ERROR;
+    }
+
+    if (options.profile_filename != NULL && (job_count > 1 || scaling_threads > 0 || options.profile_interval == 0))
+    {
+        fprintf(stderr, "Profiling needs a single firmware and a sample interval of at least 1\n");
+        return EXIT_ERROR;
+    }
+
+    if (options.callgraph_filename != NULL && (job_count > 1 || scaling_threads > 0))
+    {
+        fprintf(stderr, "The call graph can only be profiled when running a single firmware\n");
+        return EXIT_ERROR;
+    }
+
+    /* the script is loaded once, its times are turned into cycles as each firmware plays it */
+    struct teensylcd_input_script_t input_script;
+    teensylcd_input_script_init(&input_script);
+    if (script_filename != NULL)
+    {
+        if (!teensylcd_input_script_load(&input_script, script_filename))
+            return EXIT_ERROR;
+
+        options.input_script = &input_script;
+    }
+
+    /* the report goes to stdout, so send everything the simulator prints to stderr */
+    FILE *report = NULL;
+    if (report_filename != NULL)
+    {
+        report = fopen(report_filename, "w");
+        if (report == NULL)
+        {
+            fprintf(stderr, "Failed to open %s\n", report_filename);
+            return EXIT_ERROR;
+        }
+    }
+    else
+    {
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || (report = fdopen(fd, "w")) == NULL)
+        {
+            fprintf(stderr, "Failed to duplicate stdout\n");
+            return EXIT_ERROR;
+        }
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    int exit_code = EXIT_RAN_TO_END;
+    if (scaling_threads > 0)
+    {
+        exit_code = run_scaling_benchmark(report, jobs, job_count, scaling_threads, &options);
+    }
+    else
+    {
+        /* run as fast as we can */
+        uint64_t start_time = get_time_microseconds();
+        if (!run_jobs(jobs, job_count, thread_count, &options))
+            exit_code = EXIT_ERROR;
+        uint64_t elapsed_time = get_time_microseconds() - start_time;
+
+        uint64_t total_cycles = 0;
+        for (int i = 0; i < job_count; i++)
+            total_cycles += jobs[i].cycles;
+
+        fprintf(stderr, "Ran %d firmware(s), %llu cycles in %.3f s\n", job_count, (unsigned long long)total_cycles,
+                (double)elapsed_time / 1000000.0);
+
+        /* results, in command line order */
+        for (int i = 0; i < job_count; i++)
+        {
+            if (i > 0)
+                fputc('\n', report);
+            if (jobs[i].report != NULL)
+                fwrite(jobs[i].report, 1, jobs[i].report_size, report);
+            if (jobs[i].exit_code > exit_code)
+                exit_code = jobs[i].exit_code;
+        }
+        free_job_reports(jobs, job_count);
+    }
+
+    if (fclose(report) != 0)
+    {
+        fprintf(stderr, "Failed to write report\n");
+        exit_code = EXIT_ERROR;
+    }
+
+    if (export_filename != NULL && exit_code != EXIT_ERROR && !export_recording(options.record_filename, export_filename, export_scale))
+        exit_code = EXIT_ERROR;
+
+    teensylcd_input_script_free(&input_script);
+    free(jobs);
+    return exit_code;
+}
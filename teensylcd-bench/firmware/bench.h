@@ -0,0 +1,71 @@
+/*
+ * Registers and pins used by the benchmark firmwares, ATmega32u4 on the
+ * TeensyLCD board. Plain numbers rather than <avr/io.h> so the sources
+ * only need the assembler: I/O addresses for in/out/sbi/cbi, data
+ * addresses for lds/sts.
+ */
+#ifndef __TEENSYLCD_BENCH_H
+#define __TEENSYLCD_BENCH_H
+
+/* I/O addresses */
+#define PINB    0x03
+#define DDRB    0x04
+#define PORTB   0x05
+#define PIND    0x09
+#define DDRD    0x0a
+#define PORTD   0x0b
+#define PINF    0x0f
+#define DDRF    0x10
+#define PORTF   0x11
+#define TCCR0A  0x24
+#define TCCR0B  0x25
+#define TCNT0   0x26
+#define OCR0A   0x27
+#define SPCR    0x2c
+#define SPSR    0x2d
+#define SPDR    0x2e
+#define SMCR    0x33
+#define SPL     0x3d
+#define SPH     0x3e
+#define SREG    0x3f
+
+/* data addresses */
+#define TIMSK0  0x6e
+#define RAMSTART 0x0100
+#define RAMEND  0x0aff
+
+/* bits */
+#define WGM01   1       /* TCCR0A, clear timer on compare */
+#define CS00    0       /* TCCR0B, clock select */
+#define CS01    1
+#define CS02    2
+#define OCIE0A  1       /* TIMSK0 */
+#define SPE     6       /* SPCR */
+#define MSTR    4
+#define SPIF    7       /* SPSR */
+#define SPI2X   0
+#define SE      0       /* SMCR, sleep enable, idle mode */
+
+/* interrupt vectors, 4 bytes each */
+#define VECTOR_COUNT 43
+#define TIMER0_COMPA_VECTOR 21
+
+/* lcd pins, SCE is active low and DIN is sampled on the rising edge of SCLK */
+#define LCD_RST     4   /* port b */
+#define LCD_DC      5   /* port b, high for data, low for commands */
+#define LCD_DIN     6   /* port b */
+#define LCD_SCE     7   /* port d */
+#define LCD_SCLK    7   /* port f */
+#define LCD_BYTES   504 /* 84 columns by 6 banks of 8 rows */
+
+/* hardware spi, the lcd also takes its bytes */
+#define SPI_SS      0   /* port b, an output for master mode */
+#define SPI_SCK     1
+#define SPI_MOSI    2
+
+/* leds */
+#define LED0        2   /* port b */
+#define LED1        3   /* port b */
+#define LED2        6   /* port d */
+
+#endif      // __TEENSYLCD_BENCH_H
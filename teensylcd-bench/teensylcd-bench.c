@@ -0,0 +1,474 @@
+/* for fork/pipe/wait4 with -std=c99 */
+#ifndef _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "teensylcd.h"
+#include "timer.h"
+#include "sim_avr.h"
+#include "sim_perf.h"
+
+/* where the firmwares are, the build points this at the source tree */
+#ifndef TEENSYLCD_BENCH_FIRMWARE_DIR
+#define TEENSYLCD_BENCH_FIRMWARE_DIR "firmware"
+#endif
+
+/* longest time run in one teensylcd_run_time_milliseconds() call */
+#define RUN_SLICE_MS 1000
+
+/* exit codes */
+#define EXIT_OK 0
+#define EXIT_ERROR 1            /* bad arguments, or a benchmark failed */
+
+/* the firmwares are written for the teensylcd's clock */
+#define BENCH_FREQUENCY TEENSYLCD_DEFAULT_FREQUENCY
+
+/* a firmware, firmware/<name>.hex, built from firmware/<name>.S */
+struct bench_firmware_t
+{
+    const char *name;
+    const char *description;
+};
+
+static const struct bench_firmware_t firmwares[] = {
+    { "lcd_bitbang", "full screen lcd redraws, bit-banged" },
+    { "delay_ms", "_delay_ms() busy waiting" },
+    { "timer0_1khz", "1 kHz timer interrupt running software timers" },
+    { "spi_burst", "full screen lcd redraws through the spi" },
+    { "lpm_font", "text rendered from a font in flash" },
+    { "sleep_mostly", "asleep, woken by a 100 Hz tick" },
+};
+
+#define FIRMWARE_COUNT ((int)(sizeof(firmwares) / sizeof(firmwares[0])))
+
+static const char *state_names[] = {
+    [cpu_Limbo] = "limbo",
+    [cpu_Stopped] = "stopped",
+    [cpu_Running] = "running",
+    [cpu_Sleeping] = "sleeping",
+    [cpu_Step] = "step",
+    [cpu_StepDone] = "stepdone",
+    [cpu_Done] = "done",
+    [cpu_Crashed] = "crashed",
+};
+
+/* what a run sends back to the parent, so it has to be plain data */
+struct bench_run_t
+{
+    bool created;
+    bool loaded;
+    int state;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t sleep_cycles;
+    uint64_t host_us;           /* wall time, just for running the avr */
+};
+
+/* a benchmark's results, the best of its runs */
+struct bench_result_t
+{
+    const struct bench_firmware_t *firmware;
+    const char *error;          /* NULL if every run went to the end */
+    struct bench_run_t run;
+    long peak_rss_kb;           /* the highest of its runs */
+};
+
+struct bench_options_t
+{
+    const char *firmware_dir;
+    uint32_t run_ms;
+    int repeats;
+    bool verbose;
+};
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "TeensyLCD Simulator, benchmarks\n");
+    fprintf(stderr, "Using simavr by Michel Pollet\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage: %s [-t <ms>] [-n <runs>] [-d <dir>] [-o <file>] [-J] [-l] [-v] [-h] [benchmark...]\n", progname);
+    fprintf(stderr, "       -t: Simulated time to run each benchmark for in milliseconds, default 1000\n");
+    fprintf(stderr, "       -n: Run each benchmark this many times and keep the fastest, default 3\n");
+    fprintf(stderr, "       -d: Read the firmwares from this directory, default %s\n", TEENSYLCD_BENCH_FIRMWARE_DIR);
+    fprintf(stderr, "       -o: Write the results to this file instead of stdout\n");
+    fprintf(stderr, "       -J: Write the results as JSON\n");
+    fprintf(stderr, "       -l: List the benchmarks\n");
+    fprintf(stderr, "       -v: Verbose output\n");
+    fprintf(stderr, "       -h: Help detail\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Runs the named benchmarks, or all of them, each on a simulator of its own in a\n");
+    fprintf(stderr, "child process, and reports the simulated MHz, host nanoseconds per instruction\n");
+    fprintf(stderr, "and the child's peak resident set. Simulated time is virtual, sleeping firmware\n");
+    fprintf(stderr, "skips ahead instead of waiting. The instructions are counted in one more run that\n");
+    fprintf(stderr, "isn't timed, as counting them slows the simulator down.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Exit status is %d if every benchmark ran to the end, %d otherwise.\n", EXIT_OK, EXIT_ERROR);
+    fprintf(stderr, "\n");
+}
+
+static const struct bench_firmware_t *find_firmware(const char *name)
+{
+    for (int i = 0; i < FIRMWARE_COUNT; i++)
+    {
+        if (!strcmp(firmwares[i].name, name))
+            return &firmwares[i];
+    }
+    return NULL;
+}
+
+/* run the firmware in this process, from load to the end of its time, counting the instructions or not */
+static void run_firmware(const struct bench_firmware_t *firmware, const struct bench_options_t *options, bool count,
+                         struct bench_run_t *run)
+{
+    memset(run, 0, sizeof(*run));
+    run->state = cpu_Limbo;
+
+    struct teensylcd_t teensy;
+    run->created = teensylcd_init_new(&teensy, BENCH_FREQUENCY, options->verbose ? LOG_TRACE : LOG_WARNING);
+    if (!run->created)
+        return;
+
+    /* never sleep on the host, and don't wait for gdb if it crashes */
+    teensylcd_set_virtual_time(&teensy, true);
+    teensy.avr->gdb_port = 0;
+    teensylcd_set_perf_instructions(&teensy, count);
+
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/%s.hex", options->firmware_dir, firmware->name);
+    run->loaded = teensylcd_load_hex(&teensy, filename);
+    if (run->loaded)
+    {
+        uint64_t start_time = get_time_microseconds();
+        uint32_t remaining_ms = options->run_ms;
+        while (remaining_ms > 0)
+        {
+            uint32_t slice_ms = (remaining_ms < RUN_SLICE_MS) ? remaining_ms : RUN_SLICE_MS;
+            if (!teensylcd_run_time_milliseconds(&teensy, slice_ms))
+                break;
+
+            remaining_ms -= slice_ms;
+        }
+        run->host_us = get_time_microseconds() - start_time;
+
+        avr_perf_stats_t stats;
+        teensylcd_get_perf_stats(&teensy, &stats);
+        run->state = teensy.avr->state;
+        run->cycles = teensy.avr->cycle;
+        run->instructions = avr_perf_instructions(&stats);
+        run->sleep_cycles = stats.sleep_cycles;
+    }
+
+    teensylcd_cleanup(&teensy);
+}
+
+/*
+ * run the firmware once in a child process, so its peak rss is its own and
+ * a crash in the simulator only loses that benchmark. returns false if the
+ * child died before it could say how it went.
+ */
+static bool run_child(const struct bench_firmware_t *firmware, const struct bench_options_t *options, bool count,
+                      struct bench_run_t *run, long *peak_rss_kb)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    /* or the child writes them out again */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        /* the simulator and lcd chatter on stdout, which may be the results */
+        int fd = options->verbose ? STDERR_FILENO : open("/dev/null", O_WRONLY);
+        if (fd >= 0)
+            dup2(fd, STDOUT_FILENO);
+
+        close(fds[0]);
+        run_firmware(firmware, options, count, run);
+        fflush(stdout);
+        bool sent = (write(fds[1], run, sizeof(*run)) == sizeof(*run));
+        _exit(sent ? EXIT_OK : EXIT_ERROR);
+    }
+
+    close(fds[1]);
+    size_t received = 0;
+    while (received < sizeof(*run))
+    {
+        ssize_t size = read(fds[0], (char *)run + received, sizeof(*run) - received);
+        if (size <= 0)
+            break;
+
+        received += size;
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid)
+        return false;
+
+#ifdef __APPLE__
+    *peak_rss_kb = usage.ru_maxrss / 1024;      /* bytes, not kilobytes */
+#else
+    *peak_rss_kb = usage.ru_maxrss;
+#endif
+    return received == sizeof(*run) && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_OK;
+}
+
+/*
+ * run a benchmark options->repeats times, keeping the fastest run, then once more to count the
+ * instructions, which would slow the timed runs down
+ */
+static void run_benchmark(const struct bench_firmware_t *firmware, const struct bench_options_t *options,
+                          struct bench_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->firmware = firmware;
+
+    for (int i = 0; i <= options->repeats; i++)
+    {
+        bool count = (i == options->repeats);
+        struct bench_run_t run;
+        long peak_rss_kb = 0;
+        if (!run_child(firmware, options, count, &run, &peak_rss_kb))
+        {
+            result->error = "benchmark process failed";
+            return;
+        }
+
+        if (!run.created)
+        {
+            result->error = "failed to create teensylcd";
+            return;
+        }
+
+        if (!run.loaded)
+        {
+            result->error = "failed to read firmware";
+            return;
+        }
+
+        if (run.state == cpu_Done || run.state == cpu_Crashed)
+            result->error = "firmware stopped";
+
+        if (peak_rss_kb > result->peak_rss_kb)
+            result->peak_rss_kb = peak_rss_kb;
+
+        if (count)
+        {
+            result->run.instructions = run.instructions;
+            if (options->verbose)
+                fprintf(stderr, "%s: %llu instructions\n", firmware->name, (unsigned long long)run.instructions);
+            continue;
+        }
+
+        if (i == 0 || run.host_us < result->run.host_us)
+            result->run = run;
+
+        if (options->verbose)
+            fprintf(stderr, "%s: run %d, %llu cycles in %.3f s\n", firmware->name, i + 1,
+                    (unsigned long long)run.cycles, (double)run.host_us / 1000000.0);
+    }
+}
+
+static double result_mhz(const struct bench_result_t *result)
+{
+    return (result->run.host_us > 0) ? (double)result->run.cycles / result->run.host_us : 0.0;
+}
+
+static double result_ns_per_instruction(const struct bench_result_t *result)
+{
+    return (result->run.instructions > 0) ? result->run.host_us * 1000.0 / result->run.instructions : 0.0;
+}
+
+static const char *result_state(const struct bench_result_t *result)
+{
+    int state = result->run.state;
+    return (state >= 0 && state < (int)(sizeof(state_names) / sizeof(state_names[0]))) ? state_names[state] : "unknown";
+}
+
+static void write_table(FILE *fp, const struct bench_result_t *results, int count, const struct bench_options_t *options)
+{
+    fprintf(fp, "# %u ms simulated at %d Hz, best of %d\n", options->run_ms, BENCH_FREQUENCY, options->repeats);
+    fprintf(fp, "%-14s %12s %12s %10s %10s %9s %9s %s\n", "benchmark", "cycles", "instructions", "host_s",
+            "sim_mhz", "ns/insn", "rss_kb", "state");
+    for (int i = 0; i < count; i++)
+    {
+        const struct bench_result_t *result = &results[i];
+        if (result->error != NULL && !result->run.loaded)
+        {
+            fprintf(fp, "%-14s error: %s\n", result->firmware->name, result->error);
+            continue;
+        }
+
+        fprintf(fp, "%-14s %12llu %12llu %10.4f %10.1f %9.2f %9ld %s\n", result->firmware->name,
+                (unsigned long long)result->run.cycles, (unsigned long long)result->run.instructions,
+                (double)result->run.host_us / 1000000.0, result_mhz(result), result_ns_per_instruction(result),
+                result->peak_rss_kb, result_state(result));
+    }
+}
+
+static void write_json(FILE *fp, const struct bench_result_t *results, int count, const struct bench_options_t *options)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"frequency\": %d,\n", BENCH_FREQUENCY);
+    fprintf(fp, "  \"time_ms\": %u,\n", options->run_ms);
+    fprintf(fp, "  \"repeats\": %d,\n", options->repeats);
+    fprintf(fp, "  \"benchmarks\": [");
+    for (int i = 0; i < count; i++)
+    {
+        const struct bench_result_t *result = &results[i];
+        fprintf(fp, "%s\n    {\n", (i > 0) ? "," : "");
+        fprintf(fp, "      \"name\": \"%s\",\n", result->firmware->name);
+        if (result->error != NULL)
+            fprintf(fp, "      \"error\": \"%s\",\n", result->error);
+        fprintf(fp, "      \"cycles\": %llu,\n", (unsigned long long)result->run.cycles);
+        fprintf(fp, "      \"instructions\": %llu,\n", (unsigned long long)result->run.instructions);
+        fprintf(fp, "      \"sleep_cycles\": %llu,\n", (unsigned long long)result->run.sleep_cycles);
+        fprintf(fp, "      \"host_s\": %.6f,\n", (double)result->run.host_us / 1000000.0);
+        fprintf(fp, "      \"sim_mhz\": %.3f,\n", result_mhz(result));
+        fprintf(fp, "      \"ns_per_instruction\": %.3f,\n", result_ns_per_instruction(result));
+        fprintf(fp, "      \"peak_rss_kb\": %ld,\n", result->peak_rss_kb);
+        fprintf(fp, "      \"state\": \"%s\"\n", result_state(result));
+        fprintf(fp, "    }");
+    }
+    fprintf(fp, "%s]\n", (count > 0) ? "\n  " : "");
+    fprintf(fp, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output_filename = NULL;
+    bool json = false;
+    struct bench_options_t options;
+    options.firmware_dir = TEENSYLCD_BENCH_FIRMWARE_DIR;
+    options.run_ms = 1000;
+    options.repeats = 3;
+    options.verbose = false;
+
+    // parse options
+    {
+        int c;
+        while ((c = getopt(argc, argv, "t:n:d:o:Jlvh")) != -1)
+        {
+            switch (c)
+            {
+            case 't':
+                options.run_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                options.repeats = atoi(optarg);
+                break;
+            case 'd':
+                options.firmware_dir = optarg;
+                break;
+            case 'o':
+                output_filename = optarg;
+                break;
+            case 'J':
+                json = true;
+                break;
+            case 'l':
+                for (int i = 0; i < FIRMWARE_COUNT; i++)
+                    printf("%-14s %s\n", firmwares[i].name, firmwares[i].description);
+                return EXIT_OK;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_OK;
+            case '?':
+                usage(argv[0]);
+                return EXIT_ERROR;
+            }
+        }
+    }
+
+    if (options.run_ms == 0 || options.repeats < 1)
+    {
+        fprintf(stderr, "The run time and the number of runs must be at least 1\n");
+        return EXIT_ERROR;
+    }
+
+    /* the named benchmarks in command line order, or all of them */
+    const struct bench_firmware_t *selected[FIRMWARE_COUNT];
+    int count = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        const struct bench_firmware_t *firmware = find_firmware(argv[i]);
+        if (firmware == NULL)
+        {
+            fprintf(stderr, "Unknown benchmark '%s', -l lists them\n", argv[i]);
+            return EXIT_ERROR;
+        }
+
+        bool duplicate = false;
+        for (int j = 0; j < count; j++)
+            duplicate = duplicate || (selected[j] == firmware);
+        if (!duplicate)
+            selected[count++] = firmware;
+    }
+    if (count == 0)
+    {
+        for (int i = 0; i < FIRMWARE_COUNT; i++)
+            selected[count++] = &firmwares[i];
+    }
+
+    FILE *output = stdout;
+    if (output_filename != NULL)
+    {
+        output = fopen(output_filename, "w");
+        if (output == NULL)
+        {
+            fprintf(stderr, "Failed to open %s\n", output_filename);
+            return EXIT_ERROR;
+        }
+    }
+
+    struct bench_result_t results[FIRMWARE_COUNT];
+    int exit_code = EXIT_OK;
+    for (int i = 0; i < count; i++)
+    {
+        run_benchmark(selected[i], &options, &results[i]);
+        if (results[i].error != NULL)
+        {
+            fprintf(stderr, "%s: %s\n", selected[i]->name, results[i].error);
+            exit_code = EXIT_ERROR;
+        }
+    }
+
+    if (json)
+        write_json(output, results, count, &options);
+    else
+        write_table(output, results, count, &options);
+
+    if (output != stdout && fclose(output) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", output_filename);
+        exit_code = EXIT_ERROR;
+    }
+
+    return exit_code;
+}
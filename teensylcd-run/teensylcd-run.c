@@ -1,3 +1,8 @@
+/* for usleep with -std=c99 */
+#ifndef _GNU_SOURCE
+#define _XOPEN_SOURCE 500
+#endif
+
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -9,14 +14,19 @@
 #include <signal.h>
 #include <getopt.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include <SDL.h>
 #include <SDL_main.h>
 
 #include "teensylcd.h"
+#include "inputscript.h"
 #include "timer.h"
 #include "sim_avr.h"
 #include "sim_gdb.h"
+#include "sim_time.h"
+#include "sim_profiler.h"
+#include "sim_callgraph.h"
 
 volatile bool exit_flag = false;
 
@@ -25,17 +35,288 @@ static void sigint_handler(int n)
     exit_flag = true;
 }
 
-static void tracer_event_callback(struct avr_t *avr, void *param, avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4)
+/* default cycles between profiler samples */
+#define PROFILE_INTERVAL 1000
+
+/* records the core can get ahead of the main loop by, about 2MB */
+#define TRACE_RING_SIZE (64 * 1024)
+
+/* host time spent running between input checks and frame updates, the slice of simulated time is sized to match */
+#define SIM_SLICE_US 1000
+
+/* if the simulation falls further behind than this, eg stopped in gdb, it carries on from now instead of catching up */
+#define SIM_MAX_LAG_US 100000
+
+/* speeds are in percent of real time, the -/= keys step through these */
+#define SPEED_UNLIMITED 0
+#define SPEED_REAL_TIME 100
+static const uint32_t speed_steps[] = { 10, 25, 50, 100, 200, 400, 800, SPEED_UNLIMITED };
+#define NUM_SPEED_STEPS (sizeof(speed_steps) / sizeof(speed_steps[0]))
+
+/* how often the speed readout is updated */
+#define STATS_INTERVAL_US 1000000
+
+/* time between rendered frames, about 60fps */
+#define RENDER_FRAME_US 16667
+
+/* button changes the render thread can queue before the sim thread picks them up */
+#define INPUT_QUEUE_SIZE 64
+
+/**
+ * lock-free triple buffer of lcd states. the sim thread fills the back buffer and swaps it with the
+ * middle one, the render thread swaps its front buffer with the middle one when that holds a frame
+ * it hasn't seen. neither side ever waits, the render thread just gets the newest frame.
+ */
+#define FRAME_FRESH 4
+
+struct frame_buffer_t
+{
+    struct pcd8544_t frames[3];
+    int back;
+    int middle;                 /* index of the newest frame, | FRAME_FRESH until it has been taken */
+    int front;
+};
+
+static void frame_buffer_init(struct frame_buffer_t *buffer)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->back = 0;
+    buffer->middle = 1;
+    buffer->front = 2;
+}
+
+static void frame_buffer_publish(struct frame_buffer_t *buffer, const struct pcd8544_t *lcd)
+{
+    buffer->frames[buffer->back] = *lcd;
+    buffer->back = __atomic_exchange_n(&buffer->middle, buffer->back | FRAME_FRESH, __ATOMIC_ACQ_REL) & ~FRAME_FRESH;
+}
+
+/* returns the newest frame, or NULL if there hasn't been one since the last call */
+static const struct pcd8544_t *frame_buffer_latest(struct frame_buffer_t *buffer)
+{
+    if ((__atomic_load_n(&buffer->middle, __ATOMIC_ACQUIRE) & FRAME_FRESH) == 0)
+        return NULL;
+
+    buffer->front = __atomic_exchange_n(&buffer->middle, buffer->front, __ATOMIC_ACQ_REL) & ~FRAME_FRESH;
+    return &buffer->frames[buffer->front];
+}
+
+/* single producer, single consumer queue of button changes, from the render thread to the sim thread */
+struct input_event_t
+{
+    enum TEENSYLCD_BUTTON button;
+    bool state;
+};
+
+struct input_queue_t
+{
+    struct input_event_t events[INPUT_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+};
+
+static bool input_queue_push(struct input_queue_t *queue, enum TEENSYLCD_BUTTON button, bool state)
+{
+    uint32_t head = queue->head;
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == INPUT_QUEUE_SIZE)
+        return false;
+
+    queue->events[head % INPUT_QUEUE_SIZE].button = button;
+    queue->events[head % INPUT_QUEUE_SIZE].state = state;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool input_queue_pop(struct input_queue_t *queue, struct input_event_t *event)
+{
+    uint32_t tail = queue->tail;
+    if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        return false;
+
+    *event = queue->events[tail % INPUT_QUEUE_SIZE];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* everything shared between the two threads */
+struct sim_thread_t
+{
+    struct teensylcd_t *teensy;
+    struct frame_buffer_t frames;
+    struct input_queue_t input;
+    bool finished;
+
+    /* set by the render thread, turbo runs unlimited while it's held */
+    uint32_t speed;
+    bool turbo;
+
+    /* avr->cycle as of the last slice, for the readout */
+    uint64_t cycles;
+};
+
+/* the next of speed_steps faster or slower than speed, which needn't be one of them */
+static uint32_t step_speed(uint32_t speed, bool faster)
+{
+    /* unlimited is the fastest */
+    uint64_t current = (speed == SPEED_UNLIMITED) ? UINT64_MAX : speed;
+    for (size_t i = 0; i < NUM_SPEED_STEPS; i++)
+    {
+        size_t index = (faster) ? i : NUM_SPEED_STEPS - 1 - i;
+        uint64_t step = (speed_steps[index] == SPEED_UNLIMITED) ? UINT64_MAX : speed_steps[index];
+        if ((faster && step > current) || (!faster && step < current))
+            return speed_steps[index];
+    }
+    return speed;
+}
+
+static void format_speed(char *buffer, size_t size, uint32_t speed)
+{
+    if (speed == SPEED_UNLIMITED)
+        snprintf(buffer, size, "unlimited");
+    else
+        snprintf(buffer, size, "%gx", (double)speed / 100.0);
+}
+
+/**
+ * runs the avr in slices, keeping simulated time in step with the monotonic clock times the speed,
+ * or as fast as it can when unlimited. slices are sized to take about SIM_SLICE_US of host time, so
+ * button changes are applied and the lcd is published just as often at any speed.
+ */
+static void *sim_thread(void *param)
 {
-    // filter out LCD-related events
-    if (teensylcd_is_lcd_tracer_event(event, p1, p2, p3, p4))
-        return;
+    struct sim_thread_t *sim = (struct sim_thread_t *)param;
+    struct teensylcd_t *teensy = sim->teensy;
+    struct avr_t *avr = teensy->avr;
+    uint64_t base_time = get_time_microseconds();
+    uint64_t base_cycle = avr->cycle;
+    uint64_t slice_cycles = avr_usec_to_cycles(avr, SIM_SLICE_US);
+    uint64_t min_slice_cycles = slice_cycles / 10 + 1;
+    uint64_t max_slice_cycles = slice_cycles * 1000;
+    uint32_t last_speed = __atomic_load_n(&sim->speed, __ATOMIC_RELAXED);
+
+    while (!__atomic_load_n(&exit_flag, __ATOMIC_RELAXED))
+    {
+        struct input_event_t event;
+        while (input_queue_pop(&sim->input, &event))
+            teensylcd_set_button_state(teensy, event.button, event.state);
+
+        /* time is measured from the last speed change */
+        uint32_t speed = __atomic_load_n(&sim->turbo, __ATOMIC_RELAXED) ? SPEED_UNLIMITED : __atomic_load_n(&sim->speed, __ATOMIC_RELAXED);
+        uint64_t now_time = get_time_microseconds();
+        if (speed != last_speed)
+        {
+            base_time = now_time;
+            base_cycle = avr->cycle;
+            last_speed = speed;
+        }
 
-    // filter interrupt messages
-    if (event == avr_tracer_event_interrupt)
-        return;
+        /* cycles per microsecond of host time */
+        double rate = (double)avr->frequency * speed / (100.0 * 1000000.0);
+        uint64_t run_cycles = slice_cycles;
+        if (speed != SPEED_UNLIMITED)
+        {
+            /* where simulated time should be by now */
+            uint64_t target_cycle = base_cycle + (uint64_t)((double)(now_time - base_time) * rate);
+            if (target_cycle > avr->cycle + (uint64_t)(SIM_MAX_LAG_US * rate))
+            {
+                base_time = now_time;
+                base_cycle = avr->cycle;
+                target_cycle = avr->cycle;
+            }
 
-    printf("tracer_event(%u, %u, %u, %u, %u)\n", event, p1, p2, p3, p4);
+            run_cycles = (target_cycle > avr->cycle) ? target_cycle - avr->cycle : 0;
+            if (run_cycles > slice_cycles)
+                run_cycles = slice_cycles;
+        }
+
+        if (run_cycles > 0)
+        {
+            struct teensylcd_run_until_t until;
+            memset(&until, 0, sizeof(until));
+            until.conditions = TEENSYLCD_STOP_CYCLES;
+            until.cycles = run_cycles;
+
+            uint64_t start_time = get_time_microseconds();
+            if (teensylcd_run_until(teensy, &until) & TEENSYLCD_STOP_CPU_DONE)
+                break;
+            uint64_t run_time = get_time_microseconds() - start_time;
+
+            /* resize the slice from full ones, halfway towards what would have taken SIM_SLICE_US */
+            if (run_cycles == slice_cycles)
+            {
+                uint64_t ideal_cycles = slice_cycles * SIM_SLICE_US / ((run_time > 0) ? run_time : 1);
+                slice_cycles = (slice_cycles + ideal_cycles) / 2;
+                if (slice_cycles < min_slice_cycles)
+                    slice_cycles = min_slice_cycles;
+                if (slice_cycles > max_slice_cycles)
+                    slice_cycles = max_slice_cycles;
+            }
+        }
+        __atomic_store_n(&sim->cycles, avr->cycle, __ATOMIC_RELAXED);
+
+        if (teensy->lcd.pixels_changed)
+        {
+            frame_buffer_publish(&sim->frames, &teensy->lcd);
+            pcd8544_clear_dirty(&teensy->lcd);
+        }
+
+        /* sleep until the next slice is due, unlimited never does */
+        if (speed != SPEED_UNLIMITED)
+        {
+            uint64_t next_time = base_time + (uint64_t)((double)(avr->cycle - base_cycle) / rate) + SIM_SLICE_US;
+            now_time = get_time_microseconds();
+            if (next_time > now_time)
+                usleep((useconds_t)(next_time - now_time));
+        }
+    }
+
+    __atomic_store_n(&sim->finished, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* bring the render thread's copy of the lcd up to date with a frame, marking the columns that changed dirty */
+static void update_shown_lcd(struct pcd8544_t *shown, const struct pcd8544_t *frame)
+{
+    if (frame->contrast != shown->contrast || frame->invert_display != shown->invert_display)
+    {
+        pcd8544_mark_dirty(shown);
+        shown->contrast = frame->contrast;
+        shown->invert_display = frame->invert_display;
+    }
+
+    for (int bank = 0; bank < PCD8544_BANKS; bank++)
+    {
+        int x_min = 0, x_max = PCD8544_LCD_X - 1;
+        while (x_min < PCD8544_LCD_X && shown->banks[bank][x_min] == frame->banks[bank][x_min])
+            x_min++;
+        if (x_min == PCD8544_LCD_X)
+            continue;
+        while (shown->banks[bank][x_max] == frame->banks[bank][x_max])
+            x_max--;
+
+        memcpy(&shown->banks[bank][x_min], &frame->banks[bank][x_min], x_max + 1 - x_min);
+        if (x_min < shown->dirty_min[bank])
+            shown->dirty_min[bank] = x_min;
+        if (x_max > shown->dirty_max[bank])
+            shown->dirty_max[bank] = x_max;
+        shown->pixels_changed = true;
+    }
+}
+
+/* decode everything traced so far */
+static void drain_trace(avr_tracer_ring_t *ring, FILE *fp, avr_tracer_format format)
+{
+    avr_tracer_record_t records[256];
+    char line[128];
+    size_t count;
+    while ((count = avr_tracer_ring_read(ring, records, sizeof(records) / sizeof(records[0]))) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            avr_tracer_record_format(&records[i], format, line, sizeof(line));
+            fprintf(fp, "%s\n", line);
+        }
+    }
 }
 
 static void usage(const char *progname)
@@ -44,25 +325,46 @@ static void usage(const char *progname)
     fprintf(stderr, "Connor McLaughlin, n8803951\n");
     fprintf(stderr, "Using simavr by Michel Pollet\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "Usage: %s [-f <frequency>] [-e <elf_file>] [-x <hex_file>] [-g port] [-v] [-t] [-h]\n", progname);
+    fprintf(stderr, "Usage: %s [-f <frequency>] [-e <elf_file>] [-x <hex_file>] [-g port] [-p <script>] [-r <script>] [-T <file>] [-s <speed>] [-m] [-P] [-F <file>] [-N <cycles>] [-G <file>] [-v] [-t] [-h]\n", progname);
     fprintf(stderr, "       -f: Use this frequency, default 8000000 or 8mhz\n");
     fprintf(stderr, "       -e: Load this ELF file as firmware\n");
     fprintf(stderr, "       -x: Load this HEX file as firmware\n");
     fprintf(stderr, "       -g: Enable gdb on port\n");
+    fprintf(stderr, "       -p: Play back this input script\n");
+    fprintf(stderr, "       -r: Record button presses to this input script, written on exit\n");
+    fprintf(stderr, "       -T: Write the io trace to this file, as CSV if it ends in .csv, default stdout\n");
+    fprintf(stderr, "       -s: Speed relative to real time, 0.1 and up, or 0 for unlimited, default 1\n");
+    fprintf(stderr, "       -m: Print the simulated MHz and host CPU use every second\n");
+    fprintf(stderr, "       -P: Print the simulator's performance counters on exit\n");
+    fprintf(stderr, "       -F: Profile the firmware, writing folded stacks for flamegraphs to this file on exit\n");
+    fprintf(stderr, "       -N: Cycles between profiler samples, default %d\n", PROFILE_INTERVAL);
+    fprintf(stderr, "       -G: Profile the exact cycles per function, writing a callgrind file on exit\n");
     fprintf(stderr, "       -v: Verbose output\n");
     fprintf(stderr, "       -t: Trace interrupts\n");
     fprintf(stderr, "       -h: Help detail\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "Keys: Z/X push SW0/SW1, 1-9 set the window scale, -/= slow down/speed up,\n");
+    fprintf(stderr, "      0 returns to real time, hold Tab to run unlimited.\n");
+    fprintf(stderr, "\n");
 }
 
 int main(int argc, char *argv[])
 {
     const char *elf_filename = NULL;
     const char *hex_filename = NULL;
+    const char *play_filename = NULL;
+    const char *record_filename = NULL;
+    const char *trace_filename = NULL;
+    const char *profile_filename = NULL;
+    uint32_t profile_interval = PROFILE_INTERVAL;
+    const char *callgraph_filename = NULL;
     uint32_t frequency = 8000000;
     uint32_t gdb_port = 0;
     bool verbose = false;
     bool trace_interrupts = false;
+    uint32_t speed = SPEED_REAL_TIME;
+    bool print_stats = false;
+    bool print_perf = false;
 
     // parse options
     {
@@ -73,7 +375,7 @@ int main(int argc, char *argv[])
         }
 
         int c;
-        while ((c = getopt(argc, argv, "f:e:x:g:vth")) != -1)
+        while ((c = getopt(argc, argv, "f:e:x:g:p:r:T:s:mPF:N:G:vth")) != -1)
         {
             switch (c)
             {
@@ -89,6 +391,41 @@ int main(int argc, char *argv[])
             case 'g':
                 gdb_port = atoi(optarg);
                 break;
+            case 'p':
+                play_filename = optarg;
+                break;
+            case 'r':
+                record_filename = optarg;
+                break;
+            case 'T':
+                trace_filename = optarg;
+                break;
+            case 's':
+                {
+                    double multiplier = atof(optarg);
+                    if (multiplier != 0.0 && (multiplier < 0.1 || multiplier > 10000.0))
+                    {
+                        fprintf(stderr, "Invalid speed, it must be 0.1 to 10000, or 0 for unlimited\n");
+                        return -1;
+                    }
+                    speed = (uint32_t)(multiplier * 100.0 + 0.5);
+                }
+                break;
+            case 'm':
+                print_stats = true;
+                break;
+            case 'P':
+                print_perf = true;
+                break;
+            case 'F':
+                profile_filename = optarg;
+                break;
+            case 'N':
+                profile_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'G':
+                callgraph_filename = optarg;
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -122,6 +459,12 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Invalid port, it must be 1-65535\n");
         return -1;
     }
+
+    if (profile_interval == 0)
+    {
+        fprintf(stderr, "Invalid profiler interval, it must be at least 1 cycle\n");
+        return -1;
+    }
     
     /* create teensy */
     struct teensylcd_t *teensy = (struct teensylcd_t *)malloc(sizeof(struct teensylcd_t));
@@ -138,6 +481,10 @@ int main(int argc, char *argv[])
             teensy->avr->interrupts.vector[vi]->trace = 1;
     }
 
+    /* counting the instructions slows it down, so only if they're printed */
+    if (print_perf)
+        teensylcd_set_perf_instructions(teensy, true);
+
     // parse firmware
     if (elf_filename != NULL)
     {      
@@ -166,8 +513,65 @@ int main(int argc, char *argv[])
 		avr_gdb_init(teensy->avr);
 	}
 
-    /* setup tracer */
-    teensy->avr->tracer_callback = tracer_event_callback;
+    /* play back and/or record input, both start from the first instruction */
+    struct teensylcd_input_script_t play_script, record_script;
+    teensylcd_input_script_init(&play_script);
+    teensylcd_input_script_init(&record_script);
+    if (play_filename != NULL)
+    {
+        fprintf(stdout, "Loading input script: %s...\n", play_filename);
+        if (!teensylcd_input_script_load(&play_script, play_filename))
+            return -1;
+
+        teensylcd_play_input_script(teensy, &play_script);
+    }
+    if (record_filename != NULL)
+        teensylcd_record_input(teensy, &record_script);
+
+    /* the sim thread keeps pace itself, so the firmware sleeping doesn't need to sleep the host */
+    if (gdb_port == 0)
+        teensylcd_set_virtual_time(teensy, true);
+
+    /* setup tracer, io changes other than the lcd's go to a ring which is drained every frame */
+    avr_tracer_ring_t trace_ring;
+    FILE *trace_fp = stdout;
+    avr_tracer_format trace_format = avr_tracer_format_text;
+    if (avr_tracer_ring_init(&trace_ring, TRACE_RING_SIZE) != 0)
+    {
+        fprintf(stderr, "Failed to allocate trace buffer\n");
+        return -1;
+    }
+    if (trace_filename != NULL)
+    {
+        size_t len = strlen(trace_filename);
+        trace_fp = fopen(trace_filename, "w");
+        if (trace_fp == NULL)
+        {
+            fprintf(stderr, "Failed to open trace file %s\n", trace_filename);
+            return -1;
+        }
+        if (len > 4 && !strcmp(trace_filename + len - 4, ".csv"))
+        {
+            trace_format = avr_tracer_format_csv;
+            fprintf(trace_fp, "%s\n", avr_tracer_csv_header());
+        }
+    }
+    avr_tracer_ring_attach(teensy->avr, &trace_ring, AVR_TRACER_MASK(avr_tracer_event_ioport) | AVR_TRACER_MASK(avr_tracer_event_ddr));
+    teensylcd_set_lcd_tracer_events(teensy, false);
+
+    /* sample the firmware's call stacks, the profiler runs on the sim thread as a cycle timer */
+    avr_profiler_t profiler;
+    if (profile_filename != NULL && avr_profiler_start(&profiler, teensy->avr, profile_interval) != 0)
+    {
+        fprintf(stderr, "Failed to start the profiler\n");
+        return -1;
+    }
+    avr_callgraph_t callgraph;
+    if (callgraph_filename != NULL && avr_callgraph_start(&callgraph, teensy->avr) != 0)
+    {
+        fprintf(stderr, "Failed to start the call graph profiler\n");
+        return -1;
+    }
 
     /* create lcd window */
     fprintf(stdout, "Creating LCD window...\n");
@@ -179,15 +583,43 @@ int main(int argc, char *argv[])
     /* hook signals */
     signal(SIGINT, sigint_handler);
 
+    /* the avr runs on its own thread from here on, this one renders and handles input */
+    struct sim_thread_t *sim = (struct sim_thread_t *)calloc(1, sizeof(struct sim_thread_t));
+    if (sim == NULL)
+    {
+        fprintf(stderr, "Failed to allocate sim thread state\n");
+        return -1;
+    }
+    sim->teensy = teensy;
+    sim->speed = speed;
+    sim->cycles = teensy->avr->cycle;
+    frame_buffer_init(&sim->frames);
+
+    /* what's on the window, starts blank and all of it needs drawing */
+    struct pcd8544_t shown;
+    memset(&shown, 0, sizeof(shown));
+    pcd8544_mark_dirty(&shown);
+    frame_buffer_publish(&sim->frames, &teensy->lcd);
+    pcd8544_clear_dirty(&teensy->lcd);
+
     /* log */
     printf("AVR core running...\n");
 
-    uint64_t last_time = get_time_microseconds();
-    while (!exit_flag) 
+    pthread_t sim_thread_handle;
+    if (pthread_create(&sim_thread_handle, NULL, sim_thread, sim) != 0)
     {
-        uint64_t now_time = get_time_microseconds();
-        uint64_t time_diff = now_time - last_time;
-        last_time = now_time;
+        fprintf(stderr, "Failed to start sim thread\n");
+        return -1;
+    }
+
+    /* speed readout, simulated MHz is cycles per microsecond */
+    uint64_t stats_time = 0;
+    uint64_t stats_cpu_time = 0;
+    uint64_t stats_cycles = 0;
+
+    while (!exit_flag && !__atomic_load_n(&sim->finished, __ATOMIC_ACQUIRE))
+    {
+        uint64_t frame_time = get_time_microseconds();
 
         /* pump events */
         SDL_PumpEvents();
@@ -204,52 +636,172 @@ int main(int argc, char *argv[])
                     if (events[i].key.keysym.scancode == SDL_SCANCODE_Z)
                     {
                         /* push sw0 */
-                        teensylcd_set_button_state(teensy, TEENSYLCD_BUTTON_SW0, (events[i].type == SDL_KEYDOWN));
+                        input_queue_push(&sim->input, TEENSYLCD_BUTTON_SW0, (events[i].type == SDL_KEYDOWN));
                     }
                     else if (events[i].key.keysym.scancode == SDL_SCANCODE_X)
                     {
                         /* push sw1 */
-                        teensylcd_set_button_state(teensy, TEENSYLCD_BUTTON_SW1, (events[i].type == SDL_KEYDOWN));
+                        input_queue_push(&sim->input, TEENSYLCD_BUTTON_SW1, (events[i].type == SDL_KEYDOWN));
+                    }
+                    else if (events[i].key.keysym.scancode == SDL_SCANCODE_TAB)
+                    {
+                        /* turbo while held, the readout starts over at the new speed */
+                        __atomic_store_n(&sim->turbo, (events[i].type == SDL_KEYDOWN), __ATOMIC_RELAXED);
+                        stats_time = 0;
+                    }
+                    else if (events[i].type == SDL_KEYDOWN && (events[i].key.keysym.scancode == SDL_SCANCODE_MINUS ||
+                             events[i].key.keysym.scancode == SDL_SCANCODE_EQUALS || events[i].key.keysym.scancode == SDL_SCANCODE_0))
+                    {
+                        /* step to the next slower/faster speed, or back to real time */
+                        if (events[i].key.keysym.scancode == SDL_SCANCODE_0)
+                            speed = SPEED_REAL_TIME;
+                        else
+                            speed = step_speed(speed, (events[i].key.keysym.scancode == SDL_SCANCODE_EQUALS));
+                        __atomic_store_n(&sim->speed, speed, __ATOMIC_RELAXED);
+                        stats_time = 0;
+
+                        char speed_name[32];
+                        format_speed(speed_name, sizeof(speed_name), speed);
+                        printf("Speed: %s\n", speed_name);
                     }
                     else if (events[i].key.keysym.scancode >= SDL_SCANCODE_1 && events[i].key.keysym.scancode <= SDL_SCANCODE_9)
                     {
                         /* set display scale */
                         window_scale = events[i].key.keysym.scancode - SDL_SCANCODE_1 + 1;
                         SDL_SetWindowSize(window, PCD8544_LCD_X * window_scale, PCD8544_LCD_Y * window_scale);
-                        teensy->lcd.pixels_changed = true;
+                        pcd8544_mark_dirty(&shown);
                     }
                 }
             }
         }
+
+        drain_trace(&trace_ring, trace_fp, trace_format);
+
+        /* pick up the newest lcd state, if there is one */
+        const struct pcd8544_t *frame = frame_buffer_latest(&sim->frames);
+        if (frame != NULL)
+            update_shown_lcd(&shown, frame);
         
-        /* run the avr for the time difference */
-        if (!teensylcd_run_time_microseconds(teensy, time_diff))
-            break;
-        
-        /* if the lcd data has changed, update the display */
-        if (teensy->lcd.pixels_changed)
+        /* if the lcd data has changed, update the parts of the display that did */
+        struct pcd8544_rect_t dirty_rects[PCD8544_MAX_DIRTY_RECTS];
+        size_t num_dirty_rects = pcd8544_get_dirty_rects(&shown, dirty_rects);
+        if (num_dirty_rects > 0)
         {
-            //printf("Window update\n");
+            SDL_Rect window_rects[PCD8544_MAX_DIRTY_RECTS];
+            SDL_Surface *window_surface = SDL_GetWindowSurface(window);
             SDL_LockSurface(backbuffer);
-            pcd8544_render_screen(&teensy->lcd, backbuffer->pixels, backbuffer->pitch);
+            for (size_t i = 0; i < num_dirty_rects; i++)
+                pcd8544_render_screen_rect(&shown, backbuffer->pixels, backbuffer->pitch, &dirty_rects[i]);
             SDL_UnlockSurface(backbuffer);
-            SDL_Surface *window_surface = SDL_GetWindowSurface(window);
-            SDL_BlitScaled(backbuffer, NULL, window_surface, NULL);        
-            SDL_UpdateWindowSurface(window);
-            teensy->lcd.pixels_changed = false;
+            for (size_t i = 0; i < num_dirty_rects; i++)
+            {
+                SDL_Rect rect = { dirty_rects[i].x, dirty_rects[i].y, dirty_rects[i].width, dirty_rects[i].height };
+                SDL_Rect window_rect = { rect.x * window_scale, rect.y * window_scale, rect.w * window_scale, rect.h * window_scale };
+                window_rects[i] = window_rect;
+                SDL_BlitScaled(backbuffer, &rect, window_surface, &window_rects[i]);
+            }
+            SDL_UpdateWindowSurfaceRects(window, window_rects, (int)num_dirty_rects);
+            pcd8544_clear_dirty(&shown);
+        }
+
+        /* readout in the title bar, and on stdout with -m */
+        if (stats_time == 0)
+        {
+            stats_time = frame_time;
+            stats_cpu_time = get_cpu_time_microseconds();
+            stats_cycles = __atomic_load_n(&sim->cycles, __ATOMIC_RELAXED);
         }
+        else if (frame_time - stats_time >= STATS_INTERVAL_US)
+        {
+            uint64_t cycles = __atomic_load_n(&sim->cycles, __ATOMIC_RELAXED);
+            uint64_t cpu_time = get_cpu_time_microseconds();
+            double elapsed = (double)(frame_time - stats_time);
+            double mhz = (double)(cycles - stats_cycles) / elapsed;
+            double real_time = mhz * 1000000.0 / (double)frequency;
+            double cpu = (double)(cpu_time - stats_cpu_time) / elapsed;
 
-        // sleep a little bit
-        // run at roughly 60fps
-        time_diff = get_time_microseconds() - now_time;
-        if (time_diff < 16667) {
-            usleep(16667 - time_diff);
-            //printf("sleep  : %u\n", 16667 - (uint32_t)time_diff);
+            /* falling short of the speed asked for, turbo and unlimited can't */
+            uint32_t target_speed = (__atomic_load_n(&sim->turbo, __ATOMIC_RELAXED)) ? SPEED_UNLIMITED : speed;
+            bool behind = (target_speed != SPEED_UNLIMITED && real_time * 100.0 < target_speed * 0.95);
+
+            char speed_name[32], title[128];
+            format_speed(speed_name, sizeof(speed_name), target_speed);
+            snprintf(title, sizeof(title), "TeensyLCD Simulator - %s - %.2f MHz (%.0f%% real time%s) - CPU %.0f%%",
+                     speed_name, mhz, real_time * 100.0, (behind) ? ", behind" : "", cpu * 100.0);
+            SDL_SetWindowTitle(window, title);
+            if (print_stats)
+            {
+                printf("speed %s: %.2f MHz, %.0f%% of real time%s, host CPU %.0f%%\n",
+                       speed_name, mhz, real_time * 100.0, (behind) ? ", falling behind" : "", cpu * 100.0);
+            }
+
+            stats_time = frame_time;
+            stats_cpu_time = cpu_time;
+            stats_cycles = cycles;
         }
+
+        /* render at roughly 60fps, the sim thread doesn't care how long this takes */
+        uint64_t time_diff = get_time_microseconds() - frame_time;
+        if (time_diff < RENDER_FRAME_US)
+            usleep((useconds_t)(RENDER_FRAME_US - time_diff));
 	}
+
+    __atomic_store_n(&exit_flag, true, __ATOMIC_RELAXED);
+    pthread_join(sim_thread_handle, NULL);
+    free(sim);
  
     fprintf(stdout, "Exiting...\n");
 
+    if (print_perf)
+    {
+        avr_perf_stats_t perf;
+        teensylcd_get_perf_stats(teensy, &perf);
+        fprintf(stdout, "\nSimulator performance counters:\n");
+        avr_perf_print(&perf, stdout);
+        fprintf(stdout, "\n");
+    }
+
+    if (profile_filename != NULL)
+    {
+        avr_profiler_stop(&profiler);
+        fprintf(stdout, "Writing %llu profiler samples to %s...\n", (unsigned long long)profiler.samples, profile_filename);
+        FILE *profile_fp = fopen(profile_filename, "w");
+        if (profile_fp == NULL || avr_profiler_write_folded(&profiler, profile_fp) != 0)
+            fprintf(stderr, "Failed to write profile\n");
+        if (profile_fp != NULL)
+            fclose(profile_fp);
+        avr_profiler_free(&profiler);
+    }
+
+    if (callgraph_filename != NULL)
+    {
+        avr_callgraph_stop(&callgraph);
+        fprintf(stdout, "Writing the call graph of %u functions to %s...\n", callgraph.function_count, callgraph_filename);
+        FILE *callgraph_fp = fopen(callgraph_filename, "w");
+        if (callgraph_fp == NULL ||
+            avr_callgraph_write_callgrind(&callgraph, callgraph_fp, (elf_filename != NULL) ? elf_filename : hex_filename) != 0)
+            fprintf(stderr, "Failed to write call graph\n");
+        if (callgraph_fp != NULL)
+            fclose(callgraph_fp);
+        avr_callgraph_free(&callgraph);
+    }
+
+    drain_trace(&trace_ring, trace_fp, trace_format);
+    if (avr_tracer_ring_dropped(&trace_ring) > 0)
+        fprintf(stderr, "Trace buffer overflowed, %llu events dropped\n", (unsigned long long)avr_tracer_ring_dropped(&trace_ring));
+    if (trace_fp != stdout)
+        fclose(trace_fp);
+    avr_tracer_ring_free(&trace_ring);
+
+    if (record_filename != NULL)
+    {
+        fprintf(stdout, "Writing %u input events to %s...\n", (uint32_t)record_script.count, record_filename);
+        if (!teensylcd_input_script_save(&record_script, record_filename))
+            fprintf(stderr, "Failed to write input script\n");
+    }
+    teensylcd_input_script_free(&record_script);
+    teensylcd_input_script_free(&play_script);
+
     SDL_Quit();   
     return 0;
 }
@@ -53,46 +53,50 @@ static bool enable_trace_interrupts = false;
 
 static void tracer_event_callback(struct avr_t *avr, void *param, avr_tracer_event event, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4)
 {
-    // filter out LCD-related events
-    if (teensylcd_is_lcd_tracer_event(event, p1, p2, p3, p4))
-        return;
-
+    // LCD-related and disabled events are masked out before getting here, see update_tracer_mask()
     switch (event)
     {
     case avr_tracer_event_ioport:
         {
-            if (!enable_trace_ioports)
-                return;
-
             printf("TRACE: PIN%c BIT %u %u -> %u\n", p1, p2, p3, p4);
             break;
         }
 
     case avr_tracer_event_ddr:
         {
-            if (!enable_trace_ioports)
-                return;
-
             printf("TRACE: DDR%c 0x%02X -> 0x%02X (0b%u%u%u%u%u%u%u%u)\n", p1, p2, p3, (p3>>7)&1, (p3>>6)&1, (p3>>5)&1, (p3>>4)&1, (p3>>3)&1, (p3>>2)&1, (p3>>1)&1, p3&1);
             break;
         }
 
     case avr_tracer_event_interrupt:
         {
-            if (!enable_trace_interrupts)
-                return;
-
             // in datasheets interrupt vectors are one-based not zero-based
             printf("TRACE: interrupt %u fired\n", p1 + 1);
             break;
         }
+
+    default:
+        break;
     }
 }
 
+static void update_tracer_mask()
+{
+    if (teensy == NULL)
+        return;
+
+    teensy->avr->tracer_mask = 0;
+    if (enable_trace_ioports)
+        teensy->avr->tracer_mask |= AVR_TRACER_MASK(avr_tracer_event_ioport) | AVR_TRACER_MASK(avr_tracer_event_ddr);
+    if (enable_trace_interrupts)
+        teensy->avr->tracer_mask |= AVR_TRACER_MASK(avr_tracer_event_interrupt);
+}
+
 void set_tracer_messages(bool ioports, bool interrupts)
 {
     enable_trace_ioports = ioports;
     enable_trace_interrupts = interrupts;
+    update_tracer_mask();
 
     printf("Trace ioports: %s\n", (ioports) ? "on" : "off");
     printf("Trace interrupts: %s\n", (interrupts) ? "on" : "off");
@@ -168,6 +172,8 @@ void load_firmware(bool new_board, uint32_t frequency, const char *filename, boo
 
     /* tracer */
     teensy->avr->tracer_callback = tracer_event_callback;
+    teensylcd_set_lcd_tracer_events(teensy, false);
+    update_tracer_mask();
 
     // parse firmware
     if (strstr(filename, ".elf") != NULL)
@@ -267,35 +273,44 @@ void run_loop()
     if (!teensylcd_run_time_microseconds(teensy, time_diff))
         return;
     
-    /* if the lcd data has changed, update the display */
-    if (teensy->lcd.pixels_changed)
+    /* if the lcd data has changed, update the parts of the display that did */
+    struct pcd8544_rect_t dirty_rects[PCD8544_MAX_DIRTY_RECTS];
+    size_t num_dirty_rects = pcd8544_get_dirty_rects(&teensy->lcd, dirty_rects);
+    if (num_dirty_rects > 0)
     {
         //printf("Window update\n");
-        
-        pcd8544_render_luminance(&teensy->lcd, luminance_buffer);
+        SDL_Rect update_rects[PCD8544_MAX_DIRTY_RECTS];
         
         if (SDL_MUSTLOCK(screen))
             SDL_LockSurface(screen);
             
         /* map luminance to rgba */
-        for (size_t y = 0; y < PCD8544_LCD_Y; y++)
+        for (size_t i = 0; i < num_dirty_rects; i++)
         {
-            //const uint8_t *pixin = luminance_buffer + (y * PCD8544_LCD_X);
-            uint32_t *pixout = screen->pixels + (y * screen->pitch);
-            for (size_t x = 0; x < PCD8544_LCD_X; x++)
+            const struct pcd8544_rect_t *rect = &dirty_rects[i];
+            pcd8544_render_luminance_rect(&teensy->lcd, luminance_buffer, rect);
+            for (size_t y = rect->y; y < (size_t)(rect->y + rect->height); y++)
             {
-                //uint8_t luminance = *(pixin++);
-                uint8_t luminance = luminance_buffer[(y * PCD8544_LCD_X) + x];
-                *(pixout++) = SDL_MapRGBA(screen->format, luminance, luminance, luminance, 255);
+                uint32_t *pixout = (uint32_t *)((uint8_t *)screen->pixels + (y * screen->pitch)) + rect->x;
+                for (size_t x = rect->x; x < (size_t)(rect->x + rect->width); x++)
+                {
+                    uint8_t luminance = luminance_buffer[(y * PCD8544_LCD_X) + x];
+                    *(pixout++) = SDL_MapRGBA(screen->format, luminance, luminance, luminance, 255);
+                }
             }
+            
+            update_rects[i].x = rect->x;
+            update_rects[i].y = rect->y;
+            update_rects[i].w = rect->width;
+            update_rects[i].h = rect->height;
         }
         
         if (SDL_MUSTLOCK(screen))
             SDL_UnlockSurface(screen);
 
-        SDL_Flip(screen);
+        SDL_UpdateRects(screen, (int)num_dirty_rects, update_rects);
         
-        teensy->lcd.pixels_changed = false;
+        pcd8544_clear_dirty(&teensy->lcd);
     }
 
     /* check for frequency changes */